@@ -7,16 +7,27 @@
  * Windows compatible version.
  */
 
+// CancelSynchronousIo e CancelIoEx esistono da Vista in poi. Va definito
+// prima di ogni header: MinGW lo fissa al primo che include _mingw.h.
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <io.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <windows.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define USE_SSE2
+#endif
 // #include "leak_tracker.h"
 
 /* Defines */
@@ -28,6 +39,48 @@
 #define VERSION "1.0.0"
 #define SAVE_DIRECTORY "c_projects"
 #define DEFAULT_FILENAME "untitled.c"
+#define TAGS_FILENAME ".tags"
+#define OUTLINE_WIDTH 32
+#define UNDO_MAX_RECORDS 1000
+#define KILL_RING_SIZE 16
+#define OUTPUT_HEIGHT 10        // Text lines of the output pane
+#define OUTPUT_MAX_LINES 20000
+#define STATUS_MSG_SECONDS 5    // How long a status message stays visible
+#define EVENT_MAX_HANDLES 8     // Objects waited on by the main loop
+#define PIPE_DRAIN_MS 100       // Wait for the last output of an exited process
+#define REMOTE_PIPE_NAME "\\\\.\\pipe\\termineditor"  // Named pipe of --server
+#define REMOTE_MAX_CLIENTS 8          // Terminals attached to one server
+#define REMOTE_WRITE_TIMEOUT_MS 2000  // A client slower than this is dropped
+#define REMOTE_MAX_MESSAGE (1 << 24)  // Larger messages mean a broken stream
+#define REMOTE_MAX_ROWS 1000          // Larger terminal sizes mean a broken client
+#define REMOTE_MAX_COLS 1000
+/* %f = file name, %o = executable; overridden by TERMINEDITOR_BUILD */
+#define BUILD_COMMAND "gcc -Wall -g \"%f\" -o \"%o\" && \"%o\""
+/* Live check of a snapshot of the buffer; overridden by TERMINEDITOR_CHECK */
+#define CHECK_COMMAND "gcc -fsyntax-only -Wall -x c \"%f\" -I."
+#define CHECK_DELAY_MS 600      // Quiet time after the last edit
+#define GUTTER_MARK_WIDTH 2
+#define LSP_COMMAND "clangd"   // Language server; overridden by TERMINEDITOR_LSP
+#define COMPLETION_MAX 50  // Entries in the completion menu
+#define COMPLETION_ROWS 8
+#define DIFF_CONTEXT 3            // Unchanged lines shown around a change
+#define DIFF_MAX_COST 256         // Myers steps before settling for a non-minimal diff
+#define DIFF_PARALLEL_LINES 65536 // Lines before hashing is split across threads
+#define DIFF_MAX_WORKERS 16
+#define LINES_PARALLEL 32768      // Lines before sorting is split across threads
+#define LINES_MAX_WORKERS 16
+#define FILTER_BUFSIZE 65536      // Pipe writes and reads of the !command filter
+#define FILTER_POLL_MS 50         // Console check interval while a !command runs
+#define INPUT_BATCH 128           // INPUT_RECORDs read by one ReadConsoleInput
+#define INPUT_QUEUE 4096          // Decoded input events waiting to be handled
+#define ESC_TIMEOUT_MS 30         // Wait for the rest of a sequence after ESC
+#define VT_SEQ_MAX 32             // Parameter bytes of a CSI sequence
+#define WHEEL_LINES 3             // Lines scrolled per mouse wheel notch
+
+/* Modificatori combinati con i codici dei tasti speciali */
+#define MOD_SHIFT 0x10000
+#define MOD_CTRL  0x20000
+#define MOD_ALT   0x40000
 #define WELCOME_MESSAGE "HELP: Ctrl-S = Save | Ctrl-O = Open | Ctrl-F = Find | Ctrl-Q = Quit | Ctrl+] = Match Brace"
 
 enum EditorKey {
@@ -39,25 +92,654 @@ enum EditorKey {
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    F1_KEY,
+    F2_KEY,
+    F3_KEY,
+    F4_KEY,
+    F5_KEY,
+    F6_KEY,
+    F7_KEY,
+    F8_KEY,
+    F9_KEY,
+    F10_KEY,
+    F11_KEY,
+    F12_KEY,
+    PASTE_KEY,   // Bracketed paste: the text is in E.input.text
+    MOUSE_PRESS,    // Left button: the cell is in E.input.mx, E.input.my
+    MOUSE_DRAG,
+    MOUSE_RELEASE,
+    WHEEL_UP,       // E.input.wheel notches
+    WHEEL_DOWN,
+    REFRESH_KEY  // No key: background output arrived, redraw only
+};
+
+/* Messaggi tra --client e --server. Ogni messaggio e' un RemoteHeader
+   seguito da len byte. */
+enum RemoteMsg {
+    MSG_SIZE = 1,  // Client: righe e colonne del terminale (due int)
+    MSG_INPUT,     // Client: tasto, x, y, ripetizioni (int) + testo incollato
+    MSG_FRAME,     // Server: byte da scrivere sul terminale
+    MSG_QUIT       // Server: la sessione e' finita
+};
+
+/* Stati del parser delle sequenze di escape in input */
+enum VtState {
+    VT_GROUND = 0,
+    VT_ESC,    // Dopo ESC
+    VT_CSI,    // Dopo ESC [
+    VT_SS3,    // Dopo ESC O
+    VT_PASTE   // Tra ESC [200~ e ESC [201~
+};
+
+/* Token prodotti dal lexer C (condiviso da highlighting e indice simboli) */
+enum TokenType {
+    TOK_EOF = 0,
+    TOK_SPACE,
+    TOK_IDENT,
+    TOK_KEYWORD,
+    TOK_TYPE,
+    TOK_CONSTANT,
+    TOK_NUMBER,
+    TOK_STRING,
+    TOK_COMMENT,
+    TOK_PREPROC,
+    TOK_PUNCT
+};
+
+/* Modifiche applicate a tutti i cursori */
+enum EditOp {
+    EDIT_INSERT = 0,
+    EDIT_BACKSPACE,
+    EDIT_DELETE,
+    EDIT_NEWLINE
+};
+
+/* Gravita' dei messaggi del compilatore */
+enum DiagSeverity {
+    DIAG_ERROR = 0,
+    DIAG_WARNING,
+    DIAG_NOTE
+};
+
+/* Classi di caratteri per i movimenti a parole */
+enum CharClass {
+    CLASS_SPACE = 0,  // Spazio o tab
+    CLASS_WORD,       // Caratteri di un identificatore
+    CLASS_PUNCT       // Tutto il resto
+};
+
+/* Stato di una riga rispetto al file su disco (flag combinabili) */
+enum RowChange {
+    ROW_MODIFIED = 1,  // Testo cambiato
+    ROW_ADDED = 2,     // Riga nuova
+    ROW_REMOVED = 4    // Righe cancellate subito sopra (o sotto l'ultima)
+};
+
+/* Tipi di record di undo (la digitazione viene accorpata) */
+enum UndoKind {
+    UNDO_EDIT = 0,
+    UNDO_TYPING
+};
+
+/* Opzioni dei comandi sulle righe (Ctrl-E) */
+enum LineFlags {
+    LINES_REVERSE = 1,  // -r
+    LINES_NUMERIC = 2,  // -n: per valore numerico iniziale
+    LINES_ICASE = 4,    // -i: senza distinguere maiuscole e minuscole
+    LINES_UNIQUE = 8,   // -u: sort seguito da uniq
+    LINES_INVERT = 16   // -v: filter tiene le righe che non corrispondono
+};
+
+/* Tipi di simbolo, in ordine di priorita' per il go-to-definition */
+enum SymbolKind {
+    SYM_FUNCTION = 0,
+    SYM_STRUCT,
+    SYM_ENUM,
+    SYM_TYPEDEF,
+    SYM_MACRO,
+    SYM_VARIABLE,
+    SYM_PROTOTYPE
 };
 
 /* Data structures */
 typedef struct {
-    char *chars;
-    char *render;  // Rendered version of the line (with tabs expanded)
+    int type;
+    int start;  // Offset del primo carattere del token
+    int len;
+} CToken;
+
+typedef struct Symbol {
+    char *name;
+    int kind;
+    int row;                 // Riga in cui il simbolo e' definito (da leggere con symRow)
+    int epoch;               // Spostamenti di righe gia' applicati a 'row'
+    int col;
+    unsigned int hash;
+    struct Symbol *next;     // Catena nel bucket della hash table
+    struct Symbol *rownext;  // Simbolo successivo definito sulla stessa riga
+} Symbol;
+
+// Rows from 'from' on (before the change) moved by 'delta'
+typedef struct {
+    int from;
+    int delta;
+} SymbolShift;
+
+// Symbols extracted from a row, compared with the indexed ones
+typedef struct {
+    const char *name;
+    int len;
+    int kind;
+    int col;
+} SymbolFound;
+
+typedef struct {
+    Symbol **buckets;
+    int nbuckets;
+    int count;
+    SymbolFound *scratch;  // Reused by editorIndexRow, grown as needed
+    int scratchcap;
+    SymbolShift *shifts;   // Row inserts/deletes not yet applied to every Symbol.row
+    int nshifts;
+    int capshifts;
+} SymbolIndex;
+
+typedef void (*SymbolCallback)(void *ctx, const char *name, int len, int kind,
+                               int col);
+
+/* Project tag database (memory-mapped, see editorBuildTags) */
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int nfiles;
+    unsigned int nsyms;
+    unsigned int nbuckets;     // Potenza di 2
+    unsigned int files_off;    // Offset delle tabelle dall'inizio del file
+    unsigned int syms_off;
+    unsigned int buckets_off;
+    unsigned int strings_off;
+    unsigned int strings_len;
+} TagHeader;
+
+typedef struct {
+    unsigned int path;         // Offset nella string pool
+    unsigned int mtime_lo, mtime_hi;
+    unsigned int size;
+    unsigned int hash;         // Hash del contenuto
+    unsigned int first_sym;
+    unsigned int nsyms;
+} TagFileEntry;
+
+typedef struct {
+    unsigned int name;         // Offset nella string pool
+    unsigned int hash;
+    unsigned int file;
+    unsigned int line;
+    unsigned int col;
+    unsigned int kind;
+    unsigned int next;         // Simbolo successivo nel bucket
+} TagSymEntry;
+
+typedef struct {
+    HANDLE file;
+    HANDLE mapping;
+    const char *base;
+    size_t size;
+} TagDatabase;
+
+/* Immutable line text shared by rows, the kill ring and undo snapshots.
+   Only a holder with the single reference may modify it in place. */
+typedef struct ClipChunk {
+    int refs;
+    int cap;      // Bytes available in data
+    char data[];  // NUL-terminated at the holder's length
+} ClipChunk;
+
+typedef struct {
+    char *chars;       // Points into chunk->data
+    char *render;  // Rendered version of the line (tabs expanded), built lazily
     int size;
     int rsize;  // Size of the rendered line
-    int capacity;
+    ClipChunk *chunk;  // Storage of chars (see editorRowMakeWritable)
+    Symbol *syms;     // Symbols defined on this line
+    int depth;        // Brace depth at the start of the line (see editorRowDepth)
+    int brace_delta;  // Net '{' minus '}' on this line
+    int brace_min;    // Lowest relative depth reached on this line (<= 0)
+    int indent;       // Leading whitespace length, in chars
+    int *wraps;       // Soft wrap break columns (see editorComputeWraps)
+    int nwraps;
+    int capwraps;
+    int wrap_width;   // Screen width the wraps were computed for, 0 if stale
+    int vheight;      // Visual lines counted for this row in the wrap index, -1 if unknown
+    int *words;       // Identifiers on this line (ids in E.words)
+    int nwords;
+    int capwords;
+    unsigned char change;  // RowChange flags since the last open/save
+    unsigned long long hash;  // hashLine of chars, kept current by editorUpdateRow
 } EditorRow;
 
+/* Folded regions: rows start+1..end are hidden behind the header row start */
+typedef struct {
+    int start;
+    int end;
+    int hidden_before;  // Rows hidden by all the previous folds
+} Fold;
+
+typedef struct {
+    Fold *items;  // Sorted and disjoint, so lookups are binary searches
+    int count;
+    int cap;
+} FoldIndex;
+
+/* Visual line index for soft wrap: Fenwick tree of row heights */
+typedef struct {
+    int *tree;
+    int n;
+    int total;  // Total visual lines
+    int width;  // Text width the index was built for
+    int valid;
+    int stale;  // Entries for rows >= stale are rebuilt from the cached heights
+} WrapIndex;
+
+/* Outline: top-level declarations kept sorted by row */
+typedef struct {
+    Symbol **items;  // Sorted by (row, col); row shifts never reorder them
+    int count;
+    int cap;
+    int *view;       // Items at brace depth 0, rebuilt only when dirty
+    int nview;
+    int dirty;
+    int visible;     // Side panel open
+    int focused;     // Panel has keyboard focus (F2)
+    int sel;         // Selected entry (index in view)
+    int off;         // Panel scroll offset
+} OutlineIndex;
+
+/* Extra cursors; the primary cursor stays in E.cx/E.cy */
+typedef struct {
+    int cx, cy;
+} Cursor;
+
+typedef struct {
+    Cursor *items;  // Sorted by (cy, cx), no duplicates
+    int count;
+    int cap;
+    Cursor last;    // Most recent Ctrl+D match, where the next search starts
+    int has_last;
+} CursorSet;
+
+/* Selection: the anchor is fixed, the other end is the cursor */
+typedef struct {
+    int active;
+    int block;   // Column (rectangular) mode
+    int ax, ay;  // Anchor position
+    int arx;     // Block mode: anchor render column
+    int crx;     // Block mode: cursor render column, may pass the line end
+} Selection;
+
+/* Kill ring entry: lines are shared chunks, so yanking never copies them */
+typedef struct {
+    ClipChunk **lines;
+    int *lens;
+    int n;
+    int block;  // Copied from a block selection: pasted as a column
+} KillEntry;
+
+typedef struct {
+    KillEntry items[KILL_RING_SIZE];
+    int count;
+    int head;     // Most recent entry
+    int yank;     // Entry pasted by the last yank, counted back from head
+    int yanking;  // Last command was a yank: Alt+Y may replace it
+    Selection replaced;  // Selection the last yank replaced, for Alt+Y
+} KillRing;
+
+/* Undo: each step swaps a range of rows with a saved copy of them */
+typedef struct {
+    int at;        // First row of the range
+    int nold;      // Rows saved in lines/lens
+    int nnew;      // Rows the range occupies in the buffer
+    ClipChunk **lines;  // Shared with the rows they were taken from
+    int *lens;
+    int *perm;     // Not NULL: the step reorders the range (editorPermuteRows)
+} UndoStep;
+
+typedef struct {
+    int kind;
+    UndoStep *steps;  // Applied in order to redo, in reverse to undo
+    int nsteps;
+    int capsteps;
+    Cursor *before;   // Cursors before/after the change, primary first
+    int ncursors_before;
+    Cursor *after;
+    int ncursors_after;
+} UndoRecord;
+
+typedef struct {
+    UndoRecord *items;
+    int count;
+    int cap;
+    int pos;       // Records [0, pos) can be undone, [pos, count) redone
+    int open;      // Last record still accepts typing
+    int coalesce;  // Current change is being merged into the last record
+    UndoRecord pending;  // Started by undoBegin, pushed on the first saved step
+    int has_pending;
+    int group;       // Nesting depth of undoGroupBegin/undoGroupEnd
+    int group_open;  // The group's record exists: edits append to it
+} UndoHistory;
+
+/* What the main loop waits on besides the console: the wake event set by
+   background threads and a change notification on the file's directory */
+typedef struct {
+    HANDLE wake;
+    HANDLE watch;
+    char path[MAX_PATH];  // File being watched
+    FILETIME mtime;       // Its last write time at open/save (or last notice)
+    int msg_expired;      // The status message timed out and was redrawn
+} EventLoop;
+
+/* Keyboard macro (Ctrl-R records, Ctrl-P plays) */
+typedef struct {
+    int *keys;
+    int count;
+    int cap;
+    int recording;
+    int playing;  // editorReadKey takes keys from here, nothing is drawn
+    int pos;      // Next key to play
+} Macro;
+
+/* Compiler message parsed from a line of the output pane */
+typedef struct {
+    int line;      // Line of the output pane
+    char *file;
+    int row, col;  // 0-based
+    int severity;
+} Diagnostic;
+
+/* Output pane: compiler and program output, split into lines */
+typedef struct {
+    char **lines;
+    int *lens;
+    int nlines;
+    int cap;
+    int partial;   // Last line still waiting for its newline
+    int visible;
+    int height;    // Text lines shown (layout)
+    int off;       // First line shown
+    int follow;    // Keep the last line in view as output arrives
+    Diagnostic *diags;
+    int ndiags;
+    int capdiags;
+    int diag;      // Diagnostic selected with F8, -1 if none
+} OutputPane;
+
+/* Output pipe of a child process, drained by its own thread so the main
+   loop can sleep until data arrives (anonymous pipes are not waitable) */
+typedef struct {
+    HANDLE pipe;
+    HANDLE thread;
+    CRITICAL_SECTION lock;  // Protects buf, len and eof
+    char *buf;
+    int len, cap;
+    int eof;
+    int overlapped;         // Named pipe opened with FILE_FLAG_OVERLAPPED
+} PipeReader;
+
+/* Build-and-run job started with F5 */
+typedef struct {
+    int running;
+    HANDLE process;  // cmd.exe running the build command
+    HANDLE job;      // Job object holding it and its children, NULL if none
+    PipeReader out;  // Child's stdout/stderr
+    DWORD start;   // GetTickCount() at start
+    char title[128];
+} BuildJob;
+
+/* Buffer handling for screen rendering */
+struct abuf {
+    char *b;
+    int len;
+};
+
+#define ABUF_INIT {NULL, 0}
+
+/* Last frame written to the terminal, one entry per screen line: the next
+   frame rewrites only the lines that differ */
+typedef struct {
+    char **lines;
+    int *lens;        // -1: content on screen unknown, always rewritten
+    int nlines;
+    int valid;        // 0: clear the screen and rewrite every line
+} ScreenFrame;
+
+/* Decoded input event */
+typedef struct {
+    int key;
+    char *text;  // PASTE_KEY: pasted text, owned by the event
+    int len;     // PASTE_KEY: text length; wheel: notches
+    int x, y;    // Mouse: screen cell, from 0
+} InputEvent;
+
+/* Events decoded from one batch of console input, plus the state of the
+   escape sequence parser between batches */
+typedef struct {
+    InputEvent q[INPUT_QUEUE];
+    int head, count;
+    int state;              // enum VtState
+    char seq[VT_SEQ_MAX];   // CSI parameters read so far
+    int seqlen;
+    DWORD seqtick;          // GetTickCount() when the ESC arrived
+    char *paste;            // Paste being received
+    int pastelen, pastecap;
+    char *text;             // Text of the last PASTE_KEY returned
+    int textlen;
+    int mx, my;             // Cell of the last mouse event returned
+    int wheel;              // Notches of the last wheel event returned
+    DWORD buttons;          // Mouse buttons held in the last MOUSE_EVENT
+    int drag;               // The last press landed in the text: drags select
+} InputQueue;
+
+/* Header of a message between --client and --server */
+typedef struct {
+    DWORD type;  // enum RemoteMsg
+    DWORD len;   // Payload bytes after the header
+} RemoteHeader;
+
+/* Terminal attached to the --server session */
+typedef struct {
+    HANDLE pipe;
+    PipeReader in;      // Bytes from the client
+    struct abuf msg;    // Received bytes not yet forming a whole message
+    ScreenFrame frame;  // What the client's terminal is showing
+    int rows, cols;     // Its size, 0 until the first MSG_SIZE
+} RemoteClient;
+
+/* --server: the buffer is viewed and edited from the terminals attached
+   to a named pipe. --client: this process is one of those terminals. */
+typedef struct {
+    int server, client;
+    HANDLE listener;            // Server: thread accepting connections
+    HANDLE accept;              // Server: set when connections are waiting
+    HANDLE first;               // Server: first pipe instance, for the listener
+    CRITICAL_SECTION lock;      // Protects ready, nready and failed
+    HANDLE ready[REMOTE_MAX_CLIENTS];  // Connected, not yet taken by the main loop
+    int nready;
+    DWORD failed;               // Server: error that stopped the listener, 0 if none
+    RemoteClient clients[REMOTE_MAX_CLIENTS];
+    int nclients;
+    HANDLE pipe;                // Client: connection to the server
+    PipeReader conn;            // Client: messages from the server
+    struct abuf msg;
+    int sent_rows, sent_cols;   // Client: last size sent
+} RemoteSession;
+
+/* Marker of the live check on a buffer row */
+typedef struct {
+    int row;
+    int severity;
+    char *msg;
+} CheckMark;
+
+/* Background syntax check, restarted after each pause in editing */
+typedef struct {
+    int enabled;
+    int pending;      // An edit is waiting for the next run
+    DWORD due;        // GetTickCount() when the pending run starts
+    int running;
+    HANDLE process;
+    PipeReader out;
+    char tmp[MAX_PATH];  // Snapshot of the buffer given to the compiler
+    char *buf;        // Output of the running check
+    int len, cap;
+    CheckMark *marks;    // Sorted by row
+    int nmarks, capmarks;
+} SyntaxCheck;
+
+/* JSON-RPC message queued between the main thread and the I/O threads */
+typedef struct LspMessage {
+    struct LspMessage *next;
+    char *body;
+    int len;
+} LspMessage;
+
+/* Completion popup filled by a textDocument/completion response */
+typedef struct {
+    int active;
+    char **labels;
+    char **inserts;  // Text that replaces the word before the cursor
+    int count;
+    int sel;
+    int off;
+} CompletionMenu;
+
+/* Language server client: the server runs on pipes; a reader thread
+   splits its output into messages and a writer thread sends ours, so the
+   main thread never blocks on the pipes */
+typedef struct {
+    int running;
+    HANDLE process;
+    HANDLE in, out;          // Server stdin (we write), stdout (we read)
+    HANDLE reader, writer;   // I/O threads
+    HANDLE wake;             // Wakes the writer
+    CRITICAL_SECTION lock;   // Protects the two queues
+    LspMessage *inq, *inq_tail;
+    LspMessage *outq, *outq_tail;
+    volatile LONG stopping;
+    int initialized;         // initialize answered
+    int opened;              // Document open on the server
+    char *uri;
+    int version;
+    int next_id;
+    int completion_id;       // Pending completion request, 0 if none
+    int completion_row;
+    struct abuf changes;     // contentChanges not sent yet
+    int nchanges;
+} LspClient;
+
+/* Identifier trie for word completion. Siblings are kept sorted, so a
+   walk of the subtree lists the words alphabetically. Branches whose words
+   have all been deleted ('live' == 0) go back to a free list. */
+typedef struct {
+    int child;    // First child, -1 if none
+    int next;     // Next sibling, -1 if none
+    int parent;
+    int count;    // Occurrences of the word ending here (rows + keywords)
+    int live;     // Words with count > 0 in this subtree
+    char c;
+} TrieNode;
+
+typedef struct {
+    TrieNode *nodes;  // Node 0 is the root; ids of words are node indexes
+    int count;        // Nodes used so far, free ones included
+    int cap;
+    int free;         // First free node, chained through 'next'; -1 if none
+} WordIndex;
+
+/* Merkle tree of the row hashes: node i combines 2i and 2i+1 in order.
+   Edits inside a row update one path; inserting or deleting rows
+   invalidates it and the next query rebuilds it in O(n). */
+typedef struct {
+    unsigned long long *node;
+    int size;   // Leaves (a power of two >= numrows)
+    int valid;
+} HashTree;
+
+/* Diff view: a line of output. a and b are lines of the compared file
+   and of the buffer (-1 if none); '@' rows head a hunk of na/nb lines. */
+typedef struct {
+    int kind;  // ' ', '-', '+', '~' (changed, side by side) or '@'
+    int a, b;
+    int na, nb;
+} DiffRow;
+
+typedef struct {
+    int visible;
+    int unified;          // Unified or side-by-side (Tab)
+    char *name;           // Compared file
+    char *data;           // Its text; lines point into it
+    char **lines;
+    int *lens;
+    int nlines;
+    unsigned char *del;   // Per file line: not in the buffer
+    unsigned char *add;   // Per buffer row: not in the file
+    int dels, adds;
+    DiffRow *rows;        // Rebuilt when the layout changes
+    int nrows;
+    int caprows;
+    int off;
+} DiffView;
+
+/* Myers search state over line hashes */
+typedef struct {
+    const unsigned long long *a, *b;
+    int *vf, *vb;         // Furthest x per diagonal, forward and backward
+    unsigned char *del, *add;
+    int maxcost;          // Steps before diffSplit gives up on minimality
+} DiffCtx;
+
+/* Slice of lines hashed by one worker */
+typedef struct {
+    char **lines;
+    int *lens;
+    unsigned long long *hash;
+    int from, to;
+} DiffHashJob;
+
+/* Sort key of a row: points at the row text, which is not copied */
+typedef struct {
+    unsigned long long prefix;  // 8 bytes after the prefix common to the range, big endian
+    const char *s;
+    int len;
+    int idx;                  // Position in the range before sorting
+    unsigned long long hash;  // Row hash, for uniq
+    double num;               // Leading number, for sort -n
+} LineKey;
+
+/* Piece of a parallel sort: sorts src[from, to) (mid < 0) or merges
+   src[from, mid) and src[mid, to) into dst */
+typedef struct {
+    LineKey *src, *dst;
+    int from, mid, to;
+    int flags;
+} LineSortJob;
+
+/* Rows written to the stdin of a !command filter by its writer thread */
+typedef struct {
+    HANDLE in;
+    int from, n;
+} FilterJob;
+
 typedef struct {
     int cx, cy;             // Cursor position
     int rx;                 // Rendered cursor position (accounting for tabs)
     int rowoff;             // Row offset for scrolling
     int coloff;             // Column offset for scrolling
-    int screenrows;         // Number of rows in terminal
-    int screencols;         // Number of columns in terminal
+    int screenrows;         // Number of text rows on screen
+    int screencols;         // Number of text columns on screen
+    int termrows;           // Number of rows in terminal
+    int termcols;           // Number of columns in terminal
+    int winleft, wintop;    // Window origin in the console screen buffer
     int numrows;            // Number of rows in file
     EditorRow *rows;        // Array of text rows
     char *filename;         // Current filename
@@ -67,16 +749,39 @@ typedef struct {
     DWORD orig_mode;        // Original console mode
     HANDLE hStdin;          // Console input handle
     HANDLE hStdout;         // Console output handle
+    SymbolIndex symbols;    // C symbols defined in the buffer
+    TagDatabase tags;       // Project-wide symbols (SAVE_DIRECTORY)
+    int depth_valid;        // Rows [0, depth_valid) have an up-to-date depth
+    OutlineIndex outline;   // Function outline panel
+    FoldIndex folds;        // Folded regions
+    int softwrap;           // Soft wrap mode
+    int segoff;             // First wrapped segment of E.rowoff on screen
+    WrapIndex wrapidx;      // Visual line index used when soft wrapping
+    CursorSet cursors;      // Extra cursors (multi-cursor editing)
+    UndoHistory undo;       // Undo/redo history
+    Macro macro;
+    EventLoop events;
+    InputQueue input;       // Decoded console input
+    Selection sel;          // Current selection
+    KillRing kill;          // Copied and cut text
+    OutputPane output;      // Build output pane (F6)
+    BuildJob job;           // Running compile-and-run (F5)
+    SyntaxCheck check;      // Live diagnostics
+    LspClient lsp;          // Language server (F10)
+    WordIndex words;        // Identifiers of the buffer and C keywords
+    CompletionMenu menu;    // Completion popup (Ctrl+Space)
+    int gutter;             // Columns left of the text (markers)
+    DiffView diff;          // Diff against a file on disk (F7)
+    HashTree hashes;        // Row hashes, for change detection
+    unsigned long long saved_hash;  // Root of the hashes at the last open/save
+    int saved_rows;
+    int dirty_recheck;      // Undo/redo ran: compare with saved_hash even if the tree must be rebuilt
+    int linenums;           // Line numbers and change markers (F9)
+    int numdigits;          // Digits of the line numbers, cached for numrows
+    ScreenFrame frame;      // What the terminal is showing now
+    RemoteSession remote;   // --server / --client
 } EditorConfig;
 
-/* Buffer handling for screen rendering */
-struct abuf {
-    char *b;
-    int len;
-};
-
-#define ABUF_INIT {NULL, 0}
-
 /* Global editor state */
 EditorConfig E;
 
@@ -87,24 +792,122 @@ void die(const char *s);
 void disableRawMode();
 void enableRawMode();
 int editorReadKey();
+int editorReadConsoleKey();
+void inputPush(int key);
+void inputPushText(char *text, int len);
+void inputPushMouse(int key, int x, int y);
+void inputPushEvent(int key, int x, int y, int n, const char *text, int len);
+void inputDecodeMouse(MOUSE_EVENT_RECORD *m);
+void vtDispatchMouse(int final);
+int inputPop();
+int inputTakeKey(int key);
+int vtModifiers(int param);
+void vtDispatchCsi(int final);
+void vtFeed(int c);
+void vtFlush();
+int vkToKey(WORD vk, CHAR ch, int mods);
+void inputDecodeKey(KEY_EVENT_RECORD *k);
+void inputReadBatch();
 int getWindowSize(int *rows, int *cols);
+void consoleReadOrigin();
+int editorHandleResize();
+void editorUpdateLayout();
+
+/* Shared text chunks */
+ClipChunk *chunkNew(const char *s, int len, int cap);
+void chunkRetain(ClipChunk *c);
+void chunkRelease(ClipChunk *c);
+void editorRowMakeWritable(EditorRow *row, int need);
+ClipChunk *editorRowChunk(EditorRow *row, int from, int to);
 
 /* Buffer handling */
 void editorAppendRow(char *s, size_t len);
 void editorFreeRow(EditorRow *row);
 void editorFreeBuffer();
 void editorDelRow(int at);
+void editorDelRows(int at, int n);
+void editorPermuteRows(int from, int n, const int *order);
 void editorUpdateRow(EditorRow *row);
 void editorRowInsertChar(EditorRow *row, int at, int c);
 void editorRowAppendString(EditorRow *row, char *s, size_t len);
 void editorRowDelChar(EditorRow *row, int at);
 int editorRowCxToRx(EditorRow *row, int cx);
+int editorRowRxToCx(EditorRow *row, int rx);
+int editorRowDepth(int at);
+void editorInvalidateDepth(int from);
+void editorReplaceRow(int at, const char *s, int len);
+void editorSetRowChunk(int at, ClipChunk *c, int len);
+char *editorRowRender(EditorRow *row);
 
 /* Editor operations */
 void editorInsertChar(int c);
 void editorInsertRow(int at, const char *s, size_t len);
+void editorInsertRows(int at, char **lines, int *lens, int n);
+void editorInsertChunks(int at, ClipChunk **chunks, int *lens, int n);
+void editorInsertChunkGroups(int ngroups, const int *ats, const int *counts, ClipChunk **chunks, int *lens);
 void editorInsertNewline();
+int editorIndentUnit(EditorRow *row, char *out);
+int editorOpensBlock(EditorRow *row, int cx);
+int editorNewlineIndent(EditorRow *row, int cx, char *out, int *opens);
+int editorElectricDedent(int at, int cx);
 void editorDelChar();
+void editorDeleteForward();
+
+/* Undo */
+void undoFreeRecord(UndoRecord *rec);
+void undoClear();
+void undoSeal();
+void undoGroupBegin();
+void undoGroupEnd();
+Cursor *undoCopyCursors(Cursor *all, int n, int primary);
+void undoBegin(int kind, Cursor *all, int n, int primary);
+void undoPushPending();
+int undoSaveRows(int at, int n);
+void undoSavePermutation(int at, int n, const int *order);
+void undoSetRows(int step, int n);
+void undoEnd(Cursor *all, int n, int primary);
+void undoSwapStep(UndoStep *st);
+void editorUndo();
+void editorRedo();
+
+/* Multiple cursors */
+int cursorCompare(const void *a, const void *b);
+void cursorsAdd(int cx, int cy);
+void cursorsClear();
+void cursorsNormalize();
+void cursorClamp(int *cx, int *cy);
+Cursor *cursorsGather(int *n, int *primary);
+void cursorsScatter(Cursor *all, int n, int primary);
+void cursorsRestore(Cursor *set, int n);
+int cursorsFirstOnRow(int at);
+int cursorsNextMark(int at, int *mi);
+void editorMoveCursors(int key);
+void editorMultiEdit(int op, int c);
+void editorAddCursorNextMatch();
+void editorAddCursorVertical(int dir);
+
+/* Selection */
+void editorClearSelection();
+int editorSelectionBounds(int *sy, int *sx, int *ey, int *ex);
+int editorBlockBounds(int *top, int *bottom, int *left, int *right);
+int editorRowSelection(int at, int *l, int *r);
+void editorBlockRowSpan(EditorRow *row, int left, int right, int *cl, int *cr);
+int editorSelectionKey(int c);
+int editorKeyUsesSelection(int c);
+int editorCopySelection();
+int editorDeleteSelection();
+void editorCutSelection();
+
+/* Kill ring */
+void killEntryFree(KillEntry *e);
+KillEntry *killPush(int n, int block);
+KillEntry *killGet(int offset);
+void editorPasteEntry(KillEntry *e);
+void editorPaste();
+void editorPasteOverSelection(KillEntry *e);
+void editorYankPop();
+void editorPasteText(const char *text, int len);
+void editorIndentRows(int dir);
 
 /* File I/O */
 char *editorRowsToString(int *buflen);
@@ -112,15 +915,288 @@ void editorOpen(char *filename);
 void editorOpenFilePrompt();
 void ensureDirectoryExists(const char *path);
 void editorSave();
+void fileWatchStart(const char *path);
+void fileWatchStop();
+int fileWatchCheck();
 
 /* Editor Navigation */
 void editorFindMatchingBrace();
+void editorGotoDefinition();
+int charClass(int c);
+int bitScanForward(unsigned int m);
+int bitScanReverse(unsigned int m);
+unsigned int charClassMask16(const char *s, int cls);
+int scanClassForward(const char *s, int from, int to, int cls);
+int scanClassBackward(const char *s, int from, int to, int cls);
+int editorRowIsBlank(int at);
+int editorRowIndentEnd(int at);
+void editorMoveWord(int dir);
+void editorMoveParagraph(int dir);
+void editorMoveBlock(int dir);
+void editorMoveFunction(int dir);
+
+/* Syntax */
+int isIdentChar(int c);
+int wordInList(const char *word, int len, const char **list);
+int cLexToken(const char *s, int len, int i, CToken *tok);
+const char *cTokenColor(int type);
+void cExtractSymbols(const char *s, int len, SymbolCallback emit, void *ctx);
+
+/* Symbol index */
+unsigned int symHash(const char *s, int len);
+void symIndexGrow();
+void symIndexAdd(void *ctx, const char *name, int len, int kind, int col);
+void editorIndexRow(int at);
+void editorShiftSymbols(int from, int delta);
+int symRow(Symbol *sym);
+void symRenumber();
+void symIndexRemoveRow(EditorRow *row);
+void symIndexClear();
+Symbol *symIndexLookup(const char *name, int len);
+const char *symKindName(int kind);
+
+/* Outline */
+int outlineSearch(int row, int col);
+void outlineInsert(Symbol *sym);
+void outlineRemove(Symbol *sym);
+int outlineCompare(const void *a, const void *b);
+void outlineSortRows(int from, int n);
+void outlineRebuildView();
+int outlineCurrent();
+void editorOutlineNavigate();
+void editorDrawOutlineCell(struct abuf *ab, int y);
+
+/* Folding */
+int foldFind(int row);
+int editorRowIsHidden(int row);
+int editorRowToVisual(int row);
+int editorVisualToRow(int v);
+int editorNextVisibleRow(int row);
+int editorPrevVisibleRow(int row);
+void editorAddFold(int start, int end);
+void editorRemoveFold(int f);
+void editorClearFolds();
+void editorRevealRow(int row);
+void editorFoldsInsertRows(int at, int n);
+void editorFoldsDeleteRows(int at, int n);
+void editorFoldsClearRows(int at, int n);
+void editorToggleFold();
+int foldRowToVisual(int row);
+int foldVisualToRow(int v);
+
+/* Soft wrap */
+void editorComputeWraps(EditorRow *row, int width);
+void editorRowWraps(EditorRow *row);
+int editorRowHeight(int at);
+void wrapEnsureIndex();
+void wrapInvalidate();
+void wrapRowsMoved(int at);
+void editorWrapRowChanged(int at);
+int wrapRowToVisual(int row);
+int wrapVisualToRow(int v, int *seg);
+int editorRowSegment(EditorRow *row, int rx);
+int editorSegmentStart(EditorRow *row, int seg);
+void editorToggleSoftWrap();
+void editorMoveVisual(int delta);
+
+/* Project tags */
+void editorBuildTags();
+int tagsOpen();
+void tagsClose();
+const TagSymEntry *tagsLookup(const char *name, int len);
+const char *tagsFilePath(const TagSymEntry *ts);
+const char *tagsString(unsigned int off);
+
+/* Build and run */
+int spawnProcess(char *cmdline, const char *dir, HANDLE *process, HANDLE *in, HANDLE *out, HANDLE *err,
+                 HANDLE *job);
+DWORD WINAPI pipeReaderThread(LPVOID arg);
+int pipeReaderStart(PipeReader *r, HANDLE pipe, int overlapped);
+int pipeReaderTake(PipeReader *r, char *buf, int size);
+char *pipeReaderTakeAll(PipeReader *r, int *len);
+void pipeReaderDrain(PipeReader *r);
+void pipeReaderStop(PipeReader *r);
+int editorEventHandles(HANDLE *handles);
+DWORD editorBackgroundWait();
+int editorBackgroundPoll();
+void outputClear();
+void outputAppend(const char *s, int len);
+int outputAddLine(const char *s, int len);
+int outputParseDiagnostic(const char *s, int len, Diagnostic *d);
+int buildExpandCommand(char *out, int size, const char *tmpl, const char *file, const char *exe);
+void editorBuildAndRun();
+void jobStop(const char *why);
+int jobPoll();
+void editorToggleOutput();
+void editorScrollOutput(int dir);
+void editorNextDiagnostic();
+void editorDrawOutputPane(struct abuf *ab);
+
+/* Live check */
+void checkSchedule();
+void checkKill();
+void checkCleanup();
+void checkStart();
+int checkPoll();
+void checkFinish();
+void checkClearMarks();
+int checkMarkCompare(const void *a, const void *b);
+CheckMark *checkFindMark(int row);
+void checkInsertRows(int at, int n);
+void checkDeleteRows(int at, int n);
+void checkPermuteRows(int from, int n, const int *order);
+void editorToggleCheck();
+void checkFollowFile();
+
+/* Gutter */
+int countDigits(int n);
+void gutterUpdateWidth();
+void editorMarkSaved();
+void editorToggleLineNumbers();
+void editorDrawGutter(struct abuf *ab, int row);
+
+/* Row hashes */
+unsigned long long hashLine(const char *s, int len);
+unsigned long long hashCombine(unsigned long long a, unsigned long long b);
+void hashTreeInvalidate();
+void hashTreeEnsure();
+void hashTreeUpdate(int at);
+unsigned long long hashTreeQuery(int node, int lo, int hi, int from, int to);
+unsigned long long editorRangeHash(int from, int to);
+unsigned long long editorContentHash();
+int editorIsDirty();
+
+/* Diff */
+DWORD WINAPI diffHashWorker(LPVOID arg);
+void diffHashLines(char **lines, int *lens, int n, unsigned long long *hash);
+void diffSplit(DiffCtx *c, int a0, int a1, int b0, int b1, int *sx, int *sy);
+void diffCompare(DiffCtx *c, int a0, int a1, int b0, int b1);
+void diffMarkShared(const unsigned long long *h, int n, const unsigned long long *other, int m,
+                    unsigned char *keep);
+void diffRun(DiffCtx *c, int na, int nb, unsigned char *del, unsigned char *add);
+void diffAddRow(int kind, int a, int b);
+void diffBuildRows();
+void diffClose();
+int diffCompute(const char *path);
+void diffAppendText(struct abuf *ab, const char *s, int len, int width, int pad);
+void editorDrawDiff(struct abuf *ab);
+void editorDiffView(int ask);
+
+/* Line commands */
+int lineKeyCompare(const LineKey *a, const LineKey *b, int flags);
+int lineKeyEqual(const LineKey *a, const LineKey *b, int flags);
+void lineKeyMerge(LineKey *src, LineKey *dst, int from, int mid, int to, int flags);
+void lineKeySort(LineKey *keys, LineKey *tmp, int from, int to, int flags);
+DWORD WINAPI lineSortWorker(LPVOID arg);
+void lineRunJobs(LineSortJob *jobs, int n);
+void lineSortKeys(LineKey *keys, int n, int flags);
+LineKey *lineMakeKeys(int from, int n, int flags);
+void editorApplyLineOrder(int from, int n, const int *order, int m);
+void editorLineRange(int *from, int *n);
+char *lineParseFlags(char *args, const char *allowed, int *flags);
+int lineUnique(LineKey *keys, int n, int flags);
+int filterWrite(HANDLE h, const char *s, int len);
+DWORD WINAPI filterWriter(LPVOID arg);
+void editorReplaceLines(int from, int n, char **lines, int *lens, int m);
+void editorFilterLines(int from, int n, const char *cmd);
+void editorLineCommand(char *cmd);
+void editorCommand();
+
+/* Language server */
+int jsonSkipWs(const char *s, int len, int i);
+int jsonSkip(const char *s, int len, int i);
+int jsonGet(const char *s, int len, int i, const char *key);
+int jsonArrayFirst(const char *s, int len, int i);
+int jsonArrayNext(const char *s, int len, int i);
+int jsonString(const char *s, int len, int i, char *out, int size);
+int jsonInt(const char *s, int len, int i);
+void jsonAppendString(struct abuf *ab, const char *s, int len);
+char *lspMakeUri(const char *path);
+void lspQueue(LspMessage **head, LspMessage **tail, char *body, int len);
+DWORD WINAPI lspReaderThread(LPVOID arg);
+DWORD WINAPI lspWriterThread(LPVOID arg);
+void lspSend(struct abuf *msg);
+int lspRequest(const char *method, const char *params);
+void lspNotify(const char *method, const char *params);
+void lspStart();
+void lspStop();
+void lspDidOpen();
+void lspDidClose();
+void lspNoteChange(int line, int col, int endline, int endcol, const char *text, int len);
+void lspNoteReplace(int at, int oldlen);
+void lspNoteInsert(int at, int n);
+void lspNoteDelete(int at, int n);
+void lspFlushChanges();
+int lspPoll();
+void lspHandleMessage(const char *s, int len);
+void lspDiagnostics(const char *s, int len, int params);
+void lspCompletionResult(const char *s, int len, int result);
+void lspRequestCompletion();
+void editorToggleLsp();
+
+/* Completion */
+void wordIndexInit();
+void wordIndexClear();
+int wordIndexAdd(const char *s, int len);
+void wordIndexRelease(int id);
+int wordIndexFind(const char *s, int len);
+int wordIndexComplete(const char *prefix, int len, int max);
+void editorRowReleaseWords(EditorRow *row);
+void editorRowAddWord(EditorRow *row, const char *s, int len);
+void completionAdd(const char *label, const char *insert);
+void completionOpen();
+void completionClose();
+void editorRequestCompletion();
+void editorAcceptCompletion();
+int editorCompletionKey(int c);
+void editorDrawCompletion(struct abuf *ab, int y, int x, int *top, int *rows);
+
+/* Macros */
+void macroRecord(int c);
+int macroNextKey();
+void editorToggleMacroRecording(int key);
+void macroRunOnce();
+int macroStart();
+void macroFinish();
+void editorMacroPlay(int times);
+void editorMacroPlayOnLines(int from, int n, const char *text);
+
+/* Mouse */
+int editorScreenToBuffer(int x, int y, int *cx, int *cy, int *rx);
+void editorScrollLines(int delta);
+int editorMouseKey(int c);
+
+/* Remote editing */
+int remoteWrite(HANDLE pipe, const void *buf, int len);
+int remoteSend(HANDLE pipe, int type, const void *data, int len);
+int remoteNextMessage(struct abuf *msg, RemoteHeader *h, char **data);
+void remoteConsume(struct abuf *msg, int n);
+DWORD WINAPI remoteListenerThread(LPVOID arg);
+void remoteListenerFailed(DWORD error);
+void remoteServerStart();
+int remoteAccept();
+void remoteDrop(int i);
+void remoteUpdateSize();
+int remoteServerPoll();
+void remoteSendFrame(struct abuf *frame, struct abuf *tail, int top, int rows);
+void remoteStop();
+void remoteClientSendSize();
+int remoteClientPoll();
+void remoteClientRun();
 
 /* Output */
+int editorCursorVisual();
 void editorScroll();
+int editorDrawRow(struct abuf *ab, int at, int coloff, int width);
 void editorDrawRows(struct abuf *ab);
 void editorDrawStatusBar(struct abuf *ab);
 void editorDrawMessageBar(struct abuf *ab);
+void frameInvalidate(ScreenFrame *f);
+void frameTouch(ScreenFrame *f, int y, int n);
+void frameFree(ScreenFrame *f);
+int frameDiff(ScreenFrame *f, const char *b, int len, struct abuf *out);
+void frameOutput(ScreenFrame *f, struct abuf *frame, struct abuf *tail, int top, int rows,
+                 struct abuf *out);
 void editorRefreshScreen();
 void editorSetStatusMessage(const char *fmt, ...);
 
@@ -152,6 +1228,9 @@ void die(const char *s) {
 }
 
 void disableRawMode() {
+    DWORD written;
+    WriteConsole(E.hStdout, ESC "[?2004l", 8, &written, NULL);  // Bracketed paste off
+    WriteConsole(E.hStdout, ESC "[?1006l" ESC "[?1002l", 16, &written, NULL);  // Mouse off
     if (!SetConsoleMode(E.hStdin, E.orig_mode)) die("SetConsoleMode");
 }
 
@@ -169,58 +1248,519 @@ void enableRawMode() {
     DWORD mode = E.orig_mode;
     mode &= ~(ENABLE_ECHO_INPUT | ENABLE_LINE_INPUT | ENABLE_PROCESSED_INPUT);
     mode |= (ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT);
-    if (!SetConsoleMode(E.hStdin, mode)) die("SetConsoleMode (input)");
+    // Con l'input VT i tasti speciali e gli incolla arrivano come sequenze
+    // di escape; le console che non lo supportano restano all'input classico
+    if (!SetConsoleMode(E.hStdin, mode | ENABLE_VIRTUAL_TERMINAL_INPUT) &&
+        !SetConsoleMode(E.hStdin, mode))
+        die("SetConsoleMode (input)");
 
     // Enable ANSI escape sequences on the output
     DWORD outMode = 0;
     if (!GetConsoleMode(E.hStdout, &outMode)) die("GetConsoleMode (output)");
     outMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
     if (!SetConsoleMode(E.hStdout, outMode)) die("SetConsoleMode (output)");
+
+    DWORD written;
+    WriteConsole(E.hStdout, ESC "[?2004h", 8, &written, NULL);  // Bracketed paste on
+    // Click, trascinamento e rotella; con l'input VT arrivano come
+    // sequenze SGR, altrimenti come MOUSE_EVENT
+    WriteConsole(E.hStdout, ESC "[?1002h" ESC "[?1006h", 16, &written, NULL);
 }
 
+// Tasto successivo: dalla macro in riproduzione oppure dalla console,
+// registrandolo se e' in corso la registrazione di una macro
 int editorReadKey() {
-    INPUT_RECORD ir;
-    DWORD read;
+    if (E.macro.playing) return macroNextKey();
+    int c = editorReadConsoleKey();
+    if (E.macro.recording && c == PASTE_KEY) {
+        // Il testo incollato non sta in un codice di tasto: si registra
+        // come se fosse stato digitato
+        for (int i = 0; i < E.input.textlen; i++) {
+            char ch = E.input.text[i];
+            if (ch != '\r') macroRecord(ch == '\n' ? '\r' : ch);
+        }
+    } else if (E.macro.recording && c != REFRESH_KEY &&
+               !((c & ~(MOD_SHIFT | MOD_CTRL | MOD_ALT)) >= MOUSE_PRESS &&
+                 (c & ~(MOD_SHIFT | MOD_CTRL | MOD_ALT)) <= WHEEL_DOWN)) {
+        // Gli eventi del mouse dipendono da cosa c'e' sullo schermo: una
+        // macro non li ripeterebbe nello stesso punto
+        macroRecord(c);
+    }
+    return c;
+}
 
+int editorReadConsoleKey() {
     while (1) {
-        if (!ReadConsoleInput(E.hStdin, &ir, 1, &read) || read != 1) continue;
+        // Prima gli eventi gia' decodificati dall'ultimo blocco letto
+        if (E.input.count) return inputPop();
+
+        // Si dorme finche' non arriva input, un thread in background non
+        // segnala qualcosa, cambia il file o scade un timer: ad ogni
+        // risveglio si raccoglie il lavoro fatto e, se serve, si ridisegna
+        if (editorBackgroundPoll()) return REFRESH_KEY;
+        HANDLE handles[EVENT_MAX_HANDLES];
+        int n = editorEventHandles(handles);
+        DWORD timeout = editorBackgroundWait();
+        int pending = E.input.state != VT_GROUND && E.input.state != VT_PASTE;
+        if (pending) {
+            // Un ESC senza il resto della sequenza entro ESC_TIMEOUT_MS e'
+            // il tasto Esc
+            DWORD waited = GetTickCount() - E.input.seqtick;
+            if (waited >= ESC_TIMEOUT_MS) {
+                vtFlush();
+                continue;
+            }
+            if (ESC_TIMEOUT_MS - waited < timeout) timeout = ESC_TIMEOUT_MS - waited;
+        }
+        DWORD r = WaitForMultipleObjects(n, handles, FALSE, timeout);
+        if (r == WAIT_OBJECT_0 + 2 && E.events.watch) {
+            if (fileWatchCheck()) return REFRESH_KEY;
+            continue;
+        }
+        if (r == WAIT_OBJECT_0 && E.remote.server) {
+            if (remoteAccept()) return REFRESH_KEY;
+        } else if (r == WAIT_OBJECT_0) {
+            inputReadBatch();
+        }
+    }
+}
 
-        if (ir.EventType == KEY_EVENT && ir.Event.KeyEvent.bKeyDown) {
-            WORD vk = ir.Event.KeyEvent.wVirtualKeyCode;
-            CHAR ch = ir.Event.KeyEvent.uChar.AsciiChar;
+void inputPush(int key) {
+    InputQueue *in = &E.input;
+    if (in->count == INPUT_QUEUE) return;  // Coda piena: il tasto si perde
+    InputEvent *ev = &in->q[(in->head + in->count++) % INPUT_QUEUE];
+    ev->key = key;
+    ev->text = NULL;
+    ev->len = 0;
+}
+
+// Accoda un evento del mouse. Le tacche consecutive della rotella e gli
+// spostamenti consecutivi del trascinamento si fondono nell'ultimo evento
+// in coda: scorrere veloce costa un solo aggiornamento, non uno per tacca.
+void inputPushMouse(int key, int x, int y) {
+    InputQueue *in = &E.input;
+    if (in->count > 0) {
+        InputEvent *last = &in->q[(in->head + in->count - 1) % INPUT_QUEUE];
+        int base = key & ~(MOD_SHIFT | MOD_CTRL | MOD_ALT);
+        if (last->key == key && (base == WHEEL_UP || base == WHEEL_DOWN || base == MOUSE_DRAG)) {
+            last->len++;
+            last->x = x;
+            last->y = y;
+            return;
+        }
+    }
+    inputPush(key);
+    if (in->count == 0) return;
+    InputEvent *ev = &in->q[(in->head + in->count - 1) % INPUT_QUEUE];
+    if (ev->key != key) return;  // Coda piena
+    ev->len = 1;
+    ev->x = x;
+    ev->y = y;
+}
+
+// Accoda un evento gia' decodificato altrove (da un --client)
+void inputPushEvent(int key, int x, int y, int n, const char *text, int len) {
+    int base = key & ~(MOD_SHIFT | MOD_CTRL | MOD_ALT);
+    if (key == PASTE_KEY) {
+        char *copy = malloc(len + 1);
+        if (copy == NULL) die("malloc in inputPushEvent");
+        memcpy(copy, text, len);
+        copy[len] = '\0';
+        inputPushText(copy, len);
+    } else if (base >= MOUSE_PRESS && base <= WHEEL_DOWN) {
+        if (n > INPUT_QUEUE) n = INPUT_QUEUE;
+        for (int i = 0; i < (n > 0 ? n : 1); i++) inputPushMouse(key, x, y);
+    } else if (key != REFRESH_KEY) {
+        inputPush(key);
+    }
+}
+
+// Accoda un incolla; il testo passa alla coda
+void inputPushText(char *text, int len) {
+    InputQueue *in = &E.input;
+    if (in->count == INPUT_QUEUE) {
+        free(text);
+        return;
+    }
+    InputEvent *ev = &in->q[(in->head + in->count++) % INPUT_QUEUE];
+    ev->key = PASTE_KEY;
+    ev->text = text;
+    ev->len = len;
+}
+
+// Toglie il primo evento dalla coda. Il testo di un incolla resta in
+// E.input.text fino all'evento successivo.
+int inputPop() {
+    InputQueue *in = &E.input;
+    InputEvent *ev = &in->q[in->head];
+    in->head = (in->head + 1) % INPUT_QUEUE;
+    in->count--;
+    free(in->text);
+    in->text = ev->text;
+    in->textlen = ev->text ? ev->len : 0;
+    ev->text = NULL;
+    int base = ev->key & ~(MOD_SHIFT | MOD_CTRL | MOD_ALT);
+    if (base >= MOUSE_PRESS && base <= WHEEL_DOWN) {
+        in->mx = ev->x;
+        in->my = ev->y;
+        in->wheel = ev->len;
+    }
+    return ev->key;
+}
+
+// Toglie dalla coda il primo evento 'key' lasciando gli altri al loro
+// posto. Restituisce 1 se c'era.
+int inputTakeKey(int key) {
+    InputQueue *in = &E.input;
+    for (int i = 0; i < in->count; i++) {
+        if (in->q[(in->head + i) % INPUT_QUEUE].key != key) continue;
+        for (int j = i; j < in->count - 1; j++)
+            in->q[(in->head + j) % INPUT_QUEUE] = in->q[(in->head + j + 1) % INPUT_QUEUE];
+        in->count--;
+        return 1;
+    }
+    return 0;
+}
+
+// Modificatori di una sequenza CSI: il parametro vale 1 + shift(1) + alt(2) + ctrl(4)
+int vtModifiers(int param) {
+    int mods = 0;
+    if (param < 2) return 0;
+    param--;
+    if (param & 1) mods |= MOD_SHIFT;
+    if (param & 2) mods |= MOD_ALT;
+    if (param & 4) mods |= MOD_CTRL;
+    return mods;
+}
+
+// Sequenza ESC [ <parametri> <final> completa
+void vtDispatchCsi(int final) {
+    InputQueue *in = &E.input;
+    int params[4] = {0, 0, 0, 0};
+    int np = 0;
+    if (in->seqlen > 0 && in->seq[0] == '<') {
+        vtDispatchMouse(final);
+        return;
+    }
+    for (int i = 0; i < in->seqlen && np < 4; i++) {
+        char c = in->seq[i];
+        if (c >= '0' && c <= '9') params[np] = params[np] * 10 + (c - '0');
+        else if (c == ';') np++;
+        else return;  // Sequenze private (ESC [ ? ...) non interessano
+    }
+    int mods = vtModifiers(params[1]);
+    int key = 0;
+
+    switch (final) {
+        case 'A': key = ARROW_UP; break;
+        case 'B': key = ARROW_DOWN; break;
+        case 'C': key = ARROW_RIGHT; break;
+        case 'D': key = ARROW_LEFT; break;
+        case 'H': key = HOME_KEY; break;
+        case 'F': key = END_KEY; break;
+        case 'P': key = F1_KEY; break;
+        case 'Q': key = F2_KEY; break;
+        case 'R': key = F3_KEY; break;
+        case 'S': key = F4_KEY; break;
+        case 'Z':
+            inputPush('\t' | MOD_SHIFT);
+            return;
+        case '~':
+            switch (params[0]) {
+                case 1: case 7: key = HOME_KEY; break;
+                case 4: case 8: key = END_KEY; break;
+                case 3: key = DEL_KEY; break;
+                case 5: key = PAGE_UP; break;
+                case 6: key = PAGE_DOWN; break;
+                case 11: case 12: case 13: case 14: case 15:
+                    key = F1_KEY + params[0] - 11;
+                    break;
+                case 17: case 18: case 19: case 20: case 21:
+                    key = F6_KEY + params[0] - 17;
+                    break;
+                case 23: case 24:
+                    key = F11_KEY + params[0] - 23;
+                    break;
+                case 200:
+                    in->state = VT_PASTE;
+                    in->pastelen = 0;
+                    return;
+            }
+            break;
+    }
+    if (key) inputPush(key | mods);
+}
+
+// Mouse in codifica SGR: ESC [ < pulsante ; colonna ; riga M (premuto)
+// oppure m (rilasciato), colonna e riga da 1
+void vtDispatchMouse(int final) {
+    InputQueue *in = &E.input;
+    int params[3] = {0, 0, 0};
+    int np = 0;
+    for (int i = 1; i < in->seqlen && np < 3; i++) {
+        char c = in->seq[i];
+        if (c >= '0' && c <= '9') params[np] = params[np] * 10 + (c - '0');
+        else if (c == ';') np++;
+        else return;
+    }
+    if (np != 2 || (final != 'M' && final != 'm')) return;
+
+    int b = params[0];
+    int x = params[1] - 1, y = params[2] - 1;
+    int mods = 0;
+    if (b & 4) mods |= MOD_SHIFT;
+    if (b & 8) mods |= MOD_ALT;
+    if (b & 16) mods |= MOD_CTRL;
+
+    if (b & 64) {
+        if ((b & 3) <= 1) inputPushMouse(((b & 3) == 0 ? WHEEL_UP : WHEEL_DOWN) | mods, x, y);
+    } else if ((b & 3) == 0) {
+        // Solo il pulsante sinistro: gli altri restano al terminale
+        int key = final == 'm' ? MOUSE_RELEASE : (b & 32) ? MOUSE_DRAG : MOUSE_PRESS;
+        inputPushMouse(key | mods, x, y);
+    }
+}
+
+// Un carattere arrivato come testo (input VT o caratteri senza tasto
+// virtuale) passa per la macchina a stati delle sequenze di escape
+void vtFeed(int c) {
+    InputQueue *in = &E.input;
+
+    switch (in->state) {
+        case VT_GROUND:
+            if (c == '\x1b') {
+                in->state = VT_ESC;
+                in->seqtick = GetTickCount();
+            } else {
+                inputPush(c == 0 ? ' ' | MOD_CTRL : c);
+            }
+            return;
+
+        case VT_ESC:
+            if (c == '[') {
+                in->state = VT_CSI;
+                in->seqlen = 0;
+            } else if (c == 'O') {
+                in->state = VT_SS3;
+            } else if (c == '\x1b') {
+                inputPush('\x1b');  // Esc ripetuto: il primo e' un tasto
+                in->seqtick = GetTickCount();
+            } else if (c > ' ' && c < 127) {
+                in->state = VT_GROUND;
+                inputPush(tolower(c) | MOD_ALT);  // Alt+tasto
+            } else {
+                in->state = VT_GROUND;
+                inputPush('\x1b');
+                vtFeed(c);
+            }
+            return;
+
+        case VT_CSI:
+            if (c >= 0x40 && c <= 0x7e) {
+                in->state = VT_GROUND;
+                vtDispatchCsi(c);
+            } else if (c >= 0x20 && c < 0x40 && in->seqlen < VT_SEQ_MAX) {
+                in->seq[in->seqlen++] = c;
+            } else {
+                in->state = VT_GROUND;  // Sequenza non valida: scartata
+            }
+            return;
 
-            // Handle virtual key codes first
-            switch (vk) {
-                case VK_LEFT:
-                    return ARROW_LEFT;
-                case VK_UP:
-                    return ARROW_UP;
-                case VK_RIGHT:
-                    return ARROW_RIGHT;
-                case VK_DOWN:
-                    return ARROW_DOWN;
-                case VK_HOME:
-                    return HOME_KEY;
-                case VK_END:
-                    return END_KEY;
-                case VK_DELETE:
-                    return DEL_KEY;
-                case VK_PRIOR:
-                    return PAGE_UP;
-                case VK_NEXT:
-                    return PAGE_DOWN;
-                case VK_BACK:
-                    return 127;  // Backspace as ASCII DEL
+        case VT_SS3:
+            in->state = VT_GROUND;
+            switch (c) {
+                case 'A': inputPush(ARROW_UP); break;
+                case 'B': inputPush(ARROW_DOWN); break;
+                case 'C': inputPush(ARROW_RIGHT); break;
+                case 'D': inputPush(ARROW_LEFT); break;
+                case 'H': inputPush(HOME_KEY); break;
+                case 'F': inputPush(END_KEY); break;
+                case 'P': case 'Q': case 'R': case 'S':
+                    inputPush(F1_KEY + c - 'P');
+                    break;
             }
+            return;
 
-            // If there's an actual ASCII char, return it directly
-            if (ch != 0) {
-                return ch;
+        case VT_PASTE: {
+            // Tutto fino a ESC [201~ e' testo, anche gli ESC. Arriva un
+            // byte alla volta: il buffer raddoppia invece di crescere di uno
+            static const char end[] = "\x1b[201~";
+            if (in->pastelen + 1 >= in->pastecap) {
+                in->pastecap = in->pastecap ? in->pastecap * 2 : 4096;
+                in->paste = realloc(in->paste, in->pastecap);
+                if (in->paste == NULL) die("realloc in vtFeed");
+            }
+            in->paste[in->pastelen++] = c;
+            int len = in->pastelen;
+            if (len >= 6 && memcmp(in->paste + len - 6, end, 6) == 0) {
+                // Il buffer passa alla coda cosi' com'e', senza copiarlo
+                len -= 6;
+                in->paste[len] = '\0';
+                inputPushText(in->paste, len);
+                in->paste = NULL;
+                in->pastelen = in->pastecap = 0;
+                in->state = VT_GROUND;
             }
+            return;
+        }
+    }
+}
+
+// Scaduta l'attesa: la sequenza iniziata non arrivera', l'ESC era un tasto
+void vtFlush() {
+    inputPush('\x1b');
+    E.input.state = VT_GROUND;
+}
+
+// Codice dell'editor per un tasto della console classica, 0 se il tasto
+// non produce niente
+int vkToKey(WORD vk, CHAR ch, int mods) {
+    switch (vk) {
+        case VK_LEFT:
+            return ARROW_LEFT | mods;
+        case VK_UP:
+            return ARROW_UP | mods;
+        case VK_RIGHT:
+            return ARROW_RIGHT | mods;
+        case VK_DOWN:
+            return ARROW_DOWN | mods;
+        case VK_HOME:
+            return HOME_KEY | mods;
+        case VK_END:
+            return END_KEY | mods;
+        case VK_DELETE:
+            return DEL_KEY | mods;
+        case VK_PRIOR:
+            return PAGE_UP | mods;
+        case VK_NEXT:
+            return PAGE_DOWN | mods;
+        case VK_BACK:
+            return 127;  // Backspace as ASCII DEL
+        case VK_TAB:
+            return '\t' | (mods & MOD_SHIFT);
+    }
+
+    if (vk >= VK_F1 && vk <= VK_F12) return (F1_KEY + (vk - VK_F1)) | mods;
+    if (vk == VK_SPACE && (mods & (MOD_CTRL | MOD_ALT)) == MOD_CTRL) return ' ' | MOD_CTRL;
+
+    // Alt+lettera come comando; AltGr (Ctrl+Alt) scrive ancora caratteri
+    if (ch != 0 && (mods & (MOD_ALT | MOD_CTRL)) == MOD_ALT) return tolower((unsigned char)ch) | MOD_ALT;
+
+    // If there's an actual ASCII char, return it directly
+    return ch;
+}
+
+void inputDecodeKey(KEY_EVENT_RECORD *k) {
+    if (!k->bKeyDown) return;
+    WORD vk = k->wVirtualKeyCode;
+    CHAR ch = k->uChar.AsciiChar;
+    DWORD state = k->dwControlKeyState;
+    int repeat = k->wRepeatCount ? k->wRepeatCount : 1;
+
+    // Con l'input VT le sequenze arrivano carattere per carattere senza
+    // tasto virtuale; a sequenza iniziata anche il resto va al parser.
+    // Anche il NUL (Ctrl+Spazio) e' un carattere senza tasto virtuale.
+    if (E.input.state != VT_GROUND || vk == 0) {
+        while (repeat--) vtFeed(ch);
+        return;
+    }
+
+    // Modifiers are reported only for the special keys
+    int mods = 0;
+    if (state & SHIFT_PRESSED) mods |= MOD_SHIFT;
+    if (state & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) mods |= MOD_CTRL;
+    if (state & (LEFT_ALT_PRESSED | RIGHT_ALT_PRESSED)) mods |= MOD_ALT;
+
+    int key = vkToKey(vk, ch, mods);
+    if (key == 0) return;
+    // La ripetizione automatica puo' arrivare come un solo record
+    while (repeat--) inputPush(key);
+}
+
+// Mouse della console classica: i pulsanti arrivano come stato, la
+// pressione e il rilascio si ricavano dal confronto con il record prima
+void inputDecodeMouse(MOUSE_EVENT_RECORD *m) {
+    InputQueue *in = &E.input;
+    int x = m->dwMousePosition.X - E.winleft, y = m->dwMousePosition.Y - E.wintop;
+    DWORD state = m->dwControlKeyState;
+    int mods = 0;
+    if (state & SHIFT_PRESSED) mods |= MOD_SHIFT;
+    if (state & (LEFT_CTRL_PRESSED | RIGHT_CTRL_PRESSED)) mods |= MOD_CTRL;
+    if (state & (LEFT_ALT_PRESSED | RIGHT_ALT_PRESSED)) mods |= MOD_ALT;
+
+    if (m->dwEventFlags & MOUSE_WHEELED) {
+        // La parte alta dello stato e' lo spostamento, positivo verso l'alto
+        int up = (short)HIWORD(m->dwButtonState) > 0;
+        inputPushMouse((up ? WHEEL_UP : WHEEL_DOWN) | mods, x, y);
+        return;
+    }
+
+    int was = in->buttons & FROM_LEFT_1ST_BUTTON_PRESSED;
+    int now = m->dwButtonState & FROM_LEFT_1ST_BUTTON_PRESSED;
+    in->buttons = m->dwButtonState;
+    if (now && !was) inputPushMouse(MOUSE_PRESS | mods, x, y);
+    else if (!now && was) inputPushMouse(MOUSE_RELEASE | mods, x, y);
+    else if (now && (m->dwEventFlags & MOUSE_MOVED)) inputPushMouse(MOUSE_DRAG | mods, x, y);
+}
+
+// Legge in una sola chiamata tutti i record disponibili (fino a
+// INPUT_BATCH) e li decodifica nella coda: ripetizioni dei tasti e
+// incolla vengono poi consumati senza ridisegnare a ogni carattere
+void inputReadBatch() {
+    INPUT_RECORD irs[INPUT_BATCH];
+    DWORD read;
+    if (!ReadConsoleInput(E.hStdin, irs, INPUT_BATCH, &read)) return;
+
+    // La finestra puo' scorrere nel buffer senza alcun evento di
+    // ridimensionamento: l'origine si rilegge una volta per blocco
+    for (DWORD i = 0; i < read; i++) {
+        if (irs[i].EventType == MOUSE_EVENT) {
+            consoleReadOrigin();
+            break;
+        }
+    }
+
+    for (DWORD i = 0; i < read; i++) {
+        if (irs[i].EventType == KEY_EVENT) {
+            inputDecodeKey(&irs[i].Event.KeyEvent);
+        } else if (irs[i].EventType == MOUSE_EVENT) {
+            inputDecodeMouse(&irs[i].Event.MouseEvent);
+        } else if (irs[i].EventType == WINDOW_BUFFER_SIZE_EVENT) {
+            if (editorHandleResize()) inputPush(REFRESH_KEY);
         }
     }
 }
 
+// Divide lo schermo tra testo, pannello outline e barre di stato
+void editorUpdateLayout() {
+    E.screenrows = E.termrows - 2;  // leave 2 lines for status + message bars
+    // Numeri di riga (+ colonna delle modifiche), poi i marcatori del controllo
+    E.numdigits = countDigits(E.numrows);
+    E.gutter = E.check.enabled || E.lsp.running ? GUTTER_MARK_WIDTH : 0;
+    if (E.linenums) E.gutter += E.numdigits + (E.gutter ? 1 : 2);
+    E.screencols = E.termcols - E.gutter;
+    if (E.outline.visible) {
+        int panel = OUTLINE_WIDTH;
+        if (panel > E.termcols / 2) panel = E.termcols / 2;
+        E.screencols -= panel + 1;  // +1 per il separatore
+    }
+    if (E.output.visible) {
+        // Riga di titolo + OUTPUT_HEIGHT righe, al massimo meta' schermo
+        int pane = OUTPUT_HEIGHT + 1;
+        if (pane > E.screenrows / 2) pane = E.screenrows / 2;
+        E.output.height = pane > 1 ? pane - 1 : 0;
+        E.screenrows -= pane;
+    }
+    if (E.screenrows < 1) E.screenrows = 1;
+    if (E.screencols < 1) E.screencols = 1;
+
+    // Una larghezza diversa cambia gli a capo di tutte le righe
+    if (E.screencols != E.wrapidx.width) {
+        E.wrapidx.width = E.screencols;
+        wrapInvalidate();
+    }
+}
+
 int getWindowSize(int *rows, int *cols) {
     CONSOLE_SCREEN_BUFFER_INFO csbi;
 
@@ -228,39 +1768,104 @@ int getWindowSize(int *rows, int *cols) {
 
     *cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
     *rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+    // I MOUSE_EVENT danno coordinate del buffer, non della finestra
+    E.winleft = csbi.srWindow.Left;
+    E.wintop = csbi.srWindow.Top;
 
     return 0;
 }
 
-/*** Buffer handling ***/
-void editorAppendRow(char *s, size_t len) {
-    E.rows = realloc(E.rows, sizeof(EditorRow) * (E.numrows + 1));
-    if (E.rows == NULL) die("realloc");
+// Origine della finestra nel buffer, per convertire le coordinate del mouse
+void consoleReadOrigin() {
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    if (!GetConsoleScreenBufferInfo(E.hStdout, &csbi)) return;
+    E.winleft = csbi.srWindow.Left;
+    E.wintop = csbi.srWindow.Top;
+}
 
-    int at = E.numrows;
+// La dimensione della finestra si rilegge quando la console segnala un
+// ridimensionamento (l'origine anche a ogni blocco con eventi del mouse):
+// al cambio si rifanno layout e a capo e lo schermo viene ridisegnato da
+// zero. Restituisce 1 se la dimensione e' cambiata.
+int editorHandleResize() {
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1) return 0;
+    if (rows == E.termrows && cols == E.termcols) return 0;
+    E.termrows = rows;
+    E.termcols = cols;
+    editorUpdateLayout();
+    frameInvalidate(&E.frame);
+    return 1;
+}
 
-    E.rows[at].size = len;
-    E.rows[at].capacity = len + 1;  // Initialize capacity
-    E.rows[at].chars = malloc(E.rows[at].capacity);
-    if (E.rows[at].chars == NULL) die("malloc");
+/*** Shared text chunks ***/
+
+// Nuovo chunk privato (refs = 1) con una copia del testo
+ClipChunk *chunkNew(const char *s, int len, int cap) {
+    if (cap < len + 1) cap = len + 1;
+    ClipChunk *c = malloc(sizeof(ClipChunk) + cap);
+    if (c == NULL) die("malloc in chunkNew");
+    c->refs = 1;
+    c->cap = cap;
+    if (len > 0) memcpy(c->data, s, len);
+    c->data[len] = '\0';
+    return c;
+}
 
-    memcpy(E.rows[at].chars, s, len);
-    E.rows[at].chars[len] = '\0';
-    E.rows[at].render = NULL;
-    E.rows[at].rsize = 0;
+void chunkRetain(ClipChunk *c) {
+    c->refs++;
+}
 
-    editorUpdateRow(&E.rows[at]);
-    E.numrows++;
-    E.dirty = 1;
+void chunkRelease(ClipChunk *c) {
+    if (c && --c->refs == 0) free(c);
+}
+
+// Da chiamare prima di modificare una riga: se il testo e' condiviso ne
+// fa una copia privata (copy-on-write), poi garantisce 'need' byte
+void editorRowMakeWritable(EditorRow *row, int need) {
+    ClipChunk *c = row->chunk;
+    if (c->refs > 1) {
+        row->chunk = chunkNew(row->chars, row->size, need);
+        chunkRelease(c);
+    } else if (c->cap < need) {
+        int cap = c->cap * 2;
+        if (cap < need) cap = need;
+        c = realloc(c, sizeof(ClipChunk) + cap);
+        if (c == NULL) die("realloc in editorRowMakeWritable");
+        c->cap = cap;
+        row->chunk = c;
+    }
+    row->chars = row->chunk->data;
+}
+
+// Chunk con i caratteri [from, to) della riga: una riga intera viene
+// condivisa senza copiarla
+ClipChunk *editorRowChunk(EditorRow *row, int from, int to) {
+    if (from == 0 && to == row->size) {
+        chunkRetain(row->chunk);
+        return row->chunk;
+    }
+    return chunkNew(row->chars + from, to - from, 0);
+}
+
+/*** Buffer handling ***/
+void editorAppendRow(char *s, size_t len) {
+    editorInsertRow(E.numrows, s, len);
 }
 
 void editorFreeRow(EditorRow *row) {
-    free(row->chars);
+    symIndexRemoveRow(row);
+    editorRowReleaseWords(row);
+    chunkRelease(row->chunk);
     free(row->render);
+    free(row->wraps);
+    free(row->words);
 }
 
 // Libera tutte le righe e resetta lo stato del buffer
 void editorFreeBuffer() {
+    lspDidClose();
+    completionClose();
     if (E.rows == NULL) return;
 
     for (int i = 0; i < E.numrows; i++) {
@@ -269,87 +1874,170 @@ void editorFreeBuffer() {
     free(E.rows);
     E.rows = NULL;
     E.numrows = 0;
+    E.depth_valid = 0;
+    symIndexClear();
+    wordIndexClear();
+    editorClearFolds();
+    cursorsClear();
+    undoClear();
+    editorClearSelection();
+    checkKill();
+    checkClearMarks();
 
     free(E.filename);
     E.filename = NULL;
+    fileWatchStop();
 
     E.cx = 0;
     E.cy = 0;
     E.rowoff = 0;
     E.coloff = 0;
     E.dirty = 0;
+    hashTreeInvalidate();
+    E.saved_hash = 0;
+    E.saved_rows = 0;
 }
 
 void editorDelRow(int at) {
-    if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.rows[at]);
-    memmove(&E.rows[at], &E.rows[at + 1],
-            sizeof(EditorRow) * (E.numrows - at - 1));
-    E.numrows--;
-    E.dirty = 1;
+    editorDelRows(at, 1);
 }
 
-void editorUpdateRow(EditorRow *row) {
-    free(row->render);
-    int tabs = 0;
-    for (int j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') tabs++;
+// Cancella le righe [at, at + n) con un solo spostamento dell'array
+void editorDelRows(int at, int n) {
+    if (at < 0 || at >= E.numrows || n <= 0) return;
+    if (at + n > E.numrows) n = E.numrows - at;
+    lspNoteDelete(at, n);
+
+    // Le righe successive restano valide solo se il blocco non cambia la profondita'
+    int changes_depth = 0;
+    int removed = 0;  // Tolte righe che erano nel file su disco
+    for (int i = at; i < at + n; i++) {
+        if (E.rows[i].brace_delta != 0) changes_depth = 1;
+        if ((E.rows[i].change & ROW_REMOVED) || !(E.rows[i].change & ROW_ADDED)) removed = 1;
+        editorFreeRow(&E.rows[i]);
     }
+    if (changes_depth)
+        editorInvalidateDepth(at);
+    else if (E.depth_valid > at)
+        E.depth_valid = E.depth_valid >= at + n ? E.depth_valid - n : at;
+
+    memmove(&E.rows[at], &E.rows[at + n],
+            sizeof(EditorRow) * (E.numrows - at - n));
+    E.numrows -= n;
+    if (removed && E.numrows > 0) E.rows[at < E.numrows ? at : at - 1].change |= ROW_REMOVED;
+    gutterUpdateWidth();
+    editorShiftSymbols(at + n, -n);
+    editorFoldsDeleteRows(at, n);
+    checkDeleteRows(at, n);
+    checkSchedule();
+    wrapRowsMoved(at);
+    hashTreeInvalidate();
+    E.dirty = 1;
+}
 
-    // Alloca abbastanza memoria per tab, testo e codici colore
-    row->render = malloc(row->size + tabs * (TAB_SIZE - 1) + 1);
-    if (row->render == NULL) die("malloc");
+// Riordina le righe [from, from + n): in from + i va la riga che era in
+// from + order[i]. Le righe si spostano intere, con il testo e tutto
+// quello che e' gia' stato calcolato su di esse, quindi niente viene
+// riletto dal lexer.
+void editorPermuteRows(int from, int n, const int *order) {
+    EditorRow *moved = malloc(sizeof(EditorRow) * (n ? n : 1));
+    int *oldlens = malloc(sizeof(int) * (n ? n : 1));
+    if (moved == NULL || oldlens == NULL) die("malloc in editorPermuteRows");
+    for (int i = 0; i < n; i++) {
+        moved[i] = E.rows[from + order[i]];
+        oldlens[i] = E.rows[from + i].size;
+    }
+    memcpy(&E.rows[from], moved, sizeof(EditorRow) * n);
+    free(moved);
+
+    for (int i = 0; i < n; i++) {
+        if (order[i] == i) continue;
+        EditorRow *row = &E.rows[from + i];
+        for (Symbol *sym = row->syms; sym; sym = sym->rownext) {
+            sym->row = from + i;
+            sym->epoch = E.symbols.nshifts;
+        }
+        if (!(row->change & ROW_ADDED)) row->change |= ROW_MODIFIED;
+        lspNoteReplace(from + i, oldlens[i]);
+    }
+    free(oldlens);
+    outlineSortRows(from, n);
+
+    editorInvalidateDepth(from);
+    editorFoldsClearRows(from, n);
+    checkPermuteRows(from, n, order);
+    checkSchedule();
+    wrapRowsMoved(from);
+    hashTreeInvalidate();
+    E.dirty = 1;
+}
 
+void editorUpdateRow(EditorRow *row) {
+    // La versione renderizzata viene ricostruita solo quando la riga e'
+    // disegnata (editorRowRender): qui basta la sua lunghezza
+    free(row->render);
+    row->render = NULL;
     int idx = 0;
     for (int j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while (idx % TAB_SIZE != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
+        if (row->chars[j] == '\t')
+            idx += TAB_SIZE - (idx % TAB_SIZE);
+        else
+            idx++;
     }
-    row->render[idx] = '\0';
     row->rsize = idx;
+    row->indent = scanClassForward(row->chars, 0, row->size, CLASS_SPACE);
+    row->hash = hashLine(row->chars, row->size);
+    if (!(row->change & ROW_ADDED)) row->change |= ROW_MODIFIED;
+
+    // Aggiorna profondita' delle graffe e simboli solo per la riga modificata
+    int at = row - E.rows;
+    int delta = 0;
+    CToken tok;
+    int i = 0;
+    row->brace_min = 0;
+    // Le parole della riga vengono rilette dallo stesso lexer
+    editorRowReleaseWords(row);
+    while ((i = cLexToken(row->chars, row->size, i, &tok)), tok.type != TOK_EOF) {
+        if (tok.type == TOK_IDENT) editorRowAddWord(row, row->chars + tok.start, tok.len);
+        if (tok.type != TOK_PUNCT) continue;
+        if (row->chars[tok.start] == '{') delta++;
+        else if (row->chars[tok.start] == '}') delta--;
+        if (delta < row->brace_min) row->brace_min = delta;
+    }
+    if (delta != row->brace_delta) {
+        row->brace_delta = delta;
+        editorInvalidateDepth(at + 1);
+    }
 
-    // A questo punto, row->render contiene il testo con i tab espansi.
-    // Questa è una semplificazione per evitare di gestire l'offset dei colori
-    // durante il calcolo di rx. La soluzione più robusta è più complessa,
-    // ma questa risolve il problema del posizionamento del cursore.
-}
-
-void editorRowInsertChar(EditorRow *row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size;
+    editorIndexRow(at);
+    checkSchedule();
+    hashTreeUpdate(at);
 
-    // Ensure we have enough capacity before inserting
-    if (row->size + 2 > row->capacity) {  // +2 for new char + null terminator
-        int new_capacity = row->capacity * 2;
-        if (new_capacity == 0) new_capacity = 4;  // Minimum capacity
+    // Gli a capo della riga vanno ricalcolati
+    row->wrap_width = 0;
+    editorWrapRowChanged(at);
+}
 
-        char *new_chars = realloc(row->chars, new_capacity);
-        if (new_chars == NULL) return;  // Handle allocation failure gracefully
+void editorRowInsertChar(EditorRow *row, int at, int c) {
+    if (at < 0 || at > row->size) at = row->size;
 
-        row->chars = new_chars;
-        row->capacity = new_capacity;
-    }
+    // Ensure we own the text and have room for new char + null terminator
+    editorRowMakeWritable(row, row->size + 2);
 
     memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
     row->size++;
     row->chars[at] = c;
+    lspNoteChange(row - E.rows, at, row - E.rows, at, &row->chars[at], 1);
     editorUpdateRow(row);
     E.dirty = 1;
 }
 
 void editorRowAppendString(EditorRow *row, char *s, size_t len) {
     int new_size = row->size + len;
-
-    if (new_size >= row->capacity) {
-        while (row->capacity < new_size + 1) row->capacity *= 2;
-        row->chars = realloc(row->chars, row->capacity);
-        if (!row->chars) die("realloc in editorRowAppendString");
-    }
+    editorRowMakeWritable(row, new_size + 1);
 
     memcpy(&row->chars[row->size], s, len);
+    lspNoteChange(row - E.rows, row->size, row - E.rows, row->size, s, len);
     row->size = new_size;
     row->chars[row->size] = '\0';
     editorUpdateRow(row);
@@ -358,272 +2046,2004 @@ void editorRowAppendString(EditorRow *row, char *s, size_t len) {
 
 void editorRowDelChar(EditorRow *row, int at) {
     if (at < 0 || at >= row->size) return;
+    editorRowMakeWritable(row, row->size + 1);
+    lspNoteChange(row - E.rows, at, row - E.rows, at + 1, "", 0);
     memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
     row->size--;
     editorUpdateRow(row);
     E.dirty = 1;
 }
 
+// Sostituisce il contenuto della riga e la ricostruisce una sola volta
+void editorReplaceRow(int at, const char *s, int len) {
+    EditorRow *row = &E.rows[at];
+    int oldlen = row->size;
+    if (row->chunk->refs > 1 || row->chunk->cap < len + 1) {
+        // Il vecchio testo non serve: niente copy-on-write
+        ClipChunk *c = chunkNew(s, len, len + 1);
+        chunkRelease(row->chunk);
+        row->chunk = c;
+        row->chars = c->data;
+    } else {
+        memcpy(row->chars, s, len);
+        row->chars[len] = '\0';
+    }
+    row->size = len;
+    lspNoteReplace(at, oldlen);
+    editorUpdateRow(row);
+    E.dirty = 1;
+}
+
+// Sostituisce il testo della riga con un chunk condiviso (senza copiarlo)
+void editorSetRowChunk(int at, ClipChunk *c, int len) {
+    EditorRow *row = &E.rows[at];
+    int oldlen = row->size;
+    chunkRetain(c);
+    chunkRelease(row->chunk);
+    row->chunk = c;
+    row->chars = c->data;
+    row->size = len;
+    lspNoteReplace(at, oldlen);
+    editorUpdateRow(row);
+    E.dirty = 1;
+}
+
+char *editorRowRender(EditorRow *row) {
+    if (row->render) return row->render;
+
+    row->render = malloc(row->rsize + 1);
+    if (row->render == NULL) die("malloc in editorRowRender");
+    int idx = 0;
+    for (int j = 0; j < row->size; j++) {
+        if (row->chars[j] == '\t') {
+            row->render[idx++] = ' ';
+            while (idx % TAB_SIZE != 0) row->render[idx++] = ' ';
+        } else {
+            row->render[idx++] = row->chars[j];
+        }
+    }
+    row->render[idx] = '\0';
+    return row->render;
+}
+
+// Profondita' delle graffe all'inizio della riga. Le profondita' sono
+// ricalcolate in modo pigro solo dalla prima riga invalidata in poi.
+int editorRowDepth(int at) {
+    if (at < 0 || at >= E.numrows) return 0;
+    while (E.depth_valid <= at) {
+        int y = E.depth_valid;
+        E.rows[y].depth = y > 0 ? E.rows[y - 1].depth + E.rows[y - 1].brace_delta : 0;
+        E.depth_valid++;
+    }
+    return E.rows[at].depth;
+}
+
+void editorInvalidateDepth(int from) {
+    if (from < E.depth_valid) {
+        E.depth_valid = from;
+        E.outline.dirty = 1;
+    }
+}
+
 /*** Editor operations ***/
 
 void editorInsertChar(int c) {
-    if (E.cy == E.numrows) {
-        editorAppendRow("", 0);
-    }
-    editorRowInsertChar(&E.rows[E.cy], E.cx, c);
-    E.cx++;
+    editorMultiEdit(EDIT_INSERT, c);
 }
 
 void editorInsertRow(int at, const char *s, size_t len) {
-    if (at < 0 || at > E.numrows) return;
+    char *line = (char *)s;
+    int linelen = len;
+    editorInsertRows(at, &line, &linelen, 1);
+}
 
-    E.rows = realloc(E.rows, sizeof(EditorRow) * (E.numrows + 1));
-    if (!E.rows) die("realloc E.rows in editorInsertRow");
+// Inserisce n righe in 'at' con un solo spostamento dell'array
+void editorInsertRows(int at, char **lines, int *lens, int n) {
+    if (at < 0 || at > E.numrows || n <= 0) return;
+
+    ClipChunk **chunks = malloc(sizeof(ClipChunk *) * n);
+    if (chunks == NULL) die("malloc in editorInsertRows");
+    for (int i = 0; i < n; i++) chunks[i] = chunkNew(lines[i], lens[i], 0);
+    editorInsertChunks(at, chunks, lens, n);
+    for (int i = 0; i < n; i++) chunkRelease(chunks[i]);
+    free(chunks);
+}
 
-    // Move everything below 'at' down by one, making room for our new row
-    memmove(&E.rows[at + 1], &E.rows[at], sizeof(EditorRow) * (E.numrows - at));
+// Come editorInsertRows, ma le righe condividono i chunk senza copiarli
+void editorInsertChunks(int at, ClipChunk **chunks, int *lens, int n) {
+    if (at < 0 || at > E.numrows || n <= 0) return;
+    editorInsertChunkGroups(1, &at, &n, chunks, lens);
+}
 
-    E.rows[at].size = len;
-    E.rows[at].chars = malloc(len + 1);
-    if (!E.rows[at].chars) die("malloc in editorInsertRow");
+// Inserisce piu' gruppi di righe: il gruppo g (counts[g] righe, in ordine
+// in chunks) va prima della riga ats[g] del buffer attuale, con ats
+// crescenti. L'array delle righe si sposta una volta sola; gli indici
+// passati a fold, diagnostica e server sono quelli che si avrebbero
+// inserendo i gruppi uno dopo l'altro dall'alto.
+void editorInsertChunkGroups(int ngroups, const int *ats, const int *counts, ClipChunk **chunks, int *lens) {
+    int total = 0;
+    for (int g = 0; g < ngroups; g++) total += counts[g];
+    if (total == 0) return;
+
+    E.rows = realloc(E.rows, sizeof(EditorRow) * (E.numrows + total));
+    if (!E.rows) die("realloc E.rows in editorInsertChunks");
+
+    // Dal fondo: ogni tratto di righe scende di quante ne vanno sopra
+    int src = E.numrows, dst = E.numrows + total, next = total;
+    for (int g = ngroups - 1; g >= 0; g--) {
+        int len = src - ats[g];
+        src -= len;
+        dst -= len;
+        memmove(&E.rows[dst], &E.rows[src], sizeof(EditorRow) * len);
+        dst -= counts[g];
+        next -= counts[g];
+        for (int i = 0; i < counts[g]; i++) {
+            EditorRow *row = &E.rows[dst + i];
+            memset(row, 0, sizeof(*row));
+            chunkRetain(chunks[next + i]);
+            row->chunk = chunks[next + i];
+            row->chars = chunks[next + i]->data;
+            row->size = lens[next + i];
+            row->change = ROW_ADDED;
+            row->vheight = -1;
+        }
+    }
 
-    memcpy(E.rows[at].chars, s, len);
-    E.rows[at].chars[len] = '\0';
-    E.rows[at].capacity = len + 1;
-    E.rows[at].render = NULL;
-    E.rows[at].rsize = 0;
+    int numrows = E.numrows;
+    E.numrows += total;
+    for (int g = 0, shift = 0; g < ngroups; shift += counts[g++]) {
+        int at = ats[g] + shift, n = counts[g];
+        if (n == 0) continue;
+        lspNoteInsert(at, n);
+
+        // Righe vuote non cambiano la profondita' delle righe che le seguono
+        if (at < numrows && E.depth_valid > at) {
+            for (int i = 0; i < n; i++) E.rows[at + i].depth = E.rows[at + n].depth;
+            E.depth_valid += n;
+        } else if (at == numrows && E.depth_valid == at) {
+            int depth = at > 0 ? E.rows[at - 1].depth + E.rows[at - 1].brace_delta : 0;
+            for (int i = 0; i < n; i++) E.rows[at + i].depth = depth;
+            E.depth_valid += n;
+        }
+        numrows += n;
 
-    editorUpdateRow(&E.rows[at]);
-    E.numrows++;
+        editorShiftSymbols(at, n);
+        editorFoldsInsertRows(at, n);
+        checkInsertRows(at, n);
+        wrapRowsMoved(at);
+    }
+    gutterUpdateWidth();
+    hashTreeInvalidate();
+    for (int g = 0, shift = 0; g < ngroups; shift += counts[g++])
+        for (int i = 0; i < counts[g]; i++) editorUpdateRow(&E.rows[ats[g] + shift + i]);
     E.dirty = 1;
 }
 
 void editorInsertNewline() {
-    // If the cursor is at the very top-left, insert a blank line at E.cy
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
-    } else {
-        // Otherwise, split the current row at E.cx
-        EditorRow *row = &E.rows[E.cy];
-        // Insert a new row below the current one, containing the text
-        // that was to the right of the cursor
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    editorMultiEdit(EDIT_NEWLINE, 0);
+}
 
-        // Now shrink the current row to just the left part
-        row = &E.rows[E.cy];  // reacquire pointer in case of realloc
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+// Un livello di rientro nello stile della riga: tab se la riga e' rientrata
+// con i tab, altrimenti TAB_SIZE spazi
+int editorIndentUnit(EditorRow *row, char *out) {
+    if (row->indent > 0 && row->chars[0] == '\t') {
+        out[0] = '\t';
+        return 1;
     }
-    E.cy++;
-    E.cx = 0;
+    memset(out, ' ', TAB_SIZE);
+    return TAB_SIZE;
+}
+
+// 1 se il testo prima di cx lascia aperta una graffa (le graffe in
+// stringhe e commenti sono ignorate dal lexer)
+int editorOpensBlock(EditorRow *row, int cx) {
+    int open = 0;
+    CToken tok;
+    int i = 0;
+    while ((i = cLexToken(row->chars, cx, i, &tok)), tok.type != TOK_EOF) {
+        if (tok.type != TOK_PUNCT) continue;
+        if (row->chars[tok.start] == '{') open++;
+        else if (row->chars[tok.start] == '}' && open > 0) open--;
+    }
+    return open > 0;
+}
+
+// Rientro della riga creata da Invio in colonna cx: quello della riga
+// (dalla cache, senza guardare le righe precedenti) piu' un livello se il
+// cursore segue una graffa aperta. 'out' deve avere spazio per
+// row->indent + TAB_SIZE caratteri.
+int editorNewlineIndent(EditorRow *row, int cx, char *out, int *opens) {
+    int len = row->indent;
+    memcpy(out, row->chars, len);
+    *opens = cx > row->indent && editorOpensBlock(row, cx);
+    if (*opens) len += editorIndentUnit(row, out + len);
+    return len;
+}
+
+// Graffa chiusa scritta come primo carattere della riga: quanti caratteri
+// di rientro togliere prima di cx. La profondita' in cache evita di
+// togliere un livello gia' rimosso a mano.
+int editorElectricDedent(int at, int cx) {
+    EditorRow *row = &E.rows[at];
+    if (cx == 0 || cx > row->indent) return 0;
+    int depth = editorRowDepth(at);
+    if (depth == 0 || editorRowCxToRx(row, cx) <= (depth - 1) * TAB_SIZE) return 0;
+    if (row->chars[cx - 1] == '\t') return 1;
+    int n = 0;
+    while (n < TAB_SIZE && n < cx && row->chars[cx - 1 - n] == ' ') n++;
+    return n;
 }
 
 void editorDelChar() {
-    if (E.cy == E.numrows) return;
-    if (E.cx == 0 && E.cy == 0) return;
+    editorMultiEdit(EDIT_BACKSPACE, 0);
+}
 
-    EditorRow *row = &E.rows[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    } else {
-        E.cx = E.rows[E.cy - 1].size;
-        editorRowAppendString(&E.rows[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
-    }
+void editorDeleteForward() {
+    editorMultiEdit(EDIT_DELETE, 0);
 }
 
-/*** File I/O ***/
+/*** Undo ***/
 
-char *editorRowsToString(int *buflen) {
-    int totlen = 0;
-    for (int j = 0; j < E.numrows; j++) {
-        totlen += E.rows[j].size + 1;
+void undoFreeRecord(UndoRecord *rec) {
+    for (int i = 0; i < rec->nsteps; i++) {
+        UndoStep *st = &rec->steps[i];
+        for (int j = 0; st->lines && j < st->nold; j++) chunkRelease(st->lines[j]);
+        free(st->lines);
+        free(st->lens);
+        free(st->perm);
     }
-    *buflen = totlen;
+    free(rec->steps);
+    free(rec->before);
+    free(rec->after);
+    memset(rec, 0, sizeof(*rec));
+}
 
-    char *buf = malloc(totlen);
-    if (!buf) return NULL;
+void undoClear() {
+    for (int i = 0; i < E.undo.count; i++) undoFreeRecord(&E.undo.items[i]);
+    E.undo.count = 0;
+    E.undo.pos = 0;
+    E.undo.open = 0;
+}
 
-    char *p = buf;
-    for (int j = 0; j < E.numrows; j++) {
-        memcpy(p, E.rows[j].chars, E.rows[j].size);
-        p += E.rows[j].size;
-        *p = '\n';
-        p++;
-    }
+// Chiude il record corrente: la prossima modifica non viene accorpata
+void undoSeal() {
+    E.undo.open = 0;
+}
 
-    return buf;
+// Le modifiche fino a undoGroupEnd finiscono in un solo record (macro,
+// incolla sopra una selezione). Un gruppo dentro un altro, per esempio
+// un incolla durante una macro, fa parte di quello esterno.
+void undoGroupBegin() {
+    if (E.undo.group++ > 0) return;
+    undoSeal();
+    E.undo.group_open = 0;
 }
 
-void editorOpen(char *filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
-    if (E.filename == NULL) die("strdup");
+void undoGroupEnd() {
+    if (--E.undo.group > 0) return;
+    E.undo.group_open = 0;
+}
 
-    char fullPath[MAX_PATH];
-    snprintf(fullPath, sizeof(fullPath), "%s\\%s", SAVE_DIRECTORY, filename);
+// Copia dei cursori con il principale in prima posizione
+Cursor *undoCopyCursors(Cursor *all, int n, int primary) {
+    Cursor *copy = malloc(sizeof(Cursor) * n);
+    if (copy == NULL) die("malloc in undoCopyCursors");
+    copy[0] = all[primary];
+    for (int i = 0, k = 1; i < n; i++)
+        if (i != primary) copy[k++] = all[i];
+    return copy;
+}
 
-    FILE *fp = fopen(fullPath, "r");
-    if (!fp) {
-        // Try opening from current directory as fallback
-        fp = fopen(filename, "r");
-        if (!fp) {
-            // New file
-            editorSetStatusMessage("New file: %s", filename);
+// Apre il record per una modifica. La digitazione consecutiva viene
+// accorpata nello stesso record finche' non arriva un altro comando.
+// Il record entra nella cronologia solo al primo passo salvato, cosi' una
+// modifica che non cambia nulla non cancella i record da rifare.
+void undoBegin(int kind, Cursor *all, int n, int primary) {
+    if (E.undo.group) {
+        // Nel gruppo i passi si aggiungono in ordine al record gia' aperto
+        kind = UNDO_EDIT;
+        if (E.undo.group_open && E.undo.pos == E.undo.count) {
+            E.undo.coalesce = 0;
             return;
         }
     }
+    if (kind == UNDO_TYPING && E.undo.open && E.undo.pos == E.undo.count &&
+        E.undo.count > 0 && E.undo.items[E.undo.count - 1].kind == UNDO_TYPING) {
+        E.undo.coalesce = 1;
+        return;
+    }
+    E.undo.coalesce = 0;
+
+    UndoRecord *rec = &E.undo.pending;
+    undoFreeRecord(rec);
+    rec->kind = kind;
+    rec->before = undoCopyCursors(all, n, primary);
+    rec->ncursors_before = n;
+    E.undo.has_pending = 1;
+}
 
-    char linebuf[MAX_LINE_LENGTH];
-    while (fgets(linebuf, sizeof(linebuf), fp) != NULL) {
-        size_t linelen = strlen(linebuf);
+void undoPushPending() {
+    // Una nuova modifica scarta i record da rifare
+    while (E.undo.count > E.undo.pos) undoFreeRecord(&E.undo.items[--E.undo.count]);
 
-        // Check if we likely hit the buffer limit (missing part of the line)
-        if (linelen == MAX_LINE_LENGTH - 1 && linebuf[linelen - 1] != '\n') {
-            // Read and discard the rest of the line
-            int c;
-            while ((c = fgetc(fp)) != EOF && c != '\n');
-            editorSetStatusMessage("Warning: Line truncated (too long)");
+    if (E.undo.count == UNDO_MAX_RECORDS) {
+        undoFreeRecord(&E.undo.items[0]);
+        memmove(&E.undo.items[0], &E.undo.items[1],
+                sizeof(UndoRecord) * (E.undo.count - 1));
+        E.undo.count--;
+    }
+    if (E.undo.count == E.undo.cap) {
+        E.undo.cap = E.undo.cap ? E.undo.cap * 2 : 64;
+        E.undo.items = realloc(E.undo.items, sizeof(UndoRecord) * E.undo.cap);
+        if (E.undo.items == NULL) die("realloc in undoPushPending");
+    }
+
+    E.undo.items[E.undo.count++] = E.undo.pending;
+    memset(&E.undo.pending, 0, sizeof(UndoRecord));
+    E.undo.has_pending = 0;
+    E.undo.pos = E.undo.count;
+    if (E.undo.group) E.undo.group_open = 1;
+}
+
+// Salva le righe [at, at + n) prima di modificarle. Restituisce l'indice
+// del passo da completare con undoSetRows, o -1 se il record accorpato
+// contiene gia' lo stato originale della riga.
+int undoSaveRows(int at, int n) {
+    if (E.undo.has_pending) undoPushPending();
+    UndoRecord *rec = &E.undo.items[E.undo.count - 1];
+
+    // I record di digitazione hanno solo passi 1 -> 1, tenuti ordinati
+    int pos = rec->nsteps;
+    if (rec->kind == UNDO_TYPING) {
+        int lo = 0, hi = rec->nsteps;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (rec->steps[mid].at < at)
+                lo = mid + 1;
+            else
+                hi = mid;
         }
+        if (E.undo.coalesce && lo < rec->nsteps && rec->steps[lo].at == at) return -1;
+        pos = lo;
+    }
 
-        // Remove trailing newline characters
-        while (linelen > 0 &&
-               (linebuf[linelen - 1] == '\n' || linebuf[linelen - 1] == '\r'))
-            linelen--;
+    if (rec->nsteps == rec->capsteps) {
+        rec->capsteps = rec->capsteps ? rec->capsteps * 2 : 4;
+        rec->steps = realloc(rec->steps, sizeof(UndoStep) * rec->capsteps);
+        if (rec->steps == NULL) die("realloc in undoSaveRows");
+    }
+    memmove(&rec->steps[pos + 1], &rec->steps[pos], sizeof(UndoStep) * (rec->nsteps - pos));
+    rec->nsteps++;
+
+    UndoStep *st = &rec->steps[pos];
+    st->at = at;
+    st->nold = n;
+    st->nnew = n;
+    st->perm = NULL;
+    st->lines = malloc(sizeof(ClipChunk *) * (n ? n : 1));
+    st->lens = malloc(sizeof(int) * (n ? n : 1));
+    if (st->lines == NULL || st->lens == NULL) die("malloc in undoSaveRows");
+    // Le righe salvate condividono il testo: verra' copiato solo se modificato
+    for (int i = 0; i < n; i++) {
+        EditorRow *row = &E.rows[at + i];
+        st->lines[i] = editorRowChunk(row, 0, row->size);
+        st->lens[i] = row->size;
+    }
+    return pos;
+}
 
-        editorAppendRow(linebuf, linelen);
+// Registra il riordino delle righe [at, at + n) fatto con
+// editorPermuteRows(at, n, order): il passo salva la permutazione
+// inversa invece delle righe
+void undoSavePermutation(int at, int n, const int *order) {
+    if (E.undo.has_pending) undoPushPending();
+    UndoRecord *rec = &E.undo.items[E.undo.count - 1];
+    if (rec->nsteps == rec->capsteps) {
+        rec->capsteps = rec->capsteps ? rec->capsteps * 2 : 4;
+        rec->steps = realloc(rec->steps, sizeof(UndoStep) * rec->capsteps);
+        if (rec->steps == NULL) die("realloc in undoSavePermutation");
     }
+    UndoStep *st = &rec->steps[rec->nsteps++];
+    memset(st, 0, sizeof(*st));
+    st->at = at;
+    st->nold = n;
+    st->nnew = n;
+    st->perm = malloc(sizeof(int) * (n ? n : 1));
+    if (st->perm == NULL) die("malloc in undoSavePermutation");
+    for (int i = 0; i < n; i++) st->perm[order[i]] = i;
+}
 
-    fclose(fp);
-    E.dirty = 0;
+// Numero di righe che il passo occupa dopo la modifica
+void undoSetRows(int step, int n) {
+    if (step < 0) return;
+    E.undo.items[E.undo.count - 1].steps[step].nnew = n;
 }
 
-void ensureDirectoryExists(const char *path) {
-    if (CreateDirectory(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS) {
-        return;  // Success or directory already exists
+void undoEnd(Cursor *all, int n, int primary) {
+    if (E.undo.has_pending) {
+        // Nessuna riga modificata: niente da registrare
+        undoFreeRecord(&E.undo.pending);
+        E.undo.has_pending = 0;
+        return;
     }
-    editorSetStatusMessage("Warning: Could not create directory %s", path);
+    UndoRecord *rec = &E.undo.items[E.undo.count - 1];
+    free(rec->after);
+    rec->after = undoCopyCursors(all, n, primary);
+    rec->ncursors_after = n;
+    E.undo.open = rec->kind == UNDO_TYPING;
 }
 
-// Gestisce il prompt e l'apertura di un nuovo file
-void editorOpenFilePrompt() {
-    // Impedisce di aprire un nuovo file se ci sono modifiche non salvate
-    if (E.dirty) {
-        editorSetStatusMessage("WARNING! File has unsaved changes. Save first (Ctrl-S).");
+// Scambia le righe del buffer con quelle salvate nel passo: lo stesso
+// passo serve sia per annullare che per rifare
+void undoSwapStep(UndoStep *st) {
+    if (st->perm) {
+        // Si applica la permutazione e si tiene la sua inversa
+        editorPermuteRows(st->at, st->nold, st->perm);
+        int *inv = malloc(sizeof(int) * (st->nold ? st->nold : 1));
+        if (inv == NULL) die("malloc in undoSwapStep");
+        for (int i = 0; i < st->nold; i++) inv[st->perm[i]] = i;
+        free(st->perm);
+        st->perm = inv;
         return;
     }
+    ClipChunk **lines = malloc(sizeof(ClipChunk *) * (st->nnew ? st->nnew : 1));
+    int *lens = malloc(sizeof(int) * (st->nnew ? st->nnew : 1));
+    if (lines == NULL || lens == NULL) die("malloc in undoSwapStep");
+    for (int i = 0; i < st->nnew; i++) {
+        EditorRow *row = &E.rows[st->at + i];
+        lines[i] = editorRowChunk(row, 0, row->size);
+        lens[i] = row->size;
+    }
 
-    // Chiede all'utente il nome del file da aprire
-    char *filename = editorPrompt("Open File: %s (ESC to cancel)", NULL);
-    if (filename == NULL) {
-        editorSetStatusMessage("Open aborted.");
+    int common = st->nold < st->nnew ? st->nold : st->nnew;
+    for (int i = 0; i < common; i++) editorSetRowChunk(st->at + i, st->lines[i], st->lens[i]);
+    if (st->nold > common)
+        editorInsertChunks(st->at + common, st->lines + common, st->lens + common, st->nold - common);
+    if (st->nnew > common) editorDelRows(st->at + common, st->nnew - common);
+
+    for (int i = 0; i < st->nold; i++) chunkRelease(st->lines[i]);
+    free(st->lines);
+    free(st->lens);
+    st->lines = lines;
+    st->lens = lens;
+    int tmp = st->nold;
+    st->nold = st->nnew;
+    st->nnew = tmp;
+}
+
+void editorUndo() {
+    if (E.undo.pos == 0) {
+        editorSetStatusMessage("Nothing to undo");
         return;
     }
+    UndoRecord *rec = &E.undo.items[--E.undo.pos];
+    for (int i = rec->nsteps - 1; i >= 0; i--) undoSwapStep(&rec->steps[i]);
+    cursorsRestore(rec->before, rec->ncursors_before);
+    undoSeal();
+    E.dirty_recheck = 1;
+}
 
-    // Pulisce il buffer corrente prima di caricarne uno nuovo
-    editorFreeBuffer();
+void editorRedo() {
+    if (E.undo.pos == E.undo.count) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    UndoRecord *rec = &E.undo.items[E.undo.pos++];
+    for (int i = 0; i < rec->nsteps; i++) undoSwapStep(&rec->steps[i]);
+    cursorsRestore(rec->after, rec->ncursors_after);
+    undoSeal();
+    E.dirty_recheck = 1;
+}
 
-    // La funzione editorOpen si occupa di caricare il file e impostare il nome
-    editorOpen(filename);
+/*** Multiple cursors ***/
 
-    // La stringa del nome del file è stata duplicata da editorOpen, quindi possiamo liberarla
-    free(filename);
+int cursorCompare(const void *a, const void *b) {
+    const Cursor *x = a, *y = b;
+    if (x->cy != y->cy) return x->cy - y->cy;
+    return x->cx - y->cx;
 }
 
-void editorSave() {
-    // Se il file non ha nome o ha il nome di default, chiedine uno nuovo.
-    if (E.filename == NULL || strcmp(E.filename, DEFAULT_FILENAME) == 0) {
-        // Chiama editorPrompt per ottenere il nome del file dall'utente.
-        char *new_filename = editorPrompt("Save As: %s (ESC to cancel)", NULL);
-        if (new_filename == NULL) {
-            editorSetStatusMessage("Save aborted.");
-            return;
-        }
-        // Libera il vecchio nome (se presente) e assegna quello nuovo.
-        if (E.filename) free(E.filename);
-        E.filename = new_filename;
+void cursorsAdd(int cx, int cy) {
+    if (E.cursors.count == E.cursors.cap) {
+        E.cursors.cap = E.cursors.cap ? E.cursors.cap * 2 : 16;
+        E.cursors.items = realloc(E.cursors.items, sizeof(Cursor) * E.cursors.cap);
+        if (E.cursors.items == NULL) die("realloc in cursorsAdd");
     }
+    E.cursors.items[E.cursors.count].cx = cx;
+    E.cursors.items[E.cursors.count].cy = cy;
+    E.cursors.count++;
+}
 
-    ensureDirectoryExists(SAVE_DIRECTORY);
+void cursorsClear() {
+    E.cursors.count = 0;
+    E.cursors.has_last = 0;
+}
 
-    char fullPath[MAX_PATH];
-    snprintf(fullPath, sizeof(fullPath), "%s\\%s", SAVE_DIRECTORY, E.filename);
+// Ordina i cursori aggiuntivi e rimuove i duplicati, compresi quelli che
+// coincidono con il cursore principale
+void cursorsNormalize() {
+    if (E.cursors.count == 0) return;
+    Cursor *c = E.cursors.items;
+    qsort(c, E.cursors.count, sizeof(Cursor), cursorCompare);
+    int out = 0;
+    for (int i = 0; i < E.cursors.count; i++) {
+        if (c[i].cy == E.cy && c[i].cx == E.cx) continue;
+        if (out > 0 && cursorCompare(&c[out - 1], &c[i]) == 0) continue;
+        c[out++] = c[i];
+    }
+    E.cursors.count = out;
+}
 
-    int len;
-    char *buf = editorRowsToString(&len);
+// Porta una posizione dentro il buffer (al massimo la riga dopo l'ultima)
+void cursorClamp(int *cx, int *cy) {
+    if (*cy > E.numrows) *cy = E.numrows;
+    if (*cy < 0) *cy = 0;
+    int size = *cy < E.numrows ? E.rows[*cy].size : 0;
+    if (*cx > size) *cx = size;
+    if (*cx < 0) *cx = 0;
+}
 
-    FILE *fp = fopen(fullPath, "w");
-    if (fp != NULL) {
-        if (fwrite(buf, 1, len, fp) == (size_t)len) {
-            fclose(fp);
-            free(buf);
-            E.dirty = 0;
-            editorSetStatusMessage("%d bytes written to disk", len);
-            return;
+// Tutti i cursori (principale compreso) ordinati e dentro il buffer;
+// *primary riceve la posizione del principale. I cursori rimasti fuori
+// dal buffer vengono riportati dentro prima di eliminare i duplicati,
+// cosi' due cursori non finiscono mai nello stesso punto.
+Cursor *cursorsGather(int *n, int *primary) {
+    cursorClamp(&E.cx, &E.cy);
+    for (int i = 0; i < E.cursors.count; i++)
+        cursorClamp(&E.cursors.items[i].cx, &E.cursors.items[i].cy);
+    cursorsNormalize();
+    Cursor *all = malloc(sizeof(Cursor) * (E.cursors.count + 1));
+    if (all == NULL) die("malloc in cursorsGather");
+
+    Cursor p = {E.cx, E.cy};
+    int k = 0;
+    *primary = -1;
+    for (int i = 0; i < E.cursors.count; i++) {
+        if (*primary < 0 && cursorCompare(&p, &E.cursors.items[i]) < 0) {
+            *primary = k;
+            all[k++] = p;
         }
-        fclose(fp);
+        all[k++] = E.cursors.items[i];
+    }
+    if (*primary < 0) {
+        *primary = k;
+        all[k++] = p;
     }
+    *n = k;
+    return all;
+}
 
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+void cursorsScatter(Cursor *all, int n, int primary) {
+    E.cx = all[primary].cx;
+    E.cy = all[primary].cy;
+    E.cursors.count = 0;
+    for (int i = 0; i < n; i++)
+        if (i != primary) cursorsAdd(all[i].cx, all[i].cy);
+    cursorsNormalize();
 }
 
-/*** Editor Navigation ***/
-void editorFindMatchingBrace() {
-    if (E.cy >= E.numrows) return; // Cursore fuori dal testo
+// Ripristina un insieme salvato dall'undo (principale in prima posizione)
+void cursorsRestore(Cursor *set, int n) {
+    E.cx = set[0].cx;
+    E.cy = set[0].cy;
+    E.cursors.count = 0;
+    for (int i = 1; i < n; i++) cursorsAdd(set[i].cx, set[i].cy);
+    cursorsNormalize();
+}
 
-    char char_under_cursor = E.rows[E.cy].chars[E.cx];
-    char open_brace = '{', close_brace = '}';
-    int direction = 0; // 1 per avanti, -1 per indietro
+// Primo cursore aggiuntivo sulla riga 'at' o successiva (ricerca binaria)
+int cursorsFirstOnRow(int at) {
+    int lo = 0, hi = E.cursors.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (E.cursors.items[mid].cy < at)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-    if (char_under_cursor == open_brace) direction = 1;
-    if (char_under_cursor == close_brace) direction = -1;
-    if (direction == 0) return; // Non siamo su una graffa
+// Colonna renderizzata del prossimo cursore aggiuntivo sulla riga, o -1
+int cursorsNextMark(int at, int *mi) {
+    if (*mi >= E.cursors.count || E.cursors.items[*mi].cy != at) return -1;
+    EditorRow *row = &E.rows[at];
+    int cx = E.cursors.items[(*mi)++].cx;
+    return editorRowCxToRx(row, cx < row->size ? cx : row->size);
+}
 
-    int y = E.cy;
-    int x = E.cx;
-    int level = 1;
+// Applica un tasto di movimento a tutti i cursori
+void editorMoveCursors(int key) {
+    int cx = E.cx, cy = E.cy;
+    for (int i = 0; i < E.cursors.count; i++) {
+        E.cx = E.cursors.items[i].cx;
+        E.cy = E.cursors.items[i].cy;
+        editorMoveCursor(key);
+        E.cursors.items[i].cx = E.cx;
+        E.cursors.items[i].cy = E.cy;
+    }
+    E.cx = cx;
+    E.cy = cy;
+    editorMoveCursor(key);
+    cursorsNormalize();
+}
 
-    while (y >= 0 && y < E.numrows) {
-        x += direction;
-        if (x < 0) {
-            y += direction;
-            if (y < 0 || y >= E.numrows) break;
-            x = (direction == 1) ? 0 : E.rows[y].size - 1;
+// Applica la stessa modifica a tutti i cursori in un'unica passata.
+// I cursori sono raggruppati per riga: ogni riga viene ricostruita (e
+// rievidenziata) una sola volta e l'intera operazione produce un solo
+// record di undo. Le righe aggiunte o tolte dai gruppi precedenti sono
+// compensate con 'shift', quindi il costo non dipende dall'ordine.
+void editorMultiEdit(int op, int c) {
+    int n, primary;
+    Cursor *all = cursorsGather(&n, &primary);
+
+    int past_end = all[n - 1].cy >= E.numrows;
+    undoBegin(op == EDIT_INSERT && !past_end ? UNDO_TYPING : UNDO_EDIT, all, n, primary);
+
+    // Cursori che non partecipano: quello oltre l'ultima riga per il
+    // backspace, quelli a fine file per Canc
+    int active = n;
+    if (op == EDIT_DELETE) {
+        while (active > 0 && (all[active - 1].cy >= E.numrows ||
+                              (all[active - 1].cy == E.numrows - 1 &&
+                               all[active - 1].cx == E.rows[E.numrows - 1].size)))
+            active--;
+
+        // Canc equivale a spostarsi a destra e cancellare all'indietro
+        for (int i = 0; i < active; i++) {
+            if (all[i].cx < E.rows[all[i].cy].size) {
+                all[i].cx++;
+            } else {
+                all[i].cy++;
+                all[i].cx = 0;
+            }
         }
-        if (x >= E.rows[y].size) {
-            y += direction;
-            if (y >= E.numrows) break;
-            x = (direction == 1) ? 0 : E.rows[y].size - 1;
+        // Spostandosi due cursori possono coincidere: ne resta uno
+        int out = 0;
+        for (int i = 0; i < active; i++) {
+            if (out > 0 && cursorCompare(&all[out - 1], &all[i]) == 0) {
+                if (i == primary) primary = out - 1;
+                continue;
+            }
+            if (i == primary) primary = out;
+            all[out++] = all[i];
         }
+        for (int i = active; i < n; i++) {
+            if (i == primary) primary = out;
+            all[out++] = all[i];
+        }
+        active -= n - out;
+        n = out;
+        op = EDIT_BACKSPACE;
+    } else if (past_end) {
+        // Dopo cursorsGather oltre l'ultima riga c'e' al massimo un cursore
+        while (active > 0 && all[active - 1].cy >= E.numrows) active--;
+        if (op != EDIT_BACKSPACE) {
+            int s = undoSaveRows(E.numrows, 0);
+            editorInsertRow(E.numrows, "", 0);
+            undoSetRows(s, 1);
+            all[n - 1].cy = E.numrows - 1;
+            all[n - 1].cx = 0;
+            // Invio oltre la fine aggiunge solo la riga vuota
+            if (op == EDIT_NEWLINE) all[n - 1].cy = E.numrows;
+            else active = n;
+        }
+    }
 
-        if (y < 0 || y >= E.numrows) break;
+    char *buf = NULL;
+    int bufcap = 0;
+    int shift = 0;
+    int orig_rows = E.numrows;
+
+    // Le righe create dall'Invio si inseriscono tutte insieme dopo il
+    // ciclo: un gruppo per riga con cursori, spostando l'array una volta
+    int ngroups = 0, npieces = 0, piececap = 0;
+    int *gat = NULL, *gcount = NULL, *gcut = NULL;
+    ClipChunk **pieces = NULL;
+    int *plens = NULL;
+    char *ind = NULL;
+    if (op == EDIT_NEWLINE) {
+        gat = malloc(sizeof(int) * (active ? active : 1));
+        gcount = malloc(sizeof(int) * (active ? active : 1));
+        gcut = malloc(sizeof(int) * (active ? active : 1));
+        if (gat == NULL || gcount == NULL || gcut == NULL) die("malloc in editorMultiEdit");
+    }
 
-        char current_char = E.rows[y].chars[x];
-        if (current_char == open_brace) {
-            level += (direction == 1) ? 1 : -1;
-        } else if (current_char == close_brace) {
-            level += (direction == 1) ? -1 : 1;
+    for (int i = 0; i < active;) {
+        int r = all[i].cy;
+        int j = i;
+        while (j < active && all[j].cy == r) j++;
+        int k = j - i;
+        int at = r + shift;
+
+        EditorRow *row = &E.rows[op == EDIT_NEWLINE ? r : at];
+        int need = row->size + k + 1;
+        if (op == EDIT_BACKSPACE && at > 0) need += E.rows[at - 1].size;
+        if (need > bufcap) {
+            bufcap = need * 2;
+            buf = realloc(buf, bufcap);
+            if (buf == NULL) die("realloc in editorMultiEdit");
         }
 
-        if (level == 0) {
-            E.cy = y;
-            E.cx = x;
-            return;
+        int len = 0, prev = 0;
+        if (op == EDIT_INSERT) {
+            for (int m = i; m < j; m++) {
+                int p = all[m].cx;
+                memcpy(buf + len, row->chars + prev, p - prev);
+                len += p - prev;
+                if (c == '}' && m == i) len -= editorElectricDedent(at, p);
+                buf[len++] = c;
+                prev = p;
+                all[m].cx = len;
+                all[m].cy = at;
+            }
+            memcpy(buf + len, row->chars + prev, row->size - prev);
+            len += row->size - prev;
+
+            int s = undoSaveRows(at, 1);
+            editorReplaceRow(at, buf, len);
+            undoSetRows(s, 1);
+        } else if (op == EDIT_BACKSPACE) {
+            // Ogni cursore cancella il carattere alla sua sinistra; uno in
+            // colonna 0 unisce la riga alla precedente
+            int join = all[i].cx == 0 && at > 0;
+            for (int m = i; m < j; m++) {
+                int p = all[m].cx;
+                if (p > 0) {
+                    memcpy(buf + len, row->chars + prev, p - 1 - prev);
+                    len += p - 1 - prev;
+                    prev = p;
+                }
+                all[m].cx = len;
+                all[m].cy = at;
+            }
+            memcpy(buf + len, row->chars + prev, row->size - prev);
+            len += row->size - prev;
+
+            if (join) {
+                EditorRow *up = &E.rows[at - 1];
+                int uplen = up->size;
+                memmove(buf + uplen, buf, len);
+                memcpy(buf, up->chars, uplen);
+
+                int s = undoSaveRows(at - 1, 2);
+                editorReplaceRow(at - 1, buf, uplen + len);
+                editorDelRow(at);
+                undoSetRows(s, 1);
+                for (int m = i; m < j; m++) {
+                    all[m].cy = at - 1;
+                    all[m].cx += uplen;
+                }
+                shift--;
+            } else if (len != row->size) {
+                int s = undoSaveRows(at, 1);
+                editorReplaceRow(at, buf, len);
+                undoSetRows(s, 1);
+            }
+        } else if (op == EDIT_NEWLINE) {
+            // La riga si divide in k + 1 pezzi. Ogni nuova riga riceve il
+            // rientro calcolato da editorNewlineIndent; Invio tra '{' e '}'
+            // porta anche la graffa chiusa su una riga sua.
+            int size = row->size;
+            memcpy(buf, row->chars, size);
+
+            if (npieces + 2 * k > piececap) {
+                piececap = (npieces + 2 * k) * 2;
+                pieces = realloc(pieces, sizeof(ClipChunk *) * piececap);
+                plens = realloc(plens, sizeof(int) * piececap);
+                if (pieces == NULL || plens == NULL) die("realloc in editorMultiEdit");
+            }
+            ind = realloc(ind, row->indent + TAB_SIZE);
+            if (ind == NULL) die("realloc in editorMultiEdit");
+            int cut = all[i].cx;
+            int np = 0;
+            ClipChunk **gp = pieces + npieces;
+            int *gl = plens + npieces;
+            for (int m = i; m < j; m++) {
+                int start = all[m].cx;
+                int end = m + 1 < j ? all[m + 1].cx : size;
+                int opens;
+                int indlen = editorNewlineIndent(row, start, ind, &opens);
+                start = scanClassForward(buf, start, end, CLASS_SPACE);
+                int pair = opens && start < end && buf[start] == '}';
+
+                all[m].cy = at + np + 1;
+                all[m].cx = indlen;
+                if (pair) {
+                    gp[np] = chunkNew(ind, indlen, 0);
+                    gl[np++] = indlen;
+                    indlen = row->indent;
+                }
+                gp[np] = chunkNew(NULL, 0, indlen + end - start + 1);
+                memcpy(gp[np]->data, ind, indlen);
+                memcpy(gp[np]->data + indlen, buf + start, end - start);
+                gp[np]->data[indlen + end - start] = '\0';
+                gl[np++] = indlen + end - start;
+            }
+
+            gat[ngroups] = r + 1;
+            gcount[ngroups] = np;
+            gcut[ngroups++] = cut;
+            npieces += np;
+            shift += np;
         }
+        i = j;
     }
 
-    editorSetStatusMessage("No matching brace found");
-}
-
-/*** Search ***/
+    if (op == EDIT_NEWLINE) {
+        editorInsertChunkGroups(ngroups, gat, gcount, pieces, plens);
+        // Ogni riga divisa diventa un passo di undo da una a np + 1 righe,
+        // con gli indici che avrebbe se i gruppi fossero inseriti in ordine
+        for (int g = 0, moved = 0; g < ngroups; moved += gcount[g++]) {
+            int at = gat[g] - 1 + moved;
+            if (gcut[g] > bufcap) {
+                bufcap = gcut[g] * 2;
+                buf = realloc(buf, bufcap);
+                if (buf == NULL) die("realloc in editorMultiEdit");
+            }
+            int s = undoSaveRows(at, 1);
+            memcpy(buf, E.rows[at].chars, gcut[g]);
+            editorReplaceRow(at, buf, gcut[g]);
+            undoSetRows(s, gcount[g] + 1);
+        }
+        for (int p = 0; p < npieces; p++) chunkRelease(pieces[p]);
+        free(pieces);
+        free(plens);
+        free(ind);
+        free(gat);
+        free(gcount);
+        free(gcut);
+    }
 
-void editorFindCallback(char *query, int key) {
-    static int last_match = -1; // Riga dell'ultima corrispondenza trovata (-1 se nessuna)
-    static int direction = 1;   // 1 = avanti, -1 = indietro
+    // I cursori esclusi restano in fondo al buffer
+    for (int i = active; i < n; i++) {
+        if (all[i].cy >= orig_rows) {
+            all[i].cy = E.numrows;
+            all[i].cx = 0;
+        } else {
+            all[i].cy = E.numrows - 1;
+            all[i].cx = E.rows[E.numrows - 1].size;
+        }
+    }
+
+    cursorsScatter(all, n, primary);
+    undoEnd(all, n, primary);
+    free(buf);
+    free(all);
+}
+
+// Ctrl+D: aggiunge un cursore sulla prossima occorrenza della parola
+// sotto il cursore principale, alla stessa posizione dentro la parola
+void editorAddCursorNextMatch() {
+    if (E.cy >= E.numrows) return;
+    EditorRow *row = &E.rows[E.cy];
+    int s = E.cx, e = E.cx;
+    while (s > 0 && isIdentChar(row->chars[s - 1])) s--;
+    while (e < row->size && isIdentChar(row->chars[e])) e++;
+    if (s == e) {
+        editorSetStatusMessage("No word under cursor");
+        return;
+    }
+
+    int wlen = e - s;
+    int off = E.cx - s;
+    char *word = malloc(wlen + 1);
+    if (word == NULL) die("malloc in editorAddCursorNextMatch");
+    memcpy(word, &row->chars[s], wlen);
+    word[wlen] = '\0';
+
+    // Si riparte dall'ultima occorrenza aggiunta
+    int y = E.cy, x = e;
+    if (E.cursors.has_last && E.cursors.last.cy < E.numrows) {
+        y = E.cursors.last.cy;
+        x = E.cursors.last.cx - off + wlen;
+        if (x < 0) x = 0;
+    }
+
+    for (int scanned = 0; scanned <= E.numrows; scanned++) {
+        EditorRow *r = &E.rows[y];
+        char *p = x <= r->size ? r->chars + x : NULL;
+        while (p && (p = strstr(p, word)) != NULL) {
+            int col = p - r->chars;
+            int whole = (col == 0 || !isIdentChar(r->chars[col - 1])) &&
+                        !isIdentChar(r->chars[col + wlen]);
+            if (!whole) {
+                p++;
+                continue;
+            }
+            if (y == E.cy && col == s) {
+                editorSetStatusMessage("No more occurrences of '%s'", word);
+                free(word);
+                return;
+            }
+            cursorsAdd(col + off, y);
+            E.cursors.last.cx = col + off;
+            E.cursors.last.cy = y;
+            E.cursors.has_last = 1;
+            cursorsNormalize();
+            editorRevealRow(y);
+            editorSetStatusMessage("%d cursors", E.cursors.count + 1);
+            free(word);
+            return;
+        }
+        y = (y + 1) % E.numrows;
+        x = 0;
+    }
+    free(word);
+}
+
+// Ctrl+Alt+Su/Giu': aggiunge un cursore sopra il piu' alto o sotto il
+// piu' basso, alla stessa colonna visuale del cursore principale
+void editorAddCursorVertical(int dir) {
+    if (E.cy >= E.numrows) return;
+    cursorsNormalize();
+
+    int y = E.cy;
+    if (E.cursors.count > 0) {
+        if (dir < 0 && E.cursors.items[0].cy < y) y = E.cursors.items[0].cy;
+        if (dir > 0 && E.cursors.items[E.cursors.count - 1].cy > y)
+            y = E.cursors.items[E.cursors.count - 1].cy;
+    }
+    if (dir < 0 && y == 0) return;
+    int ny = dir < 0 ? editorPrevVisibleRow(y) : editorNextVisibleRow(y);
+    if (ny >= E.numrows) return;
+
+    int rx = editorRowCxToRx(&E.rows[E.cy], E.cx);
+    cursorsAdd(editorRowRxToCx(&E.rows[ny], rx), ny);
+    cursorsNormalize();
+    editorSetStatusMessage("%d cursors", E.cursors.count + 1);
+}
+
+/*** Selection ***/
+
+void editorClearSelection() {
+    E.sel.active = 0;
+}
+
+// Estremi ordinati della selezione a flusso, limitati al buffer.
+// Restituisce 0 se la selezione e' vuota.
+int editorSelectionBounds(int *sy, int *sx, int *ey, int *ex) {
+    if (!E.sel.active || E.numrows == 0) return 0;
+
+    int ay = E.sel.ay, ax = E.sel.ax, cy = E.cy, cx = E.cx;
+    if (ay > cy || (ay == cy && ax > cx)) {
+        int ty = ay, tx = ax;
+        ay = cy;
+        ax = cx;
+        cy = ty;
+        cx = tx;
+    }
+    if (cy >= E.numrows) {
+        cy = E.numrows - 1;
+        cx = E.rows[cy].size;
+    }
+    if (ay >= E.numrows) return 0;
+    if (ax > E.rows[ay].size) ax = E.rows[ay].size;
+    if (cx > E.rows[cy].size) cx = E.rows[cy].size;
+
+    *sy = ay;
+    *sx = ax;
+    *ey = cy;
+    *ex = cx;
+    return ay != cy || ax != cx;
+}
+
+// Righe e colonne renderizzate [left, right) della selezione a blocchi
+int editorBlockBounds(int *top, int *bottom, int *left, int *right) {
+    if (!E.sel.active || !E.sel.block || E.numrows == 0) return 0;
+    *top = E.sel.ay < E.cy ? E.sel.ay : E.cy;
+    *bottom = E.sel.ay < E.cy ? E.cy : E.sel.ay;
+    if (*bottom >= E.numrows) *bottom = E.numrows - 1;
+    *left = E.sel.arx < E.sel.crx ? E.sel.arx : E.sel.crx;
+    *right = E.sel.arx < E.sel.crx ? E.sel.crx : E.sel.arx;
+    return *top <= *bottom;
+}
+
+// Intervallo di colonne renderizzate selezionate sulla riga, usato dal
+// disegno. Restituisce 0 se la riga non e' selezionata.
+int editorRowSelection(int at, int *l, int *r) {
+    if (!E.sel.active) return 0;
+
+    if (E.sel.block) {
+        int top, bottom, left, right;
+        if (!editorBlockBounds(&top, &bottom, &left, &right)) return 0;
+        if (at < top || at > bottom) return 0;
+        *l = left;
+        *r = right;
+        return left < right;
+    }
+
+    int sy, sx, ey, ex;
+    if (!editorSelectionBounds(&sy, &sx, &ey, &ex)) return 0;
+    if (at < sy || at > ey) return 0;
+    EditorRow *row = &E.rows[at];
+    *l = at == sy ? editorRowCxToRx(row, sx) : 0;
+    *r = at == ey ? editorRowCxToRx(row, ex) : row->rsize;
+    return *l < *r;
+}
+
+// Caratteri [*cl, *cr) della riga coperti dalle colonne [left, right)
+void editorBlockRowSpan(EditorRow *row, int left, int right, int *cl, int *cr) {
+    *cl = editorRowRxToCx(row, left);
+    *cr = editorRowRxToCx(row, right);
+}
+
+// Shift+frecce estendono la selezione a flusso, Alt+Shift+frecce quella a
+// blocchi, Ctrl+Shift+frecce la estendono a parole o paragrafi.
+// Restituisce 1 se il tasto e' stato gestito.
+int editorSelectionKey(int c) {
+    int base = c & ~(MOD_SHIFT | MOD_CTRL | MOD_ALT);
+    if (!(c & MOD_SHIFT) || ((c & MOD_CTRL) && (c & MOD_ALT))) return 0;
+    if (base != ARROW_LEFT && base != ARROW_RIGHT && base != ARROW_UP &&
+        base != ARROW_DOWN && base != HOME_KEY && base != END_KEY)
+        return 0;
+
+    int block = (c & MOD_ALT) != 0;
+    int rx = E.cy < E.numrows ? editorRowCxToRx(&E.rows[E.cy], E.cx) : 0;
+    if (!E.sel.active || E.sel.block != block) {
+        E.sel.active = 1;
+        E.sel.block = block;
+        E.sel.ax = E.cx;
+        E.sel.ay = E.cy;
+        E.sel.arx = rx;
+        E.sel.crx = rx;
+        cursorsClear();
+    }
+
+    if (!block) {
+        editorMoveCursor(c & ~MOD_SHIFT);
+        return 1;
+    }
+
+    // A blocchi la colonna puo' andare oltre la fine delle righe corte
+    switch (base) {
+        case ARROW_LEFT:
+            if (E.sel.crx > 0) E.sel.crx--;
+            break;
+        case ARROW_RIGHT:
+            E.sel.crx++;
+            break;
+        case HOME_KEY:
+            E.sel.crx = 0;
+            break;
+        case END_KEY:
+            if (E.cy < E.numrows) E.sel.crx = E.rows[E.cy].rsize;
+            break;
+        default:
+            editorMoveCursor(base);
+            break;
+    }
+    if (E.cy < E.numrows) E.cx = editorRowRxToCx(&E.rows[E.cy], E.sel.crx);
+    return 1;
+}
+
+// Tasti che operano sulla selezione invece di annullarla
+int editorKeyUsesSelection(int c) {
+    switch (c) {
+        case CTRL_KEY('c'):
+        case CTRL_KEY('x'):
+        case CTRL_KEY('v'):
+        case PASTE_KEY:
+        case '\t':
+        case '\t' | MOD_SHIFT:
+        case '\r':
+        case 127:
+        case CTRL_KEY('h'):
+        case DEL_KEY:
+            return 1;
+    }
+    return c < 0 || (c >= ' ' && c < ARROW_LEFT);
+}
+
+// Ctrl+C: copia la selezione in una nuova voce del kill ring. Le righe
+// copiate per intero condividono il testo con il buffer.
+int editorCopySelection() {
+    int sy, sx, ey, ex;
+    int top, bottom, left, right;
+
+    if (E.sel.active && E.sel.block) {
+        if (!editorBlockBounds(&top, &bottom, &left, &right) || left == right) return 0;
+        sy = top;
+        ey = bottom;
+    } else if (!editorSelectionBounds(&sy, &sx, &ey, &ex)) {
+        return 0;
+    }
+
+    int n = ey - sy + 1;
+    KillEntry *e = killPush(n, E.sel.block);
+
+    for (int y = sy; y <= ey; y++) {
+        EditorRow *row = &E.rows[y];
+        int from, to;
+        if (E.sel.block) {
+            editorBlockRowSpan(row, left, right, &from, &to);
+        } else {
+            from = y == sy ? sx : 0;
+            to = y == ey ? ex : row->size;
+        }
+        e->lines[y - sy] = editorRowChunk(row, from, to);
+        e->lens[y - sy] = to - from;
+    }
+    editorSetStatusMessage("Copied %d line%s", n, n == 1 ? "" : "s");
+    return 1;
+}
+
+// Cancella la selezione con un solo passo di undo. Nel modo a flusso le
+// righe intermedie vengono tolte con un'unica editorDelRows.
+// Restituisce 0 se non c'era niente da cancellare.
+int editorDeleteSelection() {
+    int sy, sx, ey, ex;
+    int top, bottom, left, right;
+    Cursor cur = {E.cx, E.cy};
+
+    if (E.sel.block) {
+        if (!editorBlockBounds(&top, &bottom, &left, &right) || left == right) {
+            editorClearSelection();
+            return 0;
+        }
+        undoBegin(UNDO_EDIT, &cur, 1, 0);
+        int s = undoSaveRows(top, bottom - top + 1);
+
+        char *buf = NULL;
+        int bufcap = 0;
+        for (int y = top; y <= bottom; y++) {
+            EditorRow *row = &E.rows[y];
+            int cl, cr;
+            editorBlockRowSpan(row, left, right, &cl, &cr);
+            if (cl == cr) continue;
+            if (row->size + 1 > bufcap) {
+                bufcap = row->size * 2 + 1;
+                buf = realloc(buf, bufcap);
+                if (buf == NULL) die("realloc in editorDeleteSelection");
+            }
+            memcpy(buf, row->chars, cl);
+            memcpy(buf + cl, row->chars + cr, row->size - cr);
+            editorReplaceRow(y, buf, row->size - (cr - cl));
+        }
+        free(buf);
+        undoSetRows(s, bottom - top + 1);
+
+        E.cy = top;
+        E.cx = editorRowRxToCx(&E.rows[top], left);
+    } else {
+        if (!editorSelectionBounds(&sy, &sx, &ey, &ex)) {
+            editorClearSelection();
+            return 0;
+        }
+        undoBegin(UNDO_EDIT, &cur, 1, 0);
+        int s = undoSaveRows(sy, ey - sy + 1);
+
+        EditorRow *first = &E.rows[sy], *last = &E.rows[ey];
+        int len = sx + last->size - ex;
+        char *buf = malloc(len + 1);
+        if (buf == NULL) die("malloc in editorDeleteSelection");
+        memcpy(buf, first->chars, sx);
+        memcpy(buf + sx, last->chars + ex, last->size - ex);
+
+        editorDelRows(sy + 1, ey - sy);
+        editorReplaceRow(sy, buf, len);
+        free(buf);
+        undoSetRows(s, 1);
+
+        E.cy = sy;
+        E.cx = sx;
+    }
+
+    cur.cx = E.cx;
+    cur.cy = E.cy;
+    undoEnd(&cur, 1, 0);
+    editorClearSelection();
+    return 1;
+}
+
+// Ctrl+X: copia e cancella
+void editorCutSelection() {
+    if (editorCopySelection()) editorDeleteSelection();
+}
+
+// Tab / Shift+Tab: indenta o deindenta in un colpo solo tutte le righe
+// della selezione (o solo le righe con un cursore se non c'e' selezione)
+void editorIndentRows(int dir) {
+    int top, bottom;
+    int sy, sx, ey, ex, left, right;
+    int n, primary;
+    Cursor *all = cursorsGather(&n, &primary);
+    int *rows = NULL, nrows = 0;  // Senza selezione: le righe dei cursori, in ordine
+
+    if (E.sel.active && E.sel.block && editorBlockBounds(&top, &bottom, &left, &right)) {
+        // top e bottom gia' impostati
+    } else if (E.sel.active && editorSelectionBounds(&sy, &sx, &ey, &ex)) {
+        top = sy;
+        bottom = ey;
+        // Una selezione che finisce a inizio riga non include quella riga
+        if (ex == 0 && ey > sy) bottom--;
+    } else {
+        rows = malloc(sizeof(int) * n);
+        if (rows == NULL) die("malloc in editorIndentRows");
+        for (int i = 0; i < n; i++)
+            if (all[i].cy < E.numrows && (nrows == 0 || rows[nrows - 1] != all[i].cy))
+                rows[nrows++] = all[i].cy;
+        top = nrows ? rows[0] : E.numrows;
+        bottom = nrows ? rows[nrows - 1] : -1;
+    }
+    if (bottom >= E.numrows) bottom = E.numrows - 1;
+    if (top > bottom || top >= E.numrows) {
+        free(rows);
+        free(all);
+        return;
+    }
+
+    undoBegin(UNDO_EDIT, all, n, primary);
+    free(all);
+    // Una selezione e' un solo intervallo; i cursori possono essere
+    // lontani tra loro e ogni riga si salva da sola
+    int s = rows ? -1 : undoSaveRows(top, bottom - top + 1);
+    int count = rows ? nrows : bottom - top + 1;
+
+    char *buf = NULL;
+    int bufcap = 0;
+    for (int i = 0; i < count; i++) {
+        int y = rows ? rows[i] : top + i;
+        EditorRow *row = &E.rows[y];
+        int delta, len;
+        if (dir > 0) {
+            if (row->size == 0) continue;  // Le righe vuote restano vuote
+            if (row->size + 2 > bufcap) {
+                bufcap = row->size * 2 + 2;
+                buf = realloc(buf, bufcap);
+                if (buf == NULL) die("realloc in editorIndentRows");
+            }
+            buf[0] = '\t';
+            memcpy(buf + 1, row->chars, row->size);
+            len = row->size + 1;
+            delta = 1;
+        } else {
+            // Toglie un tab o fino a TAB_SIZE spazi
+            int k = 0;
+            if (row->size > 0 && row->chars[0] == '\t') {
+                k = 1;
+            } else {
+                while (k < TAB_SIZE && k < row->size && row->chars[k] == ' ') k++;
+            }
+            if (k == 0) continue;
+            if (row->size + 1 > bufcap) {
+                bufcap = row->size * 2 + 1;
+                buf = realloc(buf, bufcap);
+                if (buf == NULL) die("realloc in editorIndentRows");
+            }
+            memcpy(buf, row->chars + k, row->size - k);
+            len = row->size - k;
+            delta = -k;
+        }
+        int step = rows ? undoSaveRows(y, 1) : -1;
+        editorReplaceRow(y, buf, len);
+        undoSetRows(step, 1);
+
+        // I cursori e l'ancora restano sullo stesso testo
+        if (E.cy == y) E.cx = E.cx + delta < 0 ? 0 : E.cx + delta;
+        if (E.sel.active && E.sel.ay == y)
+            E.sel.ax = E.sel.ax + delta < 0 ? 0 : E.sel.ax + delta;
+        for (int j = cursorsFirstOnRow(y); j < E.cursors.count && E.cursors.items[j].cy == y; j++)
+            E.cursors.items[j].cx = E.cursors.items[j].cx + delta < 0 ? 0 : E.cursors.items[j].cx + delta;
+    }
+    free(buf);
+    free(rows);
+    if (s >= 0) undoSetRows(s, bottom - top + 1);
+
+    all = cursorsGather(&n, &primary);
+    undoEnd(all, n, primary);
+    free(all);
+}
+
+/*** Kill ring ***/
+
+void killEntryFree(KillEntry *e) {
+    for (int i = 0; i < e->n; i++) chunkRelease(e->lines[i]);
+    free(e->lines);
+    free(e->lens);
+    memset(e, 0, sizeof(*e));
+}
+
+// Nuova voce piu' recente con n righe da riempire; la piu' vecchia viene
+// scartata quando l'anello e' pieno
+KillEntry *killPush(int n, int block) {
+    E.kill.head = (E.kill.head + 1) % KILL_RING_SIZE;
+    KillEntry *e = &E.kill.items[E.kill.head];
+    killEntryFree(e);
+    if (E.kill.count < KILL_RING_SIZE) E.kill.count++;
+
+    e->lines = malloc(sizeof(ClipChunk *) * n);
+    e->lens = malloc(sizeof(int) * n);
+    if (e->lines == NULL || e->lens == NULL) die("malloc in killPush");
+    e->n = n;
+    e->block = block;
+    E.kill.yanking = 0;
+    return e;
+}
+
+// Voce 'offset' posizioni prima della piu' recente, NULL se non esiste
+KillEntry *killGet(int offset) {
+    if (offset < 0 || offset >= E.kill.count) return NULL;
+    return &E.kill.items[(E.kill.head - offset + KILL_RING_SIZE) % KILL_RING_SIZE];
+}
+
+// Incolla una voce al cursore con un solo passo di undo. Le righe
+// intermedie vengono inserite con un'unica editorInsertChunks e
+// condividono il testo con la voce: incollare non lo copia.
+void editorPasteEntry(KillEntry *e) {
+    Cursor cur = {E.cx, E.cy};
+    undoBegin(UNDO_EDIT, &cur, 1, 0);
+
+    if (E.cy >= E.numrows) {
+        int s = undoSaveRows(E.numrows, 0);
+        editorInsertRow(E.numrows, "", 0);
+        undoSetRows(s, 1);
+        E.cy = E.numrows - 1;
+        E.cx = 0;
+    }
+
+    int n = e->n;
+    if (e->block) {
+        int rx = editorRowCxToRx(&E.rows[E.cy], E.cx);
+        int existing = E.numrows - E.cy < n ? E.numrows - E.cy : n;
+        int s = undoSaveRows(E.cy, existing);
+
+        char *buf = NULL;
+        int bufcap = 0;
+        for (int i = 0; i < existing; i++) {
+            EditorRow *row = &E.rows[E.cy + i];
+            int need = row->size + rx + e->lens[i] + 1;
+            if (need > bufcap) {
+                bufcap = need * 2;
+                buf = realloc(buf, bufcap);
+                if (buf == NULL) die("realloc in editorPasteEntry");
+            }
+            // Le righe piu' corte della colonna vengono allungate con spazi
+            int at = editorRowRxToCx(row, rx);
+            int len = 0;
+            memcpy(buf, row->chars, at);
+            len = at;
+            for (int pad = row->rsize; pad < rx; pad++) buf[len++] = ' ';
+            memcpy(buf + len, e->lines[i]->data, e->lens[i]);
+            len += e->lens[i];
+            memcpy(buf + len, row->chars + at, row->size - at);
+            len += row->size - at;
+            editorReplaceRow(E.cy + i, buf, len);
+        }
+        free(buf);
+
+        // Righe oltre la fine del file
+        if (existing < n) {
+            int extra = n - existing;
+            ClipChunk **chunks = malloc(sizeof(ClipChunk *) * extra);
+            int *lens = malloc(sizeof(int) * extra);
+            if (chunks == NULL || lens == NULL) die("malloc in editorPasteEntry");
+            for (int i = 0; i < extra; i++) {
+                ClipChunk *c = e->lines[existing + i];
+                int len = e->lens[existing + i];
+                if (rx == 0) {
+                    chunkRetain(c);
+                } else {
+                    ClipChunk *pad = chunkNew(NULL, 0, rx + len + 1);
+                    memset(pad->data, ' ', rx);
+                    memcpy(pad->data + rx, c->data, len);
+                    pad->data[rx + len] = '\0';
+                    c = pad;
+                }
+                chunks[i] = c;
+                lens[i] = rx + len;
+            }
+            editorInsertChunks(E.numrows, chunks, lens, extra);
+            for (int i = 0; i < extra; i++) chunkRelease(chunks[i]);
+            free(chunks);
+            free(lens);
+        }
+        undoSetRows(s, n);
+        E.cx = editorRowRxToCx(&E.rows[E.cy], rx) + e->lens[0];
+    } else {
+        EditorRow *row = &E.rows[E.cy];
+        int head = E.cx;
+        int tail = row->size - E.cx;
+        int s = undoSaveRows(E.cy, 1);
+
+        if (n == 1) {
+            int len = row->size + e->lens[0];
+            char *buf = malloc(len + 1);
+            if (buf == NULL) die("malloc in editorPasteEntry");
+            memcpy(buf, row->chars, head);
+            memcpy(buf + head, e->lines[0]->data, e->lens[0]);
+            memcpy(buf + head + e->lens[0], row->chars + head, tail);
+            editorReplaceRow(E.cy, buf, len);
+            free(buf);
+            E.cx += e->lens[0];
+        } else {
+            // Ultima riga: ultima riga incollata + resto della riga del
+            // cursore; se il resto e' vuoto viene condivisa anche lei
+            ClipChunk *last = e->lines[n - 1];
+            int lastlen = e->lens[n - 1];
+            if (tail > 0) {
+                last = chunkNew(last->data, lastlen, lastlen + tail + 1);
+                memcpy(last->data + lastlen, row->chars + head, tail);
+                lastlen += tail;
+                last->data[lastlen] = '\0';
+            }
+
+            ClipChunk *lastsaved = e->lines[n - 1];
+            int lastsavedlen = e->lens[n - 1];
+            e->lines[n - 1] = last;
+            e->lens[n - 1] = lastlen;
+            editorInsertChunks(E.cy + 1, e->lines + 1, e->lens + 1, n - 1);
+            e->lines[n - 1] = lastsaved;
+            e->lens[n - 1] = lastsavedlen;
+            if (tail > 0) chunkRelease(last);
+
+            // Prima riga: testo prima del cursore + prima riga incollata
+            if (head == 0) {
+                editorSetRowChunk(E.cy, e->lines[0], e->lens[0]);
+            } else {
+                row = &E.rows[E.cy];
+                ClipChunk *first = chunkNew(row->chars, head, head + e->lens[0] + 1);
+                memcpy(first->data + head, e->lines[0]->data, e->lens[0]);
+                first->data[head + e->lens[0]] = '\0';
+                editorSetRowChunk(E.cy, first, head + e->lens[0]);
+                chunkRelease(first);
+            }
+            E.cy += n - 1;
+            E.cx = e->lens[n - 1];
+        }
+        undoSetRows(s, n);
+    }
+
+    cur.cx = E.cx;
+    cur.cy = E.cy;
+    undoEnd(&cur, 1, 0);
+}
+
+// Incolla al posto della selezione, se c'e': la cancellazione e
+// l'incolla sono un solo passo di undo
+void editorPasteOverSelection(KillEntry *e) {
+    undoGroupBegin();
+    if (E.sel.active) editorDeleteSelection();
+    cursorsClear();
+    editorPasteEntry(e);
+    undoGroupEnd();
+}
+
+// Ctrl+V: incolla la voce piu' recente (sostituendo la selezione). Un
+// blocco viene inserito in colonna a partire dalla riga del cursore.
+void editorPaste() {
+    KillEntry *e = killGet(0);
+    if (e == NULL) {
+        editorSetStatusMessage("Clipboard is empty");
+        return;
+    }
+    E.kill.replaced = E.sel;
+    editorPasteOverSelection(e);
+    E.kill.yank = 0;
+    E.kill.yanking = 1;
+}
+
+// Alt+Y subito dopo un incolla: lo sostituisce con la voce precedente
+void editorYankPop() {
+    if (!E.kill.yanking) {
+        editorSetStatusMessage("Previous command was not a paste");
+        return;
+    }
+    if (E.kill.count < 2) return;
+    editorUndo();  // Rimette anche il testo che l'incolla aveva sostituito
+    E.kill.yank = (E.kill.yank + 1) % E.kill.count;
+    E.sel = E.kill.replaced;
+    editorPasteOverSelection(killGet(E.kill.yank));
+    E.kill.yanking = 1;
+    editorSetStatusMessage("Kill ring entry %d/%d", E.kill.yank + 1, E.kill.count);
+}
+
+// Testo incollato dal terminale (bracketed paste): entra come un blocco
+// solo, con un passo di undo e senza auto-indentazione riga per riga
+void editorPasteText(const char *text, int len) {
+    KillEntry e = {0};
+    int n = 1;
+    for (int i = 0; i < len; i++)
+        if (text[i] == '\n') n++;
+    e.lines = malloc(sizeof(ClipChunk *) * n);
+    e.lens = malloc(sizeof(int) * n);
+    if (e.lines == NULL || e.lens == NULL) die("malloc in editorPasteText");
+
+    int start = 0;
+    for (int i = 0; i <= len; i++) {
+        if (i < len && text[i] != '\n') continue;
+        int l = i - start;
+        if (l > 0 && text[start + l - 1] == '\r') l--;  // CRLF
+        e.lines[e.n] = chunkNew(text + start, l, l + 1);
+        e.lens[e.n++] = l;
+        start = i + 1;
+    }
+
+    editorPasteOverSelection(&e);
+    killEntryFree(&e);
+}
+
+/*** File I/O ***/
+
+char *editorRowsToString(int *buflen) {
+    int totlen = 0;
+    for (int j = 0; j < E.numrows; j++) {
+        totlen += E.rows[j].size + 1;
+    }
+    *buflen = totlen;
+
+    char *buf = malloc(totlen);
+    if (!buf) return NULL;
+
+    char *p = buf;
+    for (int j = 0; j < E.numrows; j++) {
+        memcpy(p, E.rows[j].chars, E.rows[j].size);
+        p += E.rows[j].size;
+        *p = '\n';
+        p++;
+    }
+
+    return buf;
+}
+
+void editorOpen(char *filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+    if (E.filename == NULL) die("strdup");
+    checkFollowFile();
+
+    char fullPath[MAX_PATH];
+    snprintf(fullPath, sizeof(fullPath), "%s\\%s", SAVE_DIRECTORY, filename);
+
+    FILE *fp = fopen(fullPath, "r");
+    if (!fp) {
+        // Try opening from current directory as fallback
+        fp = fopen(filename, "r");
+        if (!fp) {
+            // New file
+            fileWatchStart(fullPath);
+            editorSetStatusMessage("New file: %s", filename);
+            return;
+        }
+        snprintf(fullPath, sizeof(fullPath), "%s", filename);
+    }
+
+    char linebuf[MAX_LINE_LENGTH];
+    while (fgets(linebuf, sizeof(linebuf), fp) != NULL) {
+        size_t linelen = strlen(linebuf);
+
+        // Check if we likely hit the buffer limit (missing part of the line)
+        if (linelen == MAX_LINE_LENGTH - 1 && linebuf[linelen - 1] != '\n') {
+            // Read and discard the rest of the line
+            int c;
+            while ((c = fgetc(fp)) != EOF && c != '\n');
+            editorSetStatusMessage("Warning: Line truncated (too long)");
+        }
+
+        // Remove trailing newline characters
+        while (linelen > 0 &&
+               (linebuf[linelen - 1] == '\n' || linebuf[linelen - 1] == '\r'))
+            linelen--;
+
+        editorAppendRow(linebuf, linelen);
+    }
+
+    fclose(fp);
+    fileWatchStart(fullPath);
+    editorMarkSaved();
+    E.dirty = 0;
+}
+
+void ensureDirectoryExists(const char *path) {
+    if (CreateDirectory(path, NULL) || GetLastError() == ERROR_ALREADY_EXISTS) {
+        return;  // Success or directory already exists
+    }
+    editorSetStatusMessage("Warning: Could not create directory %s", path);
+}
+
+// Gestisce il prompt e l'apertura di un nuovo file
+void editorOpenFilePrompt() {
+    // Impedisce di aprire un nuovo file se ci sono modifiche non salvate
+    if (editorIsDirty()) {
+        editorSetStatusMessage("WARNING! File has unsaved changes. Save first (Ctrl-S).");
+        return;
+    }
+
+    // Chiede all'utente il nome del file da aprire
+    char *filename = editorPrompt("Open File: %s (ESC to cancel)", NULL);
+    if (filename == NULL) {
+        editorSetStatusMessage("Open aborted.");
+        return;
+    }
+
+    // Pulisce il buffer corrente prima di caricarne uno nuovo
+    editorFreeBuffer();
+
+    // La funzione editorOpen si occupa di caricare il file e impostare il nome
+    editorOpen(filename);
+
+    // La stringa del nome del file è stata duplicata da editorOpen, quindi possiamo liberarla
+    free(filename);
+}
+
+void editorSave() {
+    // Se il file non ha nome o ha il nome di default, chiedine uno nuovo.
+    if (E.filename == NULL || strcmp(E.filename, DEFAULT_FILENAME) == 0) {
+        // Chiama editorPrompt per ottenere il nome del file dall'utente.
+        char *new_filename = editorPrompt("Save As: %s (ESC to cancel)", NULL);
+        if (new_filename == NULL) {
+            editorSetStatusMessage("Save aborted.");
+            return;
+        }
+        // Libera il vecchio nome (se presente) e assegna quello nuovo.
+        if (E.filename) free(E.filename);
+        E.filename = new_filename;
+        checkFollowFile();
+    }
+
+    ensureDirectoryExists(SAVE_DIRECTORY);
+
+    char fullPath[MAX_PATH];
+    snprintf(fullPath, sizeof(fullPath), "%s\\%s", SAVE_DIRECTORY, E.filename);
+
+    int len;
+    char *buf = editorRowsToString(&len);
+
+    FILE *fp = fopen(fullPath, "w");
+    if (fp != NULL) {
+        if (fwrite(buf, 1, len, fp) == (size_t)len) {
+            fclose(fp);
+            free(buf);
+            fileWatchStart(fullPath);
+            editorMarkSaved();
+            E.dirty = 0;
+            editorSetStatusMessage("%d bytes written to disk", len);
+            return;
+        }
+        fclose(fp);
+    }
+
+    free(buf);
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+// Sorveglia la cartella del file: il ciclo principale si sveglia quando
+// qualcosa vi cambia e fileWatchCheck guarda se e' cambiato proprio il file
+void fileWatchStart(const char *path) {
+    fileWatchStop();
+    snprintf(E.events.path, sizeof(E.events.path), "%s", path);
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    memset(&E.events.mtime, 0, sizeof(E.events.mtime));
+    if (GetFileAttributesEx(path, GetFileExInfoStandard, &info)) E.events.mtime = info.ftLastWriteTime;
+
+    char dir[MAX_PATH];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = NULL;
+    for (char *p = dir; *p; p++)
+        if (*p == '\\' || *p == '/') slash = p;
+    if (slash) *slash = '\0';
+    else snprintf(dir, sizeof(dir), ".");
+    HANDLE h = FindFirstChangeNotification(dir, FALSE,
+                                           FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+    E.events.watch = h == INVALID_HANDLE_VALUE ? NULL : h;
+}
+
+void fileWatchStop() {
+    if (E.events.watch) FindCloseChangeNotification(E.events.watch);
+    E.events.watch = NULL;
+}
+
+// La cartella e' cambiata: avvisa se e' cambiato il file aperto.
+// Restituisce 1 se c'e' un nuovo messaggio da mostrare.
+int fileWatchCheck() {
+    if (!FindNextChangeNotification(E.events.watch)) {
+        fileWatchStop();
+        return 0;
+    }
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesEx(E.events.path, GetFileExInfoStandard, &info)) return 0;
+    if (CompareFileTime(&info.ftLastWriteTime, &E.events.mtime) == 0) return 0;
+    E.events.mtime = info.ftLastWriteTime;
+    editorSetStatusMessage("%.40s changed on disk%s", E.filename ? E.filename : E.events.path,
+                           editorIsDirty() ? " (buffer has unsaved changes)" : "");
+    return 1;
+}
+
+/*** Editor Navigation ***/
+void editorFindMatchingBrace() {
+    if (E.cy >= E.numrows) return; // Cursore fuori dal testo
+
+    char char_under_cursor = E.rows[E.cy].chars[E.cx];
+    char open_brace = '{', close_brace = '}';
+    int direction = 0; // 1 per avanti, -1 per indietro
+
+    if (char_under_cursor == open_brace) direction = 1;
+    if (char_under_cursor == close_brace) direction = -1;
+    if (direction == 0) return; // Non siamo su una graffa
+
+    int y = E.cy;
+    int x = E.cx;
+    int level = 1;
+
+    while (y >= 0 && y < E.numrows) {
+        x += direction;
+        if (x < 0) {
+            y += direction;
+            if (y < 0 || y >= E.numrows) break;
+            x = (direction == 1) ? 0 : E.rows[y].size - 1;
+        }
+        if (x >= E.rows[y].size) {
+            y += direction;
+            if (y >= E.numrows) break;
+            x = (direction == 1) ? 0 : E.rows[y].size - 1;
+        }
+
+        if (y < 0 || y >= E.numrows) break;
+
+        char current_char = E.rows[y].chars[x];
+        if (current_char == open_brace) {
+            level += (direction == 1) ? 1 : -1;
+        } else if (current_char == close_brace) {
+            level += (direction == 1) ? -1 : 1;
+        }
+
+        if (level == 0) {
+            E.cy = y;
+            E.cx = x;
+            return;
+        }
+    }
+
+    editorSetStatusMessage("No matching brace found");
+}
+
+// Salta alla definizione dell'identificatore sotto il cursore (F12)
+void editorGotoDefinition() {
+    if (E.cy >= E.numrows) return;
+
+    EditorRow *row = &E.rows[E.cy];
+    int start = E.cx;
+    if (start >= row->size || !isIdentChar(row->chars[start])) start--;
+    if (start < 0 || !isIdentChar(row->chars[start])) {
+        editorSetStatusMessage("No identifier under cursor");
+        return;
+    }
+    while (start > 0 && isIdentChar(row->chars[start - 1])) start--;
+    int end = start;
+    while (end < row->size && isIdentChar(row->chars[end])) end++;
+
+    Symbol *sym = symIndexLookup(&row->chars[start], end - start);
+    if (sym == NULL) {
+        // Non e' nel buffer: cerca nel database dei tag del progetto
+        const TagSymEntry *ts = tagsLookup(&row->chars[start], end - start);
+        const char *path = ts ? tagsFilePath(ts) : NULL;
+        if (path == NULL) {
+            editorSetStatusMessage("No definition found for '%.*s'", end - start,
+                                   &row->chars[start]);
+            return;
+        }
+
+        // Copia i dati prima che la mappatura o il buffer vengano liberati
+        int line = ts->line, col = ts->col, kind = ts->kind;
+        char name[256];
+        snprintf(name, sizeof(name), "%.*s", end - start, &row->chars[start]);
+        char *file = strdup(path);
+        if (file == NULL) die("strdup");
+        if (E.filename == NULL || strcmp(E.filename, file) != 0) {
+            if (editorIsDirty()) {
+                editorSetStatusMessage("Defined in %s:%d. Save first (Ctrl-S).", file,
+                                       line + 1);
+                free(file);
+                return;
+            }
+            editorFreeBuffer();
+            editorOpen(file);
+        }
+        E.cy = line;
+        E.cx = col;
+        editorSetStatusMessage("%s %s (%s:%d)", symKindName(kind), name, file, line + 1);
+        free(file);
+        return;
+    }
+
+    E.cy = symRow(sym);
+    E.cx = sym->col;
+    editorSetStatusMessage("%s %s (line %d)", symKindName(sym->kind), sym->name,
+                           E.cy + 1);
+}
+
+/* Movimenti a parole, paragrafi, blocchi e funzioni. La ricerca del
+   prossimo confine confronta 16 caratteri alla volta con SSE2; senza
+   SSE2 (o per gli ultimi byte della riga) si usa il ciclo scalare. */
+
+int charClass(int c) {
+    if (c == ' ' || c == '\t') return CLASS_SPACE;
+    return isIdentChar(c) ? CLASS_WORD : CLASS_PUNCT;
+}
+
+int bitScanForward(unsigned int m) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanForward(&i, m);
+    return (int)i;
+#else
+    return __builtin_ctz(m);
+#endif
+}
+
+int bitScanReverse(unsigned int m) {
+#ifdef _MSC_VER
+    unsigned long i;
+    _BitScanReverse(&i, m);
+    return (int)i;
+#else
+    return 31 - __builtin_clz(m);
+#endif
+}
+
+#ifdef USE_SSE2
+// Bit i acceso se s[i] appartiene alla classe cls (legge 16 byte)
+unsigned int charClassMask16(const char *s, int cls) {
+    __m128i v = _mm_loadu_si128((const __m128i *)s);
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                                 _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    if (cls == CLASS_SPACE) return _mm_movemask_epi8(space);
+
+    // x <= k senza segno  <=>  min(x, k) == x
+    __m128i alpha = _mm_sub_epi8(_mm_or_si128(v, _mm_set1_epi8(0x20)), _mm_set1_epi8('a'));
+    alpha = _mm_cmpeq_epi8(_mm_min_epu8(alpha, _mm_set1_epi8(25)), alpha);
+    __m128i digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    digit = _mm_cmpeq_epi8(_mm_min_epu8(digit, _mm_set1_epi8(9)), digit);
+    __m128i word = _mm_or_si128(_mm_or_si128(alpha, digit),
+                                _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    if (cls == CLASS_WORD) return _mm_movemask_epi8(word);
+    return ~_mm_movemask_epi8(_mm_or_si128(space, word)) & 0xFFFF;
+}
+#else
+unsigned int charClassMask16(const char *s, int cls) {
+    unsigned int m = 0;
+    for (int i = 0; i < 16; i++)
+        if (charClass(s[i]) == cls) m |= 1u << i;
+    return m;
+}
+#endif
+
+// Prima posizione in [from, to) il cui carattere non e' della classe cls
+int scanClassForward(const char *s, int from, int to, int cls) {
+    int i = from;
+#ifdef USE_SSE2
+    for (; i + 16 <= to; i += 16) {
+        unsigned int m = ~charClassMask16(s + i, cls) & 0xFFFF;
+        if (m) return i + bitScanForward(m);
+    }
+#endif
+    while (i < to && charClass(s[i]) == cls) i++;
+    return i;
+}
+
+// Inizio della sequenza di caratteri della classe cls che finisce in 'to'
+int scanClassBackward(const char *s, int from, int to, int cls) {
+    int i = to;
+#ifdef USE_SSE2
+    for (; i - 16 >= from; i -= 16) {
+        unsigned int m = ~charClassMask16(s + i - 16, cls) & 0xFFFF;
+        if (m) return i - 16 + bitScanReverse(m) + 1;
+    }
+#endif
+    while (i > from && charClass(s[i - 1]) == cls) i--;
+    return i;
+}
+
+// Il rientro di ogni riga e' in cache (calcolato da editorUpdateRow)
+int editorRowIsBlank(int at) {
+    return E.rows[at].indent == E.rows[at].size;
+}
+
+// Colonna del primo carattere non bianco della riga
+int editorRowIndentEnd(int at) {
+    return E.rows[at].indent;
+}
+
+// Ctrl+Sinistra/Destra: inizio o fine della parola (o della sequenza di
+// simboli) successiva; ai bordi della riga passa alla riga vicina
+void editorMoveWord(int dir) {
+    if (E.cy >= E.numrows) return;
+    EditorRow *row = &E.rows[E.cy];
+
+    if (dir > 0) {
+        if (E.cx >= row->size) {
+            int next = editorNextVisibleRow(E.cy);
+            if (next < E.numrows) {
+                E.cy = next;
+                E.cx = 0;
+            }
+            return;
+        }
+        int x = scanClassForward(row->chars, E.cx, row->size, CLASS_SPACE);
+        if (x < row->size) x = scanClassForward(row->chars, x, row->size, charClass(row->chars[x]));
+        E.cx = x;
+    } else {
+        if (E.cx == 0) {
+            if (E.cy > 0) {
+                E.cy = editorPrevVisibleRow(E.cy);
+                E.cx = E.rows[E.cy].size;
+            }
+            return;
+        }
+        int x = scanClassBackward(row->chars, 0, E.cx, CLASS_SPACE);
+        if (x > 0) x = scanClassBackward(row->chars, 0, x, charClass(row->chars[x - 1]));
+        E.cx = x;
+    }
+}
+
+// Ctrl+Su/Giu': prossima riga vuota dopo un gruppo di righe non vuote
+void editorMoveParagraph(int dir) {
+    if (E.numrows == 0) return;
+    int y = E.cy < E.numrows ? E.cy : E.numrows - 1;
+
+    if (dir > 0) {
+        while (y < E.numrows && editorRowIsBlank(y)) y = editorNextVisibleRow(y);
+        while (y < E.numrows && !editorRowIsBlank(y)) y = editorNextVisibleRow(y);
+        if (y >= E.numrows) y = E.numrows - 1;
+    } else {
+        while (y > 0 && editorRowIsBlank(y)) y = editorPrevVisibleRow(y);
+        while (y > 0 && !editorRowIsBlank(y)) y = editorPrevVisibleRow(y);
+    }
+    E.cy = y;
+    E.cx = 0;
+}
+
+// Alt+Su/Giu': riga che apre o chiude il blocco che contiene il cursore,
+// usando la tabella delle profondita' invece di contare le graffe. Fuori
+// da ogni blocco salta al blocco di primo livello precedente o successivo.
+void editorMoveBlock(int dir) {
+    if (E.cy >= E.numrows) return;
+    int y = E.cy;
+    int d = editorRowDepth(y);
+
+    if (dir < 0) {
+        for (y--; y >= 0; y--) {
+            int dy = editorRowDepth(y);
+            if (d > 0 ? dy < d : dy == 0 && E.rows[y].brace_delta > 0) break;
+        }
+    } else {
+        // Sulla riga di chiusura il blocco e' gia' quello esterno
+        if (E.rows[y].brace_delta < 0) d += E.rows[y].brace_delta;
+        if (d < 0) d = 0;
+        for (y++; y < E.numrows; y++) {
+            int dy = editorRowDepth(y);
+            if (d > 0 ? dy + E.rows[y].brace_delta < d : dy == 0 && E.rows[y].brace_delta > 0) break;
+        }
+    }
+    if (y < 0 || y >= E.numrows) return;
+    E.cy = y;
+    E.cx = editorRowIndentEnd(y);
+}
+
+// Ctrl+PagSu/PagGiu': definizione di funzione precedente o successiva,
+// cercata con una ricerca binaria nell'outline (ordinato per riga)
+void editorMoveFunction(int dir) {
+    int i;
+    if (dir < 0) {
+        for (i = outlineSearch(E.cy, 0) - 1; i >= 0; i--)
+            if (E.outline.items[i]->kind == SYM_FUNCTION) break;
+    } else {
+        for (i = outlineSearch(E.cy + 1, 0); i < E.outline.count; i++)
+            if (E.outline.items[i]->kind == SYM_FUNCTION) break;
+    }
+    if (i < 0 || i >= E.outline.count) {
+        editorSetStatusMessage(dir < 0 ? "No previous function" : "No next function");
+        return;
+    }
+    E.cy = symRow(E.outline.items[i]);
+    E.cx = E.outline.items[i]->col;
+}
+
+/*** Search ***/
+
+void editorFindCallback(char *query, int key) {
+    static int last_match = -1; // Riga dell'ultima corrispondenza trovata (-1 se nessuna)
+    static int direction = 1;   // 1 = avanti, -1 = indietro
 
     // Se un tasto freccia viene premuto, imposta la direzione della ricerca
     if (key == ARROW_RIGHT || key == ARROW_DOWN) {
@@ -636,190 +4056,5224 @@ void editorFindCallback(char *query, int key) {
         direction = 1;
         return;
     } else {
-        // Se l'utente digita un nuovo carattere, la ricerca riparte dall'inizio
-        last_match = -1;
-        direction = 1;
+        // Se l'utente digita un nuovo carattere, la ricerca riparte dall'inizio
+        last_match = -1;
+        direction = 1;
+    }
+
+    if (last_match == -1) direction = 1;
+    int current = last_match;
+
+    // Cicla attraverso tutte le righe per trovare una corrispondenza
+    for (int i = 0; i < E.numrows; i++) {
+        current += direction;
+        // Gestione del "wrap-around" (se arrivi alla fine, ricomincia dall'inizio)
+        if (current == -1) current = E.numrows - 1;
+        else if (current == E.numrows) current = 0;
+
+        EditorRow *row = &E.rows[current];
+        char *match = strstr(row->chars, query); // Cerca la sottostringa
+        if (match) {
+            last_match = current;
+            E.cy = current;
+            E.cx = match - row->chars; // Posiziona il cursore all'inizio della corrispondenza
+            E.rowoff = E.numrows; // Forza lo scroll per rendere visibile la riga
+            break;
+        }
+    }
+}
+
+void editorFind() {
+    // Salva la posizione corrente del cursore per ripristinarla in caso di annullamento
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+
+    // Avvia il prompt di ricerca, passando il callback per la logica interattiva
+    char *query = editorPrompt(
+        "Search: %s (ESC=Cancel | Arrows=Navigate | Enter=Confirm)",
+        editorFindCallback);
+
+    if (query == NULL) { // L'utente ha premuto ESC
+        // Ripristina la posizione originale del cursore
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_coloff;
+        E.rowoff = saved_rowoff;
+    }
+    free(query);
+}
+
+/*** C Syntax Highlighting ***/
+
+// Definiamo i colori ANSI che useremo
+#define COLOR_RESET   "\x1b[0m"
+#define COLOR_KEYWORD "\x1b[33m" // Giallo
+#define COLOR_TYPE    "\x1b[36m" // Ciano
+#define COLOR_COMMENT "\x1b[38;5;106m" // Verde scuro
+#define COLOR_STRING  "\x1b[33m" // Arancione
+#define COLOR_NUMBER  "\x1b[31m" // Rosso
+#define COLOR_PREPROC "\x1b[35m" // Magenta
+#define COLOR_CONSTANT "\x1b[38;5;214m" // Arancione
+
+// Lista di keyword e tipi del C
+const char *C_KEYWORDS[] = {
+    "auto", "break", "case", "const", "continue", "default", "do", "else",
+    "enum", "extern", "for", "goto", "if", "register", "return", "sizeof",
+    "static", "struct", "switch", "typedef", "union", "volatile", "while", NULL
+};
+
+const char *C_TYPES[] = {
+    "char", "double", "float", "int", "long", "short", "signed", "unsigned",
+    "void", "size_t", "FILE", "HANDLE", "DWORD", "BOOL", "boolean", NULL
+};
+
+const char *C_CONSTANTS[] = {
+    "true", "false", "NULL", "BOOL", "boolean", NULL
+};
+
+int isIdentChar(int c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+// Cerca una parola in una lista terminata da NULL
+int wordInList(const char *word, int len, const char **list) {
+    for (int k = 0; list[k]; k++) {
+        if ((int)strlen(list[k]) == len && strncmp(word, list[k], len) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Lexer C: legge il token che inizia in s[i] e restituisce l'indice successivo.
+// E' lo stesso lexer usato per l'highlighting e per l'indice dei simboli.
+int cLexToken(const char *s, int len, int i, CToken *tok) {
+    tok->start = i;
+    tok->len = 0;
+    if (i >= len) {
+        tok->type = TOK_EOF;
+        return i;
+    }
+
+    int j = i;
+    unsigned char c = s[i];
+
+    if (i == 0 && c == '#') {
+        // Direttiva del preprocessore: tutta la riga
+        tok->type = TOK_PREPROC;
+        j = len;
+    } else if (c == '/' && i + 1 < len && s[i + 1] == '/') {
+        tok->type = TOK_COMMENT;
+        j = len;
+    } else if (c == '"' || c == '\'') {
+        // Stringhe e caratteri, saltando le sequenze di escape
+        tok->type = TOK_STRING;
+        j++;
+        while (j < len && s[j] != c) j += (s[j] == '\\' && j + 1 < len) ? 2 : 1;
+        if (j < len) j++;
+    } else if (isdigit(c)) {
+        tok->type = TOK_NUMBER;
+        while (j < len && isdigit((unsigned char)s[j])) j++;
+    } else if (isalpha(c) || c == '_') {
+        tok->type = TOK_IDENT;
+        while (j < len && isIdentChar(s[j])) j++;
+        // Keyword/tipi solo se la parola non e' attaccata ad un numero
+        if (i == 0 || !isalnum((unsigned char)s[i - 1])) {
+            if (wordInList(&s[i], j - i, C_KEYWORDS))
+                tok->type = TOK_KEYWORD;
+            else if (wordInList(&s[i], j - i, C_TYPES))
+                tok->type = TOK_TYPE;
+            else if (wordInList(&s[i], j - i, C_CONSTANTS))
+                tok->type = TOK_CONSTANT;
+        }
+    } else if (isspace(c)) {
+        tok->type = TOK_SPACE;
+        while (j < len && isspace((unsigned char)s[j])) j++;
+    } else {
+        tok->type = TOK_PUNCT;
+        j++;
+    }
+
+    tok->len = j - i;
+    return j;
+}
+
+const char *cTokenColor(int type) {
+    switch (type) {
+        case TOK_KEYWORD: return COLOR_KEYWORD;
+        case TOK_TYPE: return COLOR_TYPE;
+        case TOK_CONSTANT: return COLOR_CONSTANT;
+        case TOK_NUMBER: return COLOR_NUMBER;
+        case TOK_STRING: return COLOR_STRING;
+        case TOK_COMMENT: return COLOR_COMMENT;
+        case TOK_PREPROC: return COLOR_KEYWORD;
+        default: return NULL;
+    }
+}
+
+/*** Symbol Index ***/
+
+#define SYM_MAX_TOKENS 64
+#define SYM_INITIAL_BUCKETS 1024
+#define SYM_MAX_SHIFTS 64  // Spostamenti in sospeso prima di rinumerare tutto
+
+int tokIs(const char *s, const CToken *tok, const char *text) {
+    return tok->len == (int)strlen(text) &&
+           strncmp(&s[tok->start], text, tok->len) == 0;
+}
+
+int tokIsPunct(const char *s, const CToken *tok, char c) {
+    return tok->type == TOK_PUNCT && s[tok->start] == c;
+}
+
+// Estrae i simboli dichiarati su una riga di codice C. Come ctags, considera
+// solo le righe che iniziano a colonna 0 (dichiarazioni di primo livello).
+void cExtractSymbols(const char *s, int len, SymbolCallback emit, void *ctx) {
+    if (len == 0 || isspace((unsigned char)s[0])) return;
+
+    // #define NOME
+    if (s[0] == '#') {
+        int i = 1;
+        while (i < len && isspace((unsigned char)s[i])) i++;
+        if (len - i < 6 || strncmp(&s[i], "define", 6) != 0) return;
+        i += 6;
+        if (i >= len || !isspace((unsigned char)s[i])) return;
+        while (i < len && isspace((unsigned char)s[i])) i++;
+        int start = i;
+        while (i < len && isIdentChar(s[i])) i++;
+        if (i > start) emit(ctx, &s[start], i - start, SYM_MACRO, start);
+        return;
+    }
+
+    // Tokenizza la riga scartando spazi e commenti
+    CToken toks[SYM_MAX_TOKENS];
+    int n = 0, i = 0;
+    CToken tok;
+    while (n < SYM_MAX_TOKENS) {
+        i = cLexToken(s, len, i, &tok);
+        if (tok.type == TOK_EOF) break;
+        if (tok.type == TOK_SPACE || tok.type == TOK_COMMENT) continue;
+        toks[n++] = tok;
+    }
+    if (n == 0) return;
+
+    int ends_stmt = tokIsPunct(s, &toks[n - 1], ';');
+    int k;
+
+    // Chiusura di un typedef su piu' righe: "} Nome;"
+    if (tokIsPunct(s, &toks[0], '}')) {
+        if (n >= 2 && toks[1].type == TOK_IDENT)
+            emit(ctx, &s[toks[1].start], toks[1].len, SYM_TYPEDEF, toks[1].start);
+        return;
+    }
+
+    if (toks[0].type == TOK_KEYWORD) {
+        if (tokIs(s, &toks[0], "typedef")) {
+            // Puntatore a funzione: typedef void (*nome)(...);
+            for (k = 1; k + 2 < n; k++) {
+                if (tokIsPunct(s, &toks[k], '(') && tokIsPunct(s, &toks[k + 1], '*') &&
+                    toks[k + 2].type == TOK_IDENT) {
+                    emit(ctx, &s[toks[k + 2].start], toks[k + 2].len, SYM_TYPEDEF,
+                         toks[k + 2].start);
+                    return;
+                }
+            }
+            if (!ends_stmt) {
+                // typedef struct Tag { ... su piu' righe
+                if (n >= 3 && toks[2].type == TOK_IDENT &&
+                    (tokIs(s, &toks[1], "struct") || tokIs(s, &toks[1], "union") ||
+                     tokIs(s, &toks[1], "enum"))) {
+                    emit(ctx, &s[toks[2].start], toks[2].len,
+                         tokIs(s, &toks[1], "enum") ? SYM_ENUM : SYM_STRUCT,
+                         toks[2].start);
+                }
+                return;
+            }
+            // typedef ... nome;  (l'ultimo identificatore prima di ';' o '[')
+            int name = -1;
+            for (k = 1; k < n; k++) {
+                if (tokIsPunct(s, &toks[k], '[') || tokIsPunct(s, &toks[k], ';')) break;
+                if (toks[k].type == TOK_IDENT) name = k;
+            }
+            if (name > 1)
+                emit(ctx, &s[toks[name].start], toks[name].len, SYM_TYPEDEF,
+                     toks[name].start);
+            return;
+        }
+
+        if (tokIs(s, &toks[0], "struct") || tokIs(s, &toks[0], "union") ||
+            tokIs(s, &toks[0], "enum")) {
+            if (n >= 2 && toks[1].type == TOK_IDENT &&
+                (n == 2 || tokIsPunct(s, &toks[2], '{'))) {
+                emit(ctx, &s[toks[1].start], toks[1].len,
+                     tokIs(s, &toks[0], "enum") ? SYM_ENUM : SYM_STRUCT,
+                     toks[1].start);
+                return;
+            }
+            // Altrimenti e' una dichiarazione che usa il tipo: prosegue sotto
+        } else if (!tokIs(s, &toks[0], "static") && !tokIs(s, &toks[0], "extern") &&
+                   !tokIs(s, &toks[0], "const") && !tokIs(s, &toks[0], "volatile") &&
+                   !tokIs(s, &toks[0], "register")) {
+            return;  // return, if, for... non sono dichiarazioni
+        }
+    }
+
+    // Dichiarazione generica: cerca il primo separatore significativo
+    for (k = 0; k < n; k++) {
+        if (toks[k].type != TOK_PUNCT) continue;
+        char c = s[toks[k].start];
+
+        if (c == '(') {
+            // Puntatore a funzione globale: tipo (*nome)(...)
+            if (k + 2 < n && tokIsPunct(s, &toks[k + 1], '*') &&
+                toks[k + 2].type == TOK_IDENT) {
+                emit(ctx, &s[toks[k + 2].start], toks[k + 2].len, SYM_VARIABLE,
+                     toks[k + 2].start);
+                return;
+            }
+            if (k == 0 || toks[k - 1].type != TOK_IDENT) return;
+            // Senza tipo di ritorno e' una funzione solo se non termina con ';'
+            if (k == 1 && ends_stmt) return;
+            emit(ctx, &s[toks[k - 1].start], toks[k - 1].len,
+                 ends_stmt ? SYM_PROTOTYPE : SYM_FUNCTION, toks[k - 1].start);
+            return;
+        }
+
+        if (c == '=' || c == ';' || c == '[' || c == ',') {
+            if (k < 2 || toks[k - 1].type != TOK_IDENT) return;
+            emit(ctx, &s[toks[k - 1].start], toks[k - 1].len, SYM_VARIABLE,
+                 toks[k - 1].start);
+
+            // Altre variabili nella stessa dichiarazione: int a, *b = 1, c;
+            int depth = 0;
+            for (; k < n; k++) {
+                if (toks[k].type != TOK_PUNCT) continue;
+                c = s[toks[k].start];
+                if (c == '(' || c == '[' || c == '{') depth++;
+                else if (c == ')' || c == ']' || c == '}') depth--;
+                else if (c == ',' && depth == 0) {
+                    int m = k + 1;
+                    while (m < n && tokIsPunct(s, &toks[m], '*')) m++;
+                    if (m < n && toks[m].type == TOK_IDENT)
+                        emit(ctx, &s[toks[m].start], toks[m].len, SYM_VARIABLE,
+                             toks[m].start);
+                }
+            }
+            return;
+        }
+
+        if (c != '*') return;
+    }
+}
+
+// Hash FNV-1a del nome del simbolo
+unsigned int symHash(const char *s, int len) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void symIndexGrow() {
+    int nbuckets = E.symbols.nbuckets ? E.symbols.nbuckets * 2 : SYM_INITIAL_BUCKETS;
+    Symbol **buckets = calloc(nbuckets, sizeof(Symbol *));
+    if (!buckets) die("calloc in symIndexGrow");
+
+    for (int b = 0; b < E.symbols.nbuckets; b++) {
+        Symbol *sym = E.symbols.buckets[b];
+        while (sym) {
+            Symbol *next = sym->next;
+            int nb = sym->hash & (nbuckets - 1);
+            sym->next = buckets[nb];
+            buckets[nb] = sym;
+            sym = next;
+        }
+    }
+    free(E.symbols.buckets);
+    E.symbols.buckets = buckets;
+    E.symbols.nbuckets = nbuckets;
+}
+
+typedef struct {
+    EditorRow *row;
+    int at;
+} SymbolRowCtx;
+
+void symIndexAdd(void *ctx, const char *name, int len, int kind, int col) {
+    SymbolRowCtx *rc = ctx;
+
+    if (E.symbols.count >= E.symbols.nbuckets) symIndexGrow();
+
+    Symbol *sym = malloc(sizeof(Symbol));
+    if (!sym) die("malloc in symIndexAdd");
+    sym->name = malloc(len + 1);
+    if (!sym->name) die("malloc in symIndexAdd");
+    memcpy(sym->name, name, len);
+    sym->name[len] = '\0';
+    sym->kind = kind;
+    sym->row = rc->at;
+    sym->epoch = E.symbols.nshifts;
+    sym->col = col;
+    sym->hash = symHash(name, len);
+
+    int b = sym->hash & (E.symbols.nbuckets - 1);
+    sym->next = E.symbols.buckets[b];
+    E.symbols.buckets[b] = sym;
+
+    // Mantiene i simboli della riga nell'ordine in cui compaiono
+    Symbol **tail = &rc->row->syms;
+    while (*tail) tail = &(*tail)->rownext;
+    sym->rownext = NULL;
+    *tail = sym;
+
+    E.symbols.count++;
+    if (kind != SYM_PROTOTYPE) outlineInsert(sym);
+}
+
+void symIndexRemoveRow(EditorRow *row) {
+    // Righe aggiornate prima di staccarli dalla riga: symRenumber non li
+    // vedrebbe piu' e outlineRemove non li ritroverebbe
+    for (Symbol *sym = row->syms; sym; sym = sym->rownext) symRow(sym);
+    Symbol *sym = row->syms;
+    row->syms = NULL;
+    while (sym) {
+        Symbol **pp = &E.symbols.buckets[sym->hash & (E.symbols.nbuckets - 1)];
+        while (*pp && *pp != sym) pp = &(*pp)->next;
+        if (*pp) *pp = sym->next;
+        if (sym->kind != SYM_PROTOTYPE) outlineRemove(sym);
+
+        Symbol *next = sym->rownext;
+        free(sym->name);
+        free(sym);
+        E.symbols.count--;
+        sym = next;
+    }
+}
+
+void symIndexClear() {
+    for (int b = 0; b < E.symbols.nbuckets; b++) {
+        Symbol *sym = E.symbols.buckets[b];
+        while (sym) {
+            Symbol *next = sym->next;
+            free(sym->name);
+            free(sym);
+            sym = next;
+        }
+    }
+    free(E.symbols.buckets);
+    E.symbols.buckets = NULL;
+    E.symbols.nbuckets = 0;
+    E.symbols.count = 0;
+    E.symbols.nshifts = 0;
+    E.outline.count = 0;
+    E.outline.dirty = 1;
+}
+
+// Una riga puo' definire un numero qualsiasi di simboli (ad esempio un
+// enum su una riga sola): il buffer cresce e resta per le righe successive
+void symScratchAdd(void *ctx, const char *name, int len, int kind, int col) {
+    int *count = ctx;
+    SymbolIndex *idx = &E.symbols;
+    if (*count == idx->scratchcap) {
+        idx->scratchcap = idx->scratchcap ? idx->scratchcap * 2 : 16;
+        idx->scratch = realloc(idx->scratch, sizeof(SymbolFound) * idx->scratchcap);
+        if (idx->scratch == NULL) die("realloc in symScratchAdd");
+    }
+    SymbolFound *f = &idx->scratch[(*count)++];
+    f->name = name;
+    f->len = len;
+    f->kind = kind;
+    f->col = col;
+}
+
+// Reindicizza una singola riga: chiamata ad ogni modifica della riga.
+// Se i simboli non sono cambiati (il caso comune mentre si scrive) l'indice
+// e l'outline non vengono toccati.
+void editorIndexRow(int at) {
+    EditorRow *row = &E.rows[at];
+    int count = 0;
+    cExtractSymbols(row->chars, row->size, symScratchAdd, &count);
+    SymbolFound *found = E.symbols.scratch;
+
+    int same = 1, k = 0;
+    Symbol *sym = row->syms;
+    for (; sym && k < count; sym = sym->rownext, k++) {
+        if (sym->kind != found[k].kind || sym->col != found[k].col ||
+            strncmp(sym->name, found[k].name, found[k].len) != 0 ||
+            sym->name[found[k].len] != '\0') {
+            same = 0;
+            break;
+        }
+    }
+    if (same && sym == NULL && k == count) return;
+
+    if (row->syms) symIndexRemoveRow(row);
+    SymbolRowCtx ctx = {row, at};
+    for (k = 0; k < count; k++)
+        symIndexAdd(&ctx, found[k].name, found[k].len, found[k].kind, found[k].col);
+}
+
+// Le righe da 'from' in poi (contate prima della modifica) si spostano
+// di 'delta'. Invece di rinumerare i simboli di tutte le righe che
+// seguono si annota lo spostamento: symRow lo applica alla lettura.
+void editorShiftSymbols(int from, int delta) {
+    SymbolIndex *idx = &E.symbols;
+    if (idx->nshifts == idx->capshifts) {
+        idx->capshifts = idx->capshifts ? idx->capshifts * 2 : SYM_MAX_SHIFTS;
+        idx->shifts = realloc(idx->shifts, sizeof(SymbolShift) * idx->capshifts);
+        if (idx->shifts == NULL) die("realloc in editorShiftSymbols");
+    }
+    idx->shifts[idx->nshifts].from = from;
+    idx->shifts[idx->nshifts].delta = delta;
+    idx->nshifts++;
+}
+
+// Riga attuale del simbolo: applica gli spostamenti annotati dopo l'ultima
+// lettura. Quando se ne accumulano troppi (molti Invio, un incolla su
+// molti cursori) si rinumerano tutti i simboli in un solo passaggio.
+int symRow(Symbol *sym) {
+    SymbolIndex *idx = &E.symbols;
+    if (idx->nshifts > SYM_MAX_SHIFTS) symRenumber();
+    for (int i = sym->epoch; i < idx->nshifts; i++)
+        if (sym->row >= idx->shifts[i].from) sym->row += idx->shifts[i].delta;
+    sym->epoch = idx->nshifts;
+    return sym->row;
+}
+
+void symRenumber() {
+    for (int y = 0; y < E.numrows; y++) {
+        for (Symbol *sym = E.rows[y].syms; sym; sym = sym->rownext) {
+            sym->row = y;
+            sym->epoch = 0;
+        }
+    }
+    E.symbols.nshifts = 0;
+}
+
+// Restituisce la definizione migliore per il nome (funzione > tipo > prototipo)
+Symbol *symIndexLookup(const char *name, int len) {
+    if (E.symbols.nbuckets == 0) return NULL;
+
+    unsigned int h = symHash(name, len);
+    Symbol *best = NULL;
+    for (Symbol *sym = E.symbols.buckets[h & (E.symbols.nbuckets - 1)]; sym;
+         sym = sym->next) {
+        if (sym->hash != h || strncmp(sym->name, name, len) != 0 ||
+            sym->name[len] != '\0')
+            continue;
+        if (!best || sym->kind < best->kind ||
+            (sym->kind == best->kind && symRow(sym) < symRow(best)))
+            best = sym;
+    }
+    return best;
+}
+
+const char *symKindName(int kind) {
+    switch (kind) {
+        case SYM_FUNCTION: return "function";
+        case SYM_STRUCT: return "struct";
+        case SYM_ENUM: return "enum";
+        case SYM_TYPEDEF: return "typedef";
+        case SYM_MACRO: return "macro";
+        case SYM_VARIABLE: return "variable";
+        case SYM_PROTOTYPE: return "prototype";
+        default: return "symbol";
+    }
+}
+
+/*** Outline ***/
+
+// Posizione di inserimento per (row, col) nella lista ordinata
+int outlineSearch(int row, int col) {
+    int lo = 0, hi = E.outline.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        Symbol *m = E.outline.items[mid];
+        int mrow = symRow(m);
+        if (mrow < row || (mrow == row && m->col < col))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void outlineInsert(Symbol *sym) {
+    if (E.outline.count == E.outline.cap) {
+        E.outline.cap = E.outline.cap ? E.outline.cap * 2 : 256;
+        E.outline.items = realloc(E.outline.items, sizeof(Symbol *) * E.outline.cap);
+        if (E.outline.items == NULL) die("realloc in outlineInsert");
+    }
+    int at = outlineSearch(symRow(sym), sym->col);
+    memmove(&E.outline.items[at + 1], &E.outline.items[at],
+            sizeof(Symbol *) * (E.outline.count - at));
+    E.outline.items[at] = sym;
+    E.outline.count++;
+    E.outline.dirty = 1;
+}
+
+void outlineRemove(Symbol *sym) {
+    int at = outlineSearch(symRow(sym), sym->col);
+    while (at < E.outline.count && E.outline.items[at] != sym) at++;
+    if (at == E.outline.count) return;
+    memmove(&E.outline.items[at], &E.outline.items[at + 1],
+            sizeof(Symbol *) * (E.outline.count - at - 1));
+    E.outline.count--;
+    E.outline.dirty = 1;
+}
+
+int outlineCompare(const void *a, const void *b) {
+    Symbol *x = *(Symbol *const *)a, *y = *(Symbol *const *)b;
+    int xrow = symRow(x), yrow = symRow(y);
+    if (xrow != yrow) return xrow < yrow ? -1 : 1;
+    return x->col < y->col ? -1 : x->col > y->col;
+}
+
+// Le righe [from, from + n) sono state riordinate: i loro simboli sono
+// contigui nella lista (le righe sono tutte nel range), basta riordinare
+// quel tratto
+void outlineSortRows(int from, int n) {
+    int lo = outlineSearch(from, 0);
+    int hi = outlineSearch(from + n, 0);
+    if (hi - lo < 2) return;
+    qsort(&E.outline.items[lo], hi - lo, sizeof(Symbol *), outlineCompare);
+    E.outline.dirty = 1;
+}
+
+// Tiene solo le dichiarazioni di primo livello (fuori da ogni blocco)
+void outlineRebuildView() {
+    if (!E.outline.dirty) return;
+
+    E.outline.view = realloc(E.outline.view, sizeof(int) * (E.outline.count + 1));
+    if (E.outline.view == NULL) die("realloc in outlineRebuildView");
+
+    E.outline.nview = 0;
+    for (int i = 0; i < E.outline.count; i++) {
+        if (editorRowDepth(symRow(E.outline.items[i])) == 0)
+            E.outline.view[E.outline.nview++] = i;
+    }
+    if (E.outline.sel >= E.outline.nview) E.outline.sel = E.outline.nview - 1;
+    if (E.outline.sel < 0) E.outline.sel = 0;
+    E.outline.dirty = 0;
+}
+
+// Voce dell'outline che contiene il cursore (l'ultima che inizia prima)
+int outlineCurrent() {
+    int lo = 0, hi = E.outline.nview;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (symRow(E.outline.items[E.outline.view[mid]]) <= E.cy)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+void editorDrawOutlineCell(struct abuf *ab, int y) {
+    int width = E.termcols - E.screencols - 1;  // Colonne del pannello
+    abAppend(ab, ESC "[K", 3);
+    abAppend(ab, "|", 1);
+    if (y == 0) {
+        char title[OUTLINE_WIDTH];
+        int len = snprintf(title, sizeof(title), " Outline (%d)", E.outline.nview);
+        if (len > width) len = width;
+        abAppend(ab, ESC "[1m", 4);
+        abAppend(ab, title, len);
+        abAppend(ab, ESC "[m", 3);
+        return;
+    }
+
+    int idx = E.outline.off + y - 1;
+    if (idx >= E.outline.nview) return;
+
+    Symbol *sym = E.outline.items[E.outline.view[idx]];
+    char cell[OUTLINE_WIDTH * 2];
+    int len = snprintf(cell, sizeof(cell), " %c %s",
+                       sym->kind == SYM_FUNCTION ? 'f' : symKindName(sym->kind)[0],
+                       sym->name);
+    if (len > width) len = width;
+
+    int selected = E.outline.focused && idx == E.outline.sel;
+    int current = idx == outlineCurrent();
+    if (selected) abAppend(ab, ESC "[7m", 4);
+    else if (current) abAppend(ab, ESC "[1m", 4);
+    abAppend(ab, cell, len);
+    if (selected || current) abAppend(ab, ESC "[m", 3);
+}
+
+// Scorre il pannello in modo che la voce selezionata sia visibile
+void outlineScroll() {
+    int rows = E.screenrows - 1;
+    if (E.outline.sel < E.outline.off) E.outline.off = E.outline.sel;
+    if (E.outline.sel >= E.outline.off + rows) E.outline.off = E.outline.sel - rows + 1;
+    if (E.outline.off < 0) E.outline.off = 0;
+}
+
+// F2: apre il pannello e gli da' il focus. Frecce per scegliere, Invio per
+// saltare alla dichiarazione, ESC per tornare al testo, F2 per chiuderlo.
+void editorOutlineNavigate() {
+    E.outline.visible = 1;
+    E.outline.focused = 1;
+    editorUpdateLayout();
+    outlineRebuildView();
+    E.outline.sel = outlineCurrent();
+    if (E.outline.sel < 0) E.outline.sel = 0;
+
+    while (1) {
+        outlineRebuildView();
+        outlineScroll();
+        editorSetStatusMessage("Outline: Arrows=Select | Enter=Go | ESC=Back | F2=Close");
+        editorRefreshScreen();
+
+        int c = editorReadKey();
+        switch (c) {
+            case ARROW_UP:
+                if (E.outline.sel > 0) E.outline.sel--;
+                break;
+            case ARROW_DOWN:
+                if (E.outline.sel < E.outline.nview - 1) E.outline.sel++;
+                break;
+            case PAGE_UP:
+                E.outline.sel -= E.screenrows - 1;
+                if (E.outline.sel < 0) E.outline.sel = 0;
+                break;
+            case PAGE_DOWN:
+                E.outline.sel += E.screenrows - 1;
+                if (E.outline.sel >= E.outline.nview) E.outline.sel = E.outline.nview - 1;
+                if (E.outline.sel < 0) E.outline.sel = 0;
+                break;
+            case HOME_KEY:
+                E.outline.sel = 0;
+                break;
+            case END_KEY:
+                E.outline.sel = E.outline.nview > 0 ? E.outline.nview - 1 : 0;
+                break;
+            case '\r':
+                if (E.outline.sel < E.outline.nview) {
+                    Symbol *sym = E.outline.items[E.outline.view[E.outline.sel]];
+                    E.cy = symRow(sym);
+                    E.cx = sym->col;
+                }
+                E.outline.focused = 0;
+                editorSetStatusMessage("");
+                return;
+            case '\x1b':
+                E.outline.focused = 0;
+                editorSetStatusMessage("");
+                return;
+            case F2_KEY:
+                E.outline.focused = 0;
+                E.outline.visible = 0;
+                editorUpdateLayout();
+                editorSetStatusMessage("");
+                return;
+        }
+    }
+}
+
+/*** Folding ***/
+
+// Indice del fold con start <= row piu' a destra, -1 se nessuno
+int foldFind(int row) {
+    int lo = 0, hi = E.folds.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (E.folds.items[mid].start <= row)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+// Ricalcola le righe nascoste cumulative a partire dal fold 'from'
+void foldUpdatePrefix(int from) {
+    for (int i = from; i < E.folds.count; i++) {
+        Fold *prev = i > 0 ? &E.folds.items[i - 1] : NULL;
+        E.folds.items[i].hidden_before =
+            prev ? prev->hidden_before + (prev->end - prev->start) : 0;
+    }
+}
+
+int editorRowIsHidden(int row) {
+    int f = foldFind(row);
+    return f >= 0 && row > E.folds.items[f].start && row <= E.folds.items[f].end;
+}
+
+// Riga del file -> riga visuale (una riga nascosta va sulla sua intestazione)
+int foldRowToVisual(int row) {
+    int f = foldFind(row - 1);
+    if (f < 0) return row;
+    Fold *fd = &E.folds.items[f];
+    int hidden = fd->hidden_before + (row > fd->end ? fd->end - fd->start : row - fd->start);
+    return row - hidden;
+}
+
+// Riga visuale -> riga del file, in O(log n) sul numero di fold
+int foldVisualToRow(int v) {
+    int lo = 0, hi = E.folds.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        Fold *fd = &E.folds.items[mid];
+        if (fd->start - fd->hidden_before <= v)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0) return v;
+    Fold *fd = &E.folds.items[lo - 1];
+    int vstart = fd->start - fd->hidden_before;
+    return v == vstart ? fd->start : fd->end + (v - vstart);
+}
+
+// Con l'a capo attivo le righe visuali vengono dal Fenwick tree delle
+// altezze (che gia' tiene conto dei fold), altrimenti dall'indice dei fold
+int editorRowToVisual(int row) {
+    return E.softwrap ? wrapRowToVisual(row) : foldRowToVisual(row);
+}
+
+int editorVisualToRow(int v) {
+    return E.softwrap ? wrapVisualToRow(v, NULL) : foldVisualToRow(v);
+}
+
+// Riga visibile successiva: salta le righe nascoste da un fold
+int editorNextVisibleRow(int row) {
+    int f = foldFind(row);
+    if (f >= 0 && E.folds.items[f].start == row) return E.folds.items[f].end + 1;
+    return row + 1;
+}
+
+int editorPrevVisibleRow(int row) {
+    if (row <= 0) return 0;
+    return editorVisualToRow(editorRowToVisual(row) - 1);
+}
+
+void editorAddFold(int start, int end) {
+    // Un nuovo fold assorbe quelli che contiene
+    int i = 0;
+    while (i < E.folds.count && E.folds.items[i].end < start) i++;
+    int j = i;
+    while (j < E.folds.count && E.folds.items[j].start <= end) {
+        if (E.folds.items[j].end > end) end = E.folds.items[j].end;
+        if (E.folds.items[j].start < start) start = E.folds.items[j].start;
+        j++;
+    }
+
+    if (i == j && E.folds.count == E.folds.cap) {
+        E.folds.cap = E.folds.cap ? E.folds.cap * 2 : 16;
+        E.folds.items = realloc(E.folds.items, sizeof(Fold) * E.folds.cap);
+        if (E.folds.items == NULL) die("realloc in editorAddFold");
+    }
+    memmove(&E.folds.items[i + 1], &E.folds.items[j],
+            sizeof(Fold) * (E.folds.count - j));
+    E.folds.count -= j - i - 1;
+    E.folds.items[i].start = start;
+    E.folds.items[i].end = end;
+    foldUpdatePrefix(i);
+    wrapInvalidate();
+}
+
+void editorRemoveFold(int f) {
+    memmove(&E.folds.items[f], &E.folds.items[f + 1],
+            sizeof(Fold) * (E.folds.count - f - 1));
+    E.folds.count--;
+    foldUpdatePrefix(f);
+    wrapInvalidate();
+}
+
+void editorClearFolds() {
+    E.folds.count = 0;
+    wrapInvalidate();
+}
+
+// Apre il fold che nasconde la riga (ricerca, salti, modifiche)
+void editorRevealRow(int row) {
+    int f = foldFind(row);
+    while (f >= 0 && row > E.folds.items[f].start && row <= E.folds.items[f].end) {
+        editorRemoveFold(f);
+        f = foldFind(row);
+    }
+}
+
+// Aggiorna i fold dopo l'inserimento di n righe in 'at'
+void editorFoldsInsertRows(int at, int n) {
+    if (E.folds.count == 0) return;
+    for (int i = 0; i < E.folds.count; i++) {
+        Fold *fd = &E.folds.items[i];
+        if (fd->start >= at) {
+            fd->start += n;
+            fd->end += n;
+        } else if (at <= fd->end) {
+            fd->end += n;  // Righe inserite dentro la regione nascosta
+        }
+    }
+    foldUpdatePrefix(0);
+}
+
+// Aggiorna i fold dopo la cancellazione delle righe [at, at + n)
+void editorFoldsDeleteRows(int at, int n) {
+    if (E.folds.count == 0) return;
+    int j = 0;
+    for (int i = 0; i < E.folds.count; i++) {
+        Fold fd = E.folds.items[i];
+        if (fd.start >= at && fd.start < at + n) {
+            wrapInvalidate();  // Intestazione cancellata: le sue righe tornano visibili
+            continue;
+        }
+        if (fd.start >= at + n) fd.start -= n;
+        if (fd.end >= at + n) fd.end -= n;
+        else if (fd.end >= at) fd.end = at - 1;
+        if (fd.end <= fd.start) continue;
+        E.folds.items[j++] = fd;
+    }
+    E.folds.count = j;
+    foldUpdatePrefix(0);
+}
+
+// Apre i fold che toccano le righe [at, at + n), per esempio perche'
+// sono state riordinate
+void editorFoldsClearRows(int at, int n) {
+    if (E.folds.count == 0) return;
+    int j = 0;
+    for (int i = 0; i < E.folds.count; i++) {
+        Fold fd = E.folds.items[i];
+        if (fd.end >= at && fd.start < at + n) {
+            wrapInvalidate();
+            continue;
+        }
+        E.folds.items[j++] = fd;
+    }
+    E.folds.count = j;
+    foldUpdatePrefix(0);
+}
+
+// Fine del blocco aperto dall'ultima '{' non chiusa della riga 'start':
+// la prima riga in cui la profondita' scende sotto quella del blocco.
+int editorFindBlockEnd(int start) {
+    int inner = editorRowDepth(start) + E.rows[start].brace_delta;
+    for (int y = start + 1; y < E.numrows; y++) {
+        if (editorRowDepth(y) + E.rows[y].brace_min < inner) return y;
+    }
+    return -1;
+}
+
+// Regione di commento che inizia sulla riga: /* ... */ o righe // consecutive
+int editorFindCommentEnd(int start) {
+    EditorRow *row = &E.rows[start];
+    int i = 0;
+    while (i < row->size && isspace((unsigned char)row->chars[i])) i++;
+    if (i + 1 >= row->size || row->chars[i] != '/') return -1;
+
+    if (row->chars[i + 1] == '*') {
+        for (int y = start; y < E.numrows; y++) {
+            const char *from = y == start ? &E.rows[y].chars[i + 2] : E.rows[y].chars;
+            if (strstr(from, "*/")) return y > start ? y : -1;
+        }
+        return -1;
+    }
+    if (row->chars[i + 1] == '/') {
+        int y = start + 1;
+        for (; y < E.numrows; y++) {
+            EditorRow *r = &E.rows[y];
+            int k = 0;
+            while (k < r->size && isspace((unsigned char)r->chars[k])) k++;
+            if (k + 1 >= r->size || r->chars[k] != '/' || r->chars[k + 1] != '/') break;
+        }
+        return y - 1 > start ? y - 1 : -1;
+    }
+    return -1;
+}
+
+// Ctrl-K: chiude il blocco di graffe o di commenti sotto il cursore, oppure
+// riapre il fold se il cursore e' sulla sua intestazione.
+void editorToggleFold() {
+    if (E.cy >= E.numrows) return;
+
+    int f = foldFind(E.cy);
+    if (f >= 0 && E.folds.items[f].start == E.cy) {
+        editorRemoveFold(f);
+        return;
+    }
+
+    int start = E.cy;
+    int end = editorFindCommentEnd(start);
+    if (end < 0) {
+        // Se la riga non apre un blocco, usa il blocco che la contiene
+        if (E.rows[start].brace_delta <= 0) {
+            int depth = editorRowDepth(start);
+            if (depth <= 0) {
+                editorSetStatusMessage("Nothing to fold here");
+                return;
+            }
+            do {
+                start--;
+            } while (start > 0 && editorRowDepth(start) + E.rows[start].brace_min >= depth);
+        }
+        end = editorFindBlockEnd(start);
+        if (end < 0) {
+            editorSetStatusMessage("Unbalanced braces, can't fold");
+            return;
+        }
+        // "} else {" resta visibile: si nasconde solo il corpo
+        if (E.rows[end].brace_delta > E.rows[end].brace_min) end--;
+    }
+
+    if (end <= start) {
+        editorSetStatusMessage("Nothing to fold here");
+        return;
+    }
+    editorAddFold(start, end);
+    E.cy = start;
+    if (E.cx > E.rows[start].size) E.cx = E.rows[start].size;
+}
+
+/*** Soft Wrap ***/
+
+// Calcola i punti di a capo della riga per la larghezza data, preferendo
+// spezzare dopo uno spazio. wraps[k] e' la colonna renderizzata in cui
+// inizia il segmento k + 1.
+void editorComputeWraps(EditorRow *row, int width) {
+    row->nwraps = 0;
+    int col = 0, segstart = 0, brk = -1;
+
+    for (int j = 0; j < row->size; j++) {
+        int w = row->chars[j] == '\t' ? TAB_SIZE - (col % TAB_SIZE) : 1;
+        while (col + w - segstart > width && col > segstart) {
+            int at = brk > segstart ? brk : col;
+            if (row->nwraps == row->capwraps) {
+                row->capwraps = row->capwraps ? row->capwraps * 2 : 4;
+                row->wraps = realloc(row->wraps, sizeof(int) * row->capwraps);
+                if (row->wraps == NULL) die("realloc in editorComputeWraps");
+            }
+            row->wraps[row->nwraps++] = at;
+            segstart = at;
+            brk = -1;
+        }
+        if (row->chars[j] == ' ') brk = col + 1;
+        col += w;
+    }
+    row->wrap_width = width;
+}
+
+// Punti di a capo della riga, ricalcolati solo se la riga e' stata
+// modificata o se la larghezza dello schermo e' cambiata
+void editorRowWraps(EditorRow *row) {
+    if (row->wrap_width != E.screencols) editorComputeWraps(row, E.screencols);
+}
+
+// Righe visuali occupate dalla riga (0 se nascosta da un fold)
+int editorRowHeight(int at) {
+    if (E.folds.count && editorRowIsHidden(at)) return 0;
+    editorRowWraps(&E.rows[at]);
+    return E.rows[at].nwraps + 1;
+}
+
+// Ricostruisce il Fenwick tree delle altezze. Dopo fold o
+// ridimensionamenti si ricalcolano tutte le altezze in O(n); dopo
+// inserimenti o cancellazioni di righe le altezze in cache si sono
+// spostate con le righe e si rifanno solo i nodi da 'stale' in poi.
+void wrapEnsureIndex() {
+    if (E.wrapidx.valid && E.wrapidx.stale >= E.numrows && E.wrapidx.n == E.numrows) return;
+
+    E.wrapidx.tree = realloc(E.wrapidx.tree, sizeof(int) * (E.numrows + 1));
+    if (E.wrapidx.tree == NULL) die("realloc in wrapEnsureIndex");
+    int *t = E.wrapidx.tree;
+    int n = E.numrows;
+    int from = E.wrapidx.valid ? E.wrapidx.stale : 0;
+    if (from > n) from = n;
+
+    // I nodi della scomposizione del prefisso valido sono anche i figli,
+    // gia' completi, dei nodi da ricostruire
+    int total = 0;
+    for (int i = from; i > 0; i -= i & -i) total += t[i];
+    for (int i = from + 1; i <= n; i++) {
+        EditorRow *row = &E.rows[i - 1];
+        if (!E.wrapidx.valid || row->vheight < 0) row->vheight = editorRowHeight(i - 1);
+        t[i] = row->vheight;
+        total += t[i];
+    }
+    for (int i = from; i > 0; i -= i & -i)
+        if (i + (i & -i) <= n) t[i + (i & -i)] += t[i];
+    for (int i = from + 1; i <= n; i++)
+        if (i + (i & -i) <= n) t[i + (i & -i)] += t[i];
+
+    E.wrapidx.n = n;
+    E.wrapidx.total = total;
+    E.wrapidx.valid = 1;
+    E.wrapidx.stale = n;
+}
+
+void wrapInvalidate() {
+    E.wrapidx.valid = 0;
+}
+
+// Righe inserite, cancellate o riordinate da 'at' in poi: i nodi che
+// coprono le righe precedenti restano buoni
+void wrapRowsMoved(int at) {
+    if (at < E.wrapidx.stale) E.wrapidx.stale = at;
+}
+
+// Una riga modificata cambia solo la propria altezza: aggiornamento O(log n)
+void editorWrapRowChanged(int at) {
+    if (!E.softwrap || !E.wrapidx.valid) return;
+    if (at >= E.wrapidx.stale || at >= E.wrapidx.n) {
+        // Il suo nodo verra' comunque ricostruito
+        E.rows[at].vheight = -1;
+        return;
+    }
+
+    int h = editorRowHeight(at);
+    int delta = h - E.rows[at].vheight;
+    if (delta == 0) return;
+    E.rows[at].vheight = h;
+    E.wrapidx.total += delta;
+    for (int i = at + 1; i <= E.wrapidx.n; i += i & -i) E.wrapidx.tree[i] += delta;
+}
+
+// Numero di righe visuali prima della riga 'row'
+int wrapRowToVisual(int row) {
+    wrapEnsureIndex();
+    if (row >= E.wrapidx.n) return E.wrapidx.total + (row - E.wrapidx.n);
+    int v = 0;
+    for (int i = row; i > 0; i -= i & -i) v += E.wrapidx.tree[i];
+    return v;
+}
+
+// Riga e segmento che occupano la riga visuale v (discesa nel Fenwick tree)
+int wrapVisualToRow(int v, int *seg) {
+    wrapEnsureIndex();
+    if (v >= E.wrapidx.total) {
+        if (seg) *seg = 0;
+        return E.wrapidx.n + (v - E.wrapidx.total);
+    }
+
+    int pos = 0, step = 1;
+    while (step * 2 <= E.wrapidx.n) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= E.wrapidx.n && E.wrapidx.tree[pos + step] <= v) {
+            pos += step;
+            v -= E.wrapidx.tree[pos];
+        }
+    }
+    if (seg) *seg = v;
+    return pos;
+}
+
+// Segmento della riga che contiene la colonna renderizzata rx
+int editorRowSegment(EditorRow *row, int rx) {
+    editorRowWraps(row);
+    int lo = 0, hi = row->nwraps;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (row->wraps[mid] <= rx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int editorSegmentStart(EditorRow *row, int seg) {
+    return seg > 0 ? row->wraps[seg - 1] : 0;
+}
+
+// F4: attiva/disattiva l'a capo automatico
+void editorToggleSoftWrap() {
+    E.softwrap = !E.softwrap;
+    E.coloff = 0;
+    E.segoff = 0;
+    wrapInvalidate();
+    editorSetStatusMessage("Soft wrap %s", E.softwrap ? "on" : "off");
+}
+
+// Frecce su/giu' con l'a capo attivo: si muove per righe visuali
+// mantenendo la colonna sullo schermo
+void editorMoveVisual(int delta) {
+    if (E.cy >= E.numrows) {
+        if (delta < 0 && E.numrows > 0) E.cy = E.numrows - 1;
+        return;
+    }
+
+    EditorRow *row = &E.rows[E.cy];
+    int rx = editorRowCxToRx(row, E.cx);
+    int seg = editorRowSegment(row, rx);
+    int screenx = rx - editorSegmentStart(row, seg);
+
+    int v = wrapRowToVisual(E.cy) + seg + delta;
+    if (v < 0 || v >= E.wrapidx.total) return;
+
+    int nseg;
+    int y = wrapVisualToRow(v, &nseg);
+    row = &E.rows[y];
+    editorRowWraps(row);
+    int start = editorSegmentStart(row, nseg);
+    int end = nseg < row->nwraps ? row->wraps[nseg] - 1 : row->rsize;
+    rx = start + screenx;
+    if (rx > end) rx = end;
+
+    E.cy = y;
+    E.cx = editorRowRxToCx(row, rx);
+}
+
+/*** Project Tags ***/
+
+#define TAGS_MAGIC 0x47544554u  // "TETG"
+#define TAGS_VERSION 1
+#define TAGS_NONE 0xFFFFFFFFu
+#define TAGS_MAX_WORKERS 16
+
+// Un file da indicizzare (o da riprendere dal vecchio database)
+typedef struct {
+    char path[MAX_PATH];   // Relativo a SAVE_DIRECTORY
+    FILETIME mtime;
+    unsigned int size;
+    unsigned int hash;
+    int old;               // Indice nel vecchio database, -1 se assente
+    int reuse;             // 1 se i simboli vengono copiati dal vecchio database
+    TagSymEntry *syms;     // name = offset in names
+    int nsyms, capsyms;
+    char *names;
+    int nameslen, namescap;
+} TagFileJob;
+
+typedef struct {
+    TagFileJob *jobs;
+    int njobs;
+    volatile LONG next;    // Prossimo job da assegnare ad un worker
+} TagWorkQueue;
+
+int tagsIsSource(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot && (strcmp(dot, ".c") == 0 || strcmp(dot, ".h") == 0);
+}
+
+void tagsCollectFiles(const char *reldir, TagFileJob **jobs, int *njobs, int *cap) {
+    char pattern[MAX_PATH];
+    if (reldir[0])
+        snprintf(pattern, sizeof(pattern), "%s\\%s\\*", SAVE_DIRECTORY, reldir);
+    else
+        snprintf(pattern, sizeof(pattern), "%s\\*", SAVE_DIRECTORY);
+
+    WIN32_FIND_DATA fd;
+    HANDLE h = FindFirstFile(pattern, &fd);
+    if (h == INVALID_HANDLE_VALUE) return;
+
+    do {
+        if (strcmp(fd.cFileName, ".") == 0 || strcmp(fd.cFileName, "..") == 0) continue;
+
+        char rel[MAX_PATH];
+        if (reldir[0])
+            snprintf(rel, sizeof(rel), "%s\\%s", reldir, fd.cFileName);
+        else
+            snprintf(rel, sizeof(rel), "%s", fd.cFileName);
+
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            tagsCollectFiles(rel, jobs, njobs, cap);
+        } else if (tagsIsSource(fd.cFileName)) {
+            if (*njobs == *cap) {
+                *cap = *cap ? *cap * 2 : 64;
+                *jobs = realloc(*jobs, sizeof(TagFileJob) * *cap);
+                if (*jobs == NULL) die("realloc in tagsCollectFiles");
+            }
+            TagFileJob *job = &(*jobs)[(*njobs)++];
+            memset(job, 0, sizeof(*job));
+            snprintf(job->path, sizeof(job->path), "%s", rel);
+            job->mtime = fd.ftLastWriteTime;
+            job->size = fd.nFileSizeLow;
+            job->old = -1;
+        }
+    } while (FindNextFile(h, &fd));
+
+    FindClose(h);
+}
+
+void tagsJobAddSymbol(void *ctx, const char *name, int len, int kind, int col) {
+    TagFileJob *job = ctx;
+
+    if (job->nsyms == job->capsyms) {
+        job->capsyms = job->capsyms ? job->capsyms * 2 : 32;
+        job->syms = realloc(job->syms, sizeof(TagSymEntry) * job->capsyms);
+        if (job->syms == NULL) die("realloc in tagsJobAddSymbol");
+    }
+    if (job->nameslen + len + 1 > job->namescap) {
+        while (job->nameslen + len + 1 > job->namescap)
+            job->namescap = job->namescap ? job->namescap * 2 : 256;
+        job->names = realloc(job->names, job->namescap);
+        if (job->names == NULL) die("realloc in tagsJobAddSymbol");
+    }
+
+    TagSymEntry *ts = &job->syms[job->nsyms++];
+    ts->name = job->nameslen;
+    ts->hash = symHash(name, len);
+    ts->kind = kind;
+    ts->col = col;
+    ts->line = 0;  // Impostata dal chiamante
+    memcpy(&job->names[job->nameslen], name, len);
+    job->nameslen += len;
+    job->names[job->nameslen++] = '\0';
+}
+
+// Legge un file e ne estrae i simboli; eseguita dai worker in parallelo
+void tagsScanFile(TagFileJob *job) {
+    char fullPath[MAX_PATH];
+    snprintf(fullPath, sizeof(fullPath), "%s\\%s", SAVE_DIRECTORY, job->path);
+
+    FILE *fp = fopen(fullPath, "rb");
+    if (!fp) return;
+    char *buf = malloc(job->size + 1);
+    if (!buf) {
+        fclose(fp);
+        return;
+    }
+    size_t len = fread(buf, 1, job->size, fp);
+    fclose(fp);
+
+    unsigned int hash = symHash(buf, len);
+    if (job->old >= 0 && job->hash == hash) {
+        // Cambiata solo la data di modifica: i vecchi simboli sono ancora validi
+        job->reuse = 1;
+        free(buf);
+        return;
+    }
+
+    size_t start = 0;
+    unsigned int line = 0;
+    while (start < len) {
+        size_t end = start;
+        while (end < len && buf[end] != '\n') end++;
+        size_t linelen = end - start;
+        if (linelen > 0 && buf[start + linelen - 1] == '\r') linelen--;
+
+        int first = job->nsyms;
+        cExtractSymbols(&buf[start], linelen, tagsJobAddSymbol, job);
+        for (int i = first; i < job->nsyms; i++) job->syms[i].line = line;
+
+        line++;
+        start = end + 1;
+    }
+
+    job->hash = hash;
+    free(buf);
+}
+
+DWORD WINAPI tagsWorker(LPVOID arg) {
+    TagWorkQueue *q = arg;
+    while (1) {
+        LONG i = InterlockedIncrement(&q->next) - 1;
+        if (i >= q->njobs) break;
+        if (!q->jobs[i].reuse) tagsScanFile(&q->jobs[i]);
+    }
+    return 0;
+}
+
+void tagsClose() {
+    if (E.tags.base) UnmapViewOfFile(E.tags.base);
+    if (E.tags.mapping) CloseHandle(E.tags.mapping);
+    if (E.tags.file && E.tags.file != INVALID_HANDLE_VALUE) CloseHandle(E.tags.file);
+    memset(&E.tags, 0, sizeof(E.tags));
+}
+
+// Mappa in memoria il database dei tag; restituisce 0 se non disponibile
+int tagsOpen() {
+    if (E.tags.base) return 1;
+
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s\\%s", SAVE_DIRECTORY, TAGS_FILENAME);
+
+    E.tags.file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (E.tags.file == INVALID_HANDLE_VALUE) {
+        E.tags.file = NULL;
+        return 0;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(E.tags.file, &size) || size.QuadPart < (LONGLONG)sizeof(TagHeader)) {
+        tagsClose();
+        return 0;
+    }
+
+    E.tags.mapping = CreateFileMapping(E.tags.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (E.tags.mapping) E.tags.base = MapViewOfFile(E.tags.mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!E.tags.base) {
+        tagsClose();
+        return 0;
+    }
+    E.tags.size = (size_t)size.QuadPart;
+
+    // Verifica che l'header e le tabelle siano coerenti con la dimensione.
+    // La string pool deve finire con '\0': ogni offset al suo interno e'
+    // allora una stringa terminata dentro la mappatura (vedi tagsString).
+    const TagHeader *h = (const TagHeader *)E.tags.base;
+    if (h->magic != TAGS_MAGIC || h->version != TAGS_VERSION ||
+        h->nbuckets == 0 || (h->nbuckets & (h->nbuckets - 1)) != 0 ||
+        h->files_off + (unsigned long long)h->nfiles * sizeof(TagFileEntry) > E.tags.size ||
+        h->syms_off + (unsigned long long)h->nsyms * sizeof(TagSymEntry) > E.tags.size ||
+        h->buckets_off + (unsigned long long)h->nbuckets * sizeof(unsigned int) > E.tags.size ||
+        h->strings_off + (unsigned long long)h->strings_len > E.tags.size ||
+        (h->strings_len > 0 && E.tags.base[h->strings_off + h->strings_len - 1] != '\0')) {
+        tagsClose();
+        return 0;
+    }
+    return 1;
+}
+
+#define TAGS_HEADER() ((const TagHeader *)E.tags.base)
+#define TAGS_FILES() ((const TagFileEntry *)(E.tags.base + TAGS_HEADER()->files_off))
+#define TAGS_SYMS() ((const TagSymEntry *)(E.tags.base + TAGS_HEADER()->syms_off))
+#define TAGS_BUCKETS() ((const unsigned int *)(E.tags.base + TAGS_HEADER()->buckets_off))
+#define TAGS_STRING(off) (E.tags.base + TAGS_HEADER()->strings_off + (off))
+
+// Stringa della pool, o NULL se l'offset (letto dal file) e' fuori
+const char *tagsString(unsigned int off) {
+    if (off >= TAGS_HEADER()->strings_len) return NULL;
+    return TAGS_STRING(off);
+}
+
+// Cerca un simbolo nel database mappato, senza caricare gli altri file.
+// Il file puo' essere corrotto: una catena lunga piu' dei simboli che
+// esistono ha un ciclo.
+const TagSymEntry *tagsLookup(const char *name, int len) {
+    if (!tagsOpen()) return NULL;
+
+    const TagHeader *h = TAGS_HEADER();
+    const TagSymEntry *syms = TAGS_SYMS();
+    unsigned int hash = symHash(name, len);
+    const TagSymEntry *best = NULL;
+
+    unsigned int i = TAGS_BUCKETS()[hash & (h->nbuckets - 1)];
+    for (unsigned int steps = 0; i != TAGS_NONE && i < h->nsyms && steps < h->nsyms; steps++) {
+        const TagSymEntry *ts = &syms[i];
+        const char *tsname = tagsString(ts->name);
+        if (tsname && ts->hash == hash && strncmp(tsname, name, len) == 0 && tsname[len] == '\0') {
+            if (!best || ts->kind < best->kind) best = ts;
+        }
+        i = ts->next;
+    }
+    return best;
+}
+
+const char *tagsFilePath(const TagSymEntry *ts) {
+    if (ts->file >= TAGS_HEADER()->nfiles) return NULL;
+    return tagsString(TAGS_FILES()[ts->file].path);
+}
+
+// Trova un file nel vecchio database (ricerca lineare sui soli path)
+int tagsFindOldFile(const char *path) {
+    const TagHeader *h = TAGS_HEADER();
+    const TagFileEntry *files = TAGS_FILES();
+    for (unsigned int f = 0; f < h->nfiles; f++) {
+        const char *fpath = tagsString(files[f].path);
+        if (fpath && strcmp(fpath, path) == 0) return f;
+    }
+    return -1;
+}
+
+int tagsWriteDatabase(TagFileJob *jobs, int njobs, const char *path) {
+    TagHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = TAGS_MAGIC;
+    h.version = TAGS_VERSION;
+    h.nfiles = njobs;
+
+    unsigned int strings_len = 0;
+    for (int f = 0; f < njobs; f++) {
+        h.nsyms += jobs[f].nsyms;
+        strings_len += strlen(jobs[f].path) + 1 + jobs[f].nameslen;
+    }
+    h.nbuckets = 16;
+    while (h.nbuckets < h.nsyms) h.nbuckets *= 2;
+
+    h.files_off = sizeof(TagHeader);
+    h.syms_off = h.files_off + h.nfiles * sizeof(TagFileEntry);
+    h.buckets_off = h.syms_off + h.nsyms * sizeof(TagSymEntry);
+    h.strings_off = h.buckets_off + h.nbuckets * sizeof(unsigned int);
+    h.strings_len = strings_len;
+
+    TagFileEntry *files = malloc(sizeof(TagFileEntry) * (h.nfiles + 1));
+    TagSymEntry *syms = malloc(sizeof(TagSymEntry) * (h.nsyms + 1));
+    unsigned int *buckets = malloc(sizeof(unsigned int) * h.nbuckets);
+    char *strings = malloc(strings_len + 1);
+    if (!files || !syms || !buckets || !strings) die("malloc in tagsWriteDatabase");
+
+    for (unsigned int b = 0; b < h.nbuckets; b++) buckets[b] = TAGS_NONE;
+
+    unsigned int spos = 0, s = 0;
+    for (int f = 0; f < njobs; f++) {
+        TagFileJob *job = &jobs[f];
+        size_t plen = strlen(job->path) + 1;
+        files[f].path = spos;
+        memcpy(&strings[spos], job->path, plen);
+        spos += plen;
+        files[f].mtime_lo = job->mtime.dwLowDateTime;
+        files[f].mtime_hi = job->mtime.dwHighDateTime;
+        files[f].size = job->size;
+        files[f].hash = job->hash;
+        files[f].first_sym = s;
+        files[f].nsyms = job->nsyms;
+
+        unsigned int names = spos;
+        if (job->nameslen) memcpy(&strings[spos], job->names, job->nameslen);
+        spos += job->nameslen;
+
+        for (int i = 0; i < job->nsyms; i++, s++) {
+            syms[s] = job->syms[i];
+            syms[s].name += names;
+            syms[s].file = f;
+            unsigned int b = syms[s].hash & (h.nbuckets - 1);
+            syms[s].next = buckets[b];
+            buckets[b] = s;
+        }
+    }
+
+    FILE *fp = fopen(path, "wb");
+    int ok = fp != NULL;
+    if (fp) {
+        ok = fwrite(&h, sizeof(h), 1, fp) == 1 &&
+             fwrite(files, sizeof(TagFileEntry), h.nfiles, fp) == h.nfiles &&
+             fwrite(syms, sizeof(TagSymEntry), h.nsyms, fp) == h.nsyms &&
+             fwrite(buckets, sizeof(unsigned int), h.nbuckets, fp) == h.nbuckets &&
+             fwrite(strings, 1, strings_len, fp) == strings_len;
+        if (fclose(fp) != 0) ok = 0;
+    }
+
+    free(files);
+    free(syms);
+    free(buckets);
+    free(strings);
+    return ok;
+}
+
+// Distribuisce i job su un pool di worker (uno per CPU)
+void tagsRunWorkers(TagFileJob *jobs, int njobs) {
+    TagWorkQueue q = {jobs, njobs, 0};
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int nworkers = si.dwNumberOfProcessors;
+    if (nworkers > njobs) nworkers = njobs;
+    if (nworkers > TAGS_MAX_WORKERS) nworkers = TAGS_MAX_WORKERS;
+
+    HANDLE threads[TAGS_MAX_WORKERS];
+    int nthreads = 0;
+    for (int t = 0; t < nworkers; t++) {
+        threads[nthreads] = CreateThread(NULL, 0, tagsWorker, &q, 0, NULL);
+        if (threads[nthreads]) nthreads++;
+    }
+
+    if (nthreads > 0) {
+        WaitForMultipleObjects(nthreads, threads, TRUE, INFINITE);
+        for (int t = 0; t < nthreads; t++) CloseHandle(threads[t]);
+    } else {
+        tagsWorker(&q);  // Nessun thread disponibile: indicizza qui
+    }
+}
+
+// Costruisce o aggiorna il database dei tag di SAVE_DIRECTORY (Ctrl-T).
+// Solo i file modificati dall'ultima esecuzione vengono riletti.
+void editorBuildTags() {
+    clock_t start = clock();
+    editorSetStatusMessage("Indexing %s...", SAVE_DIRECTORY);
+    editorRefreshScreen();
+
+    TagFileJob *jobs = NULL;
+    int njobs = 0, cap = 0;
+    tagsCollectFiles("", &jobs, &njobs, &cap);
+
+    // Confronta con il database precedente: data e dimensione invariate
+    // significano file invariato; altrimenti decide l'hash del contenuto.
+    int have_old = tagsOpen();
+    if (have_old) {
+        const TagFileEntry *files = TAGS_FILES();
+        unsigned int old_nsyms = TAGS_HEADER()->nsyms;
+        for (int f = 0; f < njobs; f++) {
+            TagFileJob *job = &jobs[f];
+            job->old = tagsFindOldFile(job->path);
+            if (job->old < 0) continue;
+
+            const TagFileEntry *of = &files[job->old];
+            // Con simboli fuori dalla tabella o nomi non validi il file si rilegge
+            int valid = of->first_sym <= old_nsyms && of->nsyms <= old_nsyms - of->first_sym;
+            for (unsigned int i = 0; valid && i < of->nsyms; i++)
+                valid = tagsString(TAGS_SYMS()[of->first_sym + i].name) != NULL;
+            if (!valid) {
+                job->old = -1;
+                continue;
+            }
+            job->hash = of->hash;
+            job->reuse = of->size == job->size &&
+                         of->mtime_lo == job->mtime.dwLowDateTime &&
+                         of->mtime_hi == job->mtime.dwHighDateTime;
+        }
+    }
+
+    tagsRunWorkers(jobs, njobs);
+
+    int rescanned = 0, nsyms = 0;
+    for (int f = 0; f < njobs; f++) {
+        TagFileJob *job = &jobs[f];
+        if (job->reuse) {
+            const TagFileEntry *of = &TAGS_FILES()[job->old];
+            for (unsigned int i = 0; i < of->nsyms; i++) {
+                const TagSymEntry *ts = &TAGS_SYMS()[of->first_sym + i];
+                const char *name = tagsString(ts->name);
+                tagsJobAddSymbol(job, name, strlen(name), ts->kind, ts->col);
+                job->syms[job->nsyms - 1].line = ts->line;
+            }
+        } else {
+            rescanned++;
+        }
+        nsyms += job->nsyms;
+    }
+
+    // Il file mappato va chiuso prima di poterlo sostituire
+    if (have_old) tagsClose();
+
+    ensureDirectoryExists(SAVE_DIRECTORY);
+    char path[MAX_PATH], tmppath[MAX_PATH];
+    snprintf(path, sizeof(path), "%s\\%s", SAVE_DIRECTORY, TAGS_FILENAME);
+    snprintf(tmppath, sizeof(tmppath), "%s.tmp", path);
+
+    if (tagsWriteDatabase(jobs, njobs, tmppath) &&
+        MoveFileEx(tmppath, path, MOVEFILE_REPLACE_EXISTING)) {
+        editorSetStatusMessage("Tags: %d files (%d reindexed), %d symbols in %.2fs",
+                               njobs, rescanned, nsyms,
+                               (double)(clock() - start) / CLOCKS_PER_SEC);
+    } else {
+        DeleteFile(tmppath);
+        editorSetStatusMessage("Can't write tags database: %s", strerror(errno));
+    }
+
+    for (int f = 0; f < njobs; f++) {
+        free(jobs[f].syms);
+        free(jobs[f].names);
+    }
+    free(jobs);
+}
+
+
+/*** Build and run ***/
+
+// Avvia un processo senza console con stdout e stderr su una pipe e
+// stdin da NUL. Se 'in' non e' NULL lo stdin e' una seconda pipe e
+// stderr va su NUL, cosi' stdout resta un canale pulito (language
+// server); se anche 'err' non e' NULL stderr ha una pipe tutta sua.
+// Se 'job' non e' NULL il processo parte dentro un job object: terminare
+// il job ferma anche i processi che ha avviato (cmd.exe /c ...), e
+// chiuderlo li termina. Restituisce 0 se il processo non parte.
+int spawnProcess(char *cmdline, const char *dir, HANDLE *process, HANDLE *in, HANDLE *out, HANDLE *err,
+                 HANDLE *job) {
+    // Solo gli estremi del processo figlio vengono ereditati
+    SECURITY_ATTRIBUTES sa = {sizeof(sa), NULL, TRUE};
+    HANDLE rd, wr, child_in = INVALID_HANDLE_VALUE, parent_in = INVALID_HANDLE_VALUE;
+    if (!CreatePipe(&rd, &wr, &sa, 0)) return 0;
+    SetHandleInformation(rd, HANDLE_FLAG_INHERIT, 0);
+    if (in && !CreatePipe(&child_in, &parent_in, &sa, 0)) {
+        CloseHandle(rd);
+        CloseHandle(wr);
+        return 0;
+    }
+    if (in) SetHandleInformation(parent_in, HANDLE_FLAG_INHERIT, 0);
+    HANDLE err_rd = INVALID_HANDLE_VALUE, err_wr = INVALID_HANDLE_VALUE;
+    if (err && !CreatePipe(&err_rd, &err_wr, &sa, 0)) {
+        CloseHandle(rd);
+        CloseHandle(wr);
+        if (in) {
+            CloseHandle(child_in);
+            CloseHandle(parent_in);
+        }
+        return 0;
+    }
+    if (err) SetHandleInformation(err_rd, HANDLE_FLAG_INHERIT, 0);
+    HANDLE nul = CreateFile("NUL", GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            &sa, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+
+    STARTUPINFO si;
+    PROCESS_INFORMATION pi;
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = in ? child_in : nul;
+    si.hStdOutput = wr;
+    si.hStdError = err ? err_wr : in ? nul : wr;
+
+    ensureDirectoryExists(SAVE_DIRECTORY);
+    // Sospeso finche' non e' nel job, prima che possa avviare altri processi
+    DWORD flags = CREATE_NO_WINDOW | (job ? CREATE_SUSPENDED : 0);
+    BOOL ok = CreateProcess(NULL, cmdline, NULL, NULL, TRUE, flags, NULL, dir, &si, &pi);
+    CloseHandle(wr);  // Altrimenti la pipe non si chiude mai
+    if (in) CloseHandle(child_in);
+    if (err) CloseHandle(err_wr);
+    if (nul != INVALID_HANDLE_VALUE) CloseHandle(nul);
+    if (!ok) {
+        CloseHandle(rd);
+        if (in) CloseHandle(parent_in);
+        if (err) CloseHandle(err_rd);
+        return 0;
+    }
+    if (job) {
+        JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+        memset(&limits, 0, sizeof(limits));
+        limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+        *job = CreateJobObject(NULL, NULL);
+        if (*job != NULL &&
+            (!SetInformationJobObject(*job, JobObjectExtendedLimitInformation, &limits, sizeof(limits)) ||
+             !AssignProcessToJobObject(*job, pi.hProcess))) {
+            // Per esempio l'editor e' gia' in un job che non ne ammette
+            // altri (prima di Windows 8): si ferma solo il processo
+            CloseHandle(*job);
+            *job = NULL;
+        }
+        ResumeThread(pi.hThread);
+    }
+    CloseHandle(pi.hThread);
+    *process = pi.hProcess;
+    if (in) *in = parent_in;
+    if (err) *err = err_rd;
+    *out = rd;
+    return 1;
+}
+
+// Thread che legge la pipe con letture bloccanti e sveglia il ciclo
+// principale ad ogni pezzo arrivato e alla chiusura
+DWORD WINAPI pipeReaderThread(LPVOID arg) {
+    PipeReader *r = arg;
+    char chunk[4096];
+    // Una named pipe aperta in modo overlapped permette di scrivere mentre
+    // questo thread e' fermo in lettura; la lettura si aspetta qui
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    if (r->overlapped) ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    while (1) {
+        DWORD got = 0;
+        int ok;
+        if (r->overlapped)
+            ok = (ReadFile(r->pipe, chunk, sizeof(chunk), &got, &ov) || GetLastError() == ERROR_IO_PENDING) &&
+                 GetOverlappedResult(r->pipe, &ov, &got, TRUE) && got > 0;
+        else
+            ok = ReadFile(r->pipe, chunk, sizeof(chunk), &got, NULL) && got > 0;
+        EnterCriticalSection(&r->lock);
+        if (ok && r->len + (int)got > r->cap) {
+            int cap = r->cap ? r->cap * 2 : 8192;
+            while (cap < r->len + (int)got) cap *= 2;
+            char *grown = realloc(r->buf, cap);
+            if (grown == NULL) {
+                ok = 0;
+            } else {
+                r->buf = grown;
+                r->cap = cap;
+            }
+        }
+        if (ok) {
+            memcpy(r->buf + r->len, chunk, got);
+            r->len += got;
+        } else {
+            r->eof = 1;
+        }
+        LeaveCriticalSection(&r->lock);
+        SetEvent(E.events.wake);
+        if (!ok) {
+            if (ov.hEvent) CloseHandle(ov.hEvent);
+            return 0;
+        }
+    }
+}
+
+// Prende possesso della pipe e avvia il suo thread di lettura
+int pipeReaderStart(PipeReader *r, HANDLE pipe, int overlapped) {
+    memset(r, 0, sizeof(*r));
+    r->pipe = pipe;
+    r->overlapped = overlapped;
+    InitializeCriticalSection(&r->lock);
+    r->thread = CreateThread(NULL, 0, pipeReaderThread, r, 0, NULL);
+    if (r->thread == NULL) {
+        DeleteCriticalSection(&r->lock);
+        CloseHandle(pipe);
+        return 0;
+    }
+    return 1;
+}
+
+// Toglie fino a size byte gia' letti. Restituisce i byte presi, 0 se
+// non c'e' niente di nuovo, -1 se la pipe e' chiusa e vuota.
+int pipeReaderTake(PipeReader *r, char *buf, int size) {
+    EnterCriticalSection(&r->lock);
+    int n = r->len < size ? r->len : size;
+    memcpy(buf, r->buf, n);
+    memmove(r->buf, r->buf + n, r->len - n);
+    r->len -= n;
+    int eof = r->eof;
+    LeaveCriticalSection(&r->lock);
+    return n == 0 && eof ? -1 : n;
+}
+
+// Toglie tutto quello che e' gia' stato letto: il buffer del lettore,
+// terminato da '\0', passa al chiamante
+char *pipeReaderTakeAll(PipeReader *r, int *len) {
+    EnterCriticalSection(&r->lock);
+    char *data = realloc(r->buf, r->len + 1);
+    if (data == NULL) die("realloc in pipeReaderTakeAll");
+    *len = r->len;
+    r->buf = NULL;
+    r->len = r->cap = 0;
+    LeaveCriticalSection(&r->lock);
+    data[*len] = '\0';
+    return data;
+}
+
+// Il processo e' finito: da' al thread il tempo di consegnare quello che
+// e' rimasto nella pipe (non di piu', un nipote potrebbe tenerla aperta)
+void pipeReaderDrain(PipeReader *r) {
+    if (r->thread) WaitForSingleObject(r->thread, PIPE_DRAIN_MS);
+}
+
+// Ferma il thread (anche se qualche nipote del processo tiene aperta la
+// pipe) e libera tutto
+void pipeReaderStop(PipeReader *r) {
+    if (r->thread == NULL) return;
+    while (WaitForSingleObject(r->thread, 10) == WAIT_TIMEOUT) {
+        if (r->overlapped) CancelIoEx(r->pipe, NULL);
+        else CancelSynchronousIo(r->thread);
+    }
+    CloseHandle(r->thread);
+    CloseHandle(r->pipe);
+    DeleteCriticalSection(&r->lock);
+    free(r->buf);
+    memset(r, 0, sizeof(*r));
+}
+
+// Per quanto si puo' aspettare prima del prossimo timer: l'avvio del
+// controllo in sospeso e la scadenza del messaggio di stato (INFINITE se
+// non ce ne sono). Tutto il resto sveglia il ciclo con un evento.
+DWORD editorBackgroundWait() {
+    DWORD wait = INFINITE;
+    if (E.check.pending && !E.check.running) {
+        DWORD left = (int)(E.check.due - GetTickCount()) > 0 ? E.check.due - GetTickCount() : 0;
+        if (left < wait) wait = left;
+    }
+    if (E.statusmsg[0] && !E.events.msg_expired) {
+        time_t left = E.statusmsg_time + STATUS_MSG_SECONDS - time(NULL);
+        DWORD ms = left > 0 ? (DWORD)left * 1000 : 0;
+        if (ms < wait) wait = ms;
+    }
+    return wait;
+}
+
+// Fa avanzare i lavori in background. Restituisce 1 se lo schermo va
+// ridisegnato.
+int editorBackgroundPoll() {
+    int changed = 0;
+    if (E.job.running) changed |= jobPoll();
+    changed |= checkPoll();
+    changed |= lspPoll();
+    if (E.remote.server) changed |= remoteServerPoll();
+    if (E.remote.client) changed |= remoteClientPoll();
+    if (E.statusmsg[0] && !E.events.msg_expired &&
+        time(NULL) - E.statusmsg_time >= STATUS_MSG_SECONDS) {
+        E.events.msg_expired = 1;  // Il messaggio sparisce anche senza tasti
+        changed = 1;
+    }
+    return changed;
+}
+
+// Oggetti su cui il ciclo principale aspetta: la console per prima (per il
+// server le nuove connessioni), poi l'evento dei thread, il file
+// sorvegliato e i processi in corso (la loro uscita va notata anche se
+// qualche nipote tiene aperta la pipe)
+int editorEventHandles(HANDLE *handles) {
+    int n = 0;
+    handles[n++] = E.remote.server ? E.remote.accept : E.hStdin;
+    handles[n++] = E.events.wake;
+    if (E.events.watch) handles[n++] = E.events.watch;
+    if (E.job.running) handles[n++] = E.job.process;
+    if (E.check.running) handles[n++] = E.check.process;
+    if (E.lsp.running) handles[n++] = E.lsp.process;
+    return n;
+}
+
+void outputClear() {
+    for (int i = 0; i < E.output.nlines; i++) free(E.output.lines[i]);
+    for (int i = 0; i < E.output.ndiags; i++) free(E.output.diags[i].file);
+    E.output.nlines = 0;
+    E.output.partial = 0;
+    E.output.off = 0;
+    E.output.follow = 1;
+    E.output.ndiags = 0;
+    E.output.diag = -1;
+}
+
+// Aggiunge una riga (o continua l'ultima riga parziale). Restituisce 0
+// se il pannello e' pieno e la riga e' stata scartata.
+int outputAddLine(const char *s, int len) {
+    OutputPane *o = &E.output;
+    if (o->partial) {
+        int at = o->nlines - 1;
+        o->lines[at] = realloc(o->lines[at], o->lens[at] + len + 1);
+        if (o->lines[at] == NULL) die("realloc in outputAddLine");
+        memcpy(o->lines[at] + o->lens[at], s, len);
+        o->lens[at] += len;
+        o->lines[at][o->lens[at]] = '\0';
+        return 1;
+    }
+    if (o->nlines >= OUTPUT_MAX_LINES) return 0;
+    if (o->nlines == o->cap) {
+        o->cap = o->cap ? o->cap * 2 : 64;
+        o->lines = realloc(o->lines, sizeof(char *) * o->cap);
+        o->lens = realloc(o->lens, sizeof(int) * o->cap);
+        if (o->lines == NULL || o->lens == NULL) die("realloc in outputAddLine");
+    }
+    o->lines[o->nlines] = malloc(len + 1);
+    if (o->lines[o->nlines] == NULL) die("malloc in outputAddLine");
+    memcpy(o->lines[o->nlines], s, len);
+    o->lines[o->nlines][len] = '\0';
+    o->lens[o->nlines] = len;
+    o->nlines++;
+    return 1;
+}
+
+// Divide in righe l'uscita letta dalla pipe. Una riga finita viene
+// analizzata subito per riconoscere i messaggi del compilatore.
+void outputAppend(const char *s, int len) {
+    OutputPane *o = &E.output;
+    int start = 0;
+    for (int i = 0; i <= len; i++) {
+        if (i < len && s[i] != '\n') continue;
+        if (i == len) {
+            // Resto senza a capo: la riga continua con la prossima lettura
+            if (i > start && outputAddLine(s + start, i - start)) o->partial = 1;
+            break;
+        }
+        int stored = outputAddLine(s + start, i - start);
+        o->partial = 0;
+        start = i + 1;
+        if (!stored) continue;
+
+        int at = o->nlines - 1;
+        if (o->lens[at] > 0 && o->lines[at][o->lens[at] - 1] == '\r')
+            o->lines[at][--o->lens[at]] = '\0';
+        Diagnostic d;
+        if (outputParseDiagnostic(o->lines[at], o->lens[at], &d)) {
+            if (o->ndiags == o->capdiags) {
+                o->capdiags = o->capdiags ? o->capdiags * 2 : 16;
+                o->diags = realloc(o->diags, sizeof(Diagnostic) * o->capdiags);
+                if (o->diags == NULL) die("realloc in outputAppend");
+            }
+            d.line = at;
+            o->diags[o->ndiags++] = d;
+        }
+    }
+    if (o->follow && o->nlines > o->height) o->off = o->nlines - o->height;
+}
+
+// Riconosce "file:riga:col: error: ..." (gcc/clang) e
+// "file(riga): error ..." (MSVC). Il file viene allocato in d->file.
+int outputParseDiagnostic(const char *s, int len, Diagnostic *d) {
+    int i = 0, fend = -1, row = 0, col = 0;
+
+    // Salta la lettera di unita' in "C:\..."
+    if (len > 2 && isalpha((unsigned char)s[0]) && s[1] == ':') i = 2;
+    for (; i < len; i++) {
+        if (s[i] == ':' && i + 1 < len && isdigit((unsigned char)s[i + 1])) {
+            fend = i++;
+            while (i < len && isdigit((unsigned char)s[i])) row = row * 10 + (s[i++] - '0');
+            if (i < len && s[i] == ':' && i + 1 < len && isdigit((unsigned char)s[i + 1])) {
+                i++;
+                while (i < len && isdigit((unsigned char)s[i])) col = col * 10 + (s[i++] - '0');
+            }
+            if (i < len && s[i] == ':') break;
+            fend = -1;
+            row = col = 0;
+        } else if (s[i] == '(' && i + 1 < len && isdigit((unsigned char)s[i + 1])) {
+            fend = i++;
+            while (i < len && isdigit((unsigned char)s[i])) row = row * 10 + (s[i++] - '0');
+            if (i < len && s[i] == ',') {
+                i++;
+                while (i < len && isdigit((unsigned char)s[i])) col = col * 10 + (s[i++] - '0');
+            }
+            if (i + 1 < len && s[i] == ')' && s[i + 1] == ':') {
+                i++;
+                break;
+            }
+            fend = -1;
+            row = col = 0;
+        }
+    }
+    if (fend <= 0 || row <= 0) return 0;
+
+    const char *msg = s + i + 1;
+    int mlen = len - i - 1;
+    while (mlen > 0 && *msg == ' ') msg++, mlen--;
+    if (mlen >= 5 && strncmp(msg, "fatal", 5) == 0) d->severity = DIAG_ERROR;
+    else if (mlen >= 5 && strncmp(msg, "error", 5) == 0) d->severity = DIAG_ERROR;
+    else if (mlen >= 7 && strncmp(msg, "warning", 7) == 0) d->severity = DIAG_WARNING;
+    else if (mlen >= 4 && strncmp(msg, "note", 4) == 0) d->severity = DIAG_NOTE;
+    else return 0;
+
+    d->file = malloc(fend + 1);
+    if (d->file == NULL) die("malloc in outputParseDiagnostic");
+    memcpy(d->file, s, fend);
+    d->file[fend] = '\0';
+    d->row = row - 1;
+    d->col = col > 0 ? col - 1 : 0;
+    return 1;
+}
+
+// Sostituisce %f e %o nel modello del comando. 0 se non ci sta.
+int buildExpandCommand(char *out, int size, const char *tmpl, const char *file, const char *exe) {
+    int len = 0;
+    for (const char *p = tmpl; *p; p++) {
+        const char *ins = NULL;
+        if (p[0] == '%' && p[1] == 'f') ins = file;
+        else if (p[0] == '%' && p[1] == 'o') ins = exe;
+        if (ins) {
+            int n = strlen(ins);
+            if (len + n >= size) return 0;
+            memcpy(out + len, ins, n);
+            len += n;
+            p++;
+        } else {
+            if (len + 1 >= size) return 0;
+            out[len++] = *p;
+        }
+    }
+    out[len] = '\0';
+    return 1;
+}
+
+// F5: salva, compila ed esegue il file in SAVE_DIRECTORY. Il comando gira
+// in un processo separato; stdout e stderr arrivano nel pannello di
+// uscita attraverso una pipe letta senza bloccare (jobPoll). F5 mentre il
+// processo e' in corso lo interrompe.
+void editorBuildAndRun() {
+    if (E.job.running) {
+        jobStop("Stopped");
+        return;
+    }
+    editorSave();
+    if (editorIsDirty() || E.filename == NULL) return;
+
+    char exe[MAX_PATH];
+    snprintf(exe, sizeof(exe), "%s", E.filename);
+    char *dot = strrchr(exe, '.');
+    if (dot && !strchr(dot, '\\') && !strchr(dot, '/')) *dot = '\0';
+    if (strlen(exe) + 4 >= sizeof(exe)) return;
+    strcat(exe, ".exe");
+
+    const char *tmpl = getenv("TERMINEDITOR_BUILD");
+    if (tmpl == NULL || *tmpl == '\0') tmpl = BUILD_COMMAND;
+    char cmd[1024], line[1100];
+    if (!buildExpandCommand(cmd, sizeof(cmd), tmpl, E.filename, exe)) {
+        editorSetStatusMessage("Build command too long");
+        return;
+    }
+    snprintf(line, sizeof(line), "cmd.exe /c %s", cmd);
+
+    HANDLE process, rd, job;
+    if (!spawnProcess(line, SAVE_DIRECTORY, &process, NULL, &rd, NULL, &job)) {
+        editorSetStatusMessage("Can't run: %s", cmd);
+        return;
+    }
+
+    outputClear();
+    outputAppend("$ ", 2);
+    outputAppend(cmd, strlen(cmd));
+    outputAppend("\n", 1);
+    if (!pipeReaderStart(&E.job.out, rd, 0)) {
+        if (job) CloseHandle(job);
+        TerminateProcess(process, 1);
+        CloseHandle(process);
+        editorSetStatusMessage("Can't run: %s", cmd);
+        return;
+    }
+    E.job.running = 1;
+    E.job.process = process;
+    E.job.job = job;
+    E.job.start = GetTickCount();
+    snprintf(E.job.title, sizeof(E.job.title), "%s", E.filename);
+    if (!E.output.visible) editorToggleOutput();
+    editorSetStatusMessage("Running %s... (F5 to stop)", exe);
+}
+
+void jobStop(const char *why) {
+    if (!E.job.running) return;
+    DWORD code = 0;
+    if (WaitForSingleObject(E.job.process, 0) == WAIT_TIMEOUT) {
+        // Terminare solo cmd.exe lascerebbe in vita gcc o il programma
+        if (E.job.job) TerminateJobObject(E.job.job, 1);
+        else TerminateProcess(E.job.process, 1);
+        WaitForSingleObject(E.job.process, INFINITE);
+    }
+    GetExitCodeProcess(E.job.process, &code);
+    CloseHandle(E.job.process);
+    if (E.job.job) CloseHandle(E.job.job);  // Ferma anche chi e' rimasto indietro
+    E.job.job = NULL;
+    char buf[4096];
+    int got;
+    pipeReaderDrain(&E.job.out);
+    while ((got = pipeReaderTake(&E.job.out, buf, sizeof(buf))) > 0) outputAppend(buf, got);
+    pipeReaderStop(&E.job.out);
+    E.job.running = 0;
+
+    char msg[96];
+    int len = snprintf(msg, sizeof(msg), "\n[%s: exit code %lu, %.1fs]\n", why,
+                       (unsigned long)code, (GetTickCount() - E.job.start) / 1000.0);
+    outputAppend(msg + (E.output.partial ? 0 : 1), len - (E.output.partial ? 0 : 1));
+    int errors = 0;
+    for (int i = 0; i < E.output.ndiags; i++)
+        if (E.output.diags[i].severity == DIAG_ERROR) errors++;
+    editorSetStatusMessage("%s (exit %lu), %d error%s, %d diagnostic%s%s", why,
+                           (unsigned long)code, errors, errors == 1 ? "" : "s",
+                           E.output.ndiags, E.output.ndiags == 1 ? "" : "s",
+                           E.output.ndiags ? " - F8 to jump" : "");
+}
+
+// Prende l'uscita gia' letta dal thread della pipe. Restituisce 1 se il
+// pannello e' cambiato (nuova uscita o processo terminato).
+int jobPoll() {
+    char buf[4096];
+    int changed = 0;
+    while (1) {
+        int got = pipeReaderTake(&E.job.out, buf, sizeof(buf));
+        if (got < 0) {
+            // Pipe chiusa: il processo (e chi ne ha ereditato l'uscita) ha finito
+            jobStop("Done");
+            return 1;
+        }
+        if (got == 0) break;
+        outputAppend(buf, got);
+        changed = 1;
+    }
+    if (!changed && WaitForSingleObject(E.job.process, 0) == WAIT_OBJECT_0) {
+        jobStop("Done");
+        return 1;
+    }
+    return changed;
+}
+
+// F6: mostra o nasconde il pannello di uscita
+void editorToggleOutput() {
+    E.output.visible = !E.output.visible;
+    editorUpdateLayout();
+    if (E.output.visible && E.output.follow && E.output.nlines > E.output.height)
+        E.output.off = E.output.nlines - E.output.height;
+}
+
+// Shift+PagSu/PagGiu': scorre il pannello di uscita
+void editorScrollOutput(int dir) {
+    OutputPane *o = &E.output;
+    if (!o->visible) return;
+    int last = o->nlines > o->height ? o->nlines - o->height : 0;
+    o->off += dir * (o->height > 1 ? o->height - 1 : 1);
+    if (o->off < 0) o->off = 0;
+    if (o->off > last) o->off = last;
+    o->follow = o->off == last;
+}
+
+// F8: porta il cursore al prossimo messaggio del compilatore
+void editorNextDiagnostic() {
+    OutputPane *o = &E.output;
+    if (o->ndiags == 0) {
+        editorSetStatusMessage("No diagnostics");
+        return;
+    }
+    o->diag = (o->diag + 1) % o->ndiags;
+    Diagnostic *d = &o->diags[o->diag];
+
+    // Il comando gira in SAVE_DIRECTORY, quindi i nomi sono relativi a li'
+    const char *base = d->file;
+    for (const char *p = d->file; *p; p++)
+        if (*p == '\\' || *p == '/') base = p + 1;
+    if (E.filename == NULL || (strcmp(d->file, E.filename) != 0 && strcmp(base, E.filename) != 0)) {
+        if (editorIsDirty()) {
+            editorSetStatusMessage("%s:%d is in another file. Save first (Ctrl-S).", d->file,
+                                   d->row + 1);
+            return;
+        }
+        char *file = strdup(base);
+        if (file == NULL) die("strdup");
+        editorFreeBuffer();
+        editorOpen(file);
+        free(file);
+    }
+
+    E.cy = d->row < E.numrows ? d->row : (E.numrows > 0 ? E.numrows - 1 : 0);
+    E.cx = 0;
+    if (E.cy < E.numrows) {
+        E.cx = editorRowRxToCx(&E.rows[E.cy], d->col);
+        if (E.cx > E.rows[E.cy].size) E.cx = E.rows[E.cy].size;
+    }
+    if (!o->visible) editorToggleOutput();
+    if (d->line < o->off || d->line >= o->off + o->height) {
+        o->off = d->line - o->height / 2;
+        if (o->off < 0) o->off = 0;
+        o->follow = 0;
+    }
+    editorSetStatusMessage("[%d/%d] %.60s", o->diag + 1, o->ndiags, o->lines[d->line]);
+}
+
+void editorDrawOutputPane(struct abuf *ab) {
+    OutputPane *o = &E.output;
+    char title[160];
+    int tlen;
+    if (E.job.running)
+        tlen = snprintf(title, sizeof(title), " Output: %s (running, F5 to stop)", E.job.title);
+    else
+        tlen = snprintf(title, sizeof(title), " Output (%d lines, %d diagnostics)  F6 hide  F8 next",
+                        o->nlines, o->ndiags);
+    if (tlen > E.termcols) tlen = E.termcols;
+    abAppend(ab, ESC "[7m", 4);
+    abAppend(ab, title, tlen);
+    for (int x = tlen; x < E.termcols; x++) abAppend(ab, " ", 1);
+    abAppend(ab, ESC "[m\r\n", 5);
+
+    int d = 0;
+    while (d < o->ndiags && o->diags[d].line < o->off) d++;
+    for (int y = 0; y < o->height; y++) {
+        int at = o->off + y;
+        if (at < o->nlines) {
+            while (d < o->ndiags && o->diags[d].line < at) d++;
+            const char *color = NULL;
+            if (d < o->ndiags && o->diags[d].line == at) {
+                int sev = o->diags[d].severity;
+                color = sev == DIAG_ERROR ? ESC "[31m" : sev == DIAG_WARNING ? ESC "[33m" : ESC "[36m";
+                if (d == o->diag) abAppend(ab, ESC "[7m", 4);
+            }
+            if (color) abAppend(ab, color, 5);
+            int len = o->lens[at] < E.termcols ? o->lens[at] : E.termcols;
+            // Niente caratteri di controllo del programma sullo schermo
+            for (int i = 0; i < len; i++) {
+                char c = o->lines[at][i];
+                abAppend(ab, iscntrl((unsigned char)c) ? " " : &c, 1);
+            }
+            if (color) abAppend(ab, ESC "[m", 3);
+        }
+        abAppend(ab, ESC "[K\r\n", 5);
+    }
+}
+
+/*** Live check ***/
+
+// Chiamata ad ogni modifica del buffer: rimanda il controllo finche'
+// non si smette di scrivere e scarta quello in corso, ormai vecchio
+void checkSchedule() {
+    if (!E.check.enabled || E.lsp.running) return;
+    E.check.pending = 1;
+    E.check.due = GetTickCount() + CHECK_DELAY_MS;
+    if (E.check.running) checkKill();
+}
+
+void checkKill() {
+    if (!E.check.running) return;
+    if (WaitForSingleObject(E.check.process, 0) == WAIT_TIMEOUT) {
+        TerminateProcess(E.check.process, 1);
+        WaitForSingleObject(E.check.process, INFINITE);
+    }
+    CloseHandle(E.check.process);
+    pipeReaderStop(&E.check.out);
+    E.check.running = 0;
+    E.check.len = 0;
+}
+
+void checkCleanup() {
+    checkKill();
+    if (E.check.tmp[0]) DeleteFile(E.check.tmp);
+}
+
+// Scrive una copia del buffer in un file temporaneo e avvia il
+// compilatore su di essa (in SAVE_DIRECTORY, per gli #include locali)
+void checkStart() {
+    E.check.pending = 0;
+    if (E.check.tmp[0] == '\0') {
+        char dir[MAX_PATH];
+        if (GetTempPath(sizeof(dir), dir) == 0 ||
+            GetTempFileName(dir, "tec", 0, E.check.tmp) == 0) {
+            E.check.tmp[0] = '\0';
+            E.check.enabled = 0;
+            editorUpdateLayout();
+            editorSetStatusMessage("Live check disabled: no temporary file");
+            return;
+        }
+        atexit(checkCleanup);
+    }
+
+    int len;
+    char *text = editorRowsToString(&len);
+    FILE *fp = fopen(E.check.tmp, "wb");
+    if (fp == NULL) {
+        free(text);
+        return;
+    }
+    fwrite(text, 1, len, fp);
+    fclose(fp);
+    free(text);
+
+    const char *tmpl = getenv("TERMINEDITOR_CHECK");
+    if (tmpl == NULL || *tmpl == '\0') tmpl = CHECK_COMMAND;
+    char cmd[1024];
+    if (!buildExpandCommand(cmd, sizeof(cmd), tmpl, E.check.tmp, "")) return;
+    HANDLE out;
+    if (!spawnProcess(cmd, SAVE_DIRECTORY, &E.check.process, NULL, &out, NULL, NULL) ||
+        !pipeReaderStart(&E.check.out, out, 0)) {
+        E.check.enabled = 0;
+        editorUpdateLayout();
+        editorSetStatusMessage("Live check disabled: can't run '%.40s'", cmd);
+        return;
+    }
+    E.check.running = 1;
+    E.check.len = 0;
+}
+
+// Avvia il controllo quando e' il momento e raccoglie la sua uscita.
+// Restituisce 1 quando arrivano nuovi risultati.
+int checkPoll() {
+    if (!E.check.enabled) return 0;
+    if (E.check.pending && !E.check.running && (int)(GetTickCount() - E.check.due) >= 0)
+        checkStart();
+    if (!E.check.running) return 0;
+
+    int drained = 0;
+    while (1) {
+        if (E.check.len + 4096 > E.check.cap) {
+            E.check.cap = E.check.cap ? E.check.cap * 2 : 8192;
+            E.check.buf = realloc(E.check.buf, E.check.cap);
+            if (E.check.buf == NULL) die("realloc in checkPoll");
+        }
+        int got = pipeReaderTake(&E.check.out, E.check.buf + E.check.len, 4096);
+        if (got < 0) break;
+        if (got == 0) {
+            if (WaitForSingleObject(E.check.process, 0) != WAIT_OBJECT_0) return 0;
+            if (drained) break;
+            pipeReaderDrain(&E.check.out);
+            drained = 1;
+            continue;
+        }
+        E.check.len += got;
+    }
+    E.check.buf[E.check.len] = '\0';
+    checkFinish();
+    return 1;
+}
+
+// Trasforma i messaggi sul file temporaneo in marcatori sulle righe
+void checkFinish() {
+    char *out = E.check.buf;
+    int len = E.check.len;
+    checkKill();
+    checkClearMarks();
+
+    const char *base = E.check.tmp;
+    for (const char *p = E.check.tmp; *p; p++)
+        if (*p == '\\' || *p == '/') base = p + 1;
+
+    int start = 0;
+    for (int i = 0; i <= len; i++) {
+        if (i < len && out[i] != '\n') continue;
+        int end = i;
+        if (end > start && out[end - 1] == '\r') end--;
+        Diagnostic d;
+        if (outputParseDiagnostic(out + start, end - start, &d)) {
+            const char *fbase = d.file;
+            for (const char *p = d.file; *p; p++)
+                if (*p == '\\' || *p == '/') fbase = p + 1;
+            if (strcmp(fbase, base) == 0 && d.row < E.numrows) {
+                if (E.check.nmarks == E.check.capmarks) {
+                    E.check.capmarks = E.check.capmarks ? E.check.capmarks * 2 : 16;
+                    E.check.marks = realloc(E.check.marks, sizeof(CheckMark) * E.check.capmarks);
+                    if (E.check.marks == NULL) die("realloc in checkFinish");
+                }
+                // Il messaggio senza "file:riga:col: "
+                const char *msg = strstr(out + start, d.severity == DIAG_ERROR ? "error" :
+                                         d.severity == DIAG_WARNING ? "warning" : "note");
+                int mlen = msg && msg < out + end ? (int)(out + end - msg) : 0;
+                CheckMark *m = &E.check.marks[E.check.nmarks++];
+                m->row = d.row;
+                m->severity = d.severity;
+                m->msg = malloc(mlen + 1);
+                if (m->msg == NULL) die("malloc in checkFinish");
+                memcpy(m->msg, msg, mlen);
+                m->msg[mlen] = '\0';
+            }
+            free(d.file);
+        }
+        start = i + 1;
+    }
+    // Per riga, il piu' grave per primo
+    qsort(E.check.marks, E.check.nmarks, sizeof(CheckMark), checkMarkCompare);
+}
+
+void checkClearMarks() {
+    for (int i = 0; i < E.check.nmarks; i++) free(E.check.marks[i].msg);
+    E.check.nmarks = 0;
+}
+
+int checkMarkCompare(const void *a, const void *b) {
+    const CheckMark *x = a, *y = b;
+    if (x->row != y->row) return x->row < y->row ? -1 : 1;
+    return x->severity - y->severity;
+}
+
+// Marcatore piu' grave della riga (ricerca binaria), NULL se nessuno
+CheckMark *checkFindMark(int row) {
+    int lo = 0, hi = E.check.nmarks;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (E.check.marks[mid].row < row) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < E.check.nmarks && E.check.marks[lo].row == row ? &E.check.marks[lo] : NULL;
+}
+
+// I marcatori seguono le righe finche' non arriva il prossimo risultato
+void checkInsertRows(int at, int n) {
+    for (int i = 0; i < E.check.nmarks; i++)
+        if (E.check.marks[i].row >= at) E.check.marks[i].row += n;
+}
+
+void checkDeleteRows(int at, int n) {
+    int out = 0;
+    for (int i = 0; i < E.check.nmarks; i++) {
+        CheckMark m = E.check.marks[i];
+        if (m.row >= at && m.row < at + n) {
+            free(m.msg);
+            continue;
+        }
+        if (m.row >= at + n) m.row -= n;
+        E.check.marks[out++] = m;
+    }
+    E.check.nmarks = out;
+}
+
+// Le righe [from, from + n) sono state riordinate (editorPermuteRows)
+void checkPermuteRows(int from, int n, const int *order) {
+    if (E.check.nmarks == 0) return;
+    int *pos = malloc(sizeof(int) * (n ? n : 1));
+    if (pos == NULL) die("malloc in checkPermuteRows");
+    for (int i = 0; i < n; i++) pos[order[i]] = i;
+    for (int i = 0; i < E.check.nmarks; i++) {
+        int row = E.check.marks[i].row;
+        if (row >= from && row < from + n) E.check.marks[i].row = from + pos[row - from];
+    }
+    free(pos);
+    qsort(E.check.marks, E.check.nmarks, sizeof(CheckMark), checkMarkCompare);
+}
+
+// Shift+F5: attiva o disattiva il controllo durante la scrittura
+void editorToggleCheck() {
+    E.check.enabled = !E.check.enabled;
+    if (E.check.enabled && !E.lsp.running) {
+        E.check.pending = 1;
+        E.check.due = GetTickCount();
+    } else if (!E.check.enabled) {
+        checkKill();
+        checkClearMarks();
+        E.check.pending = 0;
+    }
+    editorUpdateLayout();
+    editorSetStatusMessage("Live check %s", E.check.enabled ? "on" : "off");
+}
+
+// Il comando predefinito compila il buffer come C (-x c): il controllo si
+// accende da solo sui file .c e .h, su tutti se TERMINEDITOR_CHECK dice
+// come controllarli. Va chiamata quando cambia il nome del file.
+void checkFollowFile() {
+    const char *tmpl = getenv("TERMINEDITOR_CHECK");
+    int want = (tmpl && *tmpl) || E.filename == NULL || tagsIsSource(E.filename);
+    if (want == E.check.enabled) return;
+    E.check.enabled = want;
+    if (want) {
+        checkSchedule();
+    } else {
+        checkKill();
+        checkClearMarks();
+        E.check.pending = 0;
+    }
+    editorUpdateLayout();
+}
+
+/*** Gutter ***/
+
+int countDigits(int n) {
+    int d = 1;
+    while (n >= 10) {
+        n /= 10;
+        d++;
+    }
+    return d < 2 ? 2 : d;
+}
+
+// Il margine si allarga solo quando il numero di righe cambia di cifre
+void gutterUpdateWidth() {
+    if (E.linenums && countDigits(E.numrows) != E.numdigits) editorUpdateLayout();
+}
+
+// Il buffer coincide con il file: nessuna riga risulta modificata e
+// l'hash del contenuto diventa quello di riferimento per editorIsDirty
+void editorMarkSaved() {
+    for (int i = 0; i < E.numrows; i++) E.rows[i].change = 0;
+    E.saved_hash = editorContentHash();
+    E.saved_rows = E.numrows;
+}
+
+// F9: mostra o nasconde i numeri di riga
+void editorToggleLineNumbers() {
+    E.linenums = !E.linenums;
+    editorUpdateLayout();
+}
+
+// Colonne a sinistra del testo: numero di riga e stato rispetto al file
+// (F9), poi il marcatore del controllo (E/W)
+void editorDrawGutter(struct abuf *ab, int row) {
+    if (E.gutter == 0) return;
+    int checkw = E.check.enabled || E.lsp.running ? GUTTER_MARK_WIDTH : 0;
+
+    if (E.linenums) {
+        char num[16];
+        if (row >= 0) {
+            snprintf(num, sizeof(num), "%*d", E.numdigits, row + 1);
+            abAppend(ab, ESC "[90m", 5);
+            abAppend(ab, num, E.numdigits);
+            abAppend(ab, ESC "[m", 3);
+            int change = E.rows[row].change;
+            if (change & ROW_ADDED) abAppend(ab, ESC "[32m+" ESC "[m", 9);
+            else if (change & ROW_MODIFIED) abAppend(ab, ESC "[33m~" ESC "[m", 9);
+            else if (change & ROW_REMOVED) abAppend(ab, ESC "[31m_" ESC "[m", 9);
+            else abAppend(ab, " ", 1);
+        } else {
+            for (int i = 0; i <= E.numdigits; i++) abAppend(ab, " ", 1);
+        }
+        if (checkw == 0) {
+            abAppend(ab, " ", 1);
+            return;
+        }
+    }
+
+    CheckMark *m = row >= 0 ? checkFindMark(row) : NULL;
+    if (m == NULL) {
+        for (int i = 0; i < checkw; i++) abAppend(ab, " ", 1);
+        return;
+    }
+    abAppend(ab, m->severity == DIAG_ERROR ? ESC "[41mE" : m->severity == DIAG_WARNING ? ESC "[43mW" : ESC "[46mi", 6);
+    abAppend(ab, ESC "[m", 3);
+    for (int i = 1; i < checkw; i++) abAppend(ab, " ", 1);
+}
+
+/*** Row hashes ***/
+
+// Hash di una riga, 8 byte alla volta. Le righe con hash uguale sono
+// considerate uguali (con 64 bit le collisioni sono trascurabili).
+unsigned long long hashLine(const char *s, int len) {
+    unsigned long long h = 0x9E3779B97F4A7C15ULL ^ (unsigned long long)len;
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long w;
+        memcpy(&w, s + i, 8);
+        h = (h ^ w) * 0x100000001B3ULL;
+        h ^= h >> 29;
+    }
+    unsigned long long w = 0;
+    memcpy(&w, s + i, len - i);
+    h = (h ^ w) * 0x100000001B3ULL;
+    h ^= h >> 32;
+    return h;
+}
+
+// Combinazione di due hash che dipende dall'ordine
+unsigned long long hashCombine(unsigned long long a, unsigned long long b) {
+    unsigned long long h = ((a << 23) | (a >> 41)) ^ b;
+    h *= 0x9E3779B97F4A7C15ULL;
+    return h ^ (h >> 31);
+}
+
+void hashTreeInvalidate() {
+    E.hashes.valid = 0;
+}
+
+// Ricostruisce l'albero in O(n), solo dopo inserimenti/cancellazioni di righe
+void hashTreeEnsure() {
+    HashTree *t = &E.hashes;
+    if (t->valid) return;
+    int size = 1;
+    while (size < E.numrows) size *= 2;
+    if (size != t->size) {
+        t->node = realloc(t->node, sizeof(unsigned long long) * 2 * size);
+        if (t->node == NULL) die("realloc in hashTreeEnsure");
+        t->size = size;
+    }
+    for (int i = 0; i < size; i++) t->node[size + i] = i < E.numrows ? E.rows[i].hash : 0;
+    for (int i = size - 1; i >= 1; i--) t->node[i] = hashCombine(t->node[2 * i], t->node[2 * i + 1]);
+    t->valid = 1;
+}
+
+// La riga 'at' e' cambiata: si aggiorna il solo cammino fino alla radice
+void hashTreeUpdate(int at) {
+    HashTree *t = &E.hashes;
+    if (!t->valid || at >= t->size) return;
+    int i = t->size + at;
+    t->node[i] = E.rows[at].hash;
+    for (i /= 2; i >= 1; i /= 2) t->node[i] = hashCombine(t->node[2 * i], t->node[2 * i + 1]);
+}
+
+unsigned long long hashTreeQuery(int node, int lo, int hi, int from, int to) {
+    if (from <= lo && hi <= to) return E.hashes.node[node];
+    int mid = (lo + hi) / 2;
+    if (to <= mid) return hashTreeQuery(2 * node, lo, mid, from, to);
+    if (from >= mid) return hashTreeQuery(2 * node + 1, mid, hi, from, to);
+    return hashCombine(hashTreeQuery(2 * node, lo, mid, from, to),
+                       hashTreeQuery(2 * node + 1, mid, hi, from, to));
+}
+
+// Hash delle righe [from, to) in O(log n). A parita' di numero di righe,
+// due valori uguali vogliono dire (a meno di collisioni) righe uguali.
+unsigned long long editorRangeHash(int from, int to) {
+    if (from < 0) from = 0;
+    if (to > E.numrows) to = E.numrows;
+    if (from >= to) return 0;
+    hashTreeEnsure();
+    return hashTreeQuery(1, 0, E.hashes.size, from, to);
+}
+
+unsigned long long editorContentHash() {
+    return editorRangeHash(0, E.numrows);
+}
+
+// E.dirty dice solo che c'e' stata una modifica: se il contenuto e'
+// tornato quello salvato (ad esempio con undo) il buffer non e' sporco.
+// Viene chiamata a ogni frame: il confronto si fa quando l'albero e'
+// gia' aggiornato (O(log n)) o dopo undo/redo, non a ogni ridisegno
+// dopo un inserimento di righe che richiederebbe di ricostruirlo.
+int editorIsDirty() {
+    if (E.dirty && E.numrows == E.saved_rows && (E.hashes.valid || E.dirty_recheck) &&
+        editorContentHash() == E.saved_hash) E.dirty = 0;
+    E.dirty_recheck = 0;
+    return E.dirty;
+}
+
+/*** Diff ***/
+
+DWORD WINAPI diffHashWorker(LPVOID arg) {
+    DiffHashJob *job = arg;
+    for (int i = job->from; i < job->to; i++) job->hash[i] = hashLine(job->lines[i], job->lens[i]);
+    return 0;
+}
+
+// Calcola gli hash delle righe dividendole tra i processori
+void diffHashLines(char **lines, int *lens, int n, unsigned long long *hash) {
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int nworkers = si.dwNumberOfProcessors;
+    if (nworkers > DIFF_MAX_WORKERS) nworkers = DIFF_MAX_WORKERS;
+    if (n < DIFF_PARALLEL_LINES || nworkers < 2) nworkers = 1;
+
+    DiffHashJob jobs[DIFF_MAX_WORKERS];
+    HANDLE threads[DIFF_MAX_WORKERS];
+    int nthreads = 0;
+    for (int t = 0; t < nworkers; t++) {
+        jobs[t].lines = lines;
+        jobs[t].lens = lens;
+        jobs[t].hash = hash;
+        jobs[t].from = (long long)n * t / nworkers;
+        jobs[t].to = (long long)n * (t + 1) / nworkers;
+    }
+    for (int t = 1; t < nworkers; t++) {
+        threads[nthreads] = CreateThread(NULL, 0, diffHashWorker, &jobs[t], 0, NULL);
+        if (threads[nthreads]) nthreads++;
+        else diffHashWorker(&jobs[t]);
+    }
+    diffHashWorker(&jobs[0]);  // Il primo pezzo lo fa questo thread
+    if (nthreads > 0) {
+        WaitForMultipleObjects(nthreads, threads, TRUE, INFINITE);
+        for (int t = 0; t < nthreads; t++) CloseHandle(threads[t]);
+    }
+}
+
+// Punto di divisione di A[a0, a1) e B[b0, b1) sul cammino minimo di
+// Myers, cercato contemporaneamente dall'inizio e dalla fine. Oltre
+// c->maxcost passi si accontenta del punto piu' avanzato trovato: il
+// diff resta corretto, ma non piu' necessariamente minimo.
+void diffSplit(DiffCtx *c, int a0, int a1, int b0, int b1, int *sx, int *sy) {
+    const unsigned long long *A = c->a, *B = c->b;
+    int dmin = a0 - b1, dmax = a1 - b0;  // Diagonali k = x - y
+    int fmid = a0 - b0, bmid = a1 - b1;
+    int odd = (fmid - bmid) & 1;
+    int fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+    int *vf = c->vf, *vb = c->vb;  // x piu' avanzato per diagonale
+    vf[fmid] = a0;
+    vb[bmid] = a1;
+
+    for (int ec = 1;; ec++) {
+        if (fmin > dmin) vf[--fmin - 1] = -1;
+        else ++fmin;
+        if (fmax < dmax) vf[++fmax + 1] = -1;
+        else --fmax;
+        for (int d = fmax; d >= fmin; d -= 2) {
+            int x = vf[d - 1] >= vf[d + 1] ? vf[d - 1] + 1 : vf[d + 1];
+            int y = x - d;
+            while (x < a1 && y < b1 && A[x] == B[y]) x++, y++;
+            vf[d] = x;
+            if (odd && bmin <= d && d <= bmax && vb[d] <= x) {
+                *sx = x;
+                *sy = y;
+                return;
+            }
+        }
+
+        if (bmin > dmin) vb[--bmin - 1] = INT_MAX;
+        else ++bmin;
+        if (bmax < dmax) vb[++bmax + 1] = INT_MAX;
+        else --bmax;
+        for (int d = bmax; d >= bmin; d -= 2) {
+            int x = vb[d - 1] < vb[d + 1] ? vb[d - 1] : vb[d + 1] - 1;
+            int y = x - d;
+            while (x > a0 && y > b0 && A[x - 1] == B[y - 1]) x--, y--;
+            vb[d] = x;
+            if (!odd && fmin <= d && d <= fmax && x <= vf[d]) {
+                *sx = x;
+                *sy = y;
+                return;
+            }
+        }
+
+        if (ec >= c->maxcost) {
+            // Troppo costoso: il punto piu' avanzato in una delle due direzioni
+            int fbest = -1, fx = a0, fy = b0, bbest = INT_MAX, bx = a1, by = b1;
+            for (int d = fmax; d >= fmin; d -= 2) {
+                int x = vf[d], y = x - d;
+                if (x <= a1 && y <= b1 && x + y > fbest) fbest = x + y, fx = x, fy = y;
+            }
+            for (int d = bmax; d >= bmin; d -= 2) {
+                int x = vb[d], y = x - d;
+                if (x >= a0 && y >= b0 && x + y < bbest) bbest = x + y, bx = x, by = y;
+            }
+            if (fbest - (a0 + b0) > (a1 + b1) - bbest) {
+                *sx = fx;
+                *sy = fy;
+            } else {
+                *sx = bx;
+                *sy = by;
+            }
+            return;
+        }
+    }
+}
+
+// Segna in del/add le righe di A[a0, a1) e B[b0, b1) che non sono in comune
+void diffCompare(DiffCtx *c, int a0, int a1, int b0, int b1) {
+    // Prefisso e suffisso comuni non servono alla ricerca
+    while (a0 < a1 && b0 < b1 && c->a[a0] == c->b[b0]) a0++, b0++;
+    while (a0 < a1 && b0 < b1 && c->a[a1 - 1] == c->b[b1 - 1]) a1--, b1--;
+
+    if (a0 == a1) {
+        for (int j = b0; j < b1; j++) c->add[j] = 1;
+        return;
+    }
+    if (b0 == b1) {
+        for (int i = a0; i < a1; i++) c->del[i] = 1;
+        return;
+    }
+    int x, y;
+    diffSplit(c, a0, a1, b0, b1, &x, &y);
+    if (x < a0 || x > a1 || y < b0 || y > b1 || (x == a0 && y == b0) || (x == a1 && y == b1)) {
+        // Nessun progresso (solo con l'euristica): tutto diverso
+        for (int i = a0; i < a1; i++) c->del[i] = 1;
+        for (int j = b0; j < b1; j++) c->add[j] = 1;
+        return;
+    }
+    diffCompare(c, a0, x, b0, y);
+    diffCompare(c, x, a1, y, b1);
+}
+
+// Segna in keep le righe di h che compaiono anche in other (tabella
+// hash con indirizzamento aperto). Le altre non possono far parte della
+// sottosequenza comune: vengono tolte prima di cercare il cammino.
+void diffMarkShared(const unsigned long long *h, int n, const unsigned long long *other, int m,
+                    unsigned char *keep) {
+    int size = 16;
+    while (size < 2 * m) size *= 2;
+    unsigned long long *table = calloc(size, sizeof(unsigned long long));
+    unsigned char *used = calloc(size, 1);
+    if (table == NULL || used == NULL) die("calloc in diffMarkShared");
+    for (int j = 0; j < m; j++) {
+        int slot = (int)(other[j] & (size - 1));
+        while (used[slot] && table[slot] != other[j]) slot = (slot + 1) & (size - 1);
+        used[slot] = 1;
+        table[slot] = other[j];
+    }
+    for (int i = 0; i < n; i++) {
+        int slot = (int)(h[i] & (size - 1));
+        while (used[slot] && table[slot] != h[i]) slot = (slot + 1) & (size - 1);
+        keep[i] = used[slot];
+    }
+    free(table);
+    free(used);
+}
+
+// Diff tra gli hash c->a[0, na) e c->b[0, nb): riempie del e add
+void diffRun(DiffCtx *c, int na, int nb, unsigned char *del, unsigned char *add) {
+    const unsigned long long *a = c->a, *b = c->b;
+    unsigned char *keepa = malloc(na ? na : 1), *keepb = malloc(nb ? nb : 1);
+    int *mapa = malloc(sizeof(int) * (na ? na : 1)), *mapb = malloc(sizeof(int) * (nb ? nb : 1));
+    unsigned long long *ca = malloc(sizeof(unsigned long long) * (na ? na : 1));
+    unsigned long long *cb = malloc(sizeof(unsigned long long) * (nb ? nb : 1));
+    if (!keepa || !keepb || !mapa || !mapb || !ca || !cb) die("malloc in diffRun");
+    diffMarkShared(a, na, b, nb, keepa);
+    diffMarkShared(b, nb, a, na, keepb);
+
+    // Solo le righe presenti da entrambe le parti entrano in Myers
+    int n = 0, m = 0;
+    for (int i = 0; i < na; i++) {
+        if (keepa[i]) {
+            mapa[n] = i;
+            ca[n++] = a[i];
+        } else {
+            del[i] = 1;
+        }
+    }
+    for (int j = 0; j < nb; j++) {
+        if (keepb[j]) {
+            mapb[m] = j;
+            cb[m++] = b[j];
+        } else {
+            add[j] = 1;
+        }
+    }
+
+    DiffCtx sub;
+    sub.a = ca;
+    sub.b = cb;
+    sub.del = keepa;  // Riusati per il risultato compatto
+    sub.add = keepb;
+    memset(keepa, 0, n);
+    memset(keepb, 0, m);
+    // Le diagonali vanno da -m a n: vf e vb sono spostati di m + 1
+    sub.vf = malloc(sizeof(int) * (n + m + 3));
+    sub.vb = malloc(sizeof(int) * (n + m + 3));
+    if (sub.vf == NULL || sub.vb == NULL) die("malloc in diffRun");
+    sub.vf += m + 1;
+    sub.vb += m + 1;
+    sub.maxcost = DIFF_MAX_COST;
+    diffCompare(&sub, 0, n, 0, m);
+
+    for (int i = 0; i < n; i++) if (sub.del[i]) del[mapa[i]] = 1;
+    for (int j = 0; j < m; j++) if (sub.add[j]) add[mapb[j]] = 1;
+    free(sub.vf - (m + 1));
+    free(sub.vb - (m + 1));
+    free(keepa);
+    free(keepb);
+    free(mapa);
+    free(mapb);
+    free(ca);
+    free(cb);
+}
+
+void diffAddRow(int kind, int a, int b) {
+    DiffView *d = &E.diff;
+    if (d->nrows == d->caprows) {
+        d->caprows = d->caprows ? d->caprows * 2 : 256;
+        d->rows = realloc(d->rows, sizeof(DiffRow) * d->caprows);
+        if (d->rows == NULL) die("realloc in diffAddRow");
+    }
+    DiffRow *r = &d->rows[d->nrows++];
+    r->kind = kind;
+    r->a = a;
+    r->b = b;
+    r->na = r->nb = 0;
+}
+
+// Costruisce le righe da mostrare: le modifiche con DIFF_CONTEXT righe
+// uguali attorno, raggruppate in blocchi con un'intestazione '@'.
+// Affiancato, le righe tolte e aggiunte di un blocco stanno sulla stessa riga.
+void diffBuildRows() {
+    DiffView *d = &E.diff;
+    int na = d->nlines, nb = E.numrows;
+    d->nrows = 0;
+    d->off = 0;
+
+    // Sequenza completa: per ogni passo il tipo e la posizione nei due lati
+    int nops = 0;
+    DiffRow *ops = malloc(sizeof(DiffRow) * (na + nb + 1));
+    int *near = malloc(sizeof(int) * (na + nb + 1));
+    if (ops == NULL || near == NULL) die("malloc in diffBuildRows");
+    for (int i = 0, j = 0; i < na || j < nb;) {
+        int kind = i < na && d->del[i] ? '-' : j < nb && d->add[j] ? '+' : ' ';
+        ops[nops].kind = kind;
+        ops[nops].a = i;
+        ops[nops].b = j;
+        nops++;
+        if (kind != '+') i++;
+        if (kind != '-') j++;
+    }
+    // near[k]: distanza dalla modifica piu' vicina (in passi)
+    for (int k = 0, dist = INT_MAX / 2; k < nops; k++) {
+        dist = ops[k].kind != ' ' ? 0 : dist + 1;
+        near[k] = dist;
+    }
+    for (int k = nops - 1, dist = INT_MAX / 2; k >= 0; k--) {
+        dist = ops[k].kind != ' ' ? 0 : dist + 1;
+        if (dist < near[k]) near[k] = dist;
+    }
+
+    int hunk = -1;
+    for (int k = 0; k < nops;) {
+        if (near[k] > DIFF_CONTEXT) {
+            hunk = -1;
+            k++;
+            continue;
+        }
+        if (hunk < 0) {
+            hunk = d->nrows;
+            diffAddRow('@', ops[k].a, ops[k].b);
+        }
+        if (ops[k].kind == ' ') {
+            diffAddRow(' ', ops[k].a, ops[k].b);
+            d->rows[hunk].na++;
+            d->rows[hunk].nb++;
+            k++;
+            continue;
+        }
+        // Blocco di modifiche: prima le righe tolte, poi quelle aggiunte
+        int k1 = k, k2;
+        while (k1 < nops && ops[k1].kind == '-') k1++;
+        k2 = k1;
+        while (k2 < nops && ops[k2].kind == '+') k2++;
+        int ndel = k1 - k, nadd = k2 - k1;
+        if (d->unified) {
+            for (int t = k; t < k1; t++) diffAddRow('-', ops[t].a, -1);
+            for (int t = k1; t < k2; t++) diffAddRow('+', -1, ops[t].b);
+        } else {
+            for (int t = 0; t < ndel || t < nadd; t++) {
+                int a = t < ndel ? ops[k + t].a : -1, b = t < nadd ? ops[k1 + t].b : -1;
+                diffAddRow(a >= 0 && b >= 0 ? '~' : a >= 0 ? '-' : '+', a, b);
+            }
+        }
+        d->rows[hunk].na += ndel;
+        d->rows[hunk].nb += nadd;
+        k = k2;
+    }
+    free(ops);
+    free(near);
+}
+
+void diffClose() {
+    DiffView *d = &E.diff;
+    free(d->name);
+    free(d->data);
+    free(d->lines);
+    free(d->lens);
+    free(d->del);
+    free(d->add);
+    free(d->rows);
+    memset(d, 0, sizeof(*d));
+}
+
+// Confronta il buffer con il file 'path'. Restituisce 0 se il file non
+// si legge.
+int diffCompute(const char *path) {
+    DiffView *d = &E.diff;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return 0;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    d->data = malloc(size + 1);
+    if (d->data == NULL) die("malloc in diffCompute");
+    size = fread(d->data, 1, size, fp);
+    fclose(fp);
+
+    // Le righe del file, senza "\r\n" come fa editorOpen
+    int cap = 1024;
+    d->lines = malloc(sizeof(char *) * cap);
+    d->lens = malloc(sizeof(int) * cap);
+    if (d->lines == NULL || d->lens == NULL) die("malloc in diffCompute");
+    for (long p = 0; p < size;) {
+        char *nl = memchr(d->data + p, '\n', size - p);
+        long end = nl ? nl - d->data : size;
+        if (d->nlines == cap) {
+            cap *= 2;
+            d->lines = realloc(d->lines, sizeof(char *) * cap);
+            d->lens = realloc(d->lens, sizeof(int) * cap);
+            if (d->lines == NULL || d->lens == NULL) die("realloc in diffCompute");
+        }
+        int len = end - p;
+        while (len > 0 && d->data[p + len - 1] == '\r') len--;
+        d->lines[d->nlines] = d->data + p;
+        d->lens[d->nlines++] = len;
+        p = end + 1;
+    }
+
+    // Hash delle righe dei due lati: quelli del buffer sono gia' nelle righe
+    int na = d->nlines, nb = E.numrows;
+    DiffCtx c;
+    unsigned long long *bhash = malloc(sizeof(unsigned long long) * (nb ? nb : 1));
+    c.a = malloc(sizeof(unsigned long long) * (na ? na : 1));
+    c.b = bhash;
+    d->del = calloc(na ? na : 1, 1);
+    d->add = calloc(nb ? nb : 1, 1);
+    if (!bhash || !c.a || !d->del || !d->add) die("malloc in diffCompute");
+    for (int i = 0; i < nb; i++) bhash[i] = E.rows[i].hash;
+    diffHashLines(d->lines, d->lens, na, (unsigned long long *)c.a);
+
+    diffRun(&c, na, nb, d->del, d->add);
+    free((void *)c.a);
+    free((void *)c.b);
+
+    for (int i = 0; i < na; i++) d->dels += d->del[i];
+    for (int j = 0; j < nb; j++) d->adds += d->add[j];
+    diffBuildRows();
+    return 1;
+}
+
+// Testo di una riga nella colonna, con i tab espansi e senza caratteri
+// di controllo; completa con spazi fino a width se pad
+void diffAppendText(struct abuf *ab, const char *s, int len, int width, int pad) {
+    int col = 0;
+    for (int i = 0; i < len && col < width; i++) {
+        if (s[i] == '\t') {
+            do abAppend(ab, " ", 1);
+            while (++col % TAB_SIZE != 0 && col < width);
+        } else {
+            abAppend(ab, iscntrl((unsigned char)s[i]) ? "?" : &s[i], 1);
+            col++;
+        }
+    }
+    if (pad)
+        for (; col < width; col++) abAppend(ab, " ", 1);
+}
+
+void editorDrawDiff(struct abuf *ab) {
+    DiffView *d = &E.diff;
+    int width = E.termcols;
+    int half = (width - 1) / 2;
+    for (int y = 0; y < E.screenrows; y++) {
+        int at = d->off + y;
+        if (at < d->nrows) {
+            DiffRow *r = &d->rows[at];
+            const char *atext = r->a >= 0 ? d->lines[r->a] : "";
+            int alen = r->a >= 0 ? d->lens[r->a] : 0;
+            const char *btext = r->b >= 0 ? E.rows[r->b].chars : "";
+            int blen = r->b >= 0 ? E.rows[r->b].size : 0;
+            if (r->kind == '@') {
+                char head[80];
+                int hlen = snprintf(head, sizeof(head), "@@ -%d,%d +%d,%d @@",
+                                    r->a + 1, r->na, r->b + 1, r->nb);
+                abAppend(ab, ESC "[36m", 5);
+                abAppend(ab, head, hlen < width ? hlen : width);
+                abAppend(ab, ESC "[m", 3);
+            } else if (d->unified) {
+                const char *color = r->kind == '-' ? ESC "[31m" : r->kind == '+' ? ESC "[32m" : NULL;
+                if (color) abAppend(ab, color, 5);
+                abAppend(ab, r->kind == '-' ? "-" : r->kind == '+' ? "+" : " ", 1);
+                if (r->kind == '-') diffAppendText(ab, atext, alen, width - 1, 0);
+                else diffAppendText(ab, btext, blen, width - 1, 0);
+                if (color) abAppend(ab, ESC "[m", 3);
+            } else {
+                int changed = r->kind != ' ';
+                if (changed && r->a >= 0) abAppend(ab, ESC "[31m", 5);
+                diffAppendText(ab, atext, alen, half, 1);
+                if (changed && r->a >= 0) abAppend(ab, ESC "[m", 3);
+                abAppend(ab, changed ? "|" : " ", 1);
+                if (changed && r->b >= 0) abAppend(ab, ESC "[32m", 5);
+                diffAppendText(ab, btext, blen, width - half - 1, 0);
+                if (changed && r->b >= 0) abAppend(ab, ESC "[m", 3);
+            }
+        }
+        abAppend(ab, ESC "[K\r\n", 5);
+    }
+}
+
+// F7: confronta il buffer con il file salvato, Shift+F7 con un altro
+// file. Frecce/PagSu/PagGiu' per scorrere, Tab per passare tra diff
+// unificato e affiancato, Invio per andare alla riga, ESC o F7 per uscire.
+void editorDiffView(int ask) {
+    char path[MAX_PATH];
+    char *name = NULL;
+    if (ask) {
+        name = editorPrompt("Diff with file: %s (ESC to cancel)", NULL);
+        if (name == NULL) return;
+    } else if (E.filename) {
+        name = strdup(E.filename);
+        if (name == NULL) die("strdup in editorDiffView");
+    } else {
+        editorSetStatusMessage("No file to compare with");
+        return;
+    }
+    snprintf(path, sizeof(path), "%s\\%s", SAVE_DIRECTORY, name);
+
+    diffClose();
+    E.diff.unified = 1;
+    clock_t start = clock();
+    if (!diffCompute(path)) {
+        editorSetStatusMessage("Can't read %s", path);
+        free(name);
+        diffClose();
+        return;
+    }
+    E.diff.name = name;
+    if (E.diff.adds == 0 && E.diff.dels == 0) {
+        editorSetStatusMessage("No differences with %s", name);
+        diffClose();
+        return;
+    }
+    int ms = (int)((clock() - start) * 1000 / CLOCKS_PER_SEC);
+
+    E.diff.visible = 1;
+    while (1) {
+        int maxoff = E.diff.nrows - E.screenrows;
+        if (maxoff < 0) maxoff = 0;
+        if (E.diff.off > maxoff) E.diff.off = maxoff;
+        if (E.diff.off < 0) E.diff.off = 0;
+        editorSetStatusMessage("Diff %s: +%d -%d (%d ms) | Tab=%s | Enter=Go | ESC=Close",
+                               name, E.diff.adds, E.diff.dels, ms,
+                               E.diff.unified ? "Side by side" : "Unified");
+        editorRefreshScreen();
+
+        int c = editorReadKey();
+        switch (c) {
+            case ARROW_UP:
+                E.diff.off--;
+                break;
+            case ARROW_DOWN:
+                E.diff.off++;
+                break;
+            case PAGE_UP:
+                E.diff.off -= E.screenrows - 1;
+                break;
+            case PAGE_DOWN:
+                E.diff.off += E.screenrows - 1;
+                break;
+            case WHEEL_UP:
+                E.diff.off -= WHEEL_LINES * E.input.wheel;
+                break;
+            case WHEEL_DOWN:
+                E.diff.off += WHEEL_LINES * E.input.wheel;
+                break;
+            case HOME_KEY:
+                E.diff.off = 0;
+                break;
+            case END_KEY:
+                E.diff.off = maxoff;
+                break;
+            case '\t':
+                E.diff.unified = !E.diff.unified;
+                diffBuildRows();
+                break;
+            case '\r':
+                // Prima riga del buffer visibile in alto
+                for (int i = E.diff.off; i < E.diff.nrows; i++)
+                    if (E.diff.rows[i].b >= 0 && E.diff.rows[i].b < E.numrows) {
+                        E.cy = E.diff.rows[i].b;
+                        E.cx = 0;
+                        break;
+                    }
+                diffClose();
+                editorSetStatusMessage("");
+                return;
+            case '\x1b':
+            case F7_KEY:
+                diffClose();
+                editorSetStatusMessage("");
+                return;
+        }
+    }
+}
+
+/*** Line commands ***/
+
+// Confronto di due righe secondo le opzioni di sort. A parita' decide la
+// posizione originale, cosi' l'ordinamento e' stabile.
+int lineKeyCompare(const LineKey *a, const LineKey *b, int flags) {
+    int r = 0;
+    if ((flags & LINES_NUMERIC) && a->num != b->num) r = a->num < b->num ? -1 : 1;
+    // Il prefisso nella chiave evita quasi sempre di leggere il testo
+    if (r == 0 && a->prefix != b->prefix) r = a->prefix < b->prefix ? -1 : 1;
+    if (r == 0 && (flags & LINES_ICASE)) {
+        int n = a->len < b->len ? a->len : b->len;
+        for (int i = 0; i < n && r == 0; i++)
+            r = tolower((unsigned char)a->s[i]) - tolower((unsigned char)b->s[i]);
+        if (r == 0) r = a->len - b->len;
+    } else if (r == 0) {
+        r = memcmp(a->s, b->s, a->len < b->len ? a->len : b->len);
+        if (r == 0) r = a->len - b->len;
+    }
+    if (flags & LINES_REVERSE) r = -r;
+    return r;
+}
+
+// Righe uguali per uniq: senza -i basta l'hash della riga per scartare
+// quasi tutte le coppie diverse
+int lineKeyEqual(const LineKey *a, const LineKey *b, int flags) {
+    if (!(flags & LINES_ICASE) && (a->hash != b->hash || a->len != b->len)) return 0;
+    return lineKeyCompare(a, b, flags & ~LINES_NUMERIC) == 0;
+}
+
+// Fonde src[from, mid) e src[mid, to), gia' ordinati, in dst[from, to)
+void lineKeyMerge(LineKey *src, LineKey *dst, int from, int mid, int to, int flags) {
+    int i = from, j = mid, k = from;
+    while (i < mid && j < to) {
+        int r = lineKeyCompare(&src[i], &src[j], flags);
+        if (r < 0 || (r == 0 && src[i].idx < src[j].idx))
+            dst[k++] = src[i++];
+        else
+            dst[k++] = src[j++];
+    }
+    memcpy(dst + k, src + i, sizeof(LineKey) * (mid - i));
+    k += mid - i;
+    memcpy(dst + k, src + j, sizeof(LineKey) * (to - j));
+}
+
+// Merge sort di keys[from, to) usando tmp come appoggio: prima
+// insertion sort su blocchi piccoli, poi fusioni a larghezza doppia
+void lineKeySort(LineKey *keys, LineKey *tmp, int from, int to, int flags) {
+    const int run = 16;
+    for (int lo = from; lo < to; lo += run) {
+        int hi = lo + run < to ? lo + run : to;
+        for (int i = lo + 1; i < hi; i++) {
+            LineKey k = keys[i];
+            int j = i;
+            while (j > lo && lineKeyCompare(&keys[j - 1], &k, flags) > 0) {
+                keys[j] = keys[j - 1];
+                j--;
+            }
+            keys[j] = k;
+        }
+    }
+    LineKey *src = keys, *dst = tmp;
+    for (int width = run; width < to - from; width *= 2) {
+        for (int lo = from; lo < to; lo += 2 * width) {
+            int mid = lo + width < to ? lo + width : to;
+            int hi = lo + 2 * width < to ? lo + 2 * width : to;
+            lineKeyMerge(src, dst, lo, mid, hi, flags);
+        }
+        LineKey *t = src;
+        src = dst;
+        dst = t;
+    }
+    if (src != keys) memcpy(keys + from, src + from, sizeof(LineKey) * (to - from));
+}
+
+DWORD WINAPI lineSortWorker(LPVOID arg) {
+    LineSortJob *job = arg;
+    if (job->mid < 0)
+        lineKeySort(job->src, job->dst, job->from, job->to, job->flags);
+    else
+        lineKeyMerge(job->src, job->dst, job->from, job->mid, job->to, job->flags);
+    return 0;
+}
+
+// Esegue i job in parallelo, il primo nel thread corrente
+void lineRunJobs(LineSortJob *jobs, int n) {
+    HANDLE threads[LINES_MAX_WORKERS];
+    int nthreads = 0;
+    for (int t = 1; t < n; t++) {
+        threads[nthreads] = CreateThread(NULL, 0, lineSortWorker, &jobs[t], 0, NULL);
+        if (threads[nthreads]) nthreads++;
+        else lineSortWorker(&jobs[t]);
+    }
+    if (n > 0) lineSortWorker(&jobs[0]);
+    if (nthreads > 0) {
+        WaitForMultipleObjects(nthreads, threads, TRUE, INFINITE);
+        for (int t = 0; t < nthreads; t++) CloseHandle(threads[t]);
+    }
+}
+
+// Ordinamento parallelo: ogni processore ordina un pezzo, poi i pezzi
+// vengono fusi a coppie (anche queste in parallelo) fino a uno solo
+void lineSortKeys(LineKey *keys, int n, int flags) {
+    LineKey *tmp = malloc(sizeof(LineKey) * (n ? n : 1));
+    if (tmp == NULL) die("malloc in lineSortKeys");
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int nworkers = si.dwNumberOfProcessors;
+    if (nworkers > LINES_MAX_WORKERS) nworkers = LINES_MAX_WORKERS;
+    if (n < LINES_PARALLEL || nworkers < 2) nworkers = 1;
+
+    LineSortJob jobs[LINES_MAX_WORKERS];
+    int bounds[LINES_MAX_WORKERS + 1];
+    for (int t = 0; t <= nworkers; t++) bounds[t] = (long long)n * t / nworkers;
+    for (int t = 0; t < nworkers; t++) {
+        jobs[t].src = keys;
+        jobs[t].dst = tmp;
+        jobs[t].from = bounds[t];
+        jobs[t].mid = -1;
+        jobs[t].to = bounds[t + 1];
+        jobs[t].flags = flags;
+    }
+    lineRunJobs(jobs, nworkers);
+
+    LineKey *src = keys, *dst = tmp;
+    int nruns = nworkers;
+    while (nruns > 1) {
+        int njobs = 0;
+        for (int r = 0; r < nruns; r += 2) {
+            LineSortJob *job = &jobs[njobs++];
+            job->src = src;
+            job->dst = dst;
+            job->from = bounds[r];
+            job->mid = bounds[r + 1];  // Un pezzo rimasto senza coppia viene solo copiato
+            job->to = r + 1 < nruns ? bounds[r + 2] : bounds[r + 1];
+            job->flags = flags;
+            bounds[njobs - 1] = bounds[r];
+        }
+        bounds[njobs] = n;
+        lineRunJobs(jobs, njobs);
+        LineKey *t = src;
+        src = dst;
+        dst = t;
+        nruns = njobs;
+    }
+    if (src != keys) memcpy(keys, src, sizeof(LineKey) * n);
+    free(tmp);
+}
+
+// Chiavi delle righe [from, from + n): puntano al testo delle righe, che
+// non viene copiato. Ogni chiave contiene pero' gli 8 byte che seguono
+// il prefisso comune a tutte le righe, cosi' i confronti dell'ordinamento
+// non devono saltare in memoria da una riga all'altra.
+LineKey *lineMakeKeys(int from, int n, int flags) {
+    LineKey *keys = malloc(sizeof(LineKey) * (n ? n : 1));
+    if (keys == NULL) die("malloc in lineMakeKeys");
+    // Con -i il prefisso comune andrebbe confrontato con tolower: si parte da 0
+    int common = n > 0 && !(flags & LINES_ICASE) ? E.rows[from].size : 0;
+    for (int i = 1; i < n && common > 0; i++) {
+        EditorRow *row = &E.rows[from + i];
+        int j = 0;
+        while (j < common && j < row->size && row->chars[j] == E.rows[from].chars[j]) j++;
+        common = j;
+    }
+    for (int i = 0; i < n; i++) {
+        EditorRow *row = &E.rows[from + i];
+        keys[i].prefix = 0;
+        for (int j = 0; j < 8; j++) {
+            int c = common + j < row->size ? (unsigned char)row->chars[common + j] : 0;
+            if (flags & LINES_ICASE) c = tolower(c);
+            keys[i].prefix = (keys[i].prefix << 8) | c;
+        }
+        keys[i].s = row->chars;
+        keys[i].len = row->size;
+        keys[i].idx = i;
+        keys[i].hash = row->hash;
+        keys[i].num = (flags & LINES_NUMERIC) ? strtod(row->chars, NULL) : 0;
+    }
+    return keys;
+}
+
+// Lascia nelle righe [from, from + n) solo le righe order[0, m) dello
+// stesso intervallo, in quell'ordine. Le righe vengono spostate e non
+// copiate; quelle scartate finiscono in fondo e vengono cancellate.
+// Il tutto e' un solo passo di undo.
+void editorApplyLineOrder(int from, int n, const int *order, int m) {
+    int *perm = malloc(sizeof(int) * (n ? n : 1));
+    unsigned char *used = calloc(n ? n : 1, 1);
+    if (perm == NULL || used == NULL) die("malloc in editorApplyLineOrder");
+    for (int i = 0; i < m; i++) {
+        perm[i] = order[i];
+        used[order[i]] = 1;
+    }
+    for (int i = 0, k = m; i < n; i++)
+        if (!used[i]) perm[k++] = i;
+    free(used);
+
+    Cursor cur = {E.cx, E.cy};
+    undoBegin(UNDO_EDIT, &cur, 1, 0);
+    undoSavePermutation(from, n, perm);
+    editorPermuteRows(from, n, perm);
+    free(perm);
+    if (m < n) {
+        int s = undoSaveRows(from + m, n - m);
+        editorDelRows(from + m, n - m);
+        undoSetRows(s, 0);
+    }
+
+    editorClearSelection();
+    cursorsClear();  // Le righe sotto i cursori sono cambiate
+    E.cy = from < E.numrows ? from : E.numrows;
+    E.cx = 0;
+    cur.cx = E.cx;
+    cur.cy = E.cy;
+    undoEnd(&cur, 1, 0);
+}
+
+// Righe su cui agiscono i comandi: quelle della selezione (senza l'ultima
+// se la selezione finisce a inizio riga) oppure tutto il buffer
+void editorLineRange(int *from, int *n) {
+    int sy, sx, ey, ex, left, right;
+    if (E.sel.active && E.sel.block && editorBlockBounds(&sy, &ey, &left, &right)) {
+        *from = sy;
+        *n = ey - sy + 1;
+    } else if (E.sel.active && !E.sel.block && editorSelectionBounds(&sy, &sx, &ey, &ex)) {
+        if (ex == 0 && ey > sy) ey--;
+        *from = sy;
+        *n = ey - sy + 1;
+    } else {
+        *from = 0;
+        *n = E.numrows;
+    }
+}
+
+// Legge le opzioni (-r -n -i -u -v) all'inizio di args. Restituisce il
+// resto della riga, oppure NULL se un'opzione non e' valida.
+char *lineParseFlags(char *args, const char *allowed, int *flags) {
+    *flags = 0;
+    while (1) {
+        while (*args == ' ') args++;
+        if (args[0] != '-' || args[1] == '\0' || args[1] == ' ') return args;
+        for (args++; *args && *args != ' '; args++) {
+            if (!strchr(allowed, *args)) return NULL;
+            switch (*args) {
+                case 'r': *flags |= LINES_REVERSE; break;
+                case 'n': *flags |= LINES_NUMERIC; break;
+                case 'i': *flags |= LINES_ICASE; break;
+                case 'u': *flags |= LINES_UNIQUE; break;
+                case 'v': *flags |= LINES_INVERT; break;
+            }
+        }
+    }
+}
+
+// Toglie da keys[0, n) i doppioni consecutivi. Restituisce quante restano.
+int lineUnique(LineKey *keys, int n, int flags) {
+    int m = 0;
+    for (int i = 0; i < n; i++)
+        if (m == 0 || !lineKeyEqual(&keys[m - 1], &keys[i], flags)) keys[m++] = keys[i];
+    return m;
+}
+
+// Scrive tutto il buffer nella pipe. Restituisce 0 se il processo ha
+// chiuso il suo stdin.
+int filterWrite(HANDLE h, const char *s, int len) {
+    while (len > 0) {
+        DWORD wrote = 0;
+        if (!WriteFile(h, s, len, &wrote, NULL) || wrote == 0) return 0;
+        s += wrote;
+        len -= wrote;
+    }
+    return 1;
+}
+
+// Thread che passa le righe al comando senza costruire prima una copia
+// dell'intero testo: mentre scrive, altri thread leggono l'uscita,
+// quindi nessuno resta bloccato su una pipe piena
+DWORD WINAPI filterWriter(LPVOID arg) {
+    FilterJob *job = arg;
+    char buf[FILTER_BUFSIZE];
+    int len = 0, ok = 1;
+    for (int i = 0; i < job->n && ok; i++) {
+        EditorRow *row = &E.rows[job->from + i];
+        if (len + row->size + 1 > FILTER_BUFSIZE) {
+            ok = filterWrite(job->in, buf, len);
+            len = 0;
+        }
+        if (row->size + 1 > FILTER_BUFSIZE) {
+            ok = ok && filterWrite(job->in, row->chars, row->size) && filterWrite(job->in, "\n", 1);
+            continue;
+        }
+        memcpy(buf + len, row->chars, row->size);
+        len += row->size;
+        buf[len++] = '\n';
+    }
+    if (ok && len > 0) filterWrite(job->in, buf, len);
+    CloseHandle(job->in);  // Il comando vede la fine dell'input
+    return 0;
+}
+
+// Sostituisce le righe [from, from + n) con lines[0, m) in un solo passo
+// di undo. Le righe uguali all'inizio e alla fine restano quelle che sono.
+void editorReplaceLines(int from, int n, char **lines, int *lens, int m) {
+    int pre = 0, suf = 0;
+    while (pre < n && pre < m && E.rows[from + pre].size == lens[pre] &&
+           !memcmp(E.rows[from + pre].chars, lines[pre], lens[pre]))
+        pre++;
+    while (suf < n - pre && suf < m - pre) {
+        EditorRow *row = &E.rows[from + n - 1 - suf];
+        if (row->size != lens[m - 1 - suf] || memcmp(row->chars, lines[m - 1 - suf], row->size)) break;
+        suf++;
+    }
+    // Nessuna riga cambiata: niente record di undo e buffer non modificato
+    if (n - pre - suf == 0 && m - pre - suf == 0) return;
+
+    Cursor cur = {E.cx, E.cy};
+    undoBegin(UNDO_EDIT, &cur, 1, 0);
+    int s = undoSaveRows(from + pre, n - pre - suf);
+    editorDelRows(from + pre, n - pre - suf);
+    editorInsertRows(from + pre, lines + pre, lens + pre, m - pre - suf);
+    undoSetRows(s, m - pre - suf);
+
+    editorClearSelection();
+    cursorsClear();  // Le righe sotto i cursori sono cambiate
+    E.cy = from < E.numrows ? from : E.numrows;
+    E.cx = 0;
+    cur.cx = E.cx;
+    cur.cy = E.cy;
+    undoEnd(&cur, 1, 0);
+}
+
+// !comando: passa le righe [from, from + n) allo stdin del comando e le
+// sostituisce con quello che scrive su stdout. Esc interrompe il comando;
+// se fallisce il buffer non cambia e il suo stderr finisce nel pannello
+// di uscita.
+void editorFilterLines(int from, int n, const char *cmd) {
+    char cmdline[1024];
+    snprintf(cmdline, sizeof(cmdline), "cmd /s /c \"%s\"", cmd);
+    HANDLE process, in, out, err, tree;  // tree: job object del comando e dei suoi figli
+    if (!spawnProcess(cmdline, NULL, &process, &in, &out, &err, &tree)) {
+        editorSetStatusMessage("Can't run '%.40s'", cmd);
+        return;
+    }
+    editorSetStatusMessage("Running '%.40s'... (Esc to cancel)", cmd);
+    editorRefreshScreen();
+
+    FilterJob job = {in, from, n};
+    PipeReader outr, errr;
+    int have_out = pipeReaderStart(&outr, out, 0);
+    int have_err = have_out && pipeReaderStart(&errr, err, 0);
+    if (!have_out) CloseHandle(err);
+    HANDLE writer = have_err ? CreateThread(NULL, 0, filterWriter, &job, 0, NULL) : NULL;
+    if (writer == NULL) {
+        CloseHandle(in);
+        TerminateProcess(process, 1);
+        CloseHandle(process);
+        if (tree) CloseHandle(tree);
+        if (have_out) pipeReaderStop(&outr);
+        if (have_err) pipeReaderStop(&errr);
+        editorSetStatusMessage("Can't run '%.40s': no I/O threads", cmd);
+        return;
+    }
+
+    // L'uscita la raccolgono i thread di lettura; qui si guarda solo la
+    // console, cosi' Esc arriva anche se il comando non finisce mai. Gli
+    // altri tasti restano in coda per dopo.
+    HANDLE handles[2] = {process, E.hStdin};
+    int nhandles = E.remote.server ? 1 : 2;  // Con --server la console non e' dell'utente
+    int cancelled = 0;
+    while (WaitForSingleObject(process, 0) == WAIT_TIMEOUT) {
+        if (WaitForMultipleObjects(nhandles, handles, FALSE, FILTER_POLL_MS) == WAIT_OBJECT_0 + 1)
+            inputReadBatch();
+        if (E.input.state != VT_GROUND && E.input.state != VT_PASTE &&
+            GetTickCount() - E.input.seqtick >= ESC_TIMEOUT_MS)
+            vtFlush();
+        if (inputTakeKey('\x1b')) {
+            cancelled = 1;
+            // cmd.exe da solo: il comando vero resterebbe in vita
+            if (tree) TerminateJobObject(tree, 1);
+            else TerminateProcess(process, 1);
+            break;
+        }
+    }
+    DWORD code = 1;
+    WaitForSingleObject(process, PIPE_DRAIN_MS);
+    GetExitCodeProcess(process, &code);
+    CloseHandle(process);
+    if (tree) CloseHandle(tree);  // Termina i processi rimasti nel job
+
+    // Senza job un nipote del comando potrebbe tenere aperte le pipe: dopo
+    // un po' le operazioni in corso vengono annullate
+    if (WaitForSingleObject(writer, PIPE_DRAIN_MS) == WAIT_TIMEOUT)
+        while (WaitForSingleObject(writer, 10) == WAIT_TIMEOUT) CancelSynchronousIo(writer);
+    CloseHandle(writer);
+    pipeReaderDrain(&outr);
+    pipeReaderDrain(&errr);
+    int len, errlen;
+    char *data = pipeReaderTakeAll(&outr, &len);
+    char *errs = pipeReaderTakeAll(&errr, &errlen);
+    pipeReaderStop(&outr);
+    pipeReaderStop(&errr);
+
+    if (cancelled || code != 0) {
+        if (cancelled) {
+            editorSetStatusMessage("'%.40s' cancelled", cmd);
+        } else {
+            editorSetStatusMessage("'%.40s' failed (exit code %lu)", cmd, (unsigned long)code);
+            // Il pannello e' occupato da una build in corso
+            if (errlen > 0 && !E.job.running) {
+                outputClear();
+                outputAppend("$ ", 2);
+                outputAppend(cmd, strlen(cmd));
+                outputAppend("\n", 1);
+                outputAppend(errs, errlen);
+                if (!E.output.visible) editorToggleOutput();
+            }
+        }
+        free(errs);
+        free(data);
+        return;
+    }
+    free(errs);
+
+    // Le righe puntano dentro l'uscita, senza "\r\n" come fa editorOpen
+    int m = 0, capl = 1024;
+    char **lines = malloc(sizeof(char *) * capl);
+    int *lens = malloc(sizeof(int) * capl);
+    if (lines == NULL || lens == NULL) die("malloc in editorFilterLines");
+    for (int p = 0; p < len;) {
+        char *nl = memchr(data + p, '\n', len - p);
+        int end = nl ? nl - data : len;
+        if (m == capl) {
+            capl *= 2;
+            lines = realloc(lines, sizeof(char *) * capl);
+            lens = realloc(lens, sizeof(int) * capl);
+            if (lines == NULL || lens == NULL) die("realloc in editorFilterLines");
+        }
+        int l = end - p;
+        while (l > 0 && data[p + l - 1] == '\r') l--;
+        lines[m] = data + p;
+        lens[m++] = l;
+        p = end + 1;
+    }
+
+    editorReplaceLines(from, n, lines, lens, m);
+    editorSetStatusMessage("%d lines through '%.40s': %d lines out", n, cmd, m);
+    free(lines);
+    free(lens);
+    free(data);
+}
+
+// sort [-r] [-n] [-i] [-u] / uniq [-i] / filter [-v] testo / !comando /
+// macro N / macro /testo
+void editorLineCommand(char *cmd) {
+    int from, n, flags;
+    editorLineRange(&from, &n);
+    if (cmd[0] == '!') {
+        if (cmd[1] == '\0') return;
+        editorFilterLines(from, n, cmd + 1);
+        return;
+    }
+    char *args = cmd;
+    while (*args && *args != ' ') args++;
+    int cmdlen = args - cmd;
+    if (cmdlen == 5 && !strncmp(cmd, "macro", 5)) {
+        while (*args == ' ') args++;
+        if (*args == '/' && args[1])
+            editorMacroPlayOnLines(from, n, args + 1);
+        else if (atoi(args) > 0)
+            editorMacroPlay(atoi(args));
+        else
+            editorSetStatusMessage("Usage: macro N | macro /text");
+        return;
+    }
+
+    int sort = cmdlen == 4 && !strncmp(cmd, "sort", 4);
+    int uniq = cmdlen == 4 && !strncmp(cmd, "uniq", 4);
+    int filter = cmdlen == 6 && !strncmp(cmd, "filter", 6);
+    if (!sort && !uniq && !filter) {
+        editorSetStatusMessage("Unknown command: %.*s (sort, uniq, filter, !, macro)", cmdlen, cmd);
+        return;
+    }
+    char *rest = lineParseFlags(args, sort ? "rniu" : uniq ? "i" : "v", &flags);
+    if (rest == NULL) {
+        editorSetStatusMessage("Invalid option for %.*s", cmdlen, cmd);
+        return;
+    }
+    if (filter && *rest == '\0') {
+        editorSetStatusMessage("Usage: filter [-v] text");
+        return;
+    }
+    if (n == 0) return;
+
+    LineKey *keys = lineMakeKeys(from, n, flags);
+    int m = n;
+    if (sort) lineSortKeys(keys, n, flags);
+    if (uniq || (flags & LINES_UNIQUE)) m = lineUnique(keys, n, flags);
+    if (filter) {
+        int invert = (flags & LINES_INVERT) != 0;
+        m = 0;
+        for (int i = 0; i < n; i++)
+            if ((strstr(keys[i].s, rest) != NULL) != invert) keys[m++] = keys[i];
+    }
+
+    int *order = malloc(sizeof(int) * (m ? m : 1));
+    if (order == NULL) die("malloc in editorLineCommand");
+    int same = m == n;
+    for (int i = 0; i < m; i++) {
+        order[i] = keys[i].idx;
+        if (order[i] != i) same = 0;
+    }
+    free(keys);
+
+    if (same) {
+        editorSetStatusMessage("%d lines: nothing to change", n);
+    } else {
+        editorApplyLineOrder(from, n, order, m);
+        if (sort && m == n)
+            editorSetStatusMessage("Sorted %d lines", n);
+        else
+            editorSetStatusMessage("%d of %d lines kept", m, n);
     }
+    free(order);
+}
 
-    if (last_match == -1) direction = 1;
-    int current = last_match;
+// Ctrl-E: comando sulle righe della selezione o su tutto il buffer
+void editorCommand() {
+    char *cmd = editorPrompt("Command: %s (sort [-rniu], uniq [-i], filter [-v] text, !shell command, macro N|/text)", NULL);
+    if (cmd == NULL) return;
+    editorLineCommand(cmd);
+    free(cmd);
+}
 
-    // Cicla attraverso tutte le righe per trovare una corrispondenza
-    for (int i = 0; i < E.numrows; i++) {
-        current += direction;
-        // Gestione del "wrap-around" (se arrivi alla fine, ricomincia dall'inizio)
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
+/*** Language server ***/
 
-        EditorRow *row = &E.rows[current];
-        char *match = strstr(row->chars, query); // Cerca la sottostringa
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = match - row->chars; // Posiziona il cursore all'inizio della corrispondenza
-            E.rowoff = E.numrows; // Forza lo scroll per rendere visibile la riga
-            break;
+// Mini lettore JSON: lavora sul testo del messaggio senza costruire un
+// albero. Gli indici puntano all'inizio di un valore, -1 se non c'e'.
+int jsonSkipWs(const char *s, int len, int i) {
+    while (i < len && (s[i] == ' ' || s[i] == '\t' || s[i] == '\r' || s[i] == '\n')) i++;
+    return i;
+}
+
+// Indice subito dopo il valore che inizia in i
+int jsonSkip(const char *s, int len, int i) {
+    i = jsonSkipWs(s, len, i);
+    if (i >= len) return len;
+    if (s[i] == '"') {
+        for (i++; i < len && s[i] != '"'; i++)
+            if (s[i] == '\\') i++;
+        return i < len ? i + 1 : len;
+    }
+    if (s[i] == '{' || s[i] == '[') {
+        int depth = 0;
+        for (; i < len; i++) {
+            if (s[i] == '"') {
+                i = jsonSkip(s, len, i) - 1;
+            } else if (s[i] == '{' || s[i] == '[') {
+                depth++;
+            } else if (s[i] == '}' || s[i] == ']') {
+                if (--depth == 0) return i + 1;
+            }
         }
+        return len;
     }
+    while (i < len && s[i] != ',' && s[i] != '}' && s[i] != ']' &&
+           s[i] != ' ' && s[i] != '\r' && s[i] != '\n')
+        i++;
+    return i;
 }
 
-void editorFind() {
-    // Salva la posizione corrente del cursore per ripristinarla in caso di annullamento
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
+// Valore della chiave 'key' nell'oggetto che inizia in i
+int jsonGet(const char *s, int len, int i, const char *key) {
+    if (i < 0) return -1;
+    i = jsonSkipWs(s, len, i);
+    if (i >= len || s[i] != '{') return -1;
+    int klen = strlen(key);
+    i++;
+    while (1) {
+        i = jsonSkipWs(s, len, i);
+        if (i >= len || s[i] != '"') return -1;
+        int kstart = i + 1;
+        int kend = jsonSkip(s, len, i) - 1;
+        i = jsonSkipWs(s, len, kend + 1);
+        if (i >= len || s[i] != ':') return -1;
+        i = jsonSkipWs(s, len, i + 1);
+        if (kend - kstart == klen && memcmp(s + kstart, key, klen) == 0) return i;
+        i = jsonSkipWs(s, len, jsonSkip(s, len, i));
+        if (i >= len || s[i] != ',') return -1;
+        i++;
+    }
+}
 
-    // Avvia il prompt di ricerca, passando il callback per la logica interattiva
-    char *query = editorPrompt(
-        "Search: %s (ESC=Cancel | Arrows=Navigate | Enter=Confirm)",
-        editorFindCallback);
+// Primo elemento dell'array che inizia in i
+int jsonArrayFirst(const char *s, int len, int i) {
+    if (i < 0) return -1;
+    i = jsonSkipWs(s, len, i);
+    if (i >= len || s[i] != '[') return -1;
+    i = jsonSkipWs(s, len, i + 1);
+    return i < len && s[i] != ']' ? i : -1;
+}
 
-    if (query == NULL) { // L'utente ha premuto ESC
-        // Ripristina la posizione originale del cursore
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+// Elemento che segue quello che inizia in i
+int jsonArrayNext(const char *s, int len, int i) {
+    i = jsonSkipWs(s, len, jsonSkip(s, len, i));
+    if (i >= len || s[i] != ',') return -1;
+    return jsonSkipWs(s, len, i + 1);
+}
+
+// Decodifica la stringa in i (troncata a size - 1 byte). Restituisce la
+// lunghezza, -1 se il valore non e' una stringa.
+int jsonString(const char *s, int len, int i, char *out, int size) {
+    if (i < 0) return -1;
+    i = jsonSkipWs(s, len, i);
+    if (i >= len || s[i] != '"') return -1;
+    int n = 0;
+    for (i++; i < len && s[i] != '"'; i++) {
+        char utf8[4];
+        int ulen = 1;
+        utf8[0] = s[i];
+        if (s[i] == '\\' && i + 1 < len) {
+            char e = s[++i];
+            utf8[0] = e == 'n' ? '\n' : e == 't' ? '\t' : e == 'r' ? '\r' :
+                      e == 'b' ? '\b' : e == 'f' ? '\f' : e;
+            if (e == 'u' && i + 4 < len) {
+                unsigned cp = 0;
+                for (int k = 1; k <= 4; k++) {
+                    char h = s[i + k];
+                    cp = cp * 16 + (isdigit((unsigned char)h) ? h - '0' : (tolower((unsigned char)h) - 'a' + 10) & 15);
+                }
+                i += 4;
+                if (cp < 0x80) {
+                    utf8[0] = cp;
+                } else if (cp < 0x800) {
+                    utf8[0] = 0xC0 | (cp >> 6);
+                    utf8[1] = 0x80 | (cp & 0x3F);
+                    ulen = 2;
+                } else {
+                    utf8[0] = 0xE0 | (cp >> 12);
+                    utf8[1] = 0x80 | ((cp >> 6) & 0x3F);
+                    utf8[2] = 0x80 | (cp & 0x3F);
+                    ulen = 3;
+                }
+            }
+        }
+        if (n + ulen < size) {
+            memcpy(out + n, utf8, ulen);
+            n += ulen;
+        }
+    }
+    if (size > 0) out[n] = '\0';
+    return n;
+}
+
+int jsonInt(const char *s, int len, int i) {
+    if (i < 0) return -1;
+    i = jsonSkipWs(s, len, i);
+    if (i >= len || !(isdigit((unsigned char)s[i]) || s[i] == '-')) return -1;
+    return atoi(s + i);
+}
+
+// Aggiunge s come stringa JSON, a blocchi tra un escape e l'altro
+void jsonAppendString(struct abuf *ab, const char *s, int len) {
+    abAppend(ab, "\"", 1);
+    int start = 0;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        abAppend(ab, s + start, i - start);
+        char esc[8];
+        if (c == '"' || c == '\\') snprintf(esc, sizeof(esc), "\\%c", c);
+        else if (c == '\n') strcpy(esc, "\\n");
+        else if (c == '\t') strcpy(esc, "\\t");
+        else if (c == '\r') strcpy(esc, "\\r");
+        else snprintf(esc, sizeof(esc), "\\u%04x", c);
+        abAppend(ab, esc, strlen(esc));
+        start = i + 1;
+    }
+    abAppend(ab, s + start, len - start);
+    abAppend(ab, "\"", 1);
+}
+
+// file:///C:/dir/file.c a partire da un percorso relativo
+char *lspMakeUri(const char *path) {
+    char full[MAX_PATH];
+    DWORD n = GetFullPathName(path, sizeof(full), full, NULL);
+    if (n == 0 || n >= sizeof(full)) snprintf(full, sizeof(full), "%s", path);
+
+    char *uri = malloc(strlen(full) * 3 + 9);
+    if (uri == NULL) die("malloc in lspMakeUri");
+    char *p = uri + sprintf(uri, "file:///");
+    for (const char *s = full; *s; s++) {
+        unsigned char c = *s;
+        if (c == '\\') *p++ = '/';
+        else if (isalnum(c) || strchr("/:-._~", c)) *p++ = c;
+        else p += sprintf(p, "%%%02X", c);
+    }
+    *p = '\0';
+    return uri;
+}
+
+void lspQueue(LspMessage **head, LspMessage **tail, char *body, int len) {
+    LspMessage *m = malloc(sizeof(LspMessage));
+    if (m == NULL) die("malloc in lspQueue");
+    m->next = NULL;
+    m->body = body;
+    m->len = len;
+    if (*tail) (*tail)->next = m;
+    else *head = m;
+    *tail = m;
+}
+
+// Thread di lettura: separa l'uscita del server in messaggi
+// "Content-Length: N\r\n\r\n<corpo>" e li mette in coda per il thread
+// principale. Termina quando la pipe si chiude.
+DWORD WINAPI lspReaderThread(LPVOID arg) {
+    (void)arg;
+    int cap = 65536, len = 0;
+    char *buf = malloc(cap);
+    if (buf == NULL) return 0;
+    while (1) {
+        // Un messaggio completo gia' nel buffer?
+        char *end = NULL;
+        for (int i = 0; i + 3 < len; i++)
+            if (memcmp(buf + i, "\r\n\r\n", 4) == 0) {
+                end = buf + i + 4;
+                break;
+            }
+        if (end) {
+            int body = -1;
+            for (char *p = buf; p < end; p++)
+                if ((p == buf || p[-1] == '\n') && strncmp(p, "Content-Length:", 15) == 0)
+                    body = atoi(p + 15);
+            int hlen = end - buf;
+            if (body < 0) {
+                memmove(buf, end, len - hlen);
+                len -= hlen;
+                continue;
+            }
+            if (len >= hlen + body) {
+                char *msg = malloc(body + 1);
+                if (msg == NULL) break;
+                memcpy(msg, end, body);
+                msg[body] = '\0';
+                EnterCriticalSection(&E.lsp.lock);
+                lspQueue(&E.lsp.inq, &E.lsp.inq_tail, msg, body);
+                LeaveCriticalSection(&E.lsp.lock);
+                SetEvent(E.events.wake);
+                memmove(buf, end + body, len - hlen - body);
+                len -= hlen + body;
+                continue;
+            }
+            if (hlen + body > cap) {
+                cap = hlen + body;
+                char *grown = realloc(buf, cap);
+                if (grown == NULL) break;
+                buf = grown;
+            }
+        } else if (len == cap) {
+            break;  // Intestazione impossibile
+        }
+        DWORD got = 0;
+        if (!ReadFile(E.lsp.out, buf + len, cap - len, &got, NULL) || got == 0) break;
+        len += got;
+    }
+    free(buf);
+    SetEvent(E.events.wake);
+    return 0;
+}
+
+// Thread di scrittura: svuota la coda in uscita ogni volta che viene
+// svegliato, cosi' una pipe piena non blocca mai l'editor
+DWORD WINAPI lspWriterThread(LPVOID arg) {
+    (void)arg;
+    while (1) {
+        WaitForSingleObject(E.lsp.wake, INFINITE);
+        while (1) {
+            EnterCriticalSection(&E.lsp.lock);
+            LspMessage *m = E.lsp.outq;
+            E.lsp.outq = E.lsp.outq_tail = NULL;
+            LeaveCriticalSection(&E.lsp.lock);
+            if (m == NULL) break;
+            while (m) {
+                char header[64];
+                int hlen = snprintf(header, sizeof(header), "Content-Length: %d\r\n\r\n", m->len);
+                DWORD wrote;
+                int ok = WriteFile(E.lsp.in, header, hlen, &wrote, NULL) &&
+                         WriteFile(E.lsp.in, m->body, m->len, &wrote, NULL);
+                LspMessage *next = m->next;
+                free(m->body);
+                free(m);
+                m = next;
+                if (!ok) {
+                    // Server morto: butta via il resto
+                    while (m) {
+                        next = m->next;
+                        free(m->body);
+                        free(m);
+                        m = next;
+                    }
+                }
+            }
+        }
+        if (E.lsp.stopping) break;
+    }
+    return 0;
+}
+
+// Passa il messaggio al thread di scrittura (che ne libera il testo)
+void lspSend(struct abuf *msg) {
+    EnterCriticalSection(&E.lsp.lock);
+    lspQueue(&E.lsp.outq, &E.lsp.outq_tail, msg->b, msg->len);
+    LeaveCriticalSection(&E.lsp.lock);
+    msg->b = NULL;
+    msg->len = 0;
+    SetEvent(E.lsp.wake);
+}
+
+int lspRequest(const char *method, const char *params) {
+    struct abuf msg = ABUF_INIT;
+    char head[128];
+    int id = ++E.lsp.next_id;
+    snprintf(head, sizeof(head), "{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"%s\",\"params\":", id, method);
+    abAppend(&msg, head, strlen(head));
+    abAppend(&msg, params, strlen(params));
+    abAppend(&msg, "}", 1);
+    lspSend(&msg);
+    return id;
+}
+
+void lspNotify(const char *method, const char *params) {
+    struct abuf msg = ABUF_INIT;
+    char head[128];
+    snprintf(head, sizeof(head), "{\"jsonrpc\":\"2.0\",\"method\":\"%s\",\"params\":", method);
+    abAppend(&msg, head, strlen(head));
+    abAppend(&msg, params, strlen(params));
+    abAppend(&msg, "}", 1);
+    lspSend(&msg);
+}
+
+// Avvia il server (TERMINEDITOR_LSP, di default clangd) in SAVE_DIRECTORY
+void lspStart() {
+    const char *cmd = getenv("TERMINEDITOR_LSP");
+    if (cmd == NULL || *cmd == '\0') cmd = LSP_COMMAND;
+    char line[1024];
+    snprintf(line, sizeof(line), "%s", cmd);
+    if (!spawnProcess(line, SAVE_DIRECTORY, &E.lsp.process, &E.lsp.in, &E.lsp.out, NULL, NULL)) {
+        editorSetStatusMessage("Can't run language server '%.40s'", cmd);
+        return;
+    }
+    InitializeCriticalSection(&E.lsp.lock);
+    E.lsp.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    E.lsp.stopping = 0;
+    E.lsp.reader = CreateThread(NULL, 0, lspReaderThread, NULL, 0, NULL);
+    E.lsp.writer = CreateThread(NULL, 0, lspWriterThread, NULL, 0, NULL);
+    E.lsp.running = 1;
+    E.lsp.initialized = 0;
+    E.lsp.opened = 0;
+    E.lsp.next_id = 0;
+    E.lsp.completion_id = 0;
+
+    // Le diagnosi ora arrivano dal server
+    checkKill();
+    checkClearMarks();
+    E.check.pending = 0;
+    editorUpdateLayout();
+
+    struct abuf params = ABUF_INIT;
+    char *root = lspMakeUri(SAVE_DIRECTORY);
+    abAppend(&params, "{\"processId\":null,\"rootUri\":", 28);
+    jsonAppendString(&params, root, strlen(root));
+    free(root);
+    const char *caps =
+        ",\"capabilities\":{"
+        "\"general\":{\"positionEncodings\":[\"utf-8\"]},"
+        "\"offsetEncoding\":[\"utf-8\"],"
+        "\"textDocument\":{"
+        "\"synchronization\":{\"didSave\":false},"
+        "\"publishDiagnostics\":{\"relatedInformation\":false},"
+        "\"completion\":{\"completionItem\":{\"snippetSupport\":false}}}}}";
+    abAppend(&params, caps, strlen(caps));
+    abAppend(&params, "", 1);  // Terminatore per lspRequest
+    lspRequest("initialize", params.b);
+    abFree(&params);
+    editorSetStatusMessage("Language server '%.40s' started", cmd);
+}
+
+void lspStop() {
+    if (!E.lsp.running) return;
+    if (E.lsp.initialized) {
+        lspRequest("shutdown", "null");
+        lspNotify("exit", "null");
+    }
+    InterlockedExchange(&E.lsp.stopping, 1);
+    SetEvent(E.lsp.wake);
+    // Un server che non legge piu' lascia il writer fermo in WriteFile:
+    // si annulla la scrittura finche' il thread non esce, prima di
+    // chiudere la pipe e la critical section che sta usando
+    if (WaitForSingleObject(E.lsp.writer, 2000) == WAIT_TIMEOUT)
+        while (WaitForSingleObject(E.lsp.writer, 10) == WAIT_TIMEOUT) CancelSynchronousIo(E.lsp.writer);
+    CloseHandle(E.lsp.in);  // EOF sullo stdin del server
+    if (WaitForSingleObject(E.lsp.process, 2000) == WAIT_TIMEOUT)
+        TerminateProcess(E.lsp.process, 1);
+    WaitForSingleObject(E.lsp.reader, INFINITE);
+    CloseHandle(E.lsp.reader);
+    CloseHandle(E.lsp.writer);
+    CloseHandle(E.lsp.process);
+    CloseHandle(E.lsp.out);
+    CloseHandle(E.lsp.wake);
+
+    LspMessage *queues[2] = {E.lsp.inq, E.lsp.outq};
+    for (int q = 0; q < 2; q++)
+        while (queues[q]) {
+            LspMessage *next = queues[q]->next;
+            free(queues[q]->body);
+            free(queues[q]);
+            queues[q] = next;
+        }
+    E.lsp.inq = E.lsp.inq_tail = E.lsp.outq = E.lsp.outq_tail = NULL;
+    DeleteCriticalSection(&E.lsp.lock);
+
+    E.lsp.running = 0;
+    E.lsp.initialized = 0;
+    E.lsp.opened = 0;
+    free(E.lsp.uri);
+    E.lsp.uri = NULL;
+    abFree(&E.lsp.changes);
+    E.lsp.nchanges = 0;
+    completionClose();
+    checkClearMarks();
+    if (E.check.enabled) checkSchedule();
+    editorUpdateLayout();
+}
+
+// Apre il documento sul server con il testo completo: da qui in poi
+// si mandano solo le modifiche
+void lspDidOpen() {
+    // I nomi dei file sono relativi a SAVE_DIRECTORY
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s\\%s", SAVE_DIRECTORY, E.filename ? E.filename : "untitled.c");
+    E.lsp.uri = lspMakeUri(path);
+    E.lsp.version = 1;
+    E.lsp.opened = 1;
+    abFree(&E.lsp.changes);
+    E.lsp.nchanges = 0;
+
+    int len;
+    char *text = editorRowsToString(&len);
+    if (text == NULL) die("malloc in lspDidOpen");
+    struct abuf params = ABUF_INIT;
+    abAppend(&params, "{\"textDocument\":{\"uri\":", 23);
+    jsonAppendString(&params, E.lsp.uri, strlen(E.lsp.uri));
+    abAppend(&params, ",\"languageId\":\"c\",\"version\":1,\"text\":", 38);
+    jsonAppendString(&params, text, len);
+    abAppend(&params, "}}", 3);
+    free(text);
+    lspNotify("textDocument/didOpen", params.b);
+    abFree(&params);
+}
+
+void lspDidClose() {
+    if (!E.lsp.opened) return;
+    struct abuf params = ABUF_INIT;
+    abAppend(&params, "{\"textDocument\":{\"uri\":", 23);
+    jsonAppendString(&params, E.lsp.uri, strlen(E.lsp.uri));
+    abAppend(&params, "}}", 3);
+    lspNotify("textDocument/didClose", params.b);
+    abFree(&params);
+    free(E.lsp.uri);
+    E.lsp.uri = NULL;
+    abFree(&E.lsp.changes);
+    E.lsp.nchanges = 0;
+    E.lsp.opened = 0;
+}
+
+// Registra una modifica del documento come TextDocumentContentChangeEvent.
+// Le modifiche si accumulano e partono insieme al prossimo lspPoll.
+void lspNoteChange(int line, int col, int endline, int endcol, const char *text, int len) {
+    if (!E.lsp.opened) return;
+    char range[128];
+    snprintf(range, sizeof(range),
+             "%s{\"range\":{\"start\":{\"line\":%d,\"character\":%d},"
+             "\"end\":{\"line\":%d,\"character\":%d}},\"text\":",
+             E.lsp.nchanges ? "," : "", line, col, endline, endcol);
+    abAppend(&E.lsp.changes, range, strlen(range));
+    jsonAppendString(&E.lsp.changes, text, len);
+    abAppend(&E.lsp.changes, "}", 1);
+    E.lsp.nchanges++;
+}
+
+// Da chiamare prima di sostituire il testo della riga 'at' (lungo oldlen);
+// il nuovo testo e' gia' nella riga quando lo si chiama dopo
+void lspNoteReplace(int at, int oldlen) {
+    if (!E.lsp.opened) return;
+    lspNoteChange(at, 0, at, oldlen, E.rows[at].chars, E.rows[at].size);
+}
+
+// Le n righe appena inserite in 'at', viste dal server come testo
+// inserito all'inizio della riga at
+void lspNoteInsert(int at, int n) {
+    if (!E.lsp.opened) return;
+    int total = 0;
+    for (int i = 0; i < n; i++) total += E.rows[at + i].size + 1;
+    char *text = malloc(total);
+    if (text == NULL) die("malloc in lspNoteInsert");
+    char *p = text;
+    for (int i = 0; i < n; i++) {
+        memcpy(p, E.rows[at + i].chars, E.rows[at + i].size);
+        p += E.rows[at + i].size;
+        *p++ = '\n';
+    }
+    lspNoteChange(at, 0, at, 0, text, total);
+    free(text);
+}
+
+void lspNoteDelete(int at, int n) {
+    lspNoteChange(at, 0, at + n, 0, "", 0);
+}
+
+void lspFlushChanges() {
+    if (E.lsp.nchanges == 0) return;
+    struct abuf params = ABUF_INIT;
+    char version[32];
+    abAppend(&params, "{\"textDocument\":{\"uri\":", 23);
+    jsonAppendString(&params, E.lsp.uri, strlen(E.lsp.uri));
+    snprintf(version, sizeof(version), ",\"version\":%d},", ++E.lsp.version);
+    abAppend(&params, version, strlen(version));
+    abAppend(&params, "\"contentChanges\":[", 18);
+    abAppend(&params, E.lsp.changes.b, E.lsp.changes.len);
+    abAppend(&params, "]}", 3);
+    abFree(&E.lsp.changes);
+    E.lsp.nchanges = 0;
+    lspNotify("textDocument/didChange", params.b);
+    abFree(&params);
+}
+
+// Manda le modifiche accumulate e gestisce i messaggi arrivati dal
+// server. Restituisce 1 se lo schermo va ridisegnato.
+int lspPoll() {
+    if (!E.lsp.running) return 0;
+    if (WaitForSingleObject(E.lsp.process, 0) == WAIT_OBJECT_0) {
+        lspStop();
+        editorSetStatusMessage("Language server exited");
+        return 1;
+    }
+    if (E.lsp.initialized) {
+        if (!E.lsp.opened) lspDidOpen();
+        lspFlushChanges();
+    }
+
+    EnterCriticalSection(&E.lsp.lock);
+    LspMessage *m = E.lsp.inq;
+    E.lsp.inq = E.lsp.inq_tail = NULL;
+    LeaveCriticalSection(&E.lsp.lock);
+
+    int changed = 0;
+    while (m) {
+        LspMessage *next = m->next;
+        lspHandleMessage(m->body, m->len);
+        free(m->body);
+        free(m);
+        m = next;
+        changed = 1;
+    }
+    return changed;
+}
+
+void lspHandleMessage(const char *s, int len) {
+    char method[64];
+    int id = jsonGet(s, len, 0, "id");
+    if (jsonString(s, len, jsonGet(s, len, 0, "method"), method, sizeof(method)) < 0) {
+        // Risposta a una nostra richiesta
+        int rid = jsonInt(s, len, id);
+        int result = jsonGet(s, len, 0, "result");
+        if (rid == 1 && !E.lsp.initialized) {
+            E.lsp.initialized = 1;
+            lspNotify("initialized", "{}");
+            lspDidOpen();
+        } else if (rid == E.lsp.completion_id) {
+            E.lsp.completion_id = 0;
+            if (result >= 0) lspCompletionResult(s, len, result);
+        }
+        return;
+    }
+
+    if (id >= 0) {
+        // Richiesta del server: nessuna e' supportata, risposta vuota con
+        // lo stesso id (numero o stringa)
+        struct abuf msg = ABUF_INIT;
+        abAppend(&msg, "{\"jsonrpc\":\"2.0\",\"id\":", 22);
+        abAppend(&msg, s + id, jsonSkip(s, len, id) - id);
+        abAppend(&msg, ",\"result\":null}", 15);
+        lspSend(&msg);
+        return;
+    }
+    if (strcmp(method, "textDocument/publishDiagnostics") == 0)
+        lspDiagnostics(s, len, jsonGet(s, len, 0, "params"));
+}
+
+// Le diagnosi del documento aperto diventano i marcatori del margine
+void lspDiagnostics(const char *s, int len, int params) {
+    char uri[MAX_PATH * 3];
+    if (!E.lsp.opened || jsonString(s, len, jsonGet(s, len, params, "uri"), uri, sizeof(uri)) < 0 ||
+        strcmp(uri, E.lsp.uri) != 0)
+        return;
+    checkClearMarks();
+    for (int d = jsonArrayFirst(s, len, jsonGet(s, len, params, "diagnostics")); d >= 0;
+         d = jsonArrayNext(s, len, d)) {
+        int start = jsonGet(s, len, jsonGet(s, len, d, "range"), "start");
+        int row = jsonInt(s, len, jsonGet(s, len, start, "line"));
+        int severity = jsonInt(s, len, jsonGet(s, len, d, "severity"));
+        char msg[512];
+        if (row < 0 || row >= E.numrows) continue;
+        if (jsonString(s, len, jsonGet(s, len, d, "message"), msg, sizeof(msg)) < 0) msg[0] = '\0';
+        // Solo la prima riga del messaggio (clangd aggiunge le note sotto)
+        msg[strcspn(msg, "\n")] = '\0';
+
+        if (E.check.nmarks == E.check.capmarks) {
+            E.check.capmarks = E.check.capmarks ? E.check.capmarks * 2 : 16;
+            E.check.marks = realloc(E.check.marks, sizeof(CheckMark) * E.check.capmarks);
+            if (E.check.marks == NULL) die("realloc in lspDiagnostics");
+        }
+        CheckMark *m = &E.check.marks[E.check.nmarks++];
+        m->row = row;
+        m->severity = severity == 1 ? DIAG_ERROR : severity == 2 ? DIAG_WARNING : DIAG_NOTE;
+        m->msg = strdup(msg);
+        if (m->msg == NULL) die("strdup in lspDiagnostics");
+    }
+    qsort(E.check.marks, E.check.nmarks, sizeof(CheckMark), checkMarkCompare);
+}
+
+// Riempie il menu con le voci della risposta (array o CompletionList)
+void lspCompletionResult(const char *s, int len, int result) {
+    completionClose();
+    if (E.lsp.completion_row != E.cy) return;  // Il cursore si e' spostato
+    int items = jsonGet(s, len, result, "items");
+    if (items < 0) items = result;
+
+    for (int it = jsonArrayFirst(s, len, items); it >= 0 && E.menu.count < COMPLETION_MAX;
+         it = jsonArrayNext(s, len, it)) {
+        char label[256], insert[256];
+        if (jsonString(s, len, jsonGet(s, len, it, "label"), label, sizeof(label)) < 0) continue;
+        if (jsonString(s, len, jsonGet(s, len, jsonGet(s, len, it, "textEdit"), "newText"),
+                       insert, sizeof(insert)) < 0 &&
+            jsonString(s, len, jsonGet(s, len, it, "insertText"), insert, sizeof(insert)) < 0)
+            strcpy(insert, label);
+
+        // clangd mette uno spazio o un pallino davanti all'etichetta
+        char *l = label;
+        while (*l == ' ') l++;
+        if ((unsigned char)l[0] == 0xE2 && (unsigned char)l[1] == 0x80) l += 3;
+        completionAdd(l, insert);
+    }
+    completionOpen();
+}
+
+// Chiede i completamenti per la posizione del cursore. La risposta
+// arriva in modo asincrono e apre il menu.
+void lspRequestCompletion() {
+    if (!E.lsp.opened) {
+        editorSetStatusMessage("Language server still starting...");
+        return;
+    }
+    lspFlushChanges();  // Il server deve vedere il testo attuale
+    struct abuf params = ABUF_INIT;
+    char pos[96];
+    abAppend(&params, "{\"textDocument\":{\"uri\":", 23);
+    jsonAppendString(&params, E.lsp.uri, strlen(E.lsp.uri));
+    snprintf(pos, sizeof(pos), "},\"position\":{\"line\":%d,\"character\":%d}}", E.cy, E.cx);
+    abAppend(&params, pos, strlen(pos) + 1);
+    E.lsp.completion_id = lspRequest("textDocument/completion", params.b);
+    E.lsp.completion_row = E.cy;
+    abFree(&params);
+}
+
+// F10: avvia o ferma il language server
+void editorToggleLsp() {
+    if (E.lsp.running) {
+        lspStop();
+        editorSetStatusMessage("Language server stopped");
+    } else {
+        lspStart();
+    }
+}
+
+/*** Completion ***/
+
+// Radice e parole del linguaggio, che restano sempre nell'indice
+void wordIndexInit() {
+    WordIndex *w = &E.words;
+    if (w->cap == 0) {
+        w->cap = 1024;
+        w->nodes = malloc(sizeof(TrieNode) * w->cap);
+        if (w->nodes == NULL) die("malloc in wordIndexInit");
+    }
+    w->count = 1;
+    w->free = -1;
+    memset(&w->nodes[0], 0, sizeof(TrieNode));
+    w->nodes[0].child = w->nodes[0].next = w->nodes[0].parent = -1;
+
+    const char **lists[] = {C_KEYWORDS, C_TYPES, C_CONSTANTS};
+    for (int l = 0; l < 3; l++)
+        for (int k = 0; lists[l][k]; k++) wordIndexAdd(lists[l][k], strlen(lists[l][k]));
+}
+
+// Da chiamare quando nessuna riga ha piu' parole nell'indice
+void wordIndexClear() {
+    E.words.count = 0;
+}
+
+// Registra un'occorrenza della parola e ne restituisce l'id
+int wordIndexAdd(const char *s, int len) {
+    WordIndex *w = &E.words;
+    if (w->count == 0) wordIndexInit();
+    int node = 0;
+    for (int i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        int prev = -1, child = w->nodes[node].child;
+        while (child >= 0 && (unsigned char)w->nodes[child].c < c) {
+            prev = child;
+            child = w->nodes[child].next;
+        }
+        if (child < 0 || (unsigned char)w->nodes[child].c != c) {
+            if (w->free < 0 && w->count == w->cap) {
+                w->cap *= 2;
+                w->nodes = realloc(w->nodes, sizeof(TrieNode) * w->cap);
+                if (w->nodes == NULL) die("realloc in wordIndexAdd");
+            }
+            int n = w->free >= 0 ? w->free : w->count++;
+            if (n == w->free) w->free = w->nodes[n].next;
+            w->nodes[n].child = -1;
+            w->nodes[n].next = child;
+            w->nodes[n].parent = node;
+            w->nodes[n].count = 0;
+            w->nodes[n].live = 0;
+            w->nodes[n].c = c;
+            if (prev >= 0) w->nodes[prev].next = n;
+            else w->nodes[node].child = n;
+            child = n;
+        }
+        node = child;
+    }
+    if (w->nodes[node].count++ == 0)
+        for (int n = node; n >= 0; n = w->nodes[n].parent) w->nodes[n].live++;
+    return node;
+}
+
+// Toglie un'occorrenza della parola. Quando non ne resta nessuna i nodi
+// che servivano solo a lei tornano liberi, cosi' l'indice non cresce con
+// ogni identificatore mai scritto.
+void wordIndexRelease(int id) {
+    WordIndex *w = &E.words;
+    if (id <= 0 || id >= w->count || w->nodes[id].count <= 0) return;
+    if (--w->nodes[id].count > 0) return;
+    for (int n = id; n >= 0; n = w->nodes[n].parent) w->nodes[n].live--;
+
+    // Un nodo senza parole nel sottoalbero non ha piu' figli: si stacca
+    // dal padre e si risale finche' il ramo serve ad altre parole
+    int node = id;
+    while (node > 0 && w->nodes[node].live == 0) {
+        int parent = w->nodes[node].parent;
+        int *link = &w->nodes[parent].child;
+        while (*link != node) link = &w->nodes[*link].next;
+        *link = w->nodes[node].next;
+        w->nodes[node].next = w->free;
+        w->free = node;
+        node = parent;
+    }
+}
+
+// Nodo della parola (o del prefisso) s, -1 se non c'e'
+int wordIndexFind(const char *s, int len) {
+    WordIndex *w = &E.words;
+    if (w->count == 0) return -1;
+    int node = 0;
+    for (int i = 0; i < len && node >= 0; i++) {
+        int child = w->nodes[node].child;
+        while (child >= 0 && w->nodes[child].c != s[i]) child = w->nodes[child].next;
+        node = child;
+    }
+    return node;
+}
+
+// Aggiunge al menu fino a max parole che iniziano con prefix, in ordine
+// alfabetico. Il costo dipende dalle parole trovate, non dalla dimensione
+// dell'indice. Restituisce il numero di parole aggiunte.
+int wordIndexComplete(const char *prefix, int len, int max) {
+    WordIndex *w = &E.words;
+    int root = wordIndexFind(prefix, len);
+    if (root < 0 || w->nodes[root].live == 0) return 0;
+
+    char word[256];
+    if (len >= (int)sizeof(word)) return 0;
+    memcpy(word, prefix, len);
+    int depth = len, added = 0;
+    int node = root;
+    while (added < max) {
+        // Visita in preordine: la parola del nodo viene prima dei figli
+        if (w->nodes[node].count > 0 && depth > len) {
+            word[depth] = '\0';
+            completionAdd(word, word);
+            added++;
+        }
+        int next = w->nodes[node].child;
+        while (next >= 0 && w->nodes[next].live == 0) next = w->nodes[next].next;
+        if (next >= 0 && depth + 1 < (int)sizeof(word)) {
+            word[depth++] = w->nodes[next].c;
+            node = next;
+            continue;
+        }
+        // Risale finche' trova un fratello con parole vive
+        while (node != root) {
+            int sib = w->nodes[node].next;
+            while (sib >= 0 && w->nodes[sib].live == 0) sib = w->nodes[sib].next;
+            depth--;
+            if (sib >= 0) {
+                word[depth++] = w->nodes[sib].c;
+                node = sib;
+                break;
+            }
+            node = w->nodes[node].parent;
+        }
+        if (node == root) break;
+    }
+    return added;
+}
+
+// Toglie dall'indice le parole della riga (l'array resta per la
+// prossima scansione)
+void editorRowReleaseWords(EditorRow *row) {
+    for (int i = 0; i < row->nwords; i++) wordIndexRelease(row->words[i]);
+    row->nwords = 0;
+}
+
+void editorRowAddWord(EditorRow *row, const char *s, int len) {
+    if (row->nwords == row->capwords) {
+        row->capwords = row->capwords ? row->capwords * 2 : 4;
+        row->words = realloc(row->words, sizeof(int) * row->capwords);
+        if (row->words == NULL) die("realloc in editorRowAddWord");
+    }
+    row->words[row->nwords++] = wordIndexAdd(s, len);
+}
+
+void completionAdd(const char *label, const char *insert) {
+    CompletionMenu *menu = &E.menu;
+    menu->labels = realloc(menu->labels, sizeof(char *) * (menu->count + 1));
+    menu->inserts = realloc(menu->inserts, sizeof(char *) * (menu->count + 1));
+    if (menu->labels == NULL || menu->inserts == NULL) die("realloc in completionAdd");
+    menu->labels[menu->count] = strdup(label);
+    menu->inserts[menu->count] = strdup(insert);
+    if (!menu->labels[menu->count] || !menu->inserts[menu->count]) die("strdup in completionAdd");
+    menu->count++;
+}
+
+// Mostra il menu con le voci aggiunte, se ce ne sono
+void completionOpen() {
+    if (E.menu.count == 0) {
+        editorSetStatusMessage("No completions");
+        return;
+    }
+    E.menu.active = 1;
+    E.menu.sel = 0;
+    E.menu.off = 0;
+}
+
+// Ctrl-Space: con il language server attivo chiede a lui, altrimenti
+// completa la parola prima del cursore con le parole del buffer
+void editorRequestCompletion() {
+    if (E.lsp.running) {
+        lspRequestCompletion();
+        return;
+    }
+    completionClose();
+    if (E.cy >= E.numrows) return;
+    EditorRow *row = &E.rows[E.cy];
+    int start = E.cx;
+    while (start > 0 && isIdentChar(row->chars[start - 1])) start--;
+    if (start == E.cx) {
+        editorSetStatusMessage("No word before the cursor");
+        return;
+    }
+    wordIndexComplete(row->chars + start, E.cx - start, COMPLETION_MAX);
+    completionOpen();
+}
+
+void completionClose() {
+    CompletionMenu *menu = &E.menu;
+    for (int i = 0; i < menu->count; i++) {
+        free(menu->labels[i]);
+        free(menu->inserts[i]);
+    }
+    free(menu->labels);
+    free(menu->inserts);
+    memset(menu, 0, sizeof(*menu));
+}
+
+// Sostituisce l'identificatore sotto il cursore con la voce scelta
+void editorAcceptCompletion() {
+    if (E.cy >= E.numrows) {
+        completionClose();
+        return;
+    }
+    const char *ins = E.menu.inserts[E.menu.sel];
+    int inslen = strlen(ins);
+    EditorRow *row = &E.rows[E.cy];
+    int start = E.cx, end = E.cx;
+    while (start > 0 && isIdentChar(row->chars[start - 1])) start--;
+    while (end < row->size && isIdentChar(row->chars[end])) end++;
+
+    int len = row->size - (end - start) + inslen;
+    char *buf = malloc(len + 1);
+    if (buf == NULL) die("malloc in editorAcceptCompletion");
+    memcpy(buf, row->chars, start);
+    memcpy(buf + start, ins, inslen);
+    memcpy(buf + start + inslen, row->chars + end, row->size - end);
+
+    Cursor cur = {E.cx, E.cy};
+    undoBegin(UNDO_EDIT, &cur, 1, 0);
+    int s = undoSaveRows(E.cy, 1);
+    editorReplaceRow(E.cy, buf, len);
+    undoSetRows(s, 1);
+    free(buf);
+    E.cx = start + inslen;
+    cur.cx = E.cx;
+    undoEnd(&cur, 1, 0);
+    completionClose();
+}
+
+// Tasti con il menu aperto. Restituisce 1 se il tasto e' stato usato.
+int editorCompletionKey(int c) {
+    CompletionMenu *menu = &E.menu;
+    if (!menu->active) return 0;
+    switch (c) {
+        case ARROW_UP:
+            if (menu->sel > 0) menu->sel--;
+            break;
+        case ARROW_DOWN:
+            if (menu->sel < menu->count - 1) menu->sel++;
+            break;
+        case '\r':
+        case '\t':
+            editorAcceptCompletion();
+            return 1;
+        case '\x1b':
+            completionClose();
+            return 1;
+        default:
+            // Qualsiasi altro tasto chiude il menu e fa il suo lavoro
+            completionClose();
+            return 0;
+    }
+    if (menu->sel < menu->off) menu->off = menu->sel;
+    if (menu->sel >= menu->off + COMPLETION_ROWS) menu->off = menu->sel - COMPLETION_ROWS + 1;
+    return 1;
+}
+
+// Menu dei completamenti sotto il cursore (sopra se non c'e' spazio);
+// y e x sono le coordinate del cursore sullo schermo, da 1
+void editorDrawCompletion(struct abuf *ab, int y, int x, int *ptop, int *prows) {
+    CompletionMenu *menu = &E.menu;
+    int rows = menu->count < COMPLETION_ROWS ? menu->count : COMPLETION_ROWS;
+    int width = 0;
+    for (int i = 0; i < menu->count; i++) {
+        int l = strlen(menu->labels[i]);
+        if (l > width) width = l;
+    }
+    if (width > 40) width = 40;
+    if (width > E.termcols) width = E.termcols;
+    int top = y + rows <= E.screenrows ? y + 1 : y - rows;
+    if (top < 1) top = 1;
+    if (x + width > E.termcols) x = E.termcols - width + 1;
+    if (x < 1) x = 1;
+
+    for (int i = 0; i < rows; i++) {
+        int at = menu->off + i;
+        char pos[32];
+        snprintf(pos, sizeof(pos), ESC "[%d;%dH", top + i, x);
+        abAppend(ab, pos, strlen(pos));
+        abAppend(ab, at == menu->sel ? ESC "[7m" : ESC "[100m", at == menu->sel ? 4 : 6);
+        int l = strlen(menu->labels[at]);
+        if (l > width) l = width;
+        abAppend(ab, menu->labels[at], l);
+        for (; l < width; l++) abAppend(ab, " ", 1);
+        abAppend(ab, ESC "[m", 3);
+    }
+    // Righe del frame coperte dal menu (da 0), da riscrivere al prossimo giro
+    *ptop = top - 1;
+    *prows = rows;
+}
+
+/*** Macros ***/
+
+void macroRecord(int c) {
+    Macro *m = &E.macro;
+    if (m->count == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 64;
+        m->keys = realloc(m->keys, sizeof(int) * m->cap);
+        if (m->keys == NULL) die("realloc in macroRecord");
+    }
+    m->keys[m->count++] = c;
+}
+
+// Prossimo tasto della macro in riproduzione. Se un comando chiede piu'
+// tasti di quelli rimasti (per esempio un prompt) riceve Esc.
+int macroNextKey() {
+    Macro *m = &E.macro;
+    return m->pos < m->count ? m->keys[m->pos++] : '\x1b';
+}
+
+// Ctrl-R: inizia o finisce la registrazione dei tasti. 'key' e' il tasto
+// che ha chiamato il comando: se e' stato registrato va tolto.
+void editorToggleMacroRecording(int key) {
+    Macro *m = &E.macro;
+    if (m->playing) return;
+    if (m->recording) {
+        m->recording = 0;
+        if (m->count > 0 && m->keys[m->count - 1] == key) m->count--;
+        editorSetStatusMessage("Macro recorded: %d keys (Ctrl-P to play)", m->count);
+    } else {
+        m->recording = 1;
+        m->count = 0;
+        editorSetStatusMessage("Recording macro... (Ctrl-R to stop)");
+    }
+}
+
+// Esegue la macro una volta, come se i tasti arrivassero dalla tastiera:
+// prima di ogni tasto la vista si aggiorna come nel ciclo principale
+// (senza disegnare), perche' alcuni comandi dipendono da dove si trova
+void macroRunOnce() {
+    E.macro.pos = 0;
+    while (E.macro.pos < E.macro.count) {
+        editorRefreshScreen();
+        editorProcessKeypress();
+    }
+}
+
+// Prepara la riproduzione. Restituisce 0 se non si puo' partire.
+int macroStart() {
+    Macro *m = &E.macro;
+    if (m->playing) return 0;  // Una macro che richiama se stessa
+    if (m->recording) {
+        editorSetStatusMessage("Stop recording (Ctrl-R) before playing the macro");
+        return 0;
+    }
+    if (m->count == 0) {
+        editorSetStatusMessage("No macro recorded (Ctrl-R)");
+        return 0;
     }
-    free(query);
+    // Niente disegno durante la riproduzione e un solo passo di undo
+    m->playing = 1;
+    undoGroupBegin();
+    return 1;
 }
 
-/*** C Syntax Highlighting ***/
+void macroFinish() {
+    undoGroupEnd();
+    E.macro.playing = 0;
+}
 
-// Definiamo i colori ANSI che useremo
-#define COLOR_RESET   "\x1b[0m"
-#define COLOR_KEYWORD "\x1b[33m" // Giallo
-#define COLOR_TYPE    "\x1b[36m" // Ciano
-#define COLOR_COMMENT "\x1b[38;5;106m" // Verde scuro
-#define COLOR_STRING  "\x1b[33m" // Arancione
-#define COLOR_NUMBER  "\x1b[31m" // Rosso
-#define COLOR_PREPROC "\x1b[35m" // Magenta
-#define COLOR_CONSTANT "\x1b[38;5;214m" // Arancione
+// Ctrl-P e "macro N": riproduce la macro N volte
+void editorMacroPlay(int times) {
+    if (!macroStart()) return;
+    for (int i = 0; i < times; i++) macroRunOnce();
+    macroFinish();
+    editorSetStatusMessage("Macro played %d times", times);
+}
 
-// Lista di keyword e tipi del C
-const char *C_KEYWORDS[] = {
-    "auto", "break", "case", "const", "continue", "default", "do", "else",
-    "enum", "extern", "for", "goto", "if", "register", "return", "sizeof",
-    "static", "struct", "switch", "typedef", "union", "volatile", "while", NULL
-};
+// "macro /testo": riproduce la macro all'inizio di ogni riga
+// dell'intervallo che contiene il testo. Le righe vengono scelte prima di
+// iniziare; quelle aggiunte o tolte dalla macro spostano le successive.
+void editorMacroPlayOnLines(int from, int n, const char *text) {
+    int *match = malloc(sizeof(int) * (n ? n : 1));
+    if (match == NULL) die("malloc in editorMacroPlayOnLines");
+    int nmatch = 0;
+    for (int i = 0; i < n; i++)
+        if (strstr(E.rows[from + i].chars, text)) match[nmatch++] = from + i;
+
+    if (nmatch > 0 && macroStart()) {
+        int shift = 0;
+        for (int i = 0; i < nmatch && match[i] + shift < E.numrows; i++) {
+            int before = E.numrows;
+            editorClearSelection();
+            cursorsClear();
+            E.cy = match[i] + shift;
+            E.cx = 0;
+            macroRunOnce();
+            shift += E.numrows - before;
+        }
+        macroFinish();
+        editorSetStatusMessage("Macro played on %d lines", nmatch);
+    } else if (nmatch == 0) {
+        editorSetStatusMessage("No lines contain '%.40s'", text);
+    }
+    free(match);
+}
 
-const char *C_TYPES[] = {
-    "char", "double", "float", "int", "long", "short", "signed", "unsigned",
-    "void", "size_t", "FILE", "HANDLE", "DWORD", "BOOL", "boolean", NULL
-};
+/*** Mouse ***/
+
+// Posizione nel buffer della cella (x, y) dello schermo, da 0. Restituisce
+// 0 fuori dall'area del testo (pannelli e barre di stato).
+int editorScreenToBuffer(int x, int y, int *cx, int *cy, int *rx) {
+    if (y < 0 || y >= E.screenrows) return 0;
+    int tx = x - E.gutter;
+    if (tx < 0) tx = 0;
+    if (tx >= E.screencols) return 0;
+
+    int row, col;
+    if (E.softwrap) {
+        int seg;
+        row = wrapVisualToRow(wrapRowToVisual(E.rowoff) + E.segoff + y, &seg);
+        col = tx;
+        if (row < E.numrows) {
+            EditorRow *r = &E.rows[row];
+            editorRowWraps(r);
+            col += editorSegmentStart(r, seg);
+            // Oltre la fine di un segmento si resta sul segmento
+            if (seg < r->nwraps && col >= r->wraps[seg]) col = r->wraps[seg] - 1;
+        }
+    } else {
+        row = editorVisualToRow(editorRowToVisual(E.rowoff) + y);
+        col = E.coloff + tx;
+    }
 
-const char *C_CONSTANTS[] = {
-    "true", "false", "NULL", "BOOL", "boolean", NULL
-};
+    if (row >= E.numrows) {
+        // Sotto la fine del file: fine dell'ultima riga
+        *cy = E.numrows > 0 ? E.numrows - 1 : 0;
+        *cx = E.numrows > 0 ? E.rows[*cy].size : 0;
+        *rx = E.numrows > 0 ? E.rows[*cy].rsize : 0;
+        return 1;
+    }
+    *cy = row;
+    *cx = editorRowRxToCx(&E.rows[row], col);
+    *rx = col;
+    return 1;
+}
 
-// Funzione per renderizzare una riga con la sintassi C
-void renderCSyntax(char *rendered_text, char *buffer, int buffer_size) {
-    buffer[0] = '\0';
-    int len = strlen(rendered_text);
-    int pos = 0;
-    int i = 0;
+// Rotella: sposta la vista di delta righe visuali. Il cursore la segue
+// solo se esce dallo schermo, altrimenti editorScroll riporterebbe la
+// vista indietro.
+void editorScrollLines(int delta) {
+    int vtop;
+    if (E.softwrap) {
+        int total = wrapRowToVisual(E.numrows);
+        vtop = wrapRowToVisual(E.rowoff) + E.segoff + delta;
+        if (vtop > total - 1) vtop = total - 1;
+        if (vtop < 0) vtop = 0;
+        E.rowoff = wrapVisualToRow(vtop, &E.segoff);
+    } else {
+        int last = E.numrows > 0 ? editorRowToVisual(E.numrows - 1) : 0;
+        vtop = editorRowToVisual(E.rowoff) + delta;
+        if (vtop > last) vtop = last;
+        if (vtop < 0) vtop = 0;
+        E.rowoff = editorVisualToRow(vtop);
+    }
+    if (E.numrows == 0) return;
+
+    int vcy = editorCursorVisual();
+    int target = -1;
+    if (vcy < vtop) target = vtop;
+    else if (vcy >= vtop + E.screenrows) target = vtop + E.screenrows - 1;
+    if (target < 0) return;
+
+    // Il cursore va sulla prima (o ultima) riga visibile, alla stessa colonna
+    int rx = E.cy < E.numrows ? editorRowCxToRx(&E.rows[E.cy], E.cx) : 0;
+    if (E.softwrap) {
+        int seg;
+        E.cy = wrapVisualToRow(target, &seg);
+        if (E.cy >= E.numrows) E.cy = E.numrows - 1;
+        EditorRow *r = &E.rows[E.cy];
+        editorRowWraps(r);
+        int start = editorSegmentStart(r, seg);
+        int col = start + rx % (E.screencols > 0 ? E.screencols : 1);
+        if (seg < r->nwraps && col >= r->wraps[seg]) col = r->wraps[seg] - 1;
+        E.cx = editorRowRxToCx(r, col);
+    } else {
+        E.cy = editorVisualToRow(target);
+        if (E.cy >= E.numrows) E.cy = E.numrows - 1;
+        E.cx = editorRowRxToCx(&E.rows[E.cy], rx);
+    }
+}
 
-    // Gestione direttive preprocessore all'inizio della riga
-    if (i == 0 && rendered_text[i] == '#') {
-        pos += snprintf(&buffer[pos], buffer_size - pos, "%s%s%s", COLOR_KEYWORD, rendered_text, COLOR_RESET);
-        return;
+// Click posiziona il cursore (Shift+click estende la selezione),
+// trascinare seleziona (con Alt a blocchi), la rotella scorre.
+// Restituisce 1 se il tasto era un evento del mouse.
+int editorMouseKey(int c) {
+    int base = c & ~(MOD_SHIFT | MOD_CTRL | MOD_ALT);
+    if (base < MOUSE_PRESS || base > WHEEL_DOWN) return 0;
+
+    if (base == WHEEL_UP || base == WHEEL_DOWN) {
+        int lines = WHEEL_LINES * E.input.wheel;
+        editorScrollLines(base == WHEEL_UP ? -lines : lines);
+        return 1;
+    }
+    if (base == MOUSE_RELEASE) {
+        E.input.drag = 0;
+        return 1;
     }
 
-    while (i < len) {
-        // Gestione dei commenti (//)
-        if (i + 1 < len && rendered_text[i] == '/' && rendered_text[i+1] == '/') {
-            pos += snprintf(&buffer[pos], buffer_size - pos, "%s%s%s", COLOR_COMMENT, &rendered_text[i], COLOR_RESET);
-            return; // Fine della riga
+    int cx, cy, rx;
+    int y = E.input.my;
+    // Trascinando oltre il bordo del testo si resta sull'ultima riga visibile
+    if (base == MOUSE_DRAG && y >= E.screenrows) y = E.screenrows - 1;
+    if (base == MOUSE_DRAG && y < 0) y = 0;
+    if (!editorScreenToBuffer(E.input.mx, y, &cx, &cy, &rx)) {
+        // Fuori dal testo: niente ancora, la selezione resta com'e'
+        if (base == MOUSE_PRESS) E.input.drag = 0;
+        return 1;
+    }
+    if (base == MOUSE_DRAG && !E.input.drag) return 1;
+    if (base == MOUSE_PRESS) E.input.drag = 1;
+
+    if (base == MOUSE_PRESS && !(c & MOD_SHIFT)) {
+        // L'ancora di un eventuale trascinamento e' il punto del click
+        cursorsClear();
+        editorClearSelection();
+        E.sel.ax = cx;
+        E.sel.ay = cy;
+        E.sel.arx = rx;
+    } else if (!E.sel.active) {
+        int block = base == MOUSE_DRAG && (c & MOD_ALT);
+        if (base == MOUSE_PRESS) {
+            // Shift+click: dal cursore attuale
+            E.sel.ax = E.cx;
+            E.sel.ay = E.cy;
+            E.sel.arx = E.cy < E.numrows ? editorRowCxToRx(&E.rows[E.cy], E.cx) : 0;
         }
+        E.sel.active = 1;
+        E.sel.block = block;
+        cursorsClear();
+    }
+    E.cx = cx;
+    E.cy = cy;
+    E.sel.crx = rx;
+    return 1;
+}
 
-        // Gestione delle stringhe ("...")
-        if (rendered_text[i] == '"') {
-            pos += snprintf(&buffer[pos], buffer_size - pos, "%s\"", COLOR_STRING);
-            i++;
-            while (i < len && rendered_text[i] != '"') {
-                if (pos < buffer_size - 2) buffer[pos++] = rendered_text[i++];
+/*** Remote editing ***/
+
+// Scrive tutto buf su una named pipe overlapped. Un terminale che non
+// legge per REMOTE_WRITE_TIMEOUT_MS fa fallire la scrittura invece di
+// bloccare la sessione.
+int remoteWrite(HANDLE pipe, const void *buf, int len) {
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (ov.hEvent == NULL) return 0;
+
+    const char *p = buf;
+    int ok = 1;
+    while (len > 0) {
+        DWORD put = 0;
+        if (!WriteFile(pipe, p, len, &put, &ov)) {
+            if (GetLastError() != ERROR_IO_PENDING) {
+                ok = 0;
+                break;
             }
-            if (i < len) {
-                if (pos < buffer_size - 2) buffer[pos++] = rendered_text[i++];
+            if (WaitForSingleObject(ov.hEvent, REMOTE_WRITE_TIMEOUT_MS) != WAIT_OBJECT_0) {
+                CancelIoEx(pipe, &ov);
+                GetOverlappedResult(pipe, &ov, &put, TRUE);  // Fine dell'annullamento
+                ok = 0;
+                break;
             }
-            pos += snprintf(&buffer[pos], buffer_size - pos, "%s", COLOR_RESET);
-            buffer[pos] = '\0';
-            continue;
         }
+        if (!GetOverlappedResult(pipe, &ov, &put, FALSE) || put == 0) {
+            ok = 0;
+            break;
+        }
+        p += put;
+        len -= put;
+    }
+    CloseHandle(ov.hEvent);
+    return ok;
+}
+
+int remoteSend(HANDLE pipe, int type, const void *data, int len) {
+    RemoteHeader h = {type, len};
+    struct abuf msg = ABUF_INIT;
+    abAppend(&msg, (const char *)&h, sizeof(h));
+    abAppend(&msg, data, len);
+    int ok = remoteWrite(pipe, msg.b, msg.len);
+    abFree(&msg);
+    return ok;
+}
+
+// Primo messaggio completo in msg: 1 se c'e', 0 se mancano byte, -1 se
+// il flusso non ha senso
+int remoteNextMessage(struct abuf *msg, RemoteHeader *h, char **data) {
+    if (msg->len < (int)sizeof(*h)) return 0;
+    memcpy(h, msg->b, sizeof(*h));
+    if (h->len > REMOTE_MAX_MESSAGE) return -1;
+    if (msg->len < (int)(sizeof(*h) + h->len)) return 0;
+    *data = msg->b + sizeof(*h);
+    return 1;
+}
+
+void remoteConsume(struct abuf *msg, int n) {
+    memmove(msg->b, msg->b + n, msg->len - n);
+    msg->len -= n;
+}
+
+// Accetta i terminali uno alla volta e li passa al ciclo principale.
+// ConnectNamedPipe si aspetta qui, senza occupare il ciclo. Se il thread
+// deve fermarsi lo segnala al ciclo, che lo dice nella barra di stato.
+DWORD WINAPI remoteListenerThread(LPVOID arg) {
+    HANDLE pipe = E.remote.first;
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof(ov));
+    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (ov.hEvent == NULL) {
+        remoteListenerFailed(GetLastError());
+        CloseHandle(pipe);
+        return 0;
+    }
 
-        // Gestione dei numeri
-        if (isdigit(rendered_text[i])) {
-            pos += snprintf(&buffer[pos], buffer_size - pos, "%s", COLOR_NUMBER);
-            while (i < len && isdigit(rendered_text[i])) {
-                if (pos < buffer_size - 2) buffer[pos++] = rendered_text[i++];
+    while (pipe != INVALID_HANDLE_VALUE) {
+        DWORD n;
+        int ok = ConnectNamedPipe(pipe, &ov) || GetLastError() == ERROR_PIPE_CONNECTED ||
+                 (GetLastError() == ERROR_IO_PENDING && GetOverlappedResult(pipe, &ov, &n, TRUE));
+        if (ok) {
+            EnterCriticalSection(&E.remote.lock);
+            if (E.remote.nready < REMOTE_MAX_CLIENTS) {
+                E.remote.ready[E.remote.nready++] = pipe;
+                pipe = NULL;
             }
-            pos += snprintf(&buffer[pos], buffer_size - pos, "%s", COLOR_RESET);
-            buffer[pos] = '\0';
+            LeaveCriticalSection(&E.remote.lock);
+            SetEvent(E.remote.accept);
+        }
+        if (pipe) CloseHandle(pipe);  // Connessione fallita o troppi terminali
+        pipe = CreateNamedPipe(REMOTE_PIPE_NAME, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                               PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                               PIPE_UNLIMITED_INSTANCES, 65536, 65536, 0, NULL);
+    }
+    remoteListenerFailed(GetLastError());
+    CloseHandle(ov.hEvent);
+    return 0;
+}
+
+// Dal thread di ascolto: registra l'errore e sveglia il ciclo principale
+void remoteListenerFailed(DWORD error) {
+    EnterCriticalSection(&E.remote.lock);
+    E.remote.failed = error ? error : ERROR_GEN_FAILURE;
+    LeaveCriticalSection(&E.remote.lock);
+    SetEvent(E.remote.accept);
+}
+
+// --server: la prima istanza della pipe viene creata qui, cosi' un
+// secondo server sullo stesso nome si accorge subito di non poter partire
+void remoteServerStart() {
+    E.remote.first = CreateNamedPipe(REMOTE_PIPE_NAME,
+                                     PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                     PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                     PIPE_UNLIMITED_INSTANCES, 65536, 65536, 0, NULL);
+    if (E.remote.first == INVALID_HANDLE_VALUE) die("CreateNamedPipe (server already running?)");
+    InitializeCriticalSection(&E.remote.lock);
+    E.remote.accept = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (E.remote.accept == NULL) die("CreateEvent");
+    E.remote.listener = CreateThread(NULL, 0, remoteListenerThread, NULL, 0, NULL);
+    if (E.remote.listener == NULL) die("CreateThread");
+}
+
+// Prende i terminali appena collegati. Il frame arriva dopo il loro primo
+// MSG_SIZE. Restituisce 1 se se n'e' aggiunto qualcuno.
+int remoteAccept() {
+    HANDLE ready[REMOTE_MAX_CLIENTS];
+    EnterCriticalSection(&E.remote.lock);
+    int n = E.remote.nready;
+    memcpy(ready, E.remote.ready, n * sizeof(HANDLE));
+    E.remote.nready = 0;
+    DWORD failed = E.remote.failed;
+    E.remote.failed = 0;
+    LeaveCriticalSection(&E.remote.lock);
+    if (failed) {
+        editorSetStatusMessage("Server stopped accepting terminals (error %lu)", (unsigned long)failed);
+    }
+
+    int added = failed != 0;  // Il messaggio va mostrato
+    for (int i = 0; i < n; i++) {
+        // I posti non si spostano: il thread di lettura tiene il puntatore
+        RemoteClient *c = NULL;
+        for (int j = 0; j < REMOTE_MAX_CLIENTS && c == NULL; j++)
+            if (E.remote.clients[j].pipe == NULL) c = &E.remote.clients[j];
+        if (c == NULL) {
+            CloseHandle(ready[i]);
             continue;
         }
+        memset(c, 0, sizeof(*c));
+        if (!pipeReaderStart(&c->in, ready[i], 1)) continue;
+        c->pipe = ready[i];
+        E.remote.nclients++;
+        added = 1;
+    }
+    return added;
+}
 
-        // Gestione di keyword, tipi e costanti
-        if (isalpha(rendered_text[i]) || rendered_text[i] == '_') {
-            char word[256];
-            int j = 0;
-            while (i < len && (isalnum(rendered_text[i]) || rendered_text[i] == '_')) {
-                if (j < 255) word[j++] = rendered_text[i++];
-            }
-            word[j] = '\0';
+void remoteDrop(int i) {
+    RemoteClient *c = &E.remote.clients[i];
+    pipeReaderStop(&c->in);  // Chiude anche la pipe
+    abFree(&c->msg);
+    frameFree(&c->frame);
+    memset(c, 0, sizeof(*c));
+    E.remote.nclients--;
+    remoteUpdateSize();
+}
 
-            int is_keyword = 0, is_type = 0, is_constant = 0;
-            if ((i == len || !isalnum(rendered_text[i])) && (i-j == 0 || !isalnum(rendered_text[i-j-1]))) {
-                for (int k = 0; C_KEYWORDS[k]; k++) {
-                    if (strcmp(word, C_KEYWORDS[k]) == 0) { is_keyword = 1; break; }
-                }
-                if (!is_keyword) {
-                    for (int k = 0; C_TYPES[k]; k++) {
-                        if (strcmp(word, C_TYPES[k]) == 0) { is_type = 1; break; }
-                    }
+// La sessione usa il terminale piu' piccolo tra quelli collegati: nei piu'
+// grandi il frame occupa l'angolo in alto a sinistra
+void remoteUpdateSize() {
+    int rows = 0, cols = 0;
+    for (int i = 0; i < REMOTE_MAX_CLIENTS; i++) {
+        RemoteClient *c = &E.remote.clients[i];
+        if (c->pipe == NULL || c->rows == 0) continue;
+        if (rows == 0 || c->rows < rows) rows = c->rows;
+        if (cols == 0 || c->cols < cols) cols = c->cols;
+    }
+    if (rows == 0 || (rows == E.termrows && cols == E.termcols)) return;
+    E.termrows = rows;
+    E.termcols = cols;
+    editorUpdateLayout();
+    for (int i = 0; i < REMOTE_MAX_CLIENTS; i++) frameInvalidate(&E.remote.clients[i].frame);
+}
+
+// Messaggi dei terminali: i tasti entrano nella coda dell'input come se
+// venissero dalla console. Restituisce 1 se lo schermo va ridisegnato.
+int remoteServerPoll() {
+    char chunk[16384];
+    int changed = 0;
+    for (int i = 0; i < REMOTE_MAX_CLIENTS; i++) {
+        RemoteClient *c = &E.remote.clients[i];
+        if (c->pipe == NULL) continue;
+
+        int n;
+        while ((n = pipeReaderTake(&c->in, chunk, sizeof(chunk))) > 0) abAppend(&c->msg, chunk, n);
+
+        RemoteHeader h;
+        char *data;
+        int r;
+        while ((r = remoteNextMessage(&c->msg, &h, &data)) > 0) {
+            if (h.type == MSG_SIZE && h.len >= 2 * sizeof(int)) {
+                int size[2];
+                memcpy(size, data, sizeof(size));
+                if (size[0] > REMOTE_MAX_ROWS || size[1] > REMOTE_MAX_COLS) {
+                    // Lo schermo e i frame verrebbero allocati per questa dimensione
+                    r = -1;
+                    break;
                 }
-                if (!is_keyword && !is_type) {
-                    for (int k = 0; C_CONSTANTS[k]; k++) {
-                        if (strcmp(word, C_CONSTANTS[k]) == 0) { is_constant = 1; break; }
-                    }
+                if (size[0] >= 3 && size[1] >= 1) {
+                    c->rows = size[0];
+                    c->cols = size[1];
+                    // Il terminale e' nuovo o e' stato ridimensionato: da rifare tutto
+                    frameInvalidate(&c->frame);
+                    remoteUpdateSize();
+                    changed = 1;
                 }
+            } else if (h.type == MSG_INPUT && h.len >= 4 * sizeof(int)) {
+                int ev[4];  // Tasto, x, y, ripetizioni
+                memcpy(ev, data, sizeof(ev));
+                inputPushEvent(ev[0], ev[1], ev[2], ev[3], data + sizeof(ev), h.len - sizeof(ev));
+                changed = 1;
             }
-
-            if (is_keyword) {
-                pos += snprintf(&buffer[pos], buffer_size - pos, "%s%s%s", COLOR_KEYWORD, word, COLOR_RESET);
-            } else if (is_type) {
-                pos += snprintf(&buffer[pos], buffer_size - pos, "%s%s%s", COLOR_TYPE, word, COLOR_RESET);
-            } else if (is_constant) {
-                pos += snprintf(&buffer[pos], buffer_size - pos, "%s%s%s", COLOR_CONSTANT, word, COLOR_RESET);
-            } else {
-                pos += snprintf(&buffer[pos], buffer_size - pos, "%s", word);
-            }
-            continue;
+            remoteConsume(&c->msg, sizeof(h) + h.len);
         }
+        if (n < 0 || r < 0) {
+            remoteDrop(i);
+            changed = 1;
+        }
+    }
+    return changed;
+}
 
-        // Carattere normale
-        if (pos < buffer_size - 2) {
-            buffer[pos++] = rendered_text[i++];
-            buffer[pos] = '\0';
-        } else {
-            i++;
+// Ogni terminale riceve solo le righe cambiate rispetto al suo ultimo
+// frame: chi si e' appena collegato riceve tutto, gli altri la differenza
+void remoteSendFrame(struct abuf *frame, struct abuf *tail, int top, int rows) {
+    for (int i = 0; i < REMOTE_MAX_CLIENTS; i++) {
+        RemoteClient *c = &E.remote.clients[i];
+        if (c->pipe == NULL || c->rows == 0) continue;
+        struct abuf out = ABUF_INIT;
+        frameOutput(&c->frame, frame, tail, top, rows, &out);
+        int ok = remoteSend(c->pipe, MSG_FRAME, out.b, out.len);
+        abFree(&out);
+        if (!ok) remoteDrop(i);
+    }
+}
+
+// Uscita dall'editor: i terminali collegati si chiudono con lui
+void remoteStop() {
+    if (!E.remote.server) return;
+    for (int i = 0; i < REMOTE_MAX_CLIENTS; i++) {
+        if (E.remote.clients[i].pipe == NULL) continue;
+        remoteSend(E.remote.clients[i].pipe, MSG_QUIT, NULL, 0);
+        remoteDrop(i);
+    }
+}
+
+void remoteClientSendSize() {
+    int size[2] = {E.termrows, E.termcols};
+    E.remote.sent_rows = E.termrows;
+    E.remote.sent_cols = E.termcols;
+    remoteSend(E.remote.pipe, MSG_SIZE, size, sizeof(size));
+}
+
+// --client: i frame del server vanno sulla console cosi' come sono.
+// Alla fine della sessione (o se il server sparisce) si esce.
+int remoteClientPoll() {
+    char chunk[16384];
+    int n;
+    while ((n = pipeReaderTake(&E.remote.conn, chunk, sizeof(chunk))) > 0) abAppend(&E.remote.msg, chunk, n);
+
+    RemoteHeader h;
+    char *data;
+    int r;
+    while ((r = remoteNextMessage(&E.remote.msg, &h, &data)) > 0) {
+        DWORD written;
+        if (h.type == MSG_FRAME) WriteConsole(E.hStdout, data, h.len, &written, NULL);
+        else if (h.type == MSG_QUIT) n = -1;
+        remoteConsume(&E.remote.msg, sizeof(h) + h.len);
+    }
+    if (n < 0 || r < 0) {
+        DWORD written;
+        WriteConsole(E.hStdout, ESC "[2J", 4, &written, NULL);
+        WriteConsole(E.hStdout, ESC "[H", 3, &written, NULL);
+        exit(0);
+    }
+    return 0;
+}
+
+// --client: un terminale sottile. Decodifica l'input in locale (sequenze
+// di escape, mouse, incolla) e manda gli eventi al server; tutto il resto
+// lo fa il server.
+void remoteClientRun() {
+    HANDLE pipe;
+    while (1) {
+        pipe = CreateFile(REMOTE_PIPE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                          OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+        if (pipe != INVALID_HANDLE_VALUE) break;
+        // Tutte le istanze occupate: il server ne sta preparando un'altra
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipe(REMOTE_PIPE_NAME, REMOTE_WRITE_TIMEOUT_MS))
+            die("No server (start one with --server)");
+    }
+    E.remote.pipe = pipe;
+    if (!pipeReaderStart(&E.remote.conn, pipe, 1)) die("CreateThread");
+    remoteClientSendSize();
+
+    while (1) {
+        int c = editorReadConsoleKey();
+        if (c == REFRESH_KEY) {
+            if (E.termrows != E.remote.sent_rows || E.termcols != E.remote.sent_cols)
+                remoteClientSendSize();
+            continue;
         }
+        int ev[4] = {c, E.input.mx, E.input.my, E.input.wheel};
+        struct abuf msg = ABUF_INIT;
+        abAppend(&msg, (const char *)ev, sizeof(ev));
+        if (c == PASTE_KEY) abAppend(&msg, E.input.text, E.input.textlen);
+        remoteSend(E.remote.pipe, MSG_INPUT, msg.b, msg.len);
+        abFree(&msg);
     }
 }
 
 /*** Output ***/
 
+// Riga visuale del cursore (include il segmento con l'a capo attivo)
+int editorCursorVisual() {
+    int v = editorRowToVisual(E.cy);
+    if (E.softwrap && E.cy < E.numrows)
+        v += editorRowSegment(&E.rows[E.cy], editorRowCxToRx(&E.rows[E.cy], E.cx));
+    return v;
+}
+
 void editorScroll() {
     E.rx = 0;
     if (E.cy < E.numrows) {
         E.rx = editorRowCxToRx(&E.rows[E.cy], E.cx);
     }
 
-    if (E.cy < E.rowoff) {
+    // Il cursore non resta mai dentro un fold: lo apre
+    if (E.folds.count && editorRowIsHidden(E.cy)) editorRevealRow(E.cy);
+
+    if (E.softwrap) {
+        // Con l'a capo attivo lo scroll avanza per segmenti di riga
+        E.coloff = 0;
+        int vcy = editorCursorVisual();
+        int vtop = wrapRowToVisual(E.rowoff) + E.segoff;
+        if (vcy < vtop) vtop = vcy;
+        if (vcy >= vtop + E.screenrows) vtop = vcy - E.screenrows + 1;
+        E.rowoff = wrapVisualToRow(vtop, &E.segoff);
+        return;
+    }
+
+    // Lo scroll verticale lavora sulle righe visuali (fold chiusi esclusi)
+    int vcy = editorRowToVisual(E.cy);
+    if (vcy < editorRowToVisual(E.rowoff)) {
         E.rowoff = E.cy;
     }
-    if (E.cy >= E.rowoff + E.screenrows) {
-        E.rowoff = E.cy - E.screenrows + 1;
+    if (vcy >= editorRowToVisual(E.rowoff) + E.screenrows) {
+        E.rowoff = editorVisualToRow(vcy - E.screenrows + 1);
     }
     if (E.rx < E.coloff) {
         E.coloff = E.rx;
@@ -829,10 +9283,76 @@ void editorScroll() {
     }
 }
 
+// Disegna una riga con la sintassi C, limitata alle colonne visibili
+// [coloff, coloff + width). Restituisce il numero di colonne scritte.
+int editorDrawRow(struct abuf *ab, int at, int coloff, int width) {
+    EditorRow *row = &E.rows[at];
+    const char *s = editorRowRender(row);
+    int len = row->rsize;
+    int i = 0;
+    CToken tok;
+
+    // Selezione e cursori aggiuntivi sono disegnati in video inverso
+    int mi = cursorsFirstOnRow(at);
+    int mark = cursorsNextMark(at, &mi);
+    int sel_l = -1, sel_r = -1;
+    editorRowSelection(at, &sel_l, &sel_r);
+
+    while ((i = cLexToken(s, len, i, &tok)), tok.type != TOK_EOF) {
+        int start = tok.start, end = tok.start + tok.len;
+        if (end <= coloff) continue;
+        if (start >= coloff + width) break;
+        if (start < coloff) start = coloff;
+        if (end > coloff + width) end = coloff + width;
+
+        const char *color = cTokenColor(tok.type);
+        if (color) abAppend(ab, color, strlen(color));
+        while (start < end) {
+            while (mark >= 0 && mark < start) mark = cursorsNextMark(at, &mi);
+            if (mark == start) {
+                abAppend(ab, ESC "[7m", 4);
+                abAppend(ab, &s[start++], 1);
+                abAppend(ab, ESC "[27m", 5);
+                continue;
+            }
+
+            // Spezza il token ai bordi della selezione e al prossimo cursore
+            int stop = end;
+            if (mark > start && mark < stop) stop = mark;
+            if (sel_l > start && sel_l < stop) stop = sel_l;
+            if (sel_r > start && sel_r < stop) stop = sel_r;
+            int selected = start >= sel_l && start < sel_r;
+            if (selected) abAppend(ab, ESC "[7m", 4);
+            abAppend(ab, &s[start], stop - start);
+            if (selected) abAppend(ab, ESC "[27m", 5);
+            start = stop;
+        }
+        if (color) abAppend(ab, COLOR_RESET, strlen(COLOR_RESET));
+    }
+
+    int drawn = len - coloff;
+    if (drawn < 0) drawn = 0;
+    if (drawn > width) drawn = width;
+
+    // Cursore aggiuntivo a fine riga
+    while (mark >= 0 && mark < len) mark = cursorsNextMark(at, &mi);
+    if (mark == len && len >= coloff && len < coloff + width) {
+        abAppend(ab, ESC "[7m \x1b[27m", 10);
+        drawn++;
+    }
+    return drawn;
+}
+
 /* La sua unica responsabilità e' quella di disegnare il testo */
 void editorDrawRows(struct abuf *ab) {
+    if (E.outline.visible) outlineRebuildView();
+
+    int filerow = E.rowoff;
+    int seg = E.softwrap ? E.segoff : 0;
     for (int y = 0; y < E.screenrows; y++) {
-        int filerow = y + E.rowoff;
+        int drawn = 0;
+        int lastseg = 1;  // Ultimo segmento della riga: si passa alla successiva
+        editorDrawGutter(ab, filerow < E.numrows && seg == 0 ? filerow : -1);
         if (filerow >= E.numrows) {
             // Mostra il messaggio di benvenuto solo se il file è vuoto
             if (E.numrows == 0 && y == E.screenrows / 3) {
@@ -841,6 +9361,7 @@ void editorDrawRows(struct abuf *ab) {
                                           "C Editor -- Versione %s", VERSION);
                 if (welcomelen > E.screencols) welcomelen = E.screencols;
                 int padding = (E.screencols - welcomelen) / 2;
+                drawn = padding + welcomelen;
                 if (padding) {
                     abAppend(ab, "~", 1);
                     padding--;
@@ -849,24 +9370,50 @@ void editorDrawRows(struct abuf *ab) {
                 abAppend(ab, welcome, welcomelen);
             } else {
                 abAppend(ab, "~", 1);
+                drawn = 1;
             }
+        } else if (E.softwrap) {
+            // Un segmento della riga spezzata: colonne [start, end)
+            EditorRow *row = &E.rows[filerow];
+            editorRowWraps(row);
+            int start = editorSegmentStart(row, seg);
+            int end = seg < row->nwraps ? row->wraps[seg] : row->rsize;
+            drawn = editorDrawRow(ab, filerow, start, end - start);
+            lastseg = seg >= row->nwraps;
         } else {
-            // Creiamo un buffer per la riga colorata
-            char colored_line[MAX_LINE_LENGTH * 4];
-            // Passiamo E.rows[filerow].render (con tab espansi!) alla funzione di highlighting
-            renderCSyntax(E.rows[filerow].render, colored_line, sizeof(colored_line));
+            drawn = editorDrawRow(ab, filerow, E.coloff, E.screencols);
+        }
 
-            int len = strlen(colored_line);
-            if (len > E.coloff) {
-                // Disegniamo la stringa renderizzata
-                // NOTA: lo scrolling orizzontale con i colori è complesso.
-                // Questa implementazione è una semplificazione.
-                abAppend(ab, &colored_line[E.coloff], len - E.coloff);
+        if (filerow < E.numrows && lastseg) {
+            int f = E.folds.count ? foldFind(filerow) : -1;
+            if (f >= 0 && E.folds.items[f].start == filerow && drawn < E.screencols) {
+                // Intestazione di un fold: indica quante righe sono nascoste
+                char marker[48];
+                int mlen = snprintf(marker, sizeof(marker), " ... (%d lines)",
+                                    E.folds.items[f].end - filerow);
+                if (mlen > E.screencols - drawn) mlen = E.screencols - drawn;
+                abAppend(ab, ESC "[2m", 4);
+                abAppend(ab, marker, mlen);
+                abAppend(ab, ESC "[m", 3);
+                drawn += mlen;
             }
         }
 
-        abAppend(ab, ESC "[K", 3); // Pulisce il resto della riga
+        if (E.outline.visible) {
+            // Completa la riga di testo e disegna la cella del pannello
+            while (drawn++ < E.screencols) abAppend(ab, " ", 1);
+            editorDrawOutlineCell(ab, y);
+        } else {
+            abAppend(ab, ESC "[K", 3); // Pulisce il resto della riga
+        }
         abAppend(ab, "\r\n", 2);
+
+        if (lastseg) {
+            filerow = editorNextVisibleRow(filerow);
+            seg = 0;
+        } else {
+            seg++;
+        }
     }
 }
 
@@ -874,16 +9421,22 @@ void editorDrawStatusBar(struct abuf *ab) {
     abAppend(ab, ESC "[7m", 4);  // Inverted colors
 
     char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s %s",
+    int len = snprintf(status, sizeof(status), "%.20s %s%s",
                        E.filename ? E.filename : "[No Name]",
-                       E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
-
-    if (len > E.screencols) len = E.screencols;
+                       editorIsDirty() ? "(modified)" : "",
+                       E.macro.recording ? " [recording]" : "");
+    int rlen;
+    if (E.cursors.count > 0)
+        rlen = snprintf(rstatus, sizeof(rstatus), "%d cursors  %d/%d",
+                        E.cursors.count + 1, E.cy + 1, E.numrows);
+    else
+        rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cy + 1, E.numrows);
+
+    if (len > E.termcols) len = E.termcols;
     abAppend(ab, status, len);
 
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
+    while (len < E.termcols) {
+        if (E.termcols - len == rlen) {
             abAppend(ab, rstatus, rlen);
             break;
         } else {
@@ -900,9 +9453,17 @@ void editorDrawMessageBar(struct abuf *ab) {
     abAppend(ab, ESC "[K", 3);  // Clear the message bar
 
     int msglen = strlen(E.statusmsg);
-    if (msglen > E.screencols) msglen = E.screencols;
-    if (msglen && time(NULL) - E.statusmsg_time < 5)
+    if (msglen > E.termcols) msglen = E.termcols;
+    CheckMark *m = E.check.nmarks && E.cy < E.numrows ? checkFindMark(E.cy) : NULL;
+    if (msglen && time(NULL) - E.statusmsg_time < STATUS_MSG_SECONDS) {
         abAppend(ab, E.statusmsg, msglen);
+    } else if (m) {
+        // Messaggio del controllo sulla riga del cursore
+        int len = strlen(m->msg);
+        if (len > E.termcols) len = E.termcols;
+        abAppend(ab, m->msg, len);
+        return;
+    }
 
     if (E.statusmsg[0] == '\0') {
         // Show help if no status message
@@ -910,13 +9471,85 @@ void editorDrawMessageBar(struct abuf *ab) {
     }
 }
 
-void editorRefreshScreen() {
-    // Re-check actual console dimensions each time
-    int rows, cols;
-    if (getWindowSize(&rows, &cols) != -1) {
-        E.screenrows = rows - 2;  // leave 2 lines for status + message bars
-        E.screencols = cols;
+void frameInvalidate(ScreenFrame *f) {
+    f->valid = 0;
+}
+
+// Le righe [y, y + n) sono state coperte da altro (es. il menu dei
+// completamenti) e vanno riscritte anche se il contenuto non cambia
+void frameTouch(ScreenFrame *f, int y, int n) {
+    for (int i = y < 0 ? 0 : y; i < y + n && i < f->nlines; i++) f->lens[i] = -1;
+}
+
+void frameFree(ScreenFrame *f) {
+    for (int i = 0; i < f->nlines; i++) free(f->lines[i]);
+    free(f->lines);
+    free(f->lens);
+    memset(f, 0, sizeof(*f));
+}
+
+// Confronta il frame b (righe separate da "\r\n") con quello sullo schermo
+// e aggiunge a out solo le righe cambiate, ognuna preceduta dal
+// posizionamento del cursore. Restituisce il numero di righe riscritte.
+int frameDiff(ScreenFrame *f, const char *b, int len, struct abuf *out) {
+    int n = 1;
+    for (int i = 0; i + 1 < len; i++)
+        if (b[i] == '\r' && b[i + 1] == '\n') n++;
+    if (n != f->nlines) {
+        for (int i = n; i < f->nlines; i++) free(f->lines[i]);
+        f->lines = realloc(f->lines, n * sizeof(char *));
+        f->lens = realloc(f->lens, n * sizeof(int));
+        if (!f->lines || !f->lens) die("realloc in frameDiff");
+        for (int i = f->nlines; i < n; i++) {
+            f->lines[i] = NULL;
+            f->lens[i] = -1;
+        }
+        f->nlines = n;
+    }
+    if (!f->valid) {
+        abAppend(out, ESC "[2J", 4);
+        for (int i = 0; i < n; i++) f->lens[i] = -1;
+        f->valid = 1;
+    }
+
+    int changed = 0;
+    const char *p = b, *end = b + len;
+    for (int y = 0; y < n; y++) {
+        const char *eol = p;
+        while (eol < end && !(eol[0] == '\r' && eol + 1 < end && eol[1] == '\n')) eol++;
+        int l = eol - p;
+        if (f->lens[y] != l || memcmp(f->lines[y], p, l) != 0) {
+            char pos[32];
+            int plen = snprintf(pos, sizeof(pos), ESC "[%d;1H" ESC "[m", y + 1);
+            abAppend(out, pos, plen);
+            abAppend(out, p, l);
+            char *copy = realloc(f->lines[y], l ? l : 1);
+            if (!copy) die("realloc in frameDiff");
+            memcpy(copy, p, l);
+            f->lines[y] = copy;
+            f->lens[y] = l;
+            changed++;
+        }
+        p = eol + 2;
     }
+    return changed;
+}
+
+// Frame per un terminale: righe cambiate rispetto a f, poi tail (menu e
+// cursore) scritto sopra. Le righe [top, top + rows) coperte dal menu
+// andranno riscritte al frame successivo.
+void frameOutput(ScreenFrame *f, struct abuf *frame, struct abuf *tail, int top, int rows,
+                 struct abuf *out) {
+    abAppend(out, ESC "[?25l", 6);  // Hide cursor
+    frameDiff(f, frame->b, frame->len, out);
+    abAppend(out, tail->b, tail->len);
+    frameTouch(f, top, rows);
+}
+
+void editorRefreshScreen() {
+    // Le dimensioni arrivano da editorHandleResize; qui si ricalcola solo
+    // la divisione dello schermo, che dipende da pannelli e numero di righe
+    editorUpdateLayout();
 
     // -- CLAMPING LOGIC --
     if (E.numrows == 0) {
@@ -936,23 +9569,49 @@ void editorRefreshScreen() {
     DWORD written;
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
-    abAppend(&ab, ESC "[?25l", 6);  // Hide cursor
-    abAppend(&ab, ESC "[H", 3);     // Position cursor at top-left
-
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
-
+    // Durante una macro, o con input gia' in coda, si aggiorna la vista
+    // (i tasti successivi, come PagGiu', dipendono da rowoff) ma non si
+    // disegna: si ridisegna alla fine
+    if (E.macro.playing || E.input.count) return;
+
+    // Il frame completo viene composto in memoria e sul terminale
+    // finiscono solo le righe diverse da quelle gia' visibili
+    struct abuf frame = ABUF_INIT;
+    if (E.diff.visible) editorDrawDiff(&frame);
+    else editorDrawRows(&frame);
+    if (E.output.visible) editorDrawOutputPane(&frame);
+    editorDrawStatusBar(&frame);
+    editorDrawMessageBar(&frame);
+
+    // Sopra il frame: menu dei completamenti e cursore
+    struct abuf tail = ABUF_INIT;
+    int menu_top = 0, menu_rows = 0;
     char buf[32];
-    snprintf(buf, sizeof(buf), ESC "[%d;%dH", (E.cy - E.rowoff) + 1,
-             (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    int cursor_y = editorCursorVisual() - editorRowToVisual(E.rowoff) + 1;
+    int cursor_x = E.rx - E.coloff + 1 + E.gutter;
+    if (E.softwrap) {
+        cursor_y -= E.segoff;
+        if (E.cy < E.numrows)
+            cursor_x = E.rx - editorSegmentStart(&E.rows[E.cy],
+                                                 editorRowSegment(&E.rows[E.cy], E.rx)) + 1 + E.gutter;
+    }
+    if (E.menu.active) editorDrawCompletion(&tail, cursor_y, cursor_x, &menu_top, &menu_rows);
+    snprintf(buf, sizeof(buf), ESC "[%d;%dH", cursor_y, cursor_x);
+    abAppend(&tail, buf, strlen(buf));
 
-    abAppend(&ab, ESC "[?25h", 6);  // Show cursor
+    if (!E.diff.visible) abAppend(&tail, ESC "[?25h", 6);  // Show cursor
 
-    WriteConsole(E.hStdout, ab.b, ab.len, &written, NULL);
-    abFree(&ab);
+    if (E.remote.server) {
+        // Ogni terminale collegato riceve le righe cambiate per lui
+        remoteSendFrame(&frame, &tail, menu_top, menu_rows);
+    } else {
+        struct abuf ab = ABUF_INIT;
+        frameOutput(&E.frame, &frame, &tail, menu_top, menu_rows, &ab);
+        WriteConsole(E.hStdout, ab.b, ab.len, &written, NULL);
+        abFree(&ab);
+    }
+    abFree(&frame);
+    abFree(&tail);
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -961,6 +9620,7 @@ void editorSetStatusMessage(const char *fmt, ...) {
     vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
     va_end(ap);
     E.statusmsg_time = time(NULL);
+    E.events.msg_expired = 0;
 }
 
 /*** Input ***/
@@ -976,6 +9636,7 @@ char *editorPrompt(const char *prompt, void (*callback)(char *, int)) {
         editorRefreshScreen();
 
         int c = editorReadKey();
+        if (c == REFRESH_KEY) continue;
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == 127) { // Backspace
             if (buflen != 0) buf[--buflen] = '\0';
         } else if (c == '\x1b') { // Tasto Escape
@@ -992,6 +9653,19 @@ char *editorPrompt(const char *prompt, void (*callback)(char *, int)) {
         } else if (c == ARROW_UP || c == ARROW_DOWN || c == ARROW_LEFT || c == ARROW_RIGHT) {
             // Passa i tasti freccia al callback per la navigazione della ricerca
             if (callback) callback(buf, c);
+        } else if (c == PASTE_KEY) {
+            // Nel prompt si incolla solo la prima riga
+            for (int i = 0; i < E.input.textlen && E.input.text[i] != '\n'; i++) {
+                char ch = E.input.text[i];
+                if (iscntrl((unsigned char)ch)) continue;
+                if (buflen >= bufsize - 1) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                    if (buf == NULL) die("realloc in editorPrompt");
+                }
+                buf[buflen++] = ch;
+            }
+            buf[buflen] = '\0';
         } else if (!iscntrl(c) && c < 128) {
             // Aggiungi il carattere al buffer
             if (buflen >= bufsize - 1) {
@@ -1016,7 +9690,7 @@ void editorMoveCursor(int key) {
             if (E.cx > 0) {
                 E.cx--;
             } else if (E.cy > 0) {
-                E.cy--;
+                E.cy = editorPrevVisibleRow(E.cy);
                 if (E.cy < E.numrows)
                     E.cx = E.rows[E.cy].size;
                 else
@@ -1024,19 +9698,64 @@ void editorMoveCursor(int key) {
             }
             break;
         case ARROW_DOWN:
-            if (E.cy < E.numrows - 1) E.cy++;
+            if (E.softwrap)
+                editorMoveVisual(1);
+            else if (editorNextVisibleRow(E.cy) < E.numrows)
+                E.cy = editorNextVisibleRow(E.cy);
             break;
         case ARROW_UP:
-            if (E.cy > 0) E.cy--;
+            if (E.softwrap)
+                editorMoveVisual(-1);
+            else if (E.cy > 0)
+                E.cy = editorPrevVisibleRow(E.cy);
             break;
         case ARROW_RIGHT:
             if (row && E.cx < row->size) {
                 E.cx++;
-            } else if (row && E.cx == row->size && E.cy < E.numrows - 1) {
-                E.cy++;
+            } else if (row && E.cx == row->size &&
+                       editorNextVisibleRow(E.cy) < E.numrows) {
+                E.cy = editorNextVisibleRow(E.cy);
                 E.cx = 0;
             }
             break;
+        case HOME_KEY:
+            E.cx = 0;
+            break;
+        case END_KEY:
+            if (row) E.cx = row->size;
+            break;
+        case ARROW_LEFT | MOD_CTRL:
+            editorMoveWord(-1);
+            break;
+        case ARROW_RIGHT | MOD_CTRL:
+            editorMoveWord(1);
+            break;
+        case ARROW_UP | MOD_CTRL:
+            editorMoveParagraph(-1);
+            break;
+        case ARROW_DOWN | MOD_CTRL:
+            editorMoveParagraph(1);
+            break;
+        case ARROW_UP | MOD_ALT:
+            editorMoveBlock(-1);
+            break;
+        case ARROW_DOWN | MOD_ALT:
+            editorMoveBlock(1);
+            break;
+        case PAGE_UP | MOD_CTRL:
+            editorMoveFunction(-1);
+            break;
+        case PAGE_DOWN | MOD_CTRL:
+            editorMoveFunction(1);
+            break;
+        case HOME_KEY | MOD_CTRL:
+            E.cy = 0;
+            E.cx = 0;
+            break;
+        case END_KEY | MOD_CTRL:
+            E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+            E.cx = E.numrows > 0 ? E.rows[E.cy].size : 0;
+            break;
     }
 
     // Adjust cursor if new line is shorter
@@ -1050,14 +9769,37 @@ void editorMoveCursor(int key) {
 void editorProcessKeypress() {
     static int quit_times = 2;
     int c = editorReadKey();
+    if (c == REFRESH_KEY) return;
+    if (editorCompletionKey(c)) return;
+    if (editorMouseKey(c)) {
+        undoSeal();
+        quit_times = 2;
+        return;
+    }
+
+    // Solo la digitazione continua puo' accorparsi nello stesso undo
+    if (c < ' ' || c >= 127) undoSeal();
+
+    // Alt+Y vale solo subito dopo un incolla
+    int was_yanking = E.kill.yanking;
+    E.kill.yanking = 0;
+
+    // Shift+frecce estendono la selezione, gli altri comandi la annullano
+    if (editorSelectionKey(c)) {
+        quit_times = 2;
+        return;
+    }
+    if (E.sel.active && !editorKeyUsesSelection(c)) editorClearSelection();
+
     // Normal or split-view modes
     switch (c) {
         case '\r':
+            if (E.sel.active) editorDeleteSelection();
             editorInsertNewline();
             break;
 
         case CTRL_KEY('q'):
-            if (E.dirty && quit_times > 0) {
+            if (editorIsDirty() && quit_times > 0) {
                 editorSetStatusMessage(
                     "WARNING! File has unsaved changes. "
                     "Press Ctrl-Q %d more times to quit.",
@@ -1065,6 +9807,9 @@ void editorProcessKeypress() {
                 quit_times--;
                 return;
             }
+            jobStop("Stopped");
+            lspStop();
+            remoteStop();
             {
                 DWORD written;
                 WriteConsole(E.hStdout, ESC "[2J", 4, &written, NULL);
@@ -1083,7 +9828,39 @@ void editorProcessKeypress() {
 
         case 127:  // Backspace
         case CTRL_KEY('h'):
-            editorDelChar();
+            if (!(E.sel.active && editorDeleteSelection())) editorDelChar();
+            break;
+
+        case CTRL_KEY('c'):
+            if (!editorCopySelection()) editorSetStatusMessage("Nothing selected");
+            break;
+
+        case CTRL_KEY('x'):
+            editorCutSelection();
+            break;
+
+        case CTRL_KEY('v'):
+            editorPaste();
+            break;
+
+        case PASTE_KEY:
+            editorPasteText(E.input.text, E.input.textlen);
+            break;
+
+        case 'y' | MOD_ALT:
+            E.kill.yanking = was_yanking;
+            editorYankPop();
+            break;
+
+        case '\t':
+            if (E.sel.active)
+                editorIndentRows(1);
+            else
+                editorInsertChar('\t');
+            break;
+
+        case '\t' | MOD_SHIFT:
+            editorIndentRows(-1);
             break;
 
         case CTRL_KEY('f'):
@@ -1094,39 +9871,145 @@ void editorProcessKeypress() {
             editorFindMatchingBrace();
             break;
 
+        case F12_KEY:
+            editorGotoDefinition();
+            break;
+
+        case F2_KEY:
+            editorOutlineNavigate();
+            break;
+
+        case CTRL_KEY('k'):
+            editorToggleFold();
+            break;
+
+        case F5_KEY:
+            editorBuildAndRun();
+            break;
+
+        case F5_KEY | MOD_SHIFT:
+            editorToggleCheck();
+            break;
+
+        case F6_KEY:
+            editorToggleOutput();
+            break;
+
+        case F7_KEY:
+            editorDiffView(0);
+            break;
+
+        case F7_KEY | MOD_SHIFT:
+            editorDiffView(1);
+            break;
+
+        case F8_KEY:
+            editorNextDiagnostic();
+            break;
+
+        case F9_KEY:
+            editorToggleLineNumbers();
+            break;
+
+        case F10_KEY:
+            editorToggleLsp();
+            break;
+
+        case ' ' | MOD_CTRL:
+            editorRequestCompletion();
+            break;
+
+        case CTRL_KEY('e'):
+            editorCommand();
+            break;
+
+        case CTRL_KEY('r'):
+            editorToggleMacroRecording(c);
+            break;
+
+        case CTRL_KEY('p'):
+            editorMacroPlay(1);
+            break;
+
+        case PAGE_UP | MOD_SHIFT:
+            editorScrollOutput(-1);
+            break;
+
+        case PAGE_DOWN | MOD_SHIFT:
+            editorScrollOutput(1);
+            break;
+
+        case F4_KEY:
+            editorToggleSoftWrap();
+            break;
+
+        case CTRL_KEY('t'):
+            editorBuildTags();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
+        case CTRL_KEY('d'):
+            editorAddCursorNextMatch();
+            break;
+
+        case ARROW_UP | MOD_CTRL | MOD_ALT:
+            editorAddCursorVertical(-1);
+            break;
+
+        case ARROW_DOWN | MOD_CTRL | MOD_ALT:
+            editorAddCursorVertical(1);
+            break;
+
         // Movement
         case ARROW_LEFT:
         case ARROW_RIGHT:
         case ARROW_UP:
         case ARROW_DOWN:
-            editorMoveCursor(c);
-            break;
-
         case HOME_KEY:
-            E.cx = 0;
-            break;
         case END_KEY:
-            if (E.cy < E.numrows) {
-                E.cx = E.rows[E.cy].size;
-            }
+        case ARROW_LEFT | MOD_CTRL:
+        case ARROW_RIGHT | MOD_CTRL:
+        case ARROW_UP | MOD_CTRL:
+        case ARROW_DOWN | MOD_CTRL:
+        case ARROW_UP | MOD_ALT:
+        case ARROW_DOWN | MOD_ALT:
+        case PAGE_UP | MOD_CTRL:
+        case PAGE_DOWN | MOD_CTRL:
+        case HOME_KEY | MOD_CTRL:
+        case END_KEY | MOD_CTRL:
+            editorMoveCursors(c);
             break;
         case PAGE_UP:
             E.cy = E.rowoff; // Muovi il cursore all'inizio della schermata
             break;
         case PAGE_DOWN:
-            E.cy = E.rowoff + E.screenrows - 1; // Muovi alla fine
+            // Muovi alla fine (in righe visuali, saltando i fold chiusi)
+            E.cy = editorVisualToRow(editorRowToVisual(E.rowoff) + E.screenrows - 1);
             if (E.cy > E.numrows) E.cy = E.numrows;
             break;
         case DEL_KEY:
-            editorMoveCursor(ARROW_RIGHT);
-            editorDelChar();
+            // Cancellare la fine di un'intestazione riapre il fold
+            if (E.cy < E.numrows && E.cx == E.rows[E.cy].size &&
+                editorNextVisibleRow(E.cy) != E.cy + 1)
+                editorRevealRow(E.cy + 1);
+            if (!(E.sel.active && editorDeleteSelection())) editorDeleteForward();
             break;
 
         case '\x1b':  // Escape
-            // ignore
+            cursorsClear();
+            editorClearSelection();
             break;
 
         default:
+            if (c >= ARROW_LEFT) break;  // Combinazioni di tasti non assegnate
+            if (E.sel.active) editorDeleteSelection();
             editorInsertChar(c);
             break;
         }
@@ -1160,6 +10043,17 @@ int editorRowCxToRx(EditorRow *row, int cx) {
     return rx;
 }
 
+int editorRowRxToCx(EditorRow *row, int rx) {
+    int cur_rx = 0;
+    int cx;
+    for (cx = 0; cx < row->size; cx++) {
+        if (row->chars[cx] == '\t') cur_rx += (TAB_SIZE - 1) - (cur_rx % TAB_SIZE);
+        cur_rx++;
+        if (cur_rx > rx) return cx;
+    }
+    return cx;
+}
+
 /*** Init ***/
 
 void editorInit() {
@@ -1173,19 +10067,41 @@ void editorInit() {
     E.filename = NULL;
     E.dirty = 0;
     E.statusmsg[0] = '\0';
-
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+    E.check.enabled = 1;  // Senza nome il buffer e' untitled.c
+    E.events.wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (E.events.wake == NULL) die("CreateEvent");
+
+    if (E.remote.server) {
+        // Senza console: la dimensione arriva dai terminali collegati
+        E.termrows = 24;
+        E.termcols = 80;
+    } else if (getWindowSize(&E.termrows, &E.termcols) == -1) {
+        die("getWindowSize");
+    }
 
     // Reserve two rows for the status and message bars
-    E.screenrows -= 2;
+    editorUpdateLayout();
 }
 
 int main(int argc, char *argv[]) {
-    enableRawMode();
+    // --server [file]: sessione senza terminale, a cui ci si collega con
+    // --client da uno o piu' terminali
+    int arg = 1;
+    if (argc >= 2 && strcmp(argv[1], "--server") == 0) {
+        E.remote.server = 1;
+        arg++;
+    } else if (argc >= 2 && strcmp(argv[1], "--client") == 0) {
+        E.remote.client = 1;
+        arg++;
+    }
+
+    if (!E.remote.server) enableRawMode();
     editorInit();
+    if (E.remote.client) remoteClientRun();
+    if (E.remote.server) remoteServerStart();
 
-    if (argc >= 2) {
-        editorOpen(argv[1]);
+    if (argc > arg) {
+        editorOpen(argv[arg]);
     }
 
     editorSetStatusMessage(WELCOME_MESSAGE);